@@ -3,76 +3,106 @@
 
 #include <Arduino.h>
 #include <stdint.h>
+#include "FUSB302B_Regs.h"
+#include "PD_CRC.h"
+#include "PD_Transport.h"
 
 //=============================================================================
-// FUSB302B Register Addresses
-//=============================================================================
-
-// Control and Configuration Registers
-#define REG_CONTROL0        0x06
-#define REG_CONTROL1        0x07
-#define REG_CONTROL2        0x08
-#define REG_CONTROL3        0x09
-#define REG_MASK            0x0A
-#define REG_POWER           0x0B
-#define REG_RESET           0x0C
-
-// Status and Interrupt Registers  
-#define REG_STATUS0A        0x3C
-#define REG_STATUS1A        0x3D
-#define REG_INTERRUPTA      0x3E
-#define REG_INTERRUPTB      0x3F
-#define REG_STATUS0         0x40
-#define REG_STATUS1         0x41
-#define REG_INTERRUPT       0x42
-#define REG_FIFOS           0x43
-
-//=============================================================================
-// USB-PD Protocol Constants
-//=============================================================================
-
-// FUSB302B I2C Address
-#define PD_ADDR             0x22
-
-// USB-PD Message Types (Control Messages)
-#define MSG_TYPE_GOODCRC            0x1
-#define MSG_TYPE_GOTOMIN            0x2
-#define MSG_TYPE_ACCEPT             0x3
-#define MSG_TYPE_REJECT             0x4
-#define MSG_TYPE_PING               0x5
-#define MSG_TYPE_PS_READY           0x6
-#define MSG_TYPE_GET_SOURCE_CAP     0x7
-#define MSG_TYPE_GET_SINK_CAP       0x8
-#define MSG_TYPE_DR_SWAP            0x9
-#define MSG_TYPE_PR_SWAP            0xA
-#define MSG_TYPE_VCONN_SWAP         0xB
-#define MSG_TYPE_WAIT               0xC
-#define MSG_TYPE_SOFT_RESET         0xD
-#define MSG_TYPE_NOT_SUPPORTED      0x10
-#define MSG_TYPE_GET_SOURCE_CAP_EXT 0x11
-#define MSG_TYPE_GET_STATUS         0x12
-#define MSG_TYPE_FR_SWAP            0x13
-#define MSG_TYPE_GET_PPS_STATUS     0x14
-#define MSG_TYPE_GET_COUNTRY_CODES  0x15
-
-// USB-PD Message Types (Data Messages)
-#define MSG_TYPE_SOURCE_CAPABILITIES    0x1
-#define MSG_TYPE_REQUEST                0x2
-#define MSG_TYPE_BIST                   0x3
-#define MSG_TYPE_SINK_CAPABILITIES      0x4
-#define MSG_TYPE_BATTERY_STATUS         0x5
-#define MSG_TYPE_ALERT                  0x6
-#define MSG_TYPE_GET_COUNTRY_INFO       0x7
-#define MSG_TYPE_VDM                    0xF
-
-// Protocol Sequence Constants
-#define SOP_SEQUENCE_0      0x12
-#define SOP_SEQUENCE_1      0x12
-#define SOP_SEQUENCE_2      0x12
-#define SOP_SEQUENCE_3      0x13
-#define EOP_SEQUENCE        0x14
-#define TXOFF_SEQUENCE      0xFE
-#define CRC_PLACEHOLDER     0xFF
+// Library Configuration
+//=============================================================================
+
+// Low-power idle
+#define PD_INT_PIN          6       // GPIO wired to FUSB302B INT_N
+#define PD_TOG_SAVE_PWR     3       // Longest toggle off-time between polls
+#define PD_IDD_TOGGLE_UA    25      // FUSB302B typ. current while toggling, calibrate per board
+#define PD_IDD_ACTIVE_UA    700     // FUSB302B typ. current with all blocks on, calibrate per board
+#define PD_VBUS_ON_TIMEOUT_MS 500   // tVBUSON max is 275 ms; give up and resume toggling after this
+
+// Transmit engine
+#define PD_N_RETRIES        3       // nRetryCount, handled by the FUSB302B
+#define PD_TX_TIMEOUT_MS    10      // Covers all hardware retries (tReceive ~1 ms each)
+
+// Protocol timers (USB-PD 3.1 table 6.68, upper bounds)
+#define PD_T_SENDER_RESPONSE_MS 30      // Request/Soft_Reset to the reply
+#define PD_T_SINK_WAIT_CAP_MS   620     // Attach or soft reset to Source_Capabilities
+#define PD_T_PS_TRANSITION_MS   550     // Accept to PS_RDY
+#define PD_T_HARD_RESET_CAP_MS  1600    // Hard Reset to Source_Capabilities: tPSHardReset + tSrcRecover + tSrcTurnOn + tFirstSourceCap
+#define PD_T_HARD_RESET_VBUS_OFF_MS 685 // Hard Reset to VBUS at vSafe0V: tPSHardReset + tSafe0V
+#define PD_T_PARTNER_IDLE_MS    3300    // Blocking path: window for partner requests after a contract
+#define PD_T_VDM_SENDER_RESPONSE_MS 30  // Structured VDM request to ACK/NAK/BUSY
+#define PD_T_VDM_WAIT_MODE_ENTRY_MS 50  // Enter Mode to ACK/NAK/BUSY
+#define PD_T_VDM_WAIT_MODE_EXIT_MS  50  // Exit Mode to ACK/NAK/BUSY
+#define PD_T_VDM_BUSY_MS        50      // BUSY to the retry of the same request
+#define PD_T_VCONN_STABLE_MS    50      // VCONN on to the first SOP' message
+#define PD_T_VCONN_SOURCE_TIMEOUT_MS 200 // Accepted VCONN_Swap to the new VCONN Source's PS_RDY
+#define PD_T_DISCOVER_IDENTITY_MS 45    // Unanswered SOP' Discover Identity to the next attempt
+#define PD_N_DISCOVER_IDENTITY  20      // nDiscoverIdentityCount
+#define PD_T_ENTER_EPR_MS       550     // EPR_Mode Enter Acknowledged to Enter Succeeded
+#define PD_T_PS_TRANSITION_EPR_MS 1020  // Accept to PS_RDY in EPR mode
+#define PD_T_SINK_EPR_KEEPALIVE_MS 375  // Between EPR_KeepAlive messages in EPR mode (250-500)
+#define PD_T_CHUNK_SENDER_RESPONSE_MS 30 // Chunk Request to the next chunk
+
+// Specification revision
+#ifndef PD_SPEC_REV_OURS
+#define PD_SPEC_REV_OURS    PD_SPEC_REV_30 // Highest revision spoken; Source_Capabilities can only lower it
+#endif
+#define PD_RMDO_OURS        0x31180000UL // Revision 3.1, Version 1.8, sent in reply to Get_Revision
+
+// Recovery ladder and watchdog
+#ifndef PD_WATCHDOG_MS
+#define PD_WATCHDOG_MS      2000    // Hardware watchdog fed by core 1, 0 = not armed
+#endif
+#define PD_T_SELECT_MAX_MS  (PD_TX_TIMEOUT_MS + PD_T_SENDER_RESPONSE_MS + PD_T_PS_TRANSITION_MS)
+#define PD_T_RECOVERY_MAX_MS                                                              \
+    ((PD_TX_TIMEOUT_MS + PD_T_SENDER_RESPONSE_MS + PD_T_SINK_WAIT_CAP_MS + PD_T_SELECT_MAX_MS) + \
+     (PD_T_HARD_RESET_CAP_MS + PD_T_SELECT_MAX_MS) +                                      \
+     (PD_VBUS_ON_TIMEOUT_MS + PD_T_SINK_WAIT_CAP_MS + PD_T_SELECT_MAX_MS)) // Missed deadline to 5 V contract, excluding re-toggle
+
+// Port context
+#ifndef PD_NUM_PORTS
+#define PD_NUM_PORTS        1       // FUSB302B ports served by this build
+#endif
+#define PD_MAX_OPTIONS      7       // Fixed supplies kept from (EPR_)Source_Capabilities
+#define PD_SNK_DEFAULT_MA   500     // vSafe5V current advertised until set_snk_caps()
+
+// Cable (SOP')
+#ifndef PD_VCONN_SOURCE
+#define PD_VCONN_SOURCE     0       // 1: the board supplies the VCONN pin, so VCONN can be swapped in to ask the cable
+#endif
+#define PD_CABLE_DEFAULT_MA 3000    // VBUS current through a cable whose e-marker was not read
+
+// VBUS measurement
+#ifndef PD_VBUS_SETTLE_US
+#define PD_VBUS_SETTLE_US   250     // MEASURE write to a valid COMP, default of pd_vbus_set_settle_us()
+#endif
+#define PD_VBUS_TOLERANCE_PCT 5     // vSrcNew: a contract's VBUS may be this far from the requested voltage
+
+// Device recognition
+#ifndef PD_CLASSIFY
+#define PD_CLASSIFY         1       // 1: guess the device type with pd_classify() when VID/PID recognition fails; 0: charger
+#endif
+
+// Contract and Extended Power Range
+#ifndef PD_CONTRACT_V
+#define PD_CONTRACT_V       5       // Voltage loop1() negotiates after recognition; above 20 V needs EPR
+#endif
+#ifndef PD_CONTRACT_MA
+#define PD_CONTRACT_MA      500     // Current in mA loop1() negotiates after recognition
+#endif
+#ifndef PD_EPR_SINK_PDP_W
+#define PD_EPR_SINK_PDP_W   0       // Operational PDP sent with EPR_Mode Enter, e.g. 140; 0 = SPR only
+#endif
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define PD_PORT_RAM_BUDGET  704     // 64-bit hosts: the 512-byte layout with every pointer widened
+#else
+#define PD_PORT_RAM_BUDGET  512     // Per-port state incl. flow frames, in bytes (RP2040 and other 32-bit builds)
+#endif
+#if !defined(PD_REPORT_SIZES) && defined(PD_FLOW_REPORT_SIZES)
+#define PD_REPORT_SIZES     PD_FLOW_REPORT_SIZES // Name of the switch before it covered pd_port_t
+#endif
+#ifndef PD_REPORT_SIZES
+#define PD_REPORT_SIZES     0       // 1: report port and flow frame sizes as build warnings
+#endif
 
 //=============================================================================
 // Device Type Enumerations
@@ -99,6 +129,55 @@ typedef enum {
     PDO_TYPE_AUGMENTED = 3          ///< Augmented PDO (PPS, etc.)
 } pdo_type_t;
 
+/**
+ * @brief SOP* packet types, each with its own MessageID counter
+ */
+typedef enum {
+    SOP_TYPE_SOP = 0,               ///< Port partner
+    SOP_TYPE_SOP_PRIME = 1,         ///< Cable plug, near end
+    SOP_TYPE_SOP_DPRIME = 2,        ///< Cable plug, far end
+    PD_NUM_SOP = 3
+} pd_sop_t;
+
+/**
+ * @brief Outcome of a transmission
+ */
+typedef enum : uint8_t {
+    TX_RESULT_SENT = 0,             ///< GoodCRC received from the partner
+    TX_RESULT_FAILED = 1,           ///< No GoodCRC after all hardware retries
+    TX_RESULT_DISCARDED = 2         ///< Incoming message pre-empted the transmission
+} tx_result_t;
+
+/**
+ * @brief Decoded interrupt events (see decodeIrqSnapshot)
+ *
+ * Bits 0-7 mirror INTERRUPTA, bit 8 INTERRUPTB and bits 16-23 INTERRUPT, so
+ * decoding is a couple of shifts. Bits 24+ are derived from the status bytes.
+ */
+typedef uint32_t pd_event_set_t;
+
+#define PD_EVT_HARD_RESET       (UINT32_C(1) << 0)  ///< Hard reset received
+#define PD_EVT_SOFT_RESET       (UINT32_C(1) << 1)  ///< Soft reset received
+#define PD_EVT_TX_SENT          (UINT32_C(1) << 2)  ///< Transmission acknowledged by GoodCRC
+#define PD_EVT_HARD_SENT        (UINT32_C(1) << 3)  ///< Hard reset transmitted
+#define PD_EVT_RETRY_FAIL       (UINT32_C(1) << 4)  ///< No GoodCRC after all retries
+#define PD_EVT_SOFT_FAIL        (UINT32_C(1) << 5)  ///< Automatic soft reset failed
+#define PD_EVT_TOGGLE_DONE      (UINT32_C(1) << 6)  ///< Autonomous toggle found a partner
+#define PD_EVT_OCP_TEMP         (UINT32_C(1) << 7)  ///< Over-current or over-temperature
+#define PD_EVT_GCRC_SENT        (UINT32_C(1) << 8)  ///< GoodCRC sent for a received message
+#define PD_EVT_BC_LVL           (UINT32_C(1) << 16) ///< BC_LVL changed
+#define PD_EVT_COLLISION        (UINT32_C(1) << 17) ///< CC collision while transmitting
+#define PD_EVT_WAKE             (UINT32_C(1) << 18) ///< Wake detected
+#define PD_EVT_ALERT            (UINT32_C(1) << 19) ///< TX or RX FIFO full
+#define PD_EVT_CRC_CHK          (UINT32_C(1) << 20) ///< CRC_CHK status changed
+#define PD_EVT_COMP_CHANGE      (UINT32_C(1) << 21) ///< Measure comparator output changed
+#define PD_EVT_ACTIVITY         (UINT32_C(1) << 22) ///< CC activity changed
+#define PD_EVT_VBUS_CHANGE      (UINT32_C(1) << 23) ///< VBUSOK changed
+#define PD_EVT_RX_FULL          (UINT32_C(1) << 24) ///< Alert caused by a full RX FIFO
+#define PD_EVT_TX_FULL          (UINT32_C(1) << 25) ///< Alert caused by a full TX FIFO
+
+#define PD_EVT_TX_MASK          (PD_EVT_TX_SENT | PD_EVT_RETRY_FAIL | PD_EVT_GCRC_SENT | PD_EVT_COLLISION)
+
 /**
  * @brief VDM Command Types
  */
@@ -108,9 +187,20 @@ typedef enum {
     VDM_CMD_DISCOVER_MODES = 3,     ///< Discover Modes command
     VDM_CMD_ENTER_MODE = 4,         ///< Enter Mode command
     VDM_CMD_EXIT_MODE = 5,          ///< Exit Mode command
-    VDM_CMD_ATTENTION = 6           ///< Attention command
+    VDM_CMD_ATTENTION = 6,          ///< Attention command
+    VDM_CMD_SVID_FIRST = 16         ///< First SVID-specific command (16-31)
 } vdm_command_t;
 
+/**
+ * @brief Structured VDM command types
+ */
+typedef enum {
+    VDM_CMD_TYPE_REQ = 0,           ///< Request from the initiator
+    VDM_CMD_TYPE_ACK = 1,           ///< Request done
+    VDM_CMD_TYPE_NAK = 2,           ///< Request refused or not understood
+    VDM_CMD_TYPE_BUSY = 3           ///< Try again after tVDMBusy
+} vdm_cmd_type_t;
+
 //=============================================================================
 // Data Structures
 //=============================================================================
@@ -128,45 +218,206 @@ typedef struct {
  * @brief Power capability option
  */
 typedef struct {
-    int voltage;            ///< Voltage in volts
-    int current;            ///< Current in 10mA units
-    int position;           ///< PDO position (1-7)
+    uint16_t current : 10;  ///< Current in 10mA units
+    uint16_t position : 4;  ///< PDO position (1-11), 0 = unused slot
+    uint8_t voltage;        ///< Voltage in volts
 } power_option_t;
 
 /**
- * @brief USB-PD specification revision info
+ * @brief One power requirement advertised in Sink_Capabilities
+ *
+ * Values are rounded down to the PDO's units: 50 mV and 10 mA for fixed and
+ * variable supplies, 50 mV and 250 mW for batteries, 100 mV and 50 mA for
+ * PPS APDOs.
+ */
+typedef struct {
+    uint8_t type;           ///< pdo_type_t (PDO_TYPE_AUGMENTED is a PPS APDO)
+    uint16_t min_mv;        ///< Fixed supply voltage, or the lowest voltage of a range
+    uint16_t max_mv;        ///< Highest voltage of a range, unused for fixed supplies
+    uint16_t ma;            ///< Operational current (fixed, variable), maximum current (PPS)
+    uint32_t mw;            ///< Operational power (battery)
+} pd_snk_pdo_t;
+
+/**
+ * @brief Sink capabilities: the requirements plus the flags of the first PDO
+ */
+typedef struct {
+    pd_snk_pdo_t pdos[PD_MAX_DATA_OBJECTS]; ///< pdos[0] must be a 5 V fixed supply
+    uint8_t num_pdos;               ///< 1-7
+    bool dual_role_power;           ///< Can also act as a source
+    bool higher_capability;         ///< Needs more than vSafe5V for full functionality
+    bool unconstrained_power;       ///< Powered from an external supply
+    bool usb_comms;                 ///< Can communicate over USB data lines
+    bool dual_role_data;            ///< Can swap data roles
+} pd_snk_caps_t;
+
+/**
+ * @brief Status and interrupt registers 0x3C..0x42, read in one burst
+ */
+typedef struct {
+    uint8_t status0a;       ///< REG_STATUS0A
+    uint8_t status1a;       ///< REG_STATUS1A
+    uint8_t interrupta;     ///< REG_INTERRUPTA (clear on read)
+    uint8_t interruptb;     ///< REG_INTERRUPTB (clear on read)
+    uint8_t status0;        ///< REG_STATUS0
+    uint8_t status1;        ///< REG_STATUS1
+    uint8_t interrupt;      ///< REG_INTERRUPT (clear on read)
+} pd_irq_snapshot_t;
+
+/**
+ * @brief One received message with its CRC already verified
+ */
+typedef struct {
+    uint8_t sop;                    ///< pd_sop_t the frame arrived on
+    uint8_t header[2];              ///< Message header, LSB first
+    uint8_t type;                   ///< 5-bit message type
+    uint8_t num_data_objects;       ///< 0 for control messages
+    bool extended;                  ///< Extended message flag
+    uint8_t data[7 * 4 + 4];        ///< Data objects, then the received CRC
+} pd_msg_t;
+
+/**
+ * @brief FUSB302B power state used for idle accounting
+ */
+typedef enum {
+    PD_POWER_ACTIVE = 0,    ///< All blocks powered, attached or attaching
+    PD_POWER_IDLE = 1       ///< Autonomous toggle, bandgap/wake block only
+} pd_power_state_t;
+
+/**
+ * @brief Rungs of the recovery ladder, climbed when a negotiation deadline passes
+ */
+typedef enum {
+    PD_RECOVER_NONE = 0,            ///< Contract in place, or first attempt
+    PD_RECOVER_SOFT_RESET = 1,      ///< Soft_Reset, then wait for Source_Capabilities
+    PD_RECOVER_HARD_RESET = 2,      ///< Hard Reset, then wait for Source_Capabilities
+    PD_RECOVER_DETACH = 3           ///< Reset the FUSB302B and toggle for a fresh attach
+} pd_recovery_t;
+
+/**
+ * @brief Source_Capabilities compared with the set cached from the last one
+ */
+typedef enum {
+    PD_CAPS_NEW = 0,                ///< First set, or the PDO in use changed: the Request is re-evaluated
+    PD_CAPS_PDO_KEPT = 1,           ///< Other PDOs changed; the last Request still applies
+    PD_CAPS_SAME = 2                ///< Identical set; the last Request still applies
+} pd_caps_change_t;
+
+/**
+ * @brief Power-state accounting for the idle mode
+ */
+typedef struct {
+    uint32_t idle_ms;               ///< Time spent in PD_POWER_IDLE
+    uint32_t active_ms;             ///< Time spent in PD_POWER_ACTIVE
+    uint32_t sleep_ms;              ///< Time core 1 spent waiting in WFI
+    uint32_t wakeups;               ///< INT_N wakeups while idle
+    uint32_t attach_wakeups;        ///< Wakeups where toggle found a source
+    uint32_t last_wake_to_rx_us;    ///< INT_N edge to first valid frame, last attach
+    uint32_t max_wake_to_rx_us;     ///< Worst wake-to-first-frame latency seen
+} pd_power_stats_t;
+
+/**
+ * @brief Revision Message Data Object (rev_major 0 until one is received)
  */
 typedef struct {
-    uint8_t rev_major;      ///< Revision major version
-    uint8_t rev_minor;      ///< Revision minor version  
-    uint8_t ver_major;      ///< Version major
-    uint8_t ver_minor;      ///< Version minor
+    uint8_t rev_major : 4;  ///< Revision major version
+    uint8_t rev_minor : 4;  ///< Revision minor version
+    uint8_t ver_major : 4;  ///< Version major
+    uint8_t ver_minor : 4;  ///< Version minor
 } pd_spec_rev_t;
 
+/**
+ * @brief Everything one FUSB302B port keeps between calls
+ *
+ * Widest members first so nothing is lost to padding; small state is packed
+ * into bitfields. Only pd_port (the port being serviced) is touched at a
+ * time, so the frame arena is shared by every port.
+ */
+typedef struct {
+    pd_power_stats_t power_stats;   ///< Idle accounting, see update_power_stats()
+    pd_event_set_t pending_events;  ///< Decoded events not yet consumed
+    uint32_t power_state_since;     ///< millis() when power_state last changed
+    uint32_t toggle_done_ms;        ///< millis() when toggle found a source
+    uint32_t wake_time_us;          ///< INT_N edge of the wake being timed
+    uint32_t src_pdos[PD_MAX_SRC_PDOS]; ///< Last (EPR_)Source_Capabilities as received
+    uint32_t src_caps_hash;         ///< pd_crc32() of src_pdos
+    uint32_t request_rdo;           ///< Last Request built from src_pdos, 0 = none
+    power_option_t options[PD_MAX_OPTIONS]; ///< Fixed supplies from Source_Capabilities
+    pd_irq_snapshot_t irq_status;   ///< Most recent status/interrupt snapshot
+    uint16_t transition_ms;         ///< Accept to PS_RDY of the last contract (partner classification)
+    pd_spec_rev_t partner_rev;      ///< Partner's revision and version from Get_Revision
+    uint8_t spec_revs[PD_NUM_SOP];  ///< Negotiated Specification Revision field per SOP* type (PD_SPEC_REV_*)
+    uint8_t msg_ids[PD_NUM_SOP];    ///< Next MessageID per SOP* type (0-7)
+    uint8_t dev_type : 3;           ///< Detected device type (pd_device_type_t)
+    uint8_t meas_cc1 : 2;           ///< CC1 BC level
+    uint8_t meas_cc2 : 2;           ///< CC2 BC level
+    uint8_t cc_line : 2;            ///< Active CC line (1 or 2)
+    uint8_t vconn_line : 2;         ///< VCONN line (1 or 2)
+    uint8_t attached : 1;           ///< Device attachment status
+    uint8_t new_attach : 1;         ///< New attachment flag
+    uint8_t auto_crc : 1;           ///< Hardware CRC enabled (see enable_tx_cc)
+    uint8_t cc_oriented : 1;        ///< cc_line already known from toggle
+    uint8_t power_state : 1;        ///< pd_power_state_t
+    uint8_t wake_awaiting_rx : 1;   ///< Timing wake to first valid frame
+    uint8_t recovery : 2;           ///< Highest recovery rung since the last contract (pd_recovery_t)
+    uint8_t num_src_pdos : 4;       ///< Objects in src_pdos, 0 before the first Source_Capabilities
+    uint8_t vconn_source : 1;       ///< We supply VCONN on vconn_line (see set_vconn)
+    uint8_t tx_sop : 2;             ///< pd_sop_t of the transmission in flight
+    uint8_t epr_mode : 1;           ///< EPR_Mode Enter Succeeded and not exited since
+    uint8_t epr_contract : 1;       ///< The contract in place was made with EPR_Request
+    uint8_t vbus_ok : 1;            ///< VBUS measured at the contract voltage after PS_RDY (see pd_vbus_check_contract)
+    uint8_t caps_posted : 1;        ///< on_caps posted since the attach (see pd_cb_caps)
+} pd_port_t;
+
+//=============================================================================
+// Build-Time Size Reporting
+//=============================================================================
+
+template <typename T, unsigned Bytes>
+struct pd_size_report {
+    [[deprecated("size report (PD_REPORT_SIZES)")]] static void report() {}
+    static void quiet() {}
+};
+
+#if PD_REPORT_SIZES
+#define PD_SIZE_NOTE_BYTES(type, bytes) \
+    static inline void type##_size_note() { pd_size_report<type, (bytes)>::report(); }
+#else
+#define PD_SIZE_NOTE_BYTES(type, bytes) \
+    static inline void type##_size_note() { pd_size_report<type, (bytes)>::quiet(); }
+#endif
+
+/** Report sizeof(type) as a build warning with PD_REPORT_SIZES 1 */
+#define PD_SIZE_NOTE(type) PD_SIZE_NOTE_BYTES(type, sizeof(type))
+
 //=============================================================================
 // Global State Variables (External References)
 //=============================================================================
 
-// Power delivery state
-extern int volt_options[5];        ///< Available voltage options
-extern int amp_options[5];         ///< Available current options  
-extern int options_pos[5];         ///< PDO position mapping
-extern int spec_revs[4];           ///< Specification revision info
-extern int msg_id;                 ///< Current message ID
-extern int dev_type;               ///< Detected device type
+// Mutable state is PD_TLS, so a host program can run one stack per thread
 
-// Attachment and CC line state
-extern bool int_flag;              ///< Interrupt flag
-extern bool attached;              ///< Device attachment status
-extern bool new_attach;            ///< New attachment flag
-extern int meas_cc1;               ///< CC1 measurement result
-extern int meas_cc2;               ///< CC2 measurement result
-extern int cc_line;                ///< Active CC line (1 or 2)
-extern int vconn_line;             ///< VCONN line (1 or 2)
+// Port state
+extern PD_TLS pd_port_t pd_ports[PD_NUM_PORTS]; ///< Context of every port
+extern PD_TLS pd_port_t *pd_port;  ///< Port being serviced
+extern PD_TLS uint8_t pd_frame[PD_FRAME_MAX]; ///< TX/RX frame arena shared by all ports
+
+// Interrupt state (written from the GPIO ISR)
+extern PD_TLS volatile bool int_flag; ///< Interrupt flag
+extern PD_TLS volatile uint32_t int_time_us; ///< micros() at the last INT_N edge
 
 // Device recognition database
 extern uint16_t dev_library[10][3]; ///< Device VID/PID database
 
+//=============================================================================
+// Port Context Functions
+//=============================================================================
+
+/**
+ * @brief Reset a port context to its power-on state (PD 2.0, CC1, auto CRC)
+ * @param port Port context
+ */
+void pd_port_init(pd_port_t *port);
+
 //=============================================================================
 // Core Hardware Interface Functions
 //=============================================================================
@@ -175,8 +426,9 @@ extern uint16_t dev_library[10][3]; ///< Device VID/PID database
  * @brief Set a register value on the FUSB302B
  * @param addr Register address
  * @param value Value to write
+ * @return false if the bus transfer failed
  */
-void setReg(uint8_t addr, uint8_t value);
+bool setReg(uint8_t addr, uint8_t value);
 
 /**
  * @brief Read a register value from the FUSB302B
@@ -185,26 +437,67 @@ void setReg(uint8_t addr, uint8_t value);
  */
 uint8_t getReg(uint8_t addr);
 
+/**
+ * @brief Read consecutive registers in one auto-increment burst
+ * @param addr First register address
+ * @param data Pointer to receive buffer
+ * @param length Number of registers to read
+ * @return false if the bus transfer failed
+ */
+bool getRegs(uint8_t addr, uint8_t *data, uint16_t length);
+
 /**
  * @brief Send data bytes to FUSB302B FIFO
  * @param data Pointer to data buffer
- * @param length Number of bytes to send
+ * @param length Number of bytes to send (at most FUSB_TX_FIFO_SIZE)
+ * @return false if the bus transfer failed
  */
-void sendBytes(uint8_t *data, uint16_t length);
+bool sendBytes(uint8_t *data, uint16_t length);
 
 /**
  * @brief Receive data bytes from FUSB302B FIFO
  * @param data Pointer to receive buffer
  * @param length Number of bytes to receive
+ * @return false if the bus transfer failed
+ */
+bool receiveBytes(uint8_t *data, uint16_t length);
+
+/**
+ * @brief Start reading bytes from the FUSB302B FIFO in the background
+ *
+ * On the DMA and simulated transports the CPU is free while the burst
+ * streams in; data[0 .. xfer->rx_done) is valid before it completes. Poll
+ * with pd_bus_busy() or block with pd_bus_wait(). done/user are left as set.
+ *
+ * @param data Pointer to receive buffer
+ * @param length Number of bytes to receive
+ * @param xfer Transfer descriptor, owned by the caller until it completes
+ * @return false if the transfer could not be started
+ */
+bool receiveBytesAsync(uint8_t *data, uint16_t length, pd_bus_xfer_t *xfer);
+
+/**
+ * @brief Check the RX FIFO, and a frame held by dropGoodCRC(), for bytes to read
+ * @return true if there is nothing to receive
+ */
+bool rxEmpty();
+
+/**
+ * @brief Discard a frame held by dropGoodCRC() (protocol layer reset)
+ */
+void dropHeldFrame();
+
+/**
+ * @brief Flush the RX FIFO and drop a frame held by dropGoodCRC()
  */
-void receiveBytes(uint8_t *data, uint16_t length);
+void flushRx();
 
 //=============================================================================
 // USB-PD Protocol Functions
 //=============================================================================
 
 /**
- * @brief Send a USB-PD packet
+ * @brief Send a USB-PD packet (traced according to PD_TRACE, see PD_Trace.h)
  * @param extended Extended message flag
  * @param num_data_objects Number of 32-bit data objects
  * @param message_id Message ID (0-7)
@@ -213,22 +506,147 @@ void receiveBytes(uint8_t *data, uint16_t length);
  * @param port_data_role Data role (0=UFP, 1=DFP)
  * @param message_type Message type constant
  * @param data_objects Pointer to data objects array
+ * @param sop pd_sop_t ordered set to start the frame with
  */
 void sendPacket(bool extended, uint8_t num_data_objects, uint8_t message_id,
                 uint8_t port_power_role, uint8_t spec_rev, uint8_t port_data_role,
-                uint8_t message_type, uint8_t *data_objects);
+                uint8_t message_type, const uint8_t *data_objects, uint8_t sop);
 
 /**
- * @brief Receive and parse a PD packet
- * @return true if packet received successfully
+ * @brief Receive one frame of any kind, GoodCRC included (traced according to PD_TRACE)
+ * @return true if a frame with a valid CRC was read
  */
 bool receivePacket();
 
+/**
+ * @brief Read one whole frame from the RX FIFO without waiting
+ *
+ * GoodCRC frames and frames with a bad CRC are consumed and dropped.
+ *
+ * @param msg Destination
+ * @return true if a message was received into msg
+ */
+bool receiveFrame(pd_msg_t *msg);
+
+/**
+ * @brief Consume the partner's GoodCRC after a successful transmission
+ *
+ * A message queued ahead of the GoodCRC is held and served to the next
+ * reader; only a FIFO that makes no sense is flushed.
+ */
+void dropGoodCRC();
+
+/**
+ * @brief Read a frame's trailing CRC-32 from the FIFO and verify it
+ * @param crc Running CRC over the header and data already read
+ * @return true if the CRC matches
+ */
+bool receiveCRC(uint32_t crc);
+
+/**
+ * @brief Verify a frame's trailing CRC-32 that has already been read
+ * @param crc Running CRC over header and data objects
+ * @param crc_bytes The four CRC bytes as received
+ * @return true if the CRC matches
+ */
+bool checkCRC(uint32_t crc, const uint8_t *crc_bytes);
+
 /**
  * @brief Read all FUSB302B registers for debugging
  */
 void readAllRegs();
 
+//=============================================================================
+// Transmit Engine
+//=============================================================================
+
+/**
+ * @brief Send a SOP message and wait for its definite result
+ *
+ * Fills in the MessageID, roles and spec revision, relies on the FUSB302B's
+ * auto-retry for the GoodCRC exchange and only advances the MessageID when the
+ * message was acknowledged.
+ *
+ * @param extended Extended message flag
+ * @param num_data_objects Number of 32-bit data objects
+ * @param message_type Message type constant
+ * @param data_objects Pointer to data objects array
+ * @return Transmission result
+ */
+tx_result_t transmitPacket(bool extended, uint8_t num_data_objects, uint8_t message_type,
+                           uint8_t *data_objects);
+
+/**
+ * @brief Wait for I_TXSENT / I_RETRYFAIL after a sendPacket()
+ * @param timeout_ms Upper bound on the wait
+ * @return Transmission result (FAILED on timeout)
+ */
+tx_result_t awaitTxResult(uint16_t timeout_ms);
+
+/**
+ * @brief Load a message into the TX FIFO and start it without waiting
+ *
+ * Non-blocking half of transmitPacket(): poll with pollTxResult() and hand the
+ * outcome to finishTransmit(). SOP'/SOP'' messages go to the cable plugs
+ * with their own MessageID and revision, and only while we are the VCONN
+ * Source.
+ *
+ * @param extended Extended message flag
+ * @param num_data_objects Number of 32-bit data objects
+ * @param message_type Message type constant
+ * @param data_objects Pointer to data objects array
+ * @param sop pd_sop_t to send on
+ */
+void beginTransmit(bool extended, uint8_t num_data_objects, uint8_t message_type,
+                   uint8_t *data_objects, uint8_t sop);
+
+/**
+ * @brief Check once for the outcome of the pending transmission
+ * @param result Set to the outcome when one is available
+ * @return true if the transmission has finished
+ */
+bool pollTxResult(tx_result_t *result);
+
+/**
+ * @brief Account for the outcome of a transmission started with beginTransmit()
+ *
+ * Advances the MessageID of the SOP* type sent on and drains the partner's
+ * GoodCRC on success.
+ *
+ * @param result Outcome from pollTxResult() (or TX_RESULT_FAILED on timeout)
+ * @return result
+ */
+tx_result_t finishTransmit(tx_result_t result);
+
+/**
+ * @brief Reset every MessageID counter (soft reset, hard reset, detach)
+ */
+void resetMessageIds();
+
+/**
+ * @brief Fall back to PD_SPEC_REV_OURS on every SOP* type until the next
+ *        Source_Capabilities and forget partner_rev (hard reset, detach)
+ */
+void resetSpecRevs();
+
+/**
+ * @brief Leave EPR mode without a message (hard reset, detach, or after the
+ *        source's EPR_Mode Exit)
+ */
+void exit_epr_mode();
+
+/**
+ * @brief Adopt the lower of the current revision and a partner's
+ *
+ * Called with the Specification Revision field of Source_Capabilities (SOP)
+ * or of a cable's reply (SOP'/SOP''), so the revision only ever goes down
+ * between resets.
+ *
+ * @param sop pd_sop_t the header arrived on
+ * @param spec_rev Specification Revision field of the header (PD_SPEC_REV_*)
+ */
+void adoptSpecRev(uint8_t sop, uint8_t spec_rev);
+
 //=============================================================================
 // Power Delivery Negotiation Functions  
 //=============================================================================
@@ -236,38 +654,138 @@ void readAllRegs();
 /**
  * @brief Initialize power delivery negotiation
  * @param volts Requested voltage
- * @param amps Requested current in amps
+ * @param ma Requested current in mA
  * @return true if initialization successful
  */
-bool pd_init(int volts, int amps);
+bool pd_init(int volts, int ma);
 
 /**
  * @brief Renegotiate power delivery after initialization
+ *
+ * Requests from the cached Source_Capabilities; they are fetched with
+ * get_src_cap() only when none have been received yet. A target they do
+ * not offer sends nothing and leaves the contract in place.
+ *
  * @param volts New requested voltage
- * @param amps New requested current in amps
+ * @param ma New requested current in mA
  * @return true if renegotiation successful
  */
-bool reneg_pd(int volts, int amps);
+bool reneg_pd(int volts, int ma);
 
 /**
  * @brief Get source capabilities from connected device
  */
 void get_src_cap();
 
+/**
+ * @brief Build the Request data object for a fixed supply
+ *
+ * In EPR mode a voltage no fixed supply offers is requested from an AVS APDO
+ * whose range and PDP cover it.
+ *
+ * @param volts Desired voltage
+ * @param ma Desired current in mA
+ * @return Request data object, 0 if the source offers no matching PDO
+ */
+uint32_t build_request(int volts, int ma);
+
+/**
+ * @brief Request data object for a fixed supply, skipping policy evaluation when possible
+ *
+ * The current is first held to the cable's rating (PD_CABLE_DEFAULT_MA until
+ * its e-marker was read, see pd_vdm_cable_ma()) and a voltage above the
+ * cable's rating is refused. Returns the last Request unchanged while it
+ * asked for the same voltage and current and its PDO has not changed since;
+ * otherwise evaluates the options again with build_request() and caches the
+ * result.
+ *
+ * @param volts Desired voltage
+ * @param ma Desired current in mA
+ * @return Request data object, 0 if the source or the cable offers no match
+ */
+uint32_t request_for(int volts, int ma);
+
+/**
+ * @brief vSafe5V Request with Capability Mismatch set
+ *
+ * The answer to Source_Capabilities with nothing request_for() accepts: the
+ * source still expects a Request, and the flag tells it the sink wants
+ * another supply. Cached as the last Request like request_for()'s.
+ *
+ * @return Request data object for position 1 at its full current
+ */
+uint32_t request_mismatch();
+
+/**
+ * @brief Voltage of the last Request
+ * @return The fixed PDO's voltage or the AVS output voltage in mV, 0 if there
+ *         is no Request or its PDO is of another type
+ */
+uint32_t contract_mv();
+
+/**
+ * @brief Whether a voltage can only be had by entering EPR mode
+ *
+ * True above 20 V when PD_EPR_SINK_PDP_W is set, we are not in EPR mode yet
+ * and the source's first PDO is EPR Mode Capable on PD 3.x. Only the flows
+ * enter EPR mode; the blocking path stays within SPR.
+ *
+ * @param volts Desired voltage
+ * @return true if EPR_Mode Enter should be sent
+ */
+bool epr_needed(int volts);
+
 /**
  * @brief Select and request specific source capability
+ *
+ * Answers Source_Capabilities, so a target they do not offer is requested
+ * as request_mismatch() instead.
+ *
  * @param volts Desired voltage
- * @param amps Desired current in amps
+ * @param ma Desired current in mA
  * @return true if request accepted
  */
-bool sel_src_cap(int volts, int amps);
+bool sel_src_cap(int volts, int ma);
+
+/**
+ * @brief Serialize sink capabilities into Sink_Capabilities data objects
+ * @param caps Requirements and flags
+ * @param objects Destination for up to PD_MAX_PAYLOAD bytes
+ * @return Number of data objects, 0 if caps is invalid (no 5 V fixed supply
+ *         first, too many PDOs, or a value that does not fit its field)
+ */
+uint8_t build_snk_cap(const pd_snk_caps_t *caps, uint8_t *objects);
+
+/**
+ * @brief Replace the advertised sink capabilities
+ *
+ * The objects are serialized here once and every Sink_Capabilities reply is
+ * sent from that cache. Until the first call a single vSafe5V PDO at
+ * PD_SNK_DEFAULT_MA is advertised. Call before attach or from core 1.
+ *
+ * @param caps Requirements and flags
+ * @return false if caps is invalid; the previous capabilities stay in place
+ */
+bool set_snk_caps(const pd_snk_caps_t *caps);
 
 /**
- * @brief Send sink capabilities to source
- * @param volts Maximum supported voltage
- * @param amps Maximum supported current in amps
+ * @brief Cached Sink_Capabilities data objects
+ * @param objects Set to the serialized objects
+ * @return Number of data objects
  */
-void send_snk_cap(int volts, int amps);
+uint8_t cached_snk_cap(uint8_t **objects);
+
+/**
+ * @brief Send the cached sink capabilities to the source
+ * @return Transmission result
+ */
+tx_result_t send_snk_cap();
+
+/**
+ * @brief Answer Get_Revision with PD_RMDO_OURS
+ * @return Transmission result
+ */
+tx_result_t send_revision();
 
 /**
  * @brief Get request outcome (accept/reject)
@@ -275,6 +793,51 @@ void send_snk_cap(int volts, int amps);
  */
 bool get_req_outcome();
 
+/**
+ * @brief Wait for the RX FIFO to receive something, feeding the watchdog
+ * @param timeout_ms Deadline
+ * @return false if the FIFO was still empty at the deadline
+ */
+bool wait_rx(uint16_t timeout_ms);
+
+//=============================================================================
+// Recovery and Watchdog
+//=============================================================================
+
+// A negotiation deadline that passes climbs pd_port->recovery one rung at a
+// time: Soft_Reset, Hard Reset, then detach and re-toggle. A contract resets
+// the ladder. From the missed deadline to a 5 V contract is bounded by
+// PD_T_RECOVERY_MAX_MS plus the time toggle takes to find the source again.
+
+/**
+ * @brief Signal Hard Reset and reset the protocol layer
+ */
+void send_hard_reset();
+
+/**
+ * @brief Drop the partner: reset the FUSB302B and toggle for a fresh attach
+ */
+void detach_port();
+
+/**
+ * @brief Climb the recovery ladder until a contract is in place (blocking path)
+ * @param volts Requested voltage
+ * @param ma Requested current in mA
+ * @return true if a soft or hard reset ended in a contract, false once detached
+ */
+bool recover_contract(int volts, int ma);
+
+/**
+ * @brief Arm the hardware watchdog (PD_WATCHDOG_MS); after a watchdog restart
+ *        every port skips recognition and goes straight for a contract
+ */
+void pd_watchdog_begin();
+
+/**
+ * @brief Feed the hardware watchdog (no-op when PD_WATCHDOG_MS is 0)
+ */
+void pd_watchdog_feed();
+
 //=============================================================================
 // Device Recognition Functions
 //=============================================================================
@@ -282,46 +845,84 @@ bool get_req_outcome();
 /**
  * @brief Recognize connected device type using VID/PID
  * @param volts Initial negotiation voltage
- * @param amps Initial negotiation current  
+ * @param ma Initial negotiation current in mA
  */
-void recog_dev(int volts, int amps);
+void recog_dev(int volts, int ma);
 
 /**
- * @brief Read extended source capabilities message
- * @return true if extended capabilities received
+ * @brief Look a VID/PID up in the device library
+ * @param vid Vendor ID
+ * @param pid Product ID
+ * @return true if found (dev_type is updated)
  */
-bool read_ext_src_cap();
+bool lookup_dev_type(uint16_t vid, uint16_t pid);
 
 /**
- * @brief Send discover identity request (VDM)
+ * @brief Guess dev_type with pd_classify() from the capabilities, header,
+ *        contract timing and identity of the partner (PD_CLASSIFY)
  */
-void send_dis_idt_request();
+void classify_dev_type();
 
 /**
- * @brief Send discover identity response (VDM)
+ * @brief Print the recognised device type
  */
-void send_dis_idt_response();
+void print_dev_type();
 
 /**
- * @brief Read discover identity response
- * @return true if valid response received
+ * @brief Read extended source capabilities message
+ * @return true if extended capabilities received
  */
-bool read_dis_idt_response();
+bool read_ext_src_cap();
+
+/**
+ * @brief Send discover identity request (VDM)
+ * @return Transmission result
+ */
+tx_result_t send_dis_idt_request();
 
 /**
- * @brief Send discover SVID response (VDM)
+ * @brief Read discover identity response into pd_vdm_partner() (PD_VDM.h)
+ * @return true if valid response received
  */
-void send_dis_svid_response();
+bool read_dis_idt_response();
 
 /**
  * @brief Send extended source capabilities
+ * @return Transmission result
  */
-void send_ext_src_cap();
+tx_result_t send_ext_src_cap();
 
 //=============================================================================
 // Power Data Object (PDO) Functions
 //=============================================================================
 
+/**
+ * @brief Forget the previous source's power options
+ */
+void clear_pdos();
+
+/**
+ * @brief Decode one PDO and record it in the options if it is a fixed supply
+ * @param object The PDO's four bytes, LSB first
+ * @param position Object position in the message (1-11, 8 and up in EPR mode only)
+ * @param index Next free option slot, advanced when the PDO is recorded
+ */
+void record_pdo(const uint8_t *object, uint8_t position, int *index);
+
+/**
+ * @brief Diff Source_Capabilities against the cached set and adopt them
+ *
+ * An identical set (same count and hash) leaves the options untouched. A
+ * changed set is decoded into the options; the cached Request is dropped only
+ * if the PDO it points at changed or disappeared.
+ *
+ * @param objects Data objects, LSB first
+ * @param num_objects Number of data objects (1-7, up to PD_MAX_SRC_PDOS from
+ *        EPR_Source_Capabilities)
+ * @return How the set compares with the cached one
+ */
+pd_caps_change_t update_src_caps(const uint8_t *objects, uint8_t num_objects);
+
 /**
  * @brief Read and parse Power Data Objects from source capabilities
  * @return true if PDOs parsed successfully
@@ -335,9 +936,20 @@ bool read_pdo();
 uint32_t read_rmdo();
 
 /**
- * @brief Get USB-PD specification revision information
+ * @brief Store a partner's Revision Message Data Object in partner_rev
+ * @param rmdo RMDO from a Revision message
+ */
+void record_rmdo(uint32_t rmdo);
+
+/**
+ * @brief Fetch the partner's revision and version with Get_Revision
+ *
+ * Only sent when the negotiated header revision is PD 3.x and nothing has
+ * been fetched since the last reset; the result is kept in partner_rev.
+ *
+ * @return true if partner_rev is valid
  */
-void get_spec_rev();
+bool get_spec_rev();
 
 //=============================================================================
 // CC Line and Attachment Functions
@@ -350,18 +962,127 @@ void reset_fusb();
 
 /**
  * @brief Check and process interrupts
+ *
+ * Takes one status snapshot and routes every pending event to the protocol
+ * layer handlers below.
  */
 void check_interrupt();
 
+/**
+ * @brief Read STATUS0A..INTERRUPT in a single I2C burst
+ * @param snap Destination snapshot
+ */
+void readIrqSnapshot(pd_irq_snapshot_t *snap);
+
+/**
+ * @brief Decode a snapshot into an event set
+ * @param snap Snapshot to decode
+ * @return Events signalled by the snapshot
+ */
+pd_event_set_t decodeIrqSnapshot(const pd_irq_snapshot_t *snap);
+
+/**
+ * @brief Take a snapshot and accumulate its events into pending_events
+ * @return All pending events
+ */
+pd_event_set_t pollEvents();
+
+/**
+ * @brief Consume pending events
+ * @param mask Events to consume
+ * @return The subset of mask that was pending
+ */
+pd_event_set_t takeEvents(pd_event_set_t mask);
+
+/**
+ * @brief Protocol layer response to a received hard reset
+ */
+void handleHardResetReceived();
+
+/**
+ * @brief Protocol layer response to an RX FIFO overflow
+ */
+void handleRxOverflow();
+
+/**
+ * @brief Response to the measure comparator changing state
+ * @param comp Current comparator output (STATUS0 COMP)
+ */
+void handleCompChange(bool comp);
+
+/**
+ * @brief Response to the autonomous toggle state machine finding a partner
+ * @param togss Toggle result (STATUS1A TOGSS)
+ */
+void handleToggleDone(uint8_t togss);
+
 /**
  * @brief Determine CC line orientation (must be called before init)
  */
 void orient_cc();
 
+/**
+ * @brief Switch VCONN on vconn_line and SOP'/SOP'' reception together
+ *
+ * Only the VCONN Source may talk to the cable plugs, and the plugs only
+ * answer while VCONN is up. Does nothing unless PD_VCONN_SOURCE.
+ *
+ * @param on true to become the VCONN Source, false to stop supplying VCONN
+ */
+void set_vconn(bool on);
+
+//=============================================================================
+// Low-Power Idle Functions
+//=============================================================================
+
+/**
+ * @brief Hand attach detection to the FUSB302B toggle state machine
+ *
+ * Powers down everything except the bandgap/wake block and arms SNK toggling
+ * with only I_TOGDONE unmasked. Call while detached.
+ */
+void enter_idle_toggle();
+
+/**
+ * @brief Power internal blocks back up after toggle found a source
+ * @param cc CC line reported by toggle (1 or 2)
+ */
+void exit_idle_toggle(int cc);
+
+/**
+ * @brief Sleep core 1 (WFI) until the INT_N GPIO fires
+ */
+void sleep_until_irq();
+
+/**
+ * @brief Idle-time work for loop1() when no interrupt is pending
+ *
+ * Sleeps until INT_N, or resumes toggling if a source found by toggle never
+ * brought up VBUS within PD_VBUS_ON_TIMEOUT_MS.
+ */
+void service_idle();
+
+/**
+ * @brief Renegotiate for a request left with pd_cb_request_power() (blocking loop1())
+ * @return false if no request was pending for the attached port
+ */
+bool service_power_request();
+
+/**
+ * @brief Fold time spent in the current power state into power_stats
+ */
+void update_power_stats();
+
+/**
+ * @brief Average modelled FUSB302B current since boot
+ * @return Current in microamps
+ */
+uint32_t avg_current_ua();
+
 /**
  * @brief Enable transmission on specified CC line
  * @param cc CC line number (1 or 2)
- * @param autocrc Enable automatic CRC generation
+ * @param autocrc Enable automatic CRC generation (software CRC-32 when false)
  */
 void enable_tx_cc(int cc, bool autocrc);
 
@@ -384,10 +1105,10 @@ void read_rx_fifo();
 /**
  * @brief Process remaining messages after initial negotiation
  * @param volts Negotiated voltage
- * @param amps Negotiated current
+ * @param ma Negotiated current in mA
  * @return true if processing successful
  */
-bool read_rest(int volts, int amps);
+bool read_rest(int volts, int ma);
 
 //=============================================================================
 // Arduino Setup Functions
@@ -445,11 +1166,11 @@ void loop1();
 /**
  * @brief Check if device is attached
  */
-#define IS_DEVICE_ATTACHED() (attached)
+#define IS_DEVICE_ATTACHED() (pd_port->attached)
 
 /**
  * @brief Check if new device just attached
  */
-#define IS_NEW_ATTACHMENT() (attached && new_attach)
+#define IS_NEW_ATTACHMENT() (pd_port->attached && pd_port->new_attach)
 
 #endif // FUSB302B_H 
\ No newline at end of file
@@ -0,0 +1,336 @@
+#ifndef FUSB302B_REGS_H
+#define FUSB302B_REGS_H
+
+// FUSB302B register map and USB-PD protocol constants. No Arduino
+// dependencies, so the host-side simulator and tools can share it.
+
+//=============================================================================
+// FUSB302B Register Addresses
+//=============================================================================
+
+// Control and Configuration Registers
+#define REG_DEVICE_ID       0x01
+#define REG_SWITCHES0       0x02
+#define REG_SWITCHES1       0x03
+#define REG_MEASURE         0x04
+#define REG_SLICE           0x05
+#define REG_CONTROL0        0x06
+#define REG_CONTROL1        0x07
+#define REG_CONTROL2        0x08
+#define REG_CONTROL3        0x09
+#define REG_MASK            0x0A
+#define REG_POWER           0x0B
+#define REG_RESET           0x0C
+#define REG_MASKA           0x0E
+#define REG_MASKB           0x0F
+#define REG_CONTROL4        0x10
+
+// Status and Interrupt Registers  
+#define REG_STATUS0A        0x3C
+#define REG_STATUS1A        0x3D
+#define REG_INTERRUPTA      0x3E
+#define REG_INTERRUPTB      0x3F
+#define REG_STATUS0         0x40
+#define REG_STATUS1         0x41
+#define REG_INTERRUPT       0x42
+#define REG_FIFOS           0x43
+
+//=============================================================================
+// FUSB302B Register Bit Fields
+//=============================================================================
+
+// SWITCHES0
+#define SWITCHES0_PDWN1             0x01
+#define SWITCHES0_PDWN2             0x02
+#define SWITCHES0_MEAS_CC1          0x04
+#define SWITCHES0_MEAS_CC2          0x08
+#define SWITCHES0_VCONN_CC1         0x10
+#define SWITCHES0_VCONN_CC2         0x20
+
+// SWITCHES1
+#define SWITCHES1_TXCC1             0x01
+#define SWITCHES1_TXCC2             0x02
+#define SWITCHES1_AUTO_CRC          0x04    // Auto GoodCRC reply to received messages
+#define SWITCHES1_SPECREV_2         0x20    // Spec revision used in GoodCRC replies
+
+// MEASURE
+#define MEASURE_MDAC                0x3F    // Comparator threshold: (MDAC + 1) steps
+#define MEASURE_MEAS_VBUS           0x40    // Compare VBUS instead of the CC line (MEAS_CCx must be 0)
+#define MEASURE_VBUS_STEP_MV        420     // MDAC step on VBUS: 42 mV through the 1:10 divider
+
+// CONTROL0 / CONTROL1
+#define CONTROL0_TX_START           0x01
+#define CONTROL0_TX_FLUSH           0x40
+#define CONTROL1_ENSOP1             0x01    // Receive SOP' (cable plug, near end)
+#define CONTROL1_ENSOP2             0x02    // Receive SOP''
+#define CONTROL1_RX_FLUSH           0x04
+
+// CONTROL2
+#define CONTROL2_TOGGLE             0x01
+#define CONTROL2_MODE_DRP           0x02
+#define CONTROL2_MODE_SNK           0x04
+#define CONTROL2_TOG_RD_ONLY        0x20
+#define CONTROL2_TOG_SAVE_PWR(n)    (((n) & 0x03) << 6)
+
+// CONTROL3
+#define CONTROL3_AUTO_RETRY         0x01
+#define CONTROL3_N_RETRIES(n)       (((n) & 0x03) << 1)
+#define CONTROL3_SEND_HARD_RESET    0x40
+
+// POWER (each bit enables one block)
+#define POWER_BANDGAP_WAKE          0x01
+#define POWER_RECEIVER              0x02
+#define POWER_MEASURE               0x04
+#define POWER_OSCILLATOR            0x08
+#define POWER_ALL                   0x0F
+
+// INTERRUPTA / MASKA
+#define INTERRUPTA_I_HARDRST        0x01
+#define INTERRUPTA_I_SOFTRST        0x02
+#define INTERRUPTA_I_TXSENT         0x04
+#define INTERRUPTA_I_HARDSENT       0x08
+#define INTERRUPTA_I_RETRYFAIL      0x10
+#define INTERRUPTA_I_SOFTFAIL       0x20
+#define INTERRUPTA_I_TOGDONE        0x40
+#define INTERRUPTA_I_OCP_TEMP       0x80
+
+// INTERRUPTB
+#define INTERRUPTB_I_GCRCSENT       0x01
+
+// INTERRUPT / MASK
+#define INTERRUPT_I_BC_LVL          0x01
+#define INTERRUPT_I_COLLISION       0x02
+#define INTERRUPT_I_WAKE            0x04
+#define INTERRUPT_I_ALERT           0x08
+#define INTERRUPT_I_CRC_CHK         0x10
+#define INTERRUPT_I_COMP_CHNG       0x20
+#define INTERRUPT_I_ACTIVITY        0x40
+#define INTERRUPT_I_VBUSOK          0x80
+
+// STATUS0
+#define STATUS0_BC_LVL              0x03
+#define STATUS0_COMP                0x20
+#define STATUS0_VBUSOK              0x80
+
+// STATUS1A TOGSS (bits 5:3)
+#define TOGSS_SNK_CC1               0x05
+#define TOGSS_SNK_CC2               0x06
+
+// STATUS1
+#define STATUS1_OCP                 0x01
+#define STATUS1_OVRTEMP             0x02
+#define STATUS1_TX_FULL             0x04
+#define STATUS1_RX_FULL             0x10
+#define STATUS1_RX_EMPTY            0x20
+
+//=============================================================================
+// USB-PD Protocol Constants
+//=============================================================================
+
+// FUSB302B I2C Address
+#define PD_ADDR             0x22
+
+// USB-PD Message Types (Control Messages)
+#define MSG_TYPE_GOODCRC            0x1
+#define MSG_TYPE_GOTOMIN            0x2
+#define MSG_TYPE_ACCEPT             0x3
+#define MSG_TYPE_REJECT             0x4
+#define MSG_TYPE_PING               0x5
+#define MSG_TYPE_PS_READY           0x6
+#define MSG_TYPE_GET_SOURCE_CAP     0x7
+#define MSG_TYPE_GET_SINK_CAP       0x8
+#define MSG_TYPE_DR_SWAP            0x9
+#define MSG_TYPE_PR_SWAP            0xA
+#define MSG_TYPE_VCONN_SWAP         0xB
+#define MSG_TYPE_WAIT               0xC
+#define MSG_TYPE_SOFT_RESET         0xD
+#define MSG_TYPE_NOT_SUPPORTED      0x10
+#define MSG_TYPE_GET_SOURCE_CAP_EXT 0x11
+#define MSG_TYPE_GET_STATUS         0x12
+#define MSG_TYPE_FR_SWAP            0x13
+#define MSG_TYPE_GET_PPS_STATUS     0x14
+#define MSG_TYPE_GET_COUNTRY_CODES  0x15
+#define MSG_TYPE_GET_REVISION       0x18
+
+// USB-PD Message Types (Data Messages)
+#define MSG_TYPE_SOURCE_CAPABILITIES    0x1
+#define MSG_TYPE_REQUEST                0x2
+#define MSG_TYPE_BIST                   0x3
+#define MSG_TYPE_SINK_CAPABILITIES      0x4
+#define MSG_TYPE_BATTERY_STATUS         0x5
+#define MSG_TYPE_ALERT                  0x6
+#define MSG_TYPE_GET_COUNTRY_INFO       0x7
+#define MSG_TYPE_EPR_REQUEST            0x9
+#define MSG_TYPE_EPR_MODE               0xA
+#define MSG_TYPE_REVISION               0xC
+#define MSG_TYPE_VDM                    0xF
+
+// USB-PD Message Types (Extended Messages)
+#define MSG_TYPE_SOURCE_CAPABILITIES_EXTENDED 0x1
+#define MSG_TYPE_STATUS                 0x2
+#define MSG_TYPE_EXTENDED_CONTROL       0x10
+#define MSG_TYPE_EPR_SOURCE_CAPABILITIES 0x11
+
+// Message selectors: control and data messages share type numbers
+#define PD_CTRL(type)           (type)
+#define PD_DATA(type)           (0x20 | (type))
+#define PD_EXT(type)            (0x40 | (type))
+
+// Message header fields. The type is always 5 bits: PD 2.0 keeps bit 4 zero
+#define PD_HEADER_TYPE(header)      ((header)[0] & 0x1F)
+#define PD_HEADER_SPEC_REV(header)  (((header)[0] >> 6) & 0x03)
+
+// Specification Revision header field
+#define PD_SPEC_REV_10          0x0
+#define PD_SPEC_REV_20          0x1
+#define PD_SPEC_REV_30          0x2
+
+// Extended message header (first two data bytes of an extended message)
+#define PD_EXT_HEADER(chunked, chunk, request, size) \
+    (((uint16_t)(chunked) << 15) | ((uint16_t)(chunk) << 11) | ((uint16_t)(request) << 10) | (uint16_t)(size))
+#define PD_EXT_CHUNKED(ext)         (((ext) >> 15) & 0x1)
+#define PD_EXT_CHUNK_NUMBER(ext)    (((ext) >> 11) & 0xF)
+#define PD_EXT_REQUEST_CHUNK(ext)   (((ext) >> 10) & 0x1)
+#define PD_EXT_DATA_SIZE(ext)       ((ext) & 0x1FF)
+#define PD_MAX_CHUNK_SIZE       26      // MaxExtendedMsgChunkLen
+
+// Extended_Control data block: type, then one data byte
+#define EXT_CTRL_EPR_GET_SOURCE_CAP 1
+#define EXT_CTRL_EPR_KEEPALIVE      3
+#define EXT_CTRL_EPR_KEEPALIVE_ACK  4
+
+// EPR_Mode data object
+#define EPR_MODE_OBJECT(action, data)   (((uint32_t)(action) << 24) | ((uint32_t)(data) << 16))
+#define EPR_MODE_ACTION(mdo)        (((mdo) >> 24) & 0xFF)
+#define EPR_MODE_DATA(mdo)          (((mdo) >> 16) & 0xFF)  // Sink PDP on Enter, reason on Enter Failed
+#define EPR_MODE_ENTER              1
+#define EPR_MODE_ENTER_ACK          2
+#define EPR_MODE_ENTER_SUCCEEDED    3
+#define EPR_MODE_ENTER_FAILED       4
+#define EPR_MODE_EXIT               5
+
+// Alert data object: Type of Alert bits
+#define ADO_TYPE_BATTERY_STATUS     (1UL << 25)
+#define ADO_TYPE_OCP                (1UL << 26)
+#define ADO_TYPE_OTP                (1UL << 27)
+#define ADO_TYPE_OPERATING_COND     (1UL << 28)
+#define ADO_TYPE_SOURCE_INPUT       (1UL << 29)
+#define ADO_TYPE_OVP                (1UL << 30)
+#define ADO_TYPE_EXTENDED           (1UL << 31)
+
+// Status data block (Status message): 6 bytes from PD 3.0, 7 from PD 3.1
+#define SDB_SIZE_MIN                6
+#define SDB_SIZE                    7
+#define SDB_INPUT_EXTERNAL          0x02    // Present Input
+#define SDB_EVENT_OCP               0x02    // Event Flags
+#define SDB_EVENT_OTP               0x04
+#define SDB_EVENT_OVP               0x08
+#define SDB_EVENT_CF_MODE           0x10
+#define SDB_TEMP_STATUS(b)          (((b) >> 1) & 0x3)  // 0 not supported, 1 normal, 2 warning, 3 over
+#define SDB_TEMP_OVER               3
+
+// Power and Request data objects
+#define PDO_FIXED_DUAL_ROLE_POWER   (1UL << 29) // First Source PDO flags
+#define PDO_FIXED_USB_SUSPEND       (1UL << 28)
+#define PDO_FIXED_UNCONSTRAINED     (1UL << 27)
+#define PDO_FIXED_USB_COMMS         (1UL << 26)
+#define PDO_FIXED_DUAL_ROLE_DATA    (1UL << 25)
+#define PDO_FIXED_EPR_CAPABLE       (1UL << 23) // First Source PDO: EPR Mode Capable
+#define PDO_FIXED_MV(pdo)           ((((pdo) >> 10) & 0x3FF) * 50)
+#define PDO_FIXED_MA(pdo)           (((pdo) & 0x3FF) * 10)
+#define PDO_TYPE(pdo)               (((pdo) >> 30) & 0x3)   // pdo_type_t
+#define PDO_APDO_TYPE(pdo)          (((pdo) >> 28) & 0x3)
+#define PDO_APDO_SPR_PPS            0
+#define PDO_APDO_EPR_AVS            1
+#define PDO_PPS_MAX_MV(pdo)         ((((pdo) >> 17) & 0xFF) * 100)
+#define PDO_PPS_MIN_MV(pdo)         ((((pdo) >> 8) & 0xFF) * 100)
+#define PDO_PPS_MA(pdo)             (((pdo) & 0x7F) * 50)
+#define PDO_AVS_MAX_MV(pdo)         ((((pdo) >> 17) & 0x1FF) * 100)
+#define PDO_AVS_MIN_MV(pdo)         ((((pdo) >> 8) & 0xFF) * 100)
+#define PDO_AVS_PDP_W(pdo)          ((pdo) & 0xFF)
+#define RDO_POSITION(rdo)           (((rdo) >> 28) & 0xF)
+#define RDO_FIXED_OP_MA(rdo)        ((((rdo) >> 10) & 0x3FF) * 10)
+#define RDO_CAP_MISMATCH            (1UL << 26)
+#define RDO_EPR_CAPABLE             (1UL << 22)
+#define RDO_AVS(position, mv, ma) \
+    (((uint32_t)(position) << 28) | ((uint32_t)((mv) / 25) << 9) | (uint32_t)((ma) / 50))
+#define RDO_AVS_MV(rdo)             ((((rdo) >> 9) & 0xFFF) * 25)
+#define RDO_AVS_MA(rdo)             (((rdo) & 0x7F) * 50)
+#define PD_EPR_FIRST_POSITION   8       // EPR (A)PDOs follow the seven SPR positions
+#define PD_MAX_SRC_PDOS         11      // SPR plus EPR positions of EPR_Source_Capabilities
+
+// Structured VDM header (first data object of a Vendor_Defined message)
+#define VDM_STRUCTURED          (1UL << 15)
+#define VDM_HEADER(svid, version, pos, cmd_type, cmd) \
+    (((uint32_t)(svid) << 16) | VDM_STRUCTURED | ((uint32_t)(version) << 13) | \
+     ((uint32_t)(pos) << 8) | ((uint32_t)(cmd_type) << 6) | (uint32_t)(cmd))
+#define VDM_HDR_SVID(header)        ((uint16_t)((header) >> 16))
+#define VDM_HDR_VERSION(header)     (((header) >> 13) & 0x3)
+#define VDM_HDR_OBJ_POS(header)     (((header) >> 8) & 0x7)
+#define VDM_HDR_CMD_TYPE(header)    (((header) >> 6) & 0x3)
+#define VDM_HDR_CMD(header)         ((header) & 0x1F)
+#define VDM_VERSION_10          0x0     // SVDM 1.0 (PD 2.0)
+#define VDM_VERSION_20          0x1     // SVDM 2.0 (PD 3.x)
+
+// Standard and Vendor IDs
+#define PD_SID                  0xFF00  // Discover Identity/SVIDs
+#define DP_SID                  0xFF01  // DisplayPort alternate mode
+
+// ID Header VDO
+#define VDO_IDH_USB_HOST        (1UL << 31)
+#define VDO_IDH_USB_DEVICE      (1UL << 30)
+#define VDO_IDH_MODAL           (1UL << 26)
+#define VDO_IDH_PRODUCT_TYPE(vdo)   (((vdo) >> 27) & 0x7)
+#define VDO_IDH_DFP_PRODUCT_TYPE(vdo) (((vdo) >> 23) & 0x7)    // PD 3.x
+#define VDO_IDH_VID(vdo)            ((uint16_t)((vdo) & 0xFFFF))
+#define VDO_IDH_PTYPE_PASSIVE_CABLE 3   // Product type on SOP'
+#define VDO_IDH_PTYPE_ACTIVE_CABLE  4
+
+// Passive Cable VDO / Active Cable VDO 1 (fourth VDO of a cable's Discover Identity ACK)
+#define VDO_CABLE_CURRENT(vdo)      (((vdo) >> 5) & 0x3)
+#define VDO_CABLE_CURRENT_3A        1
+#define VDO_CABLE_CURRENT_5A        2
+#define VDO_CABLE_MAX_VOLTAGE(vdo)  (((vdo) >> 9) & 0x3)   // 20/30/40/50 V, PD 3.x cables only
+#define VDO_CABLE_EPR               (1UL << 17)             // EPR Mode Capable
+
+// Protocol Sequence Constants
+#define SOP_SEQUENCE_0      0x12
+#define SOP_SEQUENCE_1      0x12
+#define SOP_SEQUENCE_2      0x12
+#define SOP_SEQUENCE_3      0x13
+#define SOP1_SEQUENCE_0     0x12    // SOP': Sync-1 Sync-1 Sync-3 Sync-3
+#define SOP1_SEQUENCE_1     0x12
+#define SOP1_SEQUENCE_2     0x1B
+#define SOP1_SEQUENCE_3     0x1B
+#define SOP2_SEQUENCE_0     0x12    // SOP'': Sync-1 Sync-3 Sync-1 Sync-3
+#define SOP2_SEQUENCE_1     0x1B
+#define SOP2_SEQUENCE_2     0x12
+#define SOP2_SEQUENCE_3     0x1B
+#define EOP_SEQUENCE        0x14
+#define TXOFF_SEQUENCE      0xFE
+#define CRC_PLACEHOLDER     0xFF
+#define PACKSYM             0x80    // OR'd with the number of packed bytes (max 31)
+#define SYNC1_TOKEN         0x12
+#define SYNC2_TOKEN         0x13
+#define SYNC3_TOKEN         0x1B
+#define TXON_TOKEN          0xA1
+
+// RX FIFO SOP tokens (bits 7:5 of the first byte of each received frame)
+#define RX_TOKEN_MASK       0xE0
+#define RX_TOKEN_SOP        0xE0
+#define RX_TOKEN_SOP1       0xC0
+#define RX_TOKEN_SOP2       0xA0
+
+// FUSB302B FIFO depths
+#define FUSB_TX_FIFO_SIZE   48
+#define FUSB_RX_FIFO_SIZE   80
+
+// Frame sizes
+#define PD_MAX_DATA_OBJECTS 7
+#define PD_MAX_PAYLOAD      (PD_MAX_DATA_OBJECTS * 4)
+// Largest FIFO image of one frame: SOP + PACKSYM + header + payload +
+// PACKSYM + software CRC + EOP + TXOFF going out (received frames are
+// token + header + payload + CRC, which is shorter)
+#define PD_FRAME_MAX        (4 + 1 + 2 + PD_MAX_PAYLOAD + 1 + 4 + 2)
+
+#endif // FUSB302B_REGS_H
@@ -0,0 +1,86 @@
+#include <Arduino.h>
+#include "PD_Alert.h"
+#include "PD_Stats.h"
+#include "PD_Callbacks.h"
+#include "PD_Log.h"
+
+static PD_TLS pd_shed_hook_t shed_hook = NULL;
+
+/**
+ * Set the load-shed hook
+ */
+void pd_alert_set_shed_hook(pd_shed_hook_t hook) {
+    shed_hook = hook;
+}
+
+/**
+ * Call the load-shed hook first, count afterwards
+ */
+bool pd_alert_shed(uint32_t ado) {
+    pd_shed_hook_t hook = shed_hook;
+    bool shed = hook && (ado & PD_ALERT_SHED_TYPES);
+
+    if (shed) {
+        hook(pd_port - pd_ports, ado);
+        uint32_t latency_us = micros() - int_time_us;
+        pd_stats_inc(PD_CNT_LOAD_SHEDS);
+        pd_stats_set(PD_CNT_SHED_LATENCY_US, latency_us);
+        if (latency_us > pd_stats_get(pd_port - pd_ports, PD_CNT_SHED_LATENCY_MAX_US)) {
+            pd_stats_set(PD_CNT_SHED_LATENCY_MAX_US, latency_us);
+        }
+    }
+    pd_stats_inc(PD_CNT_ALERTS);
+    return shed;
+}
+
+/**
+ * Log an Alert and tell the application
+ */
+void pd_alert_received(uint32_t ado) {
+    pd_log.print("Alert received, ADO: 0x");
+    pd_log.println(ado, HEX);
+    if (ado & ADO_TYPE_OCP) {
+        pd_log.println("Source over-current");
+    }
+    if (ado & ADO_TYPE_OTP) {
+        pd_log.println("Source over-temperature");
+    }
+    if (ado & ADO_TYPE_OVP) {
+        pd_log.println("Source over-voltage");
+    }
+    if (ado & ADO_TYPE_OPERATING_COND) {
+        pd_log.println("Source operating condition changed");
+    }
+    pd_cb_alert(PD_CB_ALERT_PARTNER, ado);
+}
+
+/**
+ * Decode a Status data block
+ */
+bool pd_alert_status(const uint8_t *sdb, uint8_t size) {
+    pd_status_t status = {};
+
+    if (size < SDB_SIZE_MIN) {
+        pd_log.println("Status too short");
+        return false;
+    }
+    status.internal_temp = sdb[0];
+    status.present_input = sdb[1];
+    status.battery_input = sdb[2];
+    status.event_flags = sdb[3];
+    status.temp_status = SDB_TEMP_STATUS(sdb[4]);
+    status.power_status = sdb[5];
+    status.power_state_change = (size >= SDB_SIZE) ? sdb[6] : 0;
+    pd_stats_inc(PD_CNT_STATUS_RX);
+
+    pd_log.print("Status: ");
+    pd_log.print(status.internal_temp);
+    pd_log.print(" C, event flags: 0x");
+    pd_log.print(status.event_flags, HEX);
+    pd_log.print(", temperature status: ");
+    pd_log.print(status.temp_status);
+    pd_log.print(", power status: 0x");
+    pd_log.println(status.power_status, HEX);
+    pd_cb_status(&status);
+    return true;
+}
@@ -0,0 +1,81 @@
+#ifndef PD_ALERT_H
+#define PD_ALERT_H
+
+#include <stdint.h>
+#include "FUSB302B.h"
+
+//=============================================================================
+// Source Alerts and Status
+//=============================================================================
+
+// A PD 3.x source reports OCP, OTP, OVP and operating condition changes
+// with an Alert message, and details them in a Status message when asked with
+// Get_Status. Shedding load cannot wait for that round trip or for the log:
+// the receive path hands every verified Alert straight to pd_alert_shed(),
+// which calls the application's load-shed hook before the frame is traced,
+// counted or offered to a flow. The responder (or read_rest() on the blocking
+// path) then logs the Alert, posts it to on_alert and fetches the Status,
+// which is decoded and posted to on_status.
+
+#ifndef PD_ALERT_SHED_TYPES
+#define PD_ALERT_SHED_TYPES     (ADO_TYPE_OCP | ADO_TYPE_OTP | ADO_TYPE_OVP | ADO_TYPE_OPERATING_COND)
+#endif
+
+/**
+ * @brief Load-shed hook, called on core 1 from the receive path
+ *
+ * Runs with the FUSB302B FIFO half read and the port's flows on hold, so it
+ * should only switch the load off (a GPIO write) and leave the rest to
+ * on_alert/on_status.
+ *
+ * @param port Port index
+ * @param ado Alert data object (ADO_TYPE_* bits)
+ */
+typedef void (*pd_shed_hook_t)(uint8_t port, uint32_t ado);
+
+/**
+ * @brief Decoded Status data block
+ */
+typedef struct {
+    uint8_t internal_temp;      ///< Source temperature in degrees C, 0 = not supported
+    uint8_t present_input;      ///< SDB_INPUT_* bits
+    uint8_t battery_input;      ///< Present Battery Input
+    uint8_t event_flags;        ///< SDB_EVENT_* bits
+    uint8_t temp_status;        ///< SDB_TEMP_STATUS(): 0 not supported, 1 normal, 2 warning, 3 over
+    uint8_t power_status;       ///< Power Status (why the source limits its power)
+    uint8_t power_state_change; ///< Power State Change, 0 from PD 3.0 sources
+} pd_status_t;
+
+/**
+ * @brief Set the load-shed hook
+ * @param hook Called for Alerts with any PD_ALERT_SHED_TYPES bit, NULL for none
+ */
+void pd_alert_set_shed_hook(pd_shed_hook_t hook);
+
+/**
+ * @brief Fast path: call the load-shed hook for a received Alert
+ *
+ * Called by the receive path as soon as an Alert's CRC checks out. Counts the
+ * Alert and, for a shed, the time from the INT_N edge to the hook
+ * (PD_CNT_SHED_LATENCY_US).
+ *
+ * @param ado Alert data object
+ * @return true if the hook was called
+ */
+bool pd_alert_shed(uint32_t ado);
+
+/**
+ * @brief Slow path: log an Alert and post it to on_alert (PD_CB_ALERT_PARTNER)
+ * @param ado Alert data object
+ */
+void pd_alert_received(uint32_t ado);
+
+/**
+ * @brief Decode a Status data block, log it and post it to on_status
+ * @param sdb Status data block
+ * @param size Bytes in sdb
+ * @return false if it is shorter than SDB_SIZE_MIN
+ */
+bool pd_alert_status(const uint8_t *sdb, uint8_t size);
+
+#endif // PD_ALERT_H
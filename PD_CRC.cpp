@@ -0,0 +1,153 @@
+#include "PD_CRC.h"
+
+// Tables are generated at compile time so they land in flash, and only the
+// ones needed by the selected variant are instantiated.
+
+#if defined(PD_CRC_ALL)
+#define PD_CRC_TABLES   8
+#elif (PD_CRC_IMPL == PD_CRC_SLICE8)
+#define PD_CRC_TABLES   8
+#elif (PD_CRC_IMPL == PD_CRC_SLICE4)
+#define PD_CRC_TABLES   4
+#elif (PD_CRC_IMPL == PD_CRC_TABLE)
+#define PD_CRC_TABLES   1
+#else
+#define PD_CRC_TABLES   0
+#endif
+
+#if PD_CRC_TABLES
+
+struct crc_tables_t {
+    uint32_t t[PD_CRC_TABLES][256];
+};
+
+static constexpr crc_tables_t make_crc_tables() {
+    crc_tables_t tables = {};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? ((crc >> 1) ^ PD_CRC_POLY) : (crc >> 1);
+        }
+        tables.t[0][i] = crc;
+    }
+    // Table k advances a byte that sits k positions ahead in the stream
+    for (int k = 1; k < PD_CRC_TABLES; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t prev = tables.t[k - 1][i];
+            tables.t[k][i] = (prev >> 8) ^ tables.t[0][prev & 0xFF];
+        }
+    }
+    return tables;
+}
+
+static constexpr crc_tables_t crc_tables = make_crc_tables();
+
+#endif
+
+#if defined(PD_CRC_ALL) || (PD_CRC_IMPL == PD_CRC_BITWISE)
+uint32_t pd_crc32_update_bitwise(uint32_t crc, const uint8_t *data, uint16_t length) {
+    for (uint16_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (PD_CRC_POLY & (0 - (crc & 1)));
+        }
+    }
+    return crc;
+}
+#endif
+
+#if defined(PD_CRC_ALL) || (PD_CRC_IMPL == PD_CRC_TABLE)
+uint32_t pd_crc32_update_table(uint32_t crc, const uint8_t *data, uint16_t length) {
+    for (uint16_t i = 0; i < length; i++) {
+        crc = (crc >> 8) ^ crc_tables.t[0][(crc ^ data[i]) & 0xFF];
+    }
+    return crc;
+}
+#endif
+
+// The slice variants assemble words byte by byte: the Cortex-M0+ in the RP2040
+// faults on unaligned loads and FIFO buffers carry no alignment guarantee.
+
+#if defined(PD_CRC_ALL) || (PD_CRC_IMPL == PD_CRC_SLICE4)
+uint32_t pd_crc32_update_slice4(uint32_t crc, const uint8_t *data, uint16_t length) {
+    const uint32_t (*t)[256] = crc_tables.t;
+
+    while (length >= 4) {
+        crc ^= (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+               ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+        crc = t[3][crc & 0xFF] ^ t[2][(crc >> 8) & 0xFF] ^
+              t[1][(crc >> 16) & 0xFF] ^ t[0][crc >> 24];
+        data += 4;
+        length -= 4;
+    }
+    while (length--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+#endif
+
+#if defined(PD_CRC_ALL) || (PD_CRC_IMPL == PD_CRC_SLICE8)
+uint32_t pd_crc32_update_slice8(uint32_t crc, const uint8_t *data, uint16_t length) {
+    const uint32_t (*t)[256] = crc_tables.t;
+
+    while (length >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+                             ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24));
+        uint32_t hi = (uint32_t)data[4] | ((uint32_t)data[5] << 8) |
+                      ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 24);
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^
+              t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+              t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+        data += 8;
+        length -= 8;
+    }
+    while (length--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+#endif
+
+/**
+ * Fold bytes into a running CRC using the compile-time selected variant
+ */
+uint32_t pd_crc32_update(uint32_t crc, const uint8_t *data, uint16_t length) {
+#if (PD_CRC_IMPL == PD_CRC_SLICE8)
+    return pd_crc32_update_slice8(crc, data, length);
+#elif (PD_CRC_IMPL == PD_CRC_SLICE4)
+    return pd_crc32_update_slice4(crc, data, length);
+#elif (PD_CRC_IMPL == PD_CRC_TABLE)
+    return pd_crc32_update_table(crc, data, length);
+#else
+    return pd_crc32_update_bitwise(crc, data, length);
+#endif
+}
+
+/**
+ * Compute the finished CRC-32 of a buffer
+ */
+uint32_t pd_crc32(const uint8_t *data, uint16_t length) {
+    return ~pd_crc32_update(PD_CRC_INIT, data, length);
+}
+
+/**
+ * Compare a running CRC against the received CRC bytes
+ */
+bool pd_crc32_check(uint32_t crc, const uint8_t *crc_bytes) {
+    uint32_t received = (uint32_t)crc_bytes[0] | ((uint32_t)crc_bytes[1] << 8) |
+                        ((uint32_t)crc_bytes[2] << 16) | ((uint32_t)crc_bytes[3] << 24);
+    return (~crc) == received;
+}
+
+/**
+ * Write a finished CRC into a buffer, LSB first
+ */
+void pd_crc32_store(uint32_t crc, uint8_t *out) {
+    crc = ~crc;
+    out[0] = crc & 0xFF;
+    out[1] = (crc >> 8) & 0xFF;
+    out[2] = (crc >> 16) & 0xFF;
+    out[3] = (crc >> 24) & 0xFF;
+}
@@ -0,0 +1,72 @@
+#ifndef PD_CRC_H
+#define PD_CRC_H
+
+#include <stdint.h>
+
+//=============================================================================
+// USB-PD CRC-32
+//=============================================================================
+
+// The USB-PD CRC is the IEEE 802.3 CRC-32 (polynomial 0x04C11DB7, reflected,
+// initial value 0xFFFFFFFF, inverted result) computed over the message header
+// and data. It is transmitted least significant byte first.
+//
+// This header has no Arduino dependencies so the CRC engine can also be built
+// on a host (see extras/crc_bench.cpp).
+
+// Implementation variants, ordered by flash footprint
+#define PD_CRC_BITWISE      0   ///< No table, 8 shift/xor steps per byte
+#define PD_CRC_TABLE        1   ///< 1 KB table, one lookup per byte
+#define PD_CRC_SLICE4       2   ///< 4 KB of tables, one 4-byte step per lookup round
+#define PD_CRC_SLICE8       3   ///< 8 KB of tables, one 8-byte step per lookup round
+
+/**
+ * @brief Variant used by pd_crc32_update(), selected at compile time
+ */
+#ifndef PD_CRC_IMPL
+#define PD_CRC_IMPL         PD_CRC_TABLE
+#endif
+
+#define PD_CRC_POLY         0xEDB88320UL    ///< Reflected form of 0x04C11DB7
+#define PD_CRC_INIT         0xFFFFFFFFUL    ///< Initial running CRC value
+
+/**
+ * @brief Fold bytes into a running CRC
+ * @param crc Running CRC (start with PD_CRC_INIT)
+ * @param data Pointer to data buffer
+ * @param length Number of bytes
+ * @return Updated running CRC
+ */
+uint32_t pd_crc32_update(uint32_t crc, const uint8_t *data, uint16_t length);
+
+/**
+ * @brief Compute the finished CRC-32 of a buffer
+ * @param data Pointer to data buffer (message header + data)
+ * @param length Number of bytes
+ * @return CRC value to transmit
+ */
+uint32_t pd_crc32(const uint8_t *data, uint16_t length);
+
+/**
+ * @brief Compare a running CRC against the 4 CRC bytes read from a frame
+ * @param crc Running CRC over the header and data
+ * @param crc_bytes Received CRC bytes (LSB first)
+ * @return true if the CRC matches
+ */
+bool pd_crc32_check(uint32_t crc, const uint8_t *crc_bytes);
+
+/**
+ * @brief Write a finished CRC into a buffer, LSB first
+ * @param crc Running CRC over the header and data
+ * @param out Destination for the 4 CRC bytes
+ */
+void pd_crc32_store(uint32_t crc, uint8_t *out);
+
+// Individual variants. Only the selected one is built unless PD_CRC_ALL is
+// defined, which the host benchmark uses to compare them side by side.
+uint32_t pd_crc32_update_bitwise(uint32_t crc, const uint8_t *data, uint16_t length);
+uint32_t pd_crc32_update_table(uint32_t crc, const uint8_t *data, uint16_t length);
+uint32_t pd_crc32_update_slice4(uint32_t crc, const uint8_t *data, uint16_t length);
+uint32_t pd_crc32_update_slice8(uint32_t crc, const uint8_t *data, uint16_t length);
+
+#endif // PD_CRC_H
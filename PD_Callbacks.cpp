@@ -0,0 +1,320 @@
+#include <string.h>
+#include <Arduino.h>
+#include <hardware/sync.h>
+#include "PD_Callbacks.h"
+
+#if (PD_CB_QUEUE_LEN & (PD_CB_QUEUE_LEN - 1)) || (PD_CB_QUEUE_LEN > 128)
+#error "PD_CB_QUEUE_LEN must be a power of two up to 128"
+#endif
+
+/**
+ * @brief Power request left by core 0 for one port
+ */
+typedef struct {
+    volatile int16_t volts;
+    volatile int16_t ma;
+    volatile bool pending;          ///< volts/ma not taken by core 1 yet
+} pd_cb_request_t;
+
+static PD_TLS const pd_callbacks_t *volatile cb_table = NULL;
+
+// Ring of posted events: core 1 writes cb_tail, core 0 writes cb_head
+static PD_TLS pd_cb_event_t cb_queue[PD_CB_QUEUE_LEN];
+static PD_TLS uint8_t cb_head = 0;
+static PD_TLS uint8_t cb_tail = 0;
+
+static PD_TLS pd_cb_request_t cb_requests[PD_NUM_PORTS];
+static PD_TLS pd_cb_stats_t cb_stats;
+
+/**
+ * Whether the application registered the callback of an event type
+ */
+static bool wanted(pd_cb_type_t type) {
+    const pd_callbacks_t *cb = cb_table;
+    if (!cb) {
+        return false;
+    }
+    switch (type) {
+        case PD_CB_ATTACH:   return cb->on_attach != NULL;
+        case PD_CB_CAPS:     return cb->on_caps != NULL;
+        case PD_CB_CONTRACT: return cb->on_contract != NULL;
+        case PD_CB_IDENTITY: return cb->on_identity != NULL;
+        case PD_CB_DETACH:   return cb->on_detach != NULL;
+        case PD_CB_ERROR:    return cb->on_error != NULL;
+        case PD_CB_ALERT:    return cb->on_alert != NULL;
+        case PD_CB_STATUS:   return cb->on_status != NULL;
+        default:             return false;
+    }
+}
+
+/**
+ * Claim the next free slot for an event of the current port, NULL if unwanted or full
+ */
+static pd_cb_event_t *reserve(pd_cb_type_t type) {
+    if (!wanted(type)) {
+        return NULL;
+    }
+    uint8_t tail = cb_tail;
+    if ((uint8_t)(tail - __atomic_load_n(&cb_head, __ATOMIC_ACQUIRE)) >= PD_CB_QUEUE_LEN) {
+        cb_stats.dropped++;
+        return NULL;
+    }
+    pd_cb_event_t *event = &cb_queue[tail & (PD_CB_QUEUE_LEN - 1)];
+    event->type = type;
+    event->port = pd_port - pd_ports;
+    return event;
+}
+
+/**
+ * Publish the slot reserve() returned and wake core 0
+ */
+static void post() {
+    cb_queue[cb_tail & (PD_CB_QUEUE_LEN - 1)].posted_us = micros();
+    __atomic_store_n(&cb_tail, (uint8_t)(cb_tail + 1), __ATOMIC_RELEASE);
+    cb_stats.posted++;
+    __sev(); // Core 0 may be in __wfe()
+}
+
+/**
+ * Run the callback of one event
+ */
+static void run(const pd_callbacks_t *cb, const pd_cb_event_t *event) {
+    switch (event->type) {
+        case PD_CB_ATTACH:
+            if (cb->on_attach) cb->on_attach(event->port, &event->attach);
+            break;
+        case PD_CB_CAPS:
+            if (cb->on_caps) cb->on_caps(event->port, &event->caps);
+            break;
+        case PD_CB_CONTRACT:
+            if (cb->on_contract) cb->on_contract(event->port, &event->contract);
+            break;
+        case PD_CB_IDENTITY:
+            if (cb->on_identity) cb->on_identity(event->port, &event->identity);
+            break;
+        case PD_CB_DETACH:
+            if (cb->on_detach) cb->on_detach(event->port, &event->detach);
+            break;
+        case PD_CB_ERROR:
+            if (cb->on_error) cb->on_error(event->port, &event->error);
+            break;
+        case PD_CB_ALERT:
+            if (cb->on_alert) cb->on_alert(event->port, &event->alert);
+            break;
+        case PD_CB_STATUS:
+            if (cb->on_status) cb->on_status(event->port, &event->status);
+            break;
+        default:
+            break;
+    }
+}
+
+//=============================================================================
+// Application Side
+//=============================================================================
+
+/**
+ * Register the application callbacks
+ */
+void pd_cb_register(const pd_callbacks_t *callbacks) {
+    cb_table = callbacks;
+}
+
+/**
+ * Run queued callbacks until the queue is empty or the budget is spent
+ */
+uint8_t pd_cb_dispatch(uint32_t budget_us) {
+    uint32_t start_us = micros();
+    uint8_t head = cb_head;
+    uint8_t count = 0;
+
+    while (head != __atomic_load_n(&cb_tail, __ATOMIC_ACQUIRE)) {
+        if (count && ((micros() - start_us) >= budget_us)) {
+            break; // Leave the rest for the next pass
+        }
+        const pd_cb_event_t *event = &cb_queue[head & (PD_CB_QUEUE_LEN - 1)];
+        const pd_callbacks_t *cb = cb_table;
+        uint32_t run_us = micros();
+        uint32_t latency_us = run_us - event->posted_us;
+
+        if (cb) {
+            run(cb, event);
+        }
+        run_us = micros() - run_us;
+
+        // A callback cannot be preempted; one that ran long is only counted
+        cb_stats.dispatched++;
+        if (run_us > PD_CB_BUDGET_US) {
+            cb_stats.overruns++;
+        }
+        if (run_us > cb_stats.max_run_us) {
+            cb_stats.max_run_us = run_us;
+        }
+        if (latency_us > cb_stats.max_latency_us) {
+            cb_stats.max_latency_us = latency_us;
+        }
+        __atomic_store_n(&cb_head, ++head, __ATOMIC_RELEASE);
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Leave a power request for core 1
+ */
+bool pd_cb_request_power(uint8_t port, int volts, int ma) {
+    if (port >= PD_NUM_PORTS) {
+        return false;
+    }
+    pd_cb_request_t *req = &cb_requests[port];
+    req->pending = false;
+    req->volts = volts;
+    req->ma = ma;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    req->pending = true;
+    __sev(); // Core 1 may be waiting for INT_N
+    return true;
+}
+
+/**
+ * Copy the dispatch statistics
+ */
+void pd_cb_get_stats(pd_cb_stats_t *out) {
+    memcpy(out, (const void *)&cb_stats, sizeof(*out));
+}
+
+//=============================================================================
+// Stack Side
+//=============================================================================
+
+/**
+ * Post PD_CB_ATTACH for the current port
+ */
+void pd_cb_attach() {
+    pd_port->caps_posted = false;
+    pd_cb_event_t *event = reserve(PD_CB_ATTACH);
+    if (event) {
+        event->attach.cc_line = pd_port->cc_line;
+        post();
+    }
+}
+
+/**
+ * Post PD_CB_CAPS for the Source_Capabilities just cached
+ */
+void pd_cb_caps(pd_caps_change_t change) {
+    if ((change == PD_CAPS_SAME) && pd_port->caps_posted) {
+        return; // Application has these already
+    }
+    pd_port->caps_posted = true;
+    pd_cb_event_t *event = reserve(PD_CB_CAPS);
+    if (event) {
+        event->caps.change = change;
+        event->caps.num_pdos = pd_port->num_src_pdos;
+        event->caps.epr = pd_port->epr_mode;
+        memcpy(event->caps.pdos, pd_port->src_pdos, pd_port->num_src_pdos * sizeof(uint32_t));
+        post();
+    }
+}
+
+/**
+ * Post PD_CB_CONTRACT for the Request that got PS_RDY
+ */
+void pd_cb_contract() {
+    pd_cb_event_t *event = reserve(PD_CB_CONTRACT);
+    if (event) {
+        uint32_t rdo = pd_port->request_rdo;
+        uint8_t position = RDO_POSITION(rdo);
+        bool augmented = position && (position <= pd_port->num_src_pdos) &&
+                         (GET_PDO_TYPE(pd_port->src_pdos[position - 1]) == PDO_TYPE_AUGMENTED);
+
+        event->contract.rdo = rdo;
+        event->contract.mv = contract_mv();
+        event->contract.ma = augmented ? RDO_AVS_MA(rdo) : RDO_FIXED_OP_MA(rdo);
+        event->contract.epr = pd_port->epr_contract;
+        event->contract.vbus_ok = pd_port->vbus_ok;
+        post();
+    }
+}
+
+/**
+ * Post PD_CB_IDENTITY for a recognised or classified partner
+ */
+void pd_cb_identity(uint16_t vid, uint16_t pid, bool classified) {
+    pd_cb_event_t *event = reserve(PD_CB_IDENTITY);
+    if (event) {
+        event->identity.vid = vid;
+        event->identity.pid = pid;
+        event->identity.dev_type = pd_port->dev_type;
+        event->identity.classified = classified;
+        post();
+    }
+}
+
+/**
+ * Post PD_CB_DETACH for the current port
+ */
+void pd_cb_detach(bool recovery) {
+    pd_cb_event_t *event = reserve(PD_CB_DETACH);
+    if (event) {
+        event->detach.recovery = recovery;
+        post();
+    }
+}
+
+/**
+ * Post PD_CB_ERROR for the current port
+ */
+void pd_cb_error(pd_cb_error_code_t code, uint32_t detail) {
+    pd_cb_event_t *event = reserve(PD_CB_ERROR);
+    if (event) {
+        event->error.code = code;
+        event->error.detail = detail;
+        post();
+    }
+}
+
+/**
+ * Post PD_CB_ALERT for the current port
+ */
+void pd_cb_alert(pd_cb_alert_source_t source, uint32_t value) {
+    pd_cb_event_t *event = reserve(PD_CB_ALERT);
+    if (event) {
+        event->alert.source = source;
+        event->alert.value = value;
+        post();
+    }
+}
+
+/**
+ * Post PD_CB_STATUS for the current port
+ */
+void pd_cb_status(const pd_status_t *status) {
+    pd_cb_event_t *event = reserve(PD_CB_STATUS);
+    if (event) {
+        event->status = *status;
+        post();
+    }
+}
+
+/**
+ * Whether core 0 left a power request for the current port
+ */
+bool pd_cb_request_pending() {
+    return cb_requests[pd_port - pd_ports].pending;
+}
+
+/**
+ * Take the current port's power request
+ */
+bool pd_cb_take_request(int *volts, int *ma) {
+    pd_cb_request_t *req = &cb_requests[pd_port - pd_ports];
+    if (!req->pending) {
+        return false;
+    }
+    req->pending = false;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    *volts = req->volts;
+    *ma = req->ma;
+    return true;
+}
@@ -0,0 +1,233 @@
+#ifndef PD_CALLBACKS_H
+#define PD_CALLBACKS_H
+
+#include <stdint.h>
+#include "FUSB302B.h"
+#include "PD_Alert.h"
+
+//=============================================================================
+// Application Callbacks
+//=============================================================================
+
+// Port events delivered to the application on core 0. Core 1 posts each event
+// with a typed payload into a single-producer/single-consumer ring (no locks:
+// core 1 only moves the tail, core 0 only the head) and signals SEV; core 0
+// calls pd_cb_dispatch() from loop(), which runs the registered callbacks
+// until the ring is empty or its time budget is spent. Events are only posted
+// for callbacks that are registered, and a full ring drops the event and
+// counts it rather than stalling PD processing.
+//
+// Power requests go the other way through a one-slot mailbox per port:
+// pd_cb_request_power() leaves the voltage and current for core 1, which
+// requests them from the cached Source_Capabilities on its next pass.
+
+#define PD_CB_QUEUE_LEN         16      ///< Events in flight, a power of two
+#define PD_CB_BUDGET_US         100     ///< A callback running longer counts as an overrun
+#define PD_CB_DISPATCH_BUDGET_US 1000   ///< Default budget of one pd_cb_dispatch() pass
+
+/**
+ * @brief Event types, one callback each
+ */
+typedef enum : uint8_t {
+    PD_CB_ATTACH = 0,       ///< Source attached (VBUS up)
+    PD_CB_CAPS,             ///< First or changed Source_Capabilities since the attach
+    PD_CB_CONTRACT,         ///< Explicit contract reached (PS_RDY), VBUS checked
+    PD_CB_IDENTITY,         ///< Partner VID/PID from recognition, or the device type pd_classify() guessed
+    PD_CB_DETACH,           ///< Source gone, or dropped by the recovery ladder
+    PD_CB_ERROR,            ///< Failed negotiation, hard reset, VBUS off the contract, EPR failure
+    PD_CB_ALERT,            ///< FUSB302B over-current/temperature, VBUS monitor crossing, source Alert
+    PD_CB_STATUS,           ///< Source Status fetched after an Alert
+    PD_CB_NUM_EVENTS
+} pd_cb_type_t;
+
+/**
+ * @brief Error codes of PD_CB_ERROR
+ */
+typedef enum : uint8_t {
+    PD_CB_ERR_NEGOTIATION = 0,  ///< A Request did not end in PS_RDY (detail: refusing message type, 0 = timeout or not known)
+    PD_CB_ERR_HARD_RESET,       ///< Hard Reset (detail: 0 received, 1 sent)
+    PD_CB_ERR_VBUS,             ///< VBUS not at the contract voltage (detail: reading's lower bound in mV)
+    PD_CB_ERR_EPR               ///< EPR mode not entered or not kept alive (detail: EPR_Mode action, 0 = timeout)
+} pd_cb_error_code_t;
+
+/**
+ * @brief Alert sources of PD_CB_ALERT
+ */
+typedef enum : uint8_t {
+    PD_CB_ALERT_OCP_TEMP = 0,   ///< FUSB302B over-current or over-temperature (value: STATUS1)
+    PD_CB_ALERT_VBUS,           ///< VBUS crossed the pd_vbus_monitor() threshold (value: 1 above, 0 below)
+    PD_CB_ALERT_PARTNER         ///< Alert message from the source (value: ADO, ADO_TYPE_* bits)
+} pd_cb_alert_source_t;
+
+typedef struct {
+    uint8_t cc_line;            ///< CC line the source was found on, 0 if not oriented yet
+} pd_cb_attach_t;
+
+typedef struct {
+    pd_caps_change_t change;    ///< PD_CAPS_NEW or PD_CAPS_PDO_KEPT (PD_CAPS_SAME on the first after an attach)
+    uint8_t num_pdos;           ///< Objects in pdos
+    bool epr;                   ///< EPR_Source_Capabilities (positions 8+ are EPR)
+    uint32_t pdos[PD_MAX_SRC_PDOS]; ///< As received
+} pd_cb_caps_t;
+
+typedef struct {
+    uint32_t rdo;               ///< Request data object accepted
+    uint16_t mv;                ///< Contract voltage, 0 for PDO types other than fixed and AVS
+    uint16_t ma;                ///< Operating current
+    bool epr;                   ///< Made with EPR_Request
+    bool vbus_ok;               ///< VBUS measured at mv (pd_vbus_check_contract)
+} pd_cb_contract_t;
+
+typedef struct {
+    uint16_t vid;               ///< USB Vendor ID
+    uint16_t pid;               ///< USB Product ID
+    uint8_t dev_type;           ///< pd_device_type_t from the recognition database or pd_classify()
+    bool classified;            ///< VID/PID unavailable (both 0), dev_type guessed by pd_classify()
+} pd_cb_identity_t;
+
+typedef struct {
+    bool recovery;              ///< The recovery ladder ran out; toggle looks for the source again
+} pd_cb_detach_t;
+
+typedef struct {
+    pd_cb_error_code_t code;
+    uint32_t detail;            ///< See pd_cb_error_code_t
+} pd_cb_error_t;
+
+typedef struct {
+    pd_cb_alert_source_t source;
+    uint32_t value;             ///< See pd_cb_alert_source_t
+} pd_cb_alert_t;
+
+/**
+ * @brief One queued event
+ */
+typedef struct {
+    pd_cb_type_t type;
+    uint8_t port;               ///< Index into pd_ports
+    uint32_t posted_us;         ///< micros() on core 1 when posted
+    union {
+        pd_cb_attach_t attach;
+        pd_cb_caps_t caps;
+        pd_cb_contract_t contract;
+        pd_cb_identity_t identity;
+        pd_cb_detach_t detach;
+        pd_cb_error_t error;
+        pd_cb_alert_t alert;
+        pd_status_t status;
+    };
+} pd_cb_event_t;
+
+/**
+ * @brief Application callbacks, run on core 0 by pd_cb_dispatch()
+ *
+ * Any of them may be NULL. Payloads are only valid during the call. Keep each
+ * within PD_CB_BUDGET_US; longer work belongs in loop().
+ */
+typedef struct {
+    void (*on_attach)(uint8_t port, const pd_cb_attach_t *attach);
+    void (*on_caps)(uint8_t port, const pd_cb_caps_t *caps);
+    void (*on_contract)(uint8_t port, const pd_cb_contract_t *contract);
+    void (*on_identity)(uint8_t port, const pd_cb_identity_t *identity);
+    void (*on_detach)(uint8_t port, const pd_cb_detach_t *detach);
+    void (*on_error)(uint8_t port, const pd_cb_error_t *error);
+    void (*on_alert)(uint8_t port, const pd_cb_alert_t *alert);
+    void (*on_status)(uint8_t port, const pd_status_t *status);
+} pd_callbacks_t;
+
+/**
+ * @brief Dispatch statistics
+ *
+ * posted and dropped are counted by core 1, the rest by core 0.
+ */
+typedef struct {
+    uint32_t posted;            ///< Events queued
+    uint32_t dropped;           ///< Events lost to a full queue
+    uint32_t dispatched;        ///< Callbacks run
+    uint32_t overruns;          ///< Callbacks that ran longer than PD_CB_BUDGET_US
+    uint32_t max_latency_us;    ///< Longest post to callback start
+    uint32_t max_run_us;        ///< Longest callback
+} pd_cb_stats_t;
+
+//=============================================================================
+// Application Side (core 0)
+//=============================================================================
+
+/**
+ * @brief Register the callbacks (before the first attach)
+ * @param callbacks Table, kept by reference; NULL stops posting
+ */
+void pd_cb_register(const pd_callbacks_t *callbacks);
+
+/**
+ * @brief Run queued callbacks
+ *
+ * Stops when the queue is empty or budget_us has passed; at least one
+ * callback runs when one is queued. Call from loop(); __wfe() in between
+ * sleeps until core 1 posts.
+ *
+ * @param budget_us Time allowed for the pass, e.g. PD_CB_DISPATCH_BUDGET_US
+ * @return Events dispatched
+ */
+uint8_t pd_cb_dispatch(uint32_t budget_us);
+
+/**
+ * @brief Ask core 1 for a new contract from the cached Source_Capabilities
+ *
+ * Replaces a request core 1 has not taken yet.
+ *
+ * @param port Port index
+ * @param volts Desired voltage
+ * @param ma Desired current in mA
+ * @return false for a bad port
+ */
+bool pd_cb_request_power(uint8_t port, int volts, int ma);
+
+/**
+ * @brief Copy the dispatch statistics
+ * @param out Destination
+ */
+void pd_cb_get_stats(pd_cb_stats_t *out);
+
+//=============================================================================
+// Stack Side (core 1, port being serviced)
+//=============================================================================
+
+/** @brief Post PD_CB_ATTACH (VBUS came up) */
+void pd_cb_attach();
+
+/** @brief Post PD_CB_CAPS from src_pdos unless unchanged since the last one this attach */
+void pd_cb_caps(pd_caps_change_t change);
+
+/** @brief Post PD_CB_CONTRACT for request_rdo, after pd_vbus_check_contract() */
+void pd_cb_contract();
+
+/** @brief Post PD_CB_IDENTITY once lookup_dev_type() recognised the partner or classify_dev_type() guessed it */
+void pd_cb_identity(uint16_t vid, uint16_t pid, bool classified);
+
+/** @brief Post PD_CB_DETACH (only for a port that was attached) */
+void pd_cb_detach(bool recovery);
+
+/** @brief Post PD_CB_ERROR */
+void pd_cb_error(pd_cb_error_code_t code, uint32_t detail);
+
+/** @brief Post PD_CB_ALERT */
+void pd_cb_alert(pd_cb_alert_source_t source, uint32_t value);
+
+/** @brief Post PD_CB_STATUS */
+void pd_cb_status(const pd_status_t *status);
+
+/**
+ * @brief Whether the application left a power request for the current port
+ */
+bool pd_cb_request_pending();
+
+/**
+ * @brief Take the current port's power request
+ * @param volts Requested voltage
+ * @param ma Requested current in mA
+ * @return false if none was pending
+ */
+bool pd_cb_take_request(int *volts, int *ma);
+
+#endif // PD_CALLBACKS_H
@@ -0,0 +1,79 @@
+#include "PD_Classify.h"
+#include "FUSB302B_Regs.h"
+#include "PD_Classify_Tree.h"
+
+const char *const pd_feature_names[PD_NUM_FEATURES] = {
+    "num_pdos", "num_fixed", "num_pps", "max_mv", "ma_5v", "max_w", "drp", "usb_suspend",
+    "unconstrained", "usb_comms", "drd", "epr", "spec_rev", "transition_ms", "ufp_type", "dfp_type",
+};
+
+const char *const pd_class_names[PD_CLASSIFY_CLASSES] = {
+    "charger", "monitor", "tablet", "laptop",
+};
+
+/**
+ * Extract the features from the capabilities, header and identity
+ */
+void pd_classify_features(const uint32_t *pdos, uint8_t num_pdos, uint8_t spec_rev, uint16_t transition_ms,
+                          uint32_t id_header, pd_features_t *out) {
+    uint16_t *v = out->value;
+    uint32_t first = num_pdos ? pdos[0] : 0;
+    uint32_t max_mw = 0;
+
+    if (num_pdos > 7) {
+        num_pdos = 7; // EPR objects describe the same source again
+    }
+    v[PD_FEAT_NUM_PDOS] = num_pdos;
+    v[PD_FEAT_NUM_FIXED] = 0;
+    v[PD_FEAT_NUM_PPS] = 0;
+    v[PD_FEAT_MAX_MV] = 0;
+    for (uint8_t i = 0; i < num_pdos; i++) {
+        uint32_t pdo = pdos[i];
+        uint32_t mv = 0, mw = 0;
+        if (PDO_TYPE(pdo) == 0) { // PDO_TYPE_FIXED_SUPPLY
+            mv = PDO_FIXED_MV(pdo);
+            mw = mv * PDO_FIXED_MA(pdo) / 1000;
+            v[PD_FEAT_NUM_FIXED]++;
+        } else if ((PDO_TYPE(pdo) == 3) && (PDO_APDO_TYPE(pdo) == PDO_APDO_SPR_PPS)) { // PDO_TYPE_AUGMENTED
+            mv = PDO_PPS_MAX_MV(pdo);
+            mw = mv * PDO_PPS_MA(pdo) / 1000;
+            v[PD_FEAT_NUM_PPS]++;
+        }
+        if (mv > v[PD_FEAT_MAX_MV]) {
+            v[PD_FEAT_MAX_MV] = mv;
+        }
+        if (mw > max_mw) {
+            max_mw = mw;
+        }
+    }
+    v[PD_FEAT_MA_5V] = (PDO_TYPE(first) == 0) ? PDO_FIXED_MA(first) : 0;
+    v[PD_FEAT_MAX_W] = max_mw / 1000;
+    v[PD_FEAT_DRP] = !!(first & PDO_FIXED_DUAL_ROLE_POWER);
+    v[PD_FEAT_USB_SUSPEND] = !!(first & PDO_FIXED_USB_SUSPEND);
+    v[PD_FEAT_UNCONSTRAINED] = !!(first & PDO_FIXED_UNCONSTRAINED);
+    v[PD_FEAT_USB_COMMS] = !!(first & PDO_FIXED_USB_COMMS);
+    v[PD_FEAT_DRD] = !!(first & PDO_FIXED_DUAL_ROLE_DATA);
+    v[PD_FEAT_EPR] = !!(first & PDO_FIXED_EPR_CAPABLE);
+    v[PD_FEAT_SPEC_REV] = spec_rev;
+    v[PD_FEAT_TRANSITION_MS] = transition_ms;
+    v[PD_FEAT_UFP_TYPE] = VDO_IDH_PRODUCT_TYPE(id_header);
+    v[PD_FEAT_DFP_TYPE] = VDO_IDH_DFP_PRODUCT_TYPE(id_header);
+}
+
+/**
+ * Walk a depth-first tree from the root to a leaf
+ */
+uint8_t pd_classify_tree(const pd_class_node_t *tree, const pd_features_t *features) {
+    const pd_class_node_t *node = tree;
+    while (node->feature != PD_CLASSIFY_LEAF) {
+        node += (features->value[node->feature] <= node->threshold) ? 1 : node->skip;
+    }
+    return node->threshold;
+}
+
+/**
+ * Classify with the generated tree
+ */
+uint8_t pd_classify(const pd_features_t *features) {
+    return pd_classify_tree(pd_classify_nodes, features);
+}
@@ -0,0 +1,100 @@
+#ifndef PD_CLASSIFY_H
+#define PD_CLASSIFY_H
+
+#include <stdint.h>
+
+//=============================================================================
+// Partner Classifier
+//=============================================================================
+
+// Recognition by VID/PID needs Source_Capabilities_Extended, which PD 2.0
+// sources cannot send and many PD 3.0 chargers refuse. When it fails, the
+// device type is guessed from what every negotiation yields anyway: the shape
+// of the Source_Capabilities, the flags of the first fixed PDO, the spec
+// revision in the source's header, how long the source took from Accept to
+// PS_RDY and, if Discover Identity has been answered, the product types in
+// the ID Header. pd_classify_features() reduces these to a feature vector and
+// pd_classify() walks a small binary decision tree over it: one compare per
+// level, a few dozen nodes, well under a microsecond at 133 MHz.
+//
+// The tree in PD_Classify_Tree.h is generated by extras/pd_classify.cpp,
+// which trains it from labelled samples and cross-validates it on the host.
+// Like PD_CRC.h, this header has no Arduino dependencies.
+
+/**
+ * @brief Features, in the order of pd_features_t::value
+ */
+typedef enum {
+    PD_FEAT_NUM_PDOS = 0,           ///< Objects in Source_Capabilities
+    PD_FEAT_NUM_FIXED,              ///< Fixed supply PDOs among them
+    PD_FEAT_NUM_PPS,                ///< PPS APDOs among them
+    PD_FEAT_MAX_MV,                 ///< Highest voltage offered, mV
+    PD_FEAT_MA_5V,                  ///< Current of the vSafe5V PDO, mA
+    PD_FEAT_MAX_W,                  ///< Highest power of any PDO, W
+    PD_FEAT_DRP,                    ///< First PDO flags, 0 or 1
+    PD_FEAT_USB_SUSPEND,
+    PD_FEAT_UNCONSTRAINED,
+    PD_FEAT_USB_COMMS,
+    PD_FEAT_DRD,
+    PD_FEAT_EPR,
+    PD_FEAT_SPEC_REV,               ///< Header Specification Revision (PD_SPEC_REV_*)
+    PD_FEAT_TRANSITION_MS,          ///< Accept to PS_RDY, ms
+    PD_FEAT_UFP_TYPE,               ///< ID Header UFP product type, 0 if not discovered
+    PD_FEAT_DFP_TYPE,               ///< ID Header DFP product type, 0 if not discovered
+    PD_NUM_FEATURES
+} pd_feature_t;
+
+#define PD_CLASSIFY_CLASSES     4       ///< pd_device_type_t values a leaf can hold
+#define PD_CLASSIFY_LEAF        0xFF    ///< pd_class_node_t::feature of a leaf
+
+/**
+ * @brief Feature vector of one partner
+ */
+typedef struct {
+    uint16_t value[PD_NUM_FEATURES];
+} pd_features_t;
+
+/**
+ * @brief Decision tree node, 4 bytes; the root is node 0
+ *
+ * An inner node goes to node + 1 when value[feature] <= threshold and to
+ * node + skip otherwise, so a tree is stored depth first and needs no child
+ * indices. A leaf has feature PD_CLASSIFY_LEAF and the class in threshold.
+ */
+typedef struct {
+    uint8_t feature;        ///< pd_feature_t, or PD_CLASSIFY_LEAF
+    uint8_t skip;           ///< Distance to the "greater" child
+    uint16_t threshold;     ///< Split value, or the leaf's pd_device_type_t
+} pd_class_node_t;
+
+extern const char *const pd_feature_names[PD_NUM_FEATURES];    ///< Short names, as in the sample files
+extern const char *const pd_class_names[PD_CLASSIFY_CLASSES];  ///< pd_device_type_t names
+
+/**
+ * @brief Reduce what negotiation learned about a source to features
+ * @param pdos Source_Capabilities as received
+ * @param num_pdos Objects in pdos (1-7; only SPR objects are looked at)
+ * @param spec_rev Specification Revision of the source's header
+ * @param transition_ms Accept to PS_RDY of the contract, 0 if unknown
+ * @param id_header ID Header VDO from Discover Identity, 0 if not discovered
+ * @param out Features
+ */
+void pd_classify_features(const uint32_t *pdos, uint8_t num_pdos, uint8_t spec_rev, uint16_t transition_ms,
+                          uint32_t id_header, pd_features_t *out);
+
+/**
+ * @brief Classify with a given tree
+ * @param tree Nodes, root first
+ * @param features Features
+ * @return pd_device_type_t
+ */
+uint8_t pd_classify_tree(const pd_class_node_t *tree, const pd_features_t *features);
+
+/**
+ * @brief Classify with the built-in tree (PD_Classify_Tree.h)
+ * @param features Features
+ * @return pd_device_type_t
+ */
+uint8_t pd_classify(const pd_features_t *features);
+
+#endif // PD_CLASSIFY_H
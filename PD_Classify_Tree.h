@@ -0,0 +1,20 @@
+#ifndef PD_CLASSIFY_TREE_H
+#define PD_CLASSIFY_TREE_H
+
+#include "PD_Classify.h"
+
+// Generated by extras/pd_classify.cpp from extras/pd_classify_samples.csv
+// (50 samples, depth 5, min leaf 2); retrain rather than edit.
+static const pd_class_node_t pd_classify_nodes[] = {
+    {PD_FEAT_USB_COMMS, 2, 0},                   // usb_comms <= 0
+    {PD_CLASSIFY_LEAF, 0, 0},                    //   charger
+    {PD_FEAT_DRP, 2, 0},                         //   drp <= 0
+    {PD_CLASSIFY_LEAF, 0, 1},                    //     monitor
+    {PD_FEAT_UNCONSTRAINED, 4, 0},               //     unconstrained <= 0
+    {PD_FEAT_TRANSITION_MS, 2, 127},             //       transition_ms <= 127
+    {PD_CLASSIFY_LEAF, 0, 2},                    //         tablet
+    {PD_CLASSIFY_LEAF, 0, 3},                    //         laptop
+    {PD_CLASSIFY_LEAF, 0, 3},                    //       laptop
+};
+
+#endif // PD_CLASSIFY_TREE_H
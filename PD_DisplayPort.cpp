@@ -0,0 +1,124 @@
+#include <Arduino.h>
+#include "PD_DisplayPort.h"
+#include "PD_Log.h"
+
+static PD_TLS pd_dp_state_t dp_ports[PD_NUM_PORTS];
+
+/**
+ * Our DP Status: connected as UFP_D, enabled once configured
+ */
+static uint32_t dpStatus(const pd_dp_state_t *dp) {
+    uint32_t status = DP_STATUS_CONN_UFP_D;
+    if (dp->pin_assignment) {
+        status |= DP_STATUS_ENABLED;
+    }
+    if (PD_DP_MULTI_FUNCTION && (PD_DP_PIN_ASSIGNMENTS & DP_PIN_MULTI_FUNCTION)) {
+        status |= DP_STATUS_MF_PREFERRED;
+    }
+    if (dp->hpd) {
+        status |= DP_STATUS_HPD;
+    }
+    return status;
+}
+
+/**
+ * One mode: UFP_D on a receptacle with the configured pin assignments
+ */
+static uint8_t dpModes(uint32_t *vdos) {
+    vdos[0] = DP_CAP_UFP_D | DP_CAP_SIGNAL_DP13 | DP_CAP_RECEPTACLE | DP_CAP_UFP_D_PINS(PD_DP_PIN_ASSIGNMENTS);
+    return 1;
+}
+
+static bool dpEnter(uint8_t port, uint8_t mode) {
+    if (mode != 1) {
+        return false;
+    }
+    pd_log.println("DisplayPort mode entered");
+    dp_ports[port].entered = true;
+    dp_ports[port].pin_assignment = 0;
+    return true;
+}
+
+static void dpExit(uint8_t port, uint8_t) {
+    pd_log.println("DisplayPort mode exited");
+    dp_ports[port].entered = false;
+    dp_ports[port].pin_assignment = 0;
+    dp_ports[port].dfp_status = 0;
+}
+
+static vdm_cmd_type_t dpCommand(uint8_t port, uint32_t header, const uint32_t *vdos, uint8_t num_vdos,
+                                uint32_t *reply, uint8_t *num_reply) {
+    pd_dp_state_t *dp = &dp_ports[port];
+
+    switch (VDM_HDR_CMD(header)) {
+    case DP_CMD_STATUS_UPDATE:
+        if (num_vdos) {
+            dp->dfp_status = vdos[0];
+        }
+        reply[0] = dpStatus(dp);
+        *num_reply = 1;
+        return VDM_CMD_TYPE_ACK;
+
+    case DP_CMD_CONFIGURE: {
+        if (!num_vdos) {
+            return VDM_CMD_TYPE_NAK;
+        }
+        uint8_t select = DP_CONF_SELECT(vdos[0]);
+        uint8_t pins = DP_CONF_PINS(vdos[0]);
+        if (select == DP_CONF_USB) {
+            dp->pin_assignment = 0;
+            pd_log.println("DisplayPort: USB configuration");
+            return VDM_CMD_TYPE_ACK;
+        }
+        // Exactly one of the pin assignments we offered
+        if ((select != DP_CONF_UFP_U_AS_UFP_D) || !pins || (pins & (pins - 1)) ||
+            !(pins & PD_DP_PIN_ASSIGNMENTS)) {
+            return VDM_CMD_TYPE_NAK;
+        }
+        dp->pin_assignment = pins;
+        pd_log.print("DisplayPort: pin assignment ");
+        pd_log.println((char)('A' + __builtin_ctz(pins)));
+        return VDM_CMD_TYPE_ACK;
+    }
+    }
+    return VDM_CMD_TYPE_NAK;
+}
+
+static void dpPartnerModes(uint8_t port, const uint32_t *vdos, uint8_t num_vdos) {
+    if (num_vdos) {
+        dp_ports[port].partner_caps = vdos[0];
+    }
+}
+
+static const pd_svid_handler_t dp_handler = {
+    DP_SID, dpModes, dpEnter, dpExit, dpCommand, NULL, dpPartnerModes
+};
+
+/**
+ * Register the DisplayPort handler
+ */
+bool pd_dp_register() {
+    return pd_vdm_register(&dp_handler);
+}
+
+/**
+ * DisplayPort state of a port
+ */
+const pd_dp_state_t *pd_dp_state(uint8_t port) {
+    return &dp_ports[(port < PD_NUM_PORTS) ? port : 0];
+}
+
+/**
+ * Report an HPD change with Attention
+ */
+bool pd_dp_set_hpd(uint8_t port, bool level, bool irq) {
+    if ((port >= PD_NUM_PORTS) || !dp_ports[port].entered) {
+        return false;
+    }
+    dp_ports[port].hpd = level;
+    uint32_t status = dpStatus(&dp_ports[port]);
+    if (irq) {
+        status |= DP_STATUS_IRQ_HPD;
+    }
+    return pd_vdm_attention(port, DP_SID, status);
+}
@@ -0,0 +1,94 @@
+#ifndef PD_DISPLAYPORT_H
+#define PD_DISPLAYPORT_H
+
+#include <stdint.h>
+#include "PD_VDM.h"
+
+//=============================================================================
+// DisplayPort Alternate Mode (UFP_D)
+//=============================================================================
+
+// SVID handler for DP_SID on the sink side of a dock or adapter: one
+// DisplayPort mode, DP Status Update and DP Configure answered for the DFP_D,
+// HPD reported with Attention. The DFP_D picks the pin assignment from the
+// ones advertised in PD_DP_PIN_ASSIGNMENTS.
+
+#define DP_CMD_STATUS_UPDATE    16      ///< DisplayPort Status Update
+#define DP_CMD_CONFIGURE        17      ///< DisplayPort Configure
+
+// Pin assignments (DP Capabilities and DP Configure bit fields)
+#define DP_PIN_A                (1 << 0)
+#define DP_PIN_B                (1 << 1)
+#define DP_PIN_C                (1 << 2)    ///< 4 DP lanes
+#define DP_PIN_D                (1 << 3)    ///< 2 DP lanes + USB 3
+#define DP_PIN_E                (1 << 4)    ///< 4 DP lanes, DP receptacle
+#define DP_PIN_F                (1 << 5)
+#define DP_PIN_MULTI_FUNCTION   (DP_PIN_B | DP_PIN_D | DP_PIN_F)
+
+// DP Capabilities VDO (the mode)
+#define DP_CAP_UFP_D            0x1         ///< UFP_D-capable
+#define DP_CAP_DFP_D            0x2         ///< DFP_D-capable
+#define DP_CAP_SIGNAL_DP13      (1UL << 2)  ///< DP v1.3 signaling
+#define DP_CAP_RECEPTACLE       (1UL << 6)  ///< USB Type-C receptacle (pin fields not swapped)
+#define DP_CAP_DFP_D_PINS(pins) ((uint32_t)(pins) << 8)
+#define DP_CAP_UFP_D_PINS(pins) ((uint32_t)(pins) << 16)
+
+// DP Status VDO
+#define DP_STATUS_CONN_DFP_D    0x1         ///< Connected: DFP_D
+#define DP_STATUS_CONN_UFP_D    0x2         ///< Connected: UFP_D
+#define DP_STATUS_POWER_LOW     (1UL << 2)
+#define DP_STATUS_ENABLED       (1UL << 3)
+#define DP_STATUS_MF_PREFERRED  (1UL << 4)  ///< Multi-function (pin assignment D) preferred
+#define DP_STATUS_USB_CONFIG    (1UL << 5)  ///< Request to switch to USB configuration
+#define DP_STATUS_EXIT          (1UL << 6)  ///< Request to exit the mode
+#define DP_STATUS_HPD           (1UL << 7)  ///< HPD state
+#define DP_STATUS_IRQ_HPD       (1UL << 8)  ///< HPD interrupt
+
+// DP Configure VDO
+#define DP_CONF_SELECT(vdo)     ((vdo) & 0x3)
+#define DP_CONF_USB             0x0         ///< Back to USB configuration
+#define DP_CONF_UFP_U_AS_DFP_D  0x1
+#define DP_CONF_UFP_U_AS_UFP_D  0x2
+#define DP_CONF_PINS(vdo)       (((vdo) >> 8) & 0xFF)
+
+#ifndef PD_DP_PIN_ASSIGNMENTS
+#define PD_DP_PIN_ASSIGNMENTS   (DP_PIN_C | DP_PIN_D | DP_PIN_E) ///< Offered to the DFP_D
+#endif
+#ifndef PD_DP_MULTI_FUNCTION
+#define PD_DP_MULTI_FUNCTION    1           ///< Ask for pin assignment D to keep USB 3 up
+#endif
+
+/**
+ * @brief DisplayPort state of one port
+ */
+typedef struct {
+    uint32_t partner_caps;          ///< Partner's DP Capabilities from our Discover Modes, 0 = none
+    uint32_t dfp_status;            ///< Last DP Status sent by the DFP_D
+    uint8_t pin_assignment;         ///< Configured DP_PIN_*, 0 = USB configuration
+    bool entered;                   ///< DisplayPort mode entered
+    bool hpd;                       ///< HPD level reported to the DFP_D
+} pd_dp_state_t;
+
+/**
+ * @brief Register the DisplayPort handler with the VDM engine (before attach)
+ * @return false if the registry is full
+ */
+bool pd_dp_register();
+
+/**
+ * @brief DisplayPort state of a port
+ * @param port Port index
+ * @return State, updated by core 1
+ */
+const pd_dp_state_t *pd_dp_state(uint8_t port);
+
+/**
+ * @brief Report an HPD change to the DFP_D with Attention
+ * @param port Port index
+ * @param level HPD level
+ * @param irq true for an IRQ_HPD pulse
+ * @return false if the mode is not entered
+ */
+bool pd_dp_set_hpd(uint8_t port, bool level, bool irq);
+
+#endif // PD_DISPLAYPORT_H
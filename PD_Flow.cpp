@@ -0,0 +1,1120 @@
+#include <Arduino.h>
+#include "PD_Flow.h"
+#include "PD_Stats.h"
+#include "PD_VDM.h"
+#include "PD_VBUS.h"
+#include "PD_Callbacks.h"
+#include "PD_Alert.h"
+#include "PD_Reset.h"
+#include "PD_Log.h"
+
+//=============================================================================
+// Scheduler
+//=============================================================================
+
+/**
+ * Initialise a scheduler with no flows
+ */
+void pd_sched_init(pd_sched_t *sched) {
+    memset(sched, 0, sizeof(*sched));
+}
+
+/**
+ * Start a flow from the top
+ */
+bool pd_flow_start(pd_sched_t *sched, pd_flow_t *flow) {
+    for (int i = 0; i < PD_FLOW_MAX; i++) {
+        if (!sched->flows[i]) {
+            flow->sched = sched;
+            flow->resume = 0;
+            flow->status = PD_FLOW_WAITING;
+            flow->rx = 0;
+            sched->flows[i] = flow;
+            return true;
+        }
+    }
+    pd_log.print("No free flow slot for ");
+    pd_log.println(flow->name);
+    return false;
+}
+
+/**
+ * Stop every flow
+ */
+void pd_sched_stop_all(pd_sched_t *sched) {
+    if (sched->tx_owner) {
+        setReg(REG_CONTROL0, (getReg(REG_CONTROL0) | CONTROL0_TX_FLUSH));
+    }
+    pd_sched_init(sched);
+}
+
+/**
+ * Stop one flow
+ */
+void pd_flow_stop(pd_sched_t *sched, pd_flow_t *flow) {
+    for (int i = 0; i < PD_FLOW_MAX; i++) {
+        if (sched->flows[i] == flow) {
+            sched->flows[i] = 0;
+        }
+    }
+    if (sched->tx_owner) {
+        setReg(REG_CONTROL0, (getReg(REG_CONTROL0) | CONTROL0_TX_FLUSH));
+        sched->tx_owner = 0;
+    }
+}
+
+/**
+ * Pull at most one message and step every flow once
+ */
+bool pd_sched_run(pd_sched_t *sched) {
+    bool received = false;
+
+    // While a transmission is in flight the partner's GoodCRC belongs to it
+    if (!sched->msg_valid && !sched->tx_owner) {
+        received = receiveFrame(&sched->msg);
+        sched->msg_valid = received;
+    }
+    sched->busy = false;
+
+    for (int i = 0; i < PD_FLOW_MAX; i++) {
+        pd_flow_t *flow = sched->flows[i];
+        if (!flow) {
+            continue;
+        }
+        flow->status = flow->step(flow);
+        if (flow->status != PD_FLOW_WAITING) {
+            if (sched->tx_owner == flow) {
+                sched->tx_owner = 0;
+            }
+            if (sched->flows[i] == flow) {
+                sched->flows[i] = 0;
+            }
+        }
+    }
+
+    if (sched->msg_valid) {
+        // Offered to every flow and nobody was waiting for it
+        sched->msg_valid = false;
+        sched->dropped++;
+        pd_stats_inc(PD_CNT_UNEXPECTED);
+        pd_log.print("Unhandled message, type: ");
+        pd_log.println(sched->msg.type, DEC);
+    }
+    return sched->busy || received || sched->tx_owner;
+}
+
+//=============================================================================
+// Await Helpers
+//=============================================================================
+
+/**
+ * Start the timeout of an await
+ */
+void pd_flow_arm(pd_flow_t *flow, uint32_t timeout_ms) {
+    flow->deadline_ms = timeout_ms ? (millis() + timeout_ms) : 0;
+    flow->rx = 0;
+}
+
+/**
+ * Check the timeout of an await
+ */
+bool pd_flow_expired(pd_flow_t *flow) {
+    if (!flow->deadline_ms) {
+        return false;
+    }
+    flow->sched->busy = true;
+    return (int32_t)(millis() - flow->deadline_ms) >= 0;
+}
+
+static bool claim(pd_flow_t *flow) {
+    flow->sched->msg_valid = false;
+    flow->rx = &flow->sched->msg;
+    return true;
+}
+
+/**
+ * Message selector of a received message
+ */
+static uint8_t selector_of(const pd_msg_t *msg) {
+    if (msg->extended) {
+        return PD_EXT(msg->type);
+    }
+    return msg->num_data_objects ? PD_DATA(msg->type) : PD_CTRL(msg->type);
+}
+
+/**
+ * Await condition: a matching SOP message or the timeout
+ */
+bool pd_flow_rx(pd_flow_t *flow, uint8_t selector) {
+    pd_sched_t *sched = flow->sched;
+    if (sched->msg_valid && (sched->msg.sop == SOP_TYPE_SOP) && (selector_of(&sched->msg) == selector)) {
+        return claim(flow);
+    }
+    return pd_flow_expired(flow);
+}
+
+/**
+ * Await condition: a message on sop accepted by match or the timeout
+ */
+bool pd_flow_rx_if(pd_flow_t *flow, uint8_t sop, pd_msg_match_t match) {
+    pd_sched_t *sched = flow->sched;
+    if (sched->msg_valid && (sched->msg.sop == sop) && match(&sched->msg)) {
+        return claim(flow);
+    }
+    return pd_flow_expired(flow);
+}
+
+/**
+ * Await condition: the transmitter is free and the message has been loaded
+ */
+bool pd_flow_tx_begin(pd_flow_t *flow, uint8_t sop, bool extended, uint8_t num_data_objects,
+                      uint8_t message_type, uint8_t *data_objects) {
+    pd_sched_t *sched = flow->sched;
+    if (sched->tx_owner) {
+        return false;
+    }
+    beginTransmit(extended, num_data_objects, message_type, data_objects, sop);
+    sched->tx_owner = flow;
+    sched->tx_start_ms = millis();
+    return true;
+}
+
+/**
+ * Await condition: the transmission has a result
+ */
+bool pd_flow_tx_done(pd_flow_t *flow) {
+    pd_sched_t *sched = flow->sched;
+    tx_result_t result;
+
+    if (pollTxResult(&result)) {
+        flow->tx = finishTransmit(result);
+    } else if ((millis() - sched->tx_start_ms) >= PD_TX_TIMEOUT_MS) {
+        pd_stats_inc(PD_CNT_TIMEOUT_TX);
+        flow->tx = finishTransmit(TX_RESULT_FAILED);
+    } else {
+        return false;
+    }
+    sched->tx_owner = 0;
+    return true;
+}
+
+/**
+ * Start a child flow embedded in the parent's frame
+ */
+void pd_flow_enter(pd_flow_t *parent, void *child) {
+    pd_flow_t *flow = (pd_flow_t *)child;
+    flow->sched = parent->sched;
+    flow->resume = 0;
+    flow->status = PD_FLOW_WAITING;
+    flow->rx = 0;
+}
+
+/**
+ * Await condition: step the child once and report whether it finished
+ */
+bool pd_flow_child_done(void *child) {
+    pd_flow_t *flow = (pd_flow_t *)child;
+    flow->status = flow->step(flow);
+    return flow->status != PD_FLOW_WAITING;
+}
+
+//=============================================================================
+// Flows
+//=============================================================================
+
+static uint32_t data_object(const uint8_t *data) {
+    return ((uint32_t)data[3] << 24) | ((uint32_t)data[2] << 16) | ((uint32_t)data[1] << 8) | data[0];
+}
+
+static uint16_t ext_header(const pd_msg_t *msg) {
+    return msg->data[0] | (msg->data[1] << 8);
+}
+
+static void put_object(uint8_t *objects, uint32_t object) {
+    objects[0] = object & 0xFF;
+    objects[1] = (object >> 8) & 0xFF;
+    objects[2] = (object >> 16) & 0xFF;
+    objects[3] = (object >> 24) & 0xFF;
+}
+
+static bool is_request_reply(const pd_msg_t *msg) {
+    return (msg->num_data_objects == 0) &&
+           ((msg->type == MSG_TYPE_ACCEPT) || (msg->type == MSG_TYPE_REJECT) || (msg->type == MSG_TYPE_WAIT));
+}
+
+/**
+ * Count a Request that did not end in PS_RDY and tell the application
+ */
+static void select_failed(uint8_t refusal) {
+    pd_stats_inc(PD_CNT_NEGOTIATION_FAILURES);
+    pd_cb_error(PD_CB_ERR_NEGOTIATION, refusal);
+}
+
+static pd_flow_status_t select_step(pd_flow_t *f) {
+    pd_flow_select_t *s = (pd_flow_select_t *)f;
+
+    PD_FLOW_BEGIN(f);
+    {
+        uint32_t request_msg = request_for(s->volts, s->ma);
+        if (!request_msg && epr_needed(s->volts)) {
+            // EPR voltages are only offered in EPR mode, entered from an SPR contract
+            request_msg = request_for(5, s->ma);
+        }
+        if (!request_msg && s->mismatch) {
+            request_msg = request_mismatch(); // Source_Capabilities are answered all the same
+        }
+        if (!request_msg) {
+            PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+        }
+        put_object(s->request, request_msg);
+
+        // In EPR mode every request is an EPR_Request with a copy of the PDO
+        s->epr = pd_port->epr_mode;
+        if (s->epr) {
+            put_object(&s->request[4], pd_port->src_pdos[RDO_POSITION(request_msg) - 1]);
+        }
+    }
+
+    PD_AWAIT_TX(f, false, s->epr ? 2 : 1, s->epr ? MSG_TYPE_EPR_REQUEST : MSG_TYPE_REQUEST, s->request);
+    if (f->tx != TX_RESULT_SENT) {
+        select_failed(0);
+        PD_FLOW_EXIT(f, PD_FLOW_TIMEOUT);
+    }
+    pd_log.println("Voltage and current requested from source");
+
+    PD_AWAIT_RX_IF(f, is_request_reply, PD_T_SENDER_RESPONSE_MS);
+    if (!f->rx) {
+        pd_log.println("No response received - request");
+        pd_stats_inc(PD_CNT_TIMEOUT_SENDER_RESPONSE);
+        select_failed(0);
+        PD_FLOW_EXIT(f, PD_FLOW_TIMEOUT);
+    }
+    if (f->rx->type != MSG_TYPE_ACCEPT) {
+        pd_log.print("Request refused, message type: ");
+        pd_log.println(f->rx->type, DEC);
+        pd_stats_inc((f->rx->type == MSG_TYPE_WAIT) ? PD_CNT_WAITS : PD_CNT_REJECTS);
+        select_failed(f->rx->type);
+        PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+    }
+    pd_log.println("Request accepted");
+    pd_port->vbus_ok = false; // VBUS is in transition
+    s->accept_ms = millis();
+
+    PD_AWAIT_RX(f, PD_CTRL(MSG_TYPE_PS_READY), s->epr ? PD_T_PS_TRANSITION_EPR_MS : PD_T_PS_TRANSITION_MS);
+    if (!f->rx) {
+        pd_log.println("No PS_RDY after Accept");
+        pd_stats_inc(PD_CNT_TIMEOUT_PS_TRANSITION);
+        select_failed(0);
+        PD_FLOW_EXIT(f, PD_FLOW_TIMEOUT);
+    }
+    pd_log.println("Power supply ready");
+    pd_port->transition_ms = millis() - s->accept_ms;
+    pd_port->recovery = PD_RECOVER_NONE;
+    pd_stats_inc(PD_CNT_CONTRACTS);
+    pd_reset_contract();
+    if (s->epr) {
+        pd_stats_inc(PD_CNT_EPR_CONTRACTS);
+        if (!pd_port->epr_contract) {
+            pd_stats_set(PD_CNT_EPR_CONTRACT_MS, millis() - pd_port->toggle_done_ms);
+        }
+    }
+    pd_port->epr_contract = s->epr;
+    pd_vbus_check_contract();
+    pd_cb_contract();
+    PD_FLOW_END(f);
+}
+
+/**
+ * Prepare a select flow frame
+ */
+pd_flow_t *pd_flow_select_init(pd_flow_select_t *frame, int volts, int ma) {
+    frame->flow.name = "select";
+    frame->flow.step = select_step;
+    frame->volts = volts;
+    frame->ma = ma;
+    frame->mismatch = true;
+    return &frame->flow;
+}
+
+static void record_src_caps(const pd_msg_t *msg) {
+    pd_log.println("Source capabilities message received");
+    exit_epr_mode(); // Only ever sent outside EPR mode
+    adoptSpecRev(msg->sop, PD_HEADER_SPEC_REV(msg->header));
+    update_src_caps(msg->data, msg->num_data_objects);
+}
+
+static pd_flow_status_t negotiate_step(pd_flow_t *f) {
+    pd_flow_negotiate_t *s = (pd_flow_negotiate_t *)f;
+
+    PD_FLOW_BEGIN(f);
+    PD_AWAIT_RX(f, PD_DATA(MSG_TYPE_SOURCE_CAPABILITIES), s->wait_ms);
+    if (!f->rx) {
+        pd_log.println("No response received - read PDO");
+        pd_stats_inc(PD_CNT_TIMEOUT_SINK_WAIT_CAP);
+        PD_FLOW_EXIT(f, PD_FLOW_TIMEOUT);
+    }
+    record_src_caps(f->rx);
+
+    pd_flow_select_init(&s->select, s->volts, s->ma);
+    PD_AWAIT_FLOW(f, &s->select);
+    if (s->select.flow.status != PD_FLOW_DONE) {
+        PD_FLOW_EXIT(f, s->select.flow.status);
+    }
+    PD_FLOW_END(f);
+}
+
+/**
+ * Prepare a negotiate flow frame
+ */
+pd_flow_t *pd_flow_negotiate_init(pd_flow_negotiate_t *frame, int volts, int ma) {
+    frame->flow.name = "negotiate";
+    frame->flow.step = negotiate_step;
+    frame->volts = volts;
+    frame->ma = ma;
+    frame->wait_ms = PD_T_SINK_WAIT_CAP_MS;
+    return &frame->flow;
+}
+
+static pd_flow_status_t recover_step(pd_flow_t *f) {
+    pd_flow_recover_t *s = (pd_flow_recover_t *)f;
+
+    PD_FLOW_BEGIN(f);
+    // In EPR mode the ladder starts at Hard Reset
+    if (!pd_port->epr_mode) {
+        pd_port->recovery = PD_RECOVER_SOFT_RESET;
+        pd_log.println("Recovery: soft reset");
+        resetMessageIds(); // Soft_Reset goes out as MessageID 0
+        pd_stats_inc(PD_CNT_SOFT_RESETS_TX);
+        pd_reset_begin(PD_RESET_SOFT_SENT);
+        PD_AWAIT_TX(f, false, 0, MSG_TYPE_SOFT_RESET, NULL);
+        if (f->tx == TX_RESULT_SENT) {
+            PD_AWAIT_RX(f, PD_CTRL(MSG_TYPE_ACCEPT), PD_T_SENDER_RESPONSE_MS);
+            if (!f->rx) {
+                pd_stats_inc(PD_CNT_TIMEOUT_SENDER_RESPONSE);
+            }
+        }
+        if ((f->tx == TX_RESULT_SENT) && f->rx) {
+            pd_flow_negotiate_init(&s->negotiate, s->volts, s->ma);
+            PD_AWAIT_FLOW(f, &s->negotiate);
+            if (s->negotiate.flow.status == PD_FLOW_DONE) {
+                PD_FLOW_EXIT(f, PD_FLOW_DONE);
+            }
+        }
+    }
+
+    pd_port->recovery = PD_RECOVER_HARD_RESET;
+    pd_log.println("Recovery: hard reset");
+    send_hard_reset();
+    pd_flow_negotiate_init(&s->negotiate, s->volts, s->ma);
+    s->negotiate.wait_ms = PD_T_HARD_RESET_CAP_MS;
+    PD_AWAIT_FLOW(f, &s->negotiate);
+    if (s->negotiate.flow.status == PD_FLOW_DONE) {
+        PD_FLOW_EXIT(f, PD_FLOW_DONE);
+    }
+
+    pd_port->recovery = PD_RECOVER_DETACH;
+    detach_port();
+    PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+    PD_FLOW_END(f);
+}
+
+/**
+ * Prepare a recovery flow frame
+ */
+pd_flow_t *pd_flow_recover_init(pd_flow_recover_t *frame, int volts, int ma) {
+    frame->flow.name = "recover";
+    frame->flow.step = recover_step;
+    frame->volts = volts;
+    frame->ma = ma;
+    return &frame->flow;
+}
+
+static bool is_ext_src_cap_reply(const pd_msg_t *msg) {
+    return (msg->extended && (msg->type == 0x1)) ||
+           (!msg->num_data_objects && (msg->type == MSG_TYPE_NOT_SUPPORTED));
+}
+
+static pd_flow_status_t recog_step(pd_flow_t *f) {
+    pd_flow_recog_t *s = (pd_flow_recog_t *)f;
+
+    PD_FLOW_BEGIN(f);
+    pd_flow_negotiate_init(&s->negotiate, s->volts, s->ma);
+    PD_AWAIT_FLOW(f, &s->negotiate);
+
+    // Extended messages only exist from PD 3.0, as the source's header says
+    f->rx = 0;
+    if (pd_port->spec_revs[SOP_TYPE_SOP] >= PD_SPEC_REV_30) {
+        PD_AWAIT_TX(f, false, 0, MSG_TYPE_GET_SOURCE_CAP_EXT, NULL);
+        pd_log.println("Requested extended source capabilities");
+        if (f->tx == TX_RESULT_SENT) {
+            PD_AWAIT_RX_IF(f, is_ext_src_cap_reply, PD_T_SENDER_RESPONSE_MS);
+        }
+    }
+
+    // Extended header, then VID and PID at the start of the SCEDB
+    if (f->rx && f->rx->extended && (f->rx->num_data_objects >= 2)) {
+        uint16_t vid = (f->rx->data[3] << 8) | f->rx->data[2];
+        uint16_t pid = (f->rx->data[5] << 8) | f->rx->data[4];
+        pd_log.print("Device VID: ");
+        pd_log.println(vid, HEX);
+        pd_log.print("Device PID: ");
+        pd_log.println(pid, HEX);
+        lookup_dev_type(vid, pid);
+        pd_log.print("VID & PID registered successfully ---> ");
+        print_dev_type();
+    } else {
+        classify_dev_type();
+    }
+
+    send_hard_reset();
+    PD_FLOW_END(f);
+}
+
+/**
+ * Prepare a device recognition flow frame
+ */
+pd_flow_t *pd_flow_recog_init(pd_flow_recog_t *frame, int volts, int ma) {
+    frame->flow.name = "recog";
+    frame->flow.step = recog_step;
+    frame->volts = volts;
+    frame->ma = ma;
+    return &frame->flow;
+}
+
+static bool is_revision_reply(const pd_msg_t *msg) {
+    return (!msg->extended && (msg->num_data_objects == 1) && (msg->type == MSG_TYPE_REVISION)) ||
+           (!msg->num_data_objects && (msg->type == MSG_TYPE_NOT_SUPPORTED));
+}
+
+static pd_flow_status_t revision_step(pd_flow_t *f) {
+    PD_FLOW_BEGIN(f);
+    // Nothing to ask a PD 2.0 partner, and nothing new since the last answer
+    if (pd_port->partner_rev.rev_major) {
+        PD_FLOW_EXIT(f, PD_FLOW_DONE);
+    }
+    if (pd_port->spec_revs[SOP_TYPE_SOP] < PD_SPEC_REV_30) {
+        PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+    }
+
+    PD_AWAIT_TX(f, false, 0, MSG_TYPE_GET_REVISION, NULL);
+    if (f->tx != TX_RESULT_SENT) {
+        PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+    }
+    PD_AWAIT_RX_IF(f, is_revision_reply, PD_T_SENDER_RESPONSE_MS);
+    if (!f->rx) {
+        pd_log.println("No response received - get revision");
+        pd_stats_inc(PD_CNT_TIMEOUT_SENDER_RESPONSE);
+        PD_FLOW_EXIT(f, PD_FLOW_TIMEOUT);
+    }
+    if (f->rx->type != MSG_TYPE_REVISION) {
+        PD_FLOW_EXIT(f, PD_FLOW_FAILED); // Not_Supported: a PD 3.0 partner without Get_Revision
+    }
+    record_rmdo(data_object(f->rx->data));
+    PD_FLOW_END(f);
+}
+
+/**
+ * Prepare a revision query flow frame
+ */
+pd_flow_t *pd_flow_revision_init(pd_flow_revision_t *frame) {
+    frame->flow.name = "revision";
+    frame->flow.step = revision_step;
+    return &frame->flow;
+}
+
+static bool is_vdm_reply(const pd_msg_t *msg) {
+    return !msg->extended && msg->num_data_objects && (msg->type == MSG_TYPE_VDM) &&
+           (msg->data[1] & (VDM_STRUCTURED >> 8)) && ((msg->data[0] >> 6) != VDM_CMD_TYPE_REQ);
+}
+
+static uint16_t vdm_response_ms(uint8_t command) {
+    if (command == VDM_CMD_ENTER_MODE) {
+        return PD_T_VDM_WAIT_MODE_ENTRY_MS;
+    }
+    return (command == VDM_CMD_EXIT_MODE) ? PD_T_VDM_WAIT_MODE_EXIT_MS : PD_T_VDM_SENDER_RESPONSE_MS;
+}
+
+static pd_flow_status_t vdm_step(pd_flow_t *f) {
+    pd_flow_vdm_t *s = (pd_flow_vdm_t *)f;
+
+    PD_FLOW_BEGIN(f);
+    for (;;) {
+        PD_AWAIT_TX_SOP(f, s->sop, false, s->num_data_objects, MSG_TYPE_VDM, s->objects);
+        if (f->tx != TX_RESULT_SENT) {
+            PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+        }
+        if ((s->objects[0] & 0x1F) == VDM_CMD_ATTENTION) {
+            PD_FLOW_EXIT(f, PD_FLOW_DONE); // Never answered
+        }
+
+        PD_AWAIT_RX_SOP_IF(f, s->sop, is_vdm_reply, vdm_response_ms(s->objects[0] & 0x1F));
+        if (!f->rx) {
+            pd_log.println("No response received - VDM");
+            pd_stats_inc(PD_CNT_TIMEOUT_VDM_RESPONSE);
+            PD_FLOW_EXIT(f, PD_FLOW_TIMEOUT);
+        }
+        // One request in flight: the reply must be to this SVID and command
+        if ((f->rx->data[0] & 0x1F) != (s->objects[0] & 0x1F) ||
+            (f->rx->data[2] != s->objects[2]) || (f->rx->data[3] != s->objects[3])) {
+            pd_stats_inc(PD_CNT_UNEXPECTED);
+            PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+        }
+        switch (f->rx->data[0] >> 6) {
+        case VDM_CMD_TYPE_ACK:
+            PD_FLOW_EXIT(f, PD_FLOW_DONE);
+        case VDM_CMD_TYPE_NAK:
+            pd_stats_inc(PD_CNT_VDM_NAKS);
+            PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+        }
+        pd_stats_inc(PD_CNT_VDM_BUSY);
+        if (!s->busy_retries) {
+            PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+        }
+        s->busy_retries--;
+        PD_AWAIT_MS(f, PD_T_VDM_BUSY_MS);
+    }
+    PD_FLOW_END(f);
+}
+
+/**
+ * Prepare a structured VDM request flow frame
+ */
+pd_flow_t *pd_flow_vdm_init(pd_flow_vdm_t *frame, uint32_t header, const uint32_t *vdos, uint8_t num_vdos) {
+    frame->flow.name = "vdm";
+    frame->flow.step = vdm_step;
+    frame->sop = SOP_TYPE_SOP;
+    frame->busy_retries = PD_VDM_BUSY_RETRIES;
+    frame->num_data_objects = pd_vdm_build(frame->objects, header, vdos, (num_vdos > 1) ? 1 : num_vdos);
+    return &frame->flow;
+}
+
+static pd_flow_status_t discover_step(pd_flow_t *f) {
+    pd_flow_discover_t *s = (pd_flow_discover_t *)f;
+
+    PD_FLOW_BEGIN(f);
+    pd_flow_vdm_init(&s->vdm, VDM_HEADER(PD_SID, VDM_VERSION_20, 0, VDM_CMD_TYPE_REQ, VDM_CMD_DISCOVER_IDENTITY),
+                     NULL, 0);
+    PD_AWAIT_FLOW(f, &s->vdm);
+    if (s->vdm.flow.status != PD_FLOW_DONE) {
+        pd_vdm_discovered(PD_VDM_NOT_SUPPORTED);
+        PD_FLOW_EXIT(f, s->vdm.flow.status);
+    }
+    pd_vdm_record(s->vdm.flow.rx->data, s->vdm.flow.rx->num_data_objects);
+    if (!(pd_vdm_partner(pd_port - pd_ports)->id_header & VDO_IDH_MODAL)) {
+        pd_vdm_discovered(PD_VDM_DISCOVERED); // No modes to ask about
+        PD_FLOW_EXIT(f, PD_FLOW_DONE);
+    }
+
+    // SVIDs come twelve per reply until a zero SVID ends the list
+    do {
+        pd_flow_vdm_init(&s->vdm, VDM_HEADER(PD_SID, VDM_VERSION_20, 0, VDM_CMD_TYPE_REQ, VDM_CMD_DISCOVER_SVID),
+                         NULL, 0);
+        PD_AWAIT_FLOW(f, &s->vdm);
+    } while ((s->vdm.flow.status == PD_FLOW_DONE) &&
+             pd_vdm_record(s->vdm.flow.rx->data, s->vdm.flow.rx->num_data_objects));
+
+    // Modes only of the SVIDs somebody here understands
+    for (s->index = 0; s->index < pd_vdm_partner(pd_port - pd_ports)->num_svids; s->index++) {
+        if (!pd_vdm_handler(pd_vdm_partner(pd_port - pd_ports)->svids[s->index])) {
+            continue;
+        }
+        pd_flow_vdm_init(&s->vdm, VDM_HEADER(pd_vdm_partner(pd_port - pd_ports)->svids[s->index], VDM_VERSION_20, 0,
+                                             VDM_CMD_TYPE_REQ, VDM_CMD_DISCOVER_MODES),
+                         NULL, 0);
+        PD_AWAIT_FLOW(f, &s->vdm);
+        if (s->vdm.flow.status == PD_FLOW_DONE) {
+            pd_vdm_record(s->vdm.flow.rx->data, s->vdm.flow.rx->num_data_objects);
+        }
+    }
+    pd_vdm_discovered(PD_VDM_DISCOVERED);
+    PD_FLOW_END(f);
+}
+
+/**
+ * Prepare a discovery flow frame
+ */
+pd_flow_t *pd_flow_discover_init(pd_flow_discover_t *frame) {
+    frame->flow.name = "discover";
+    frame->flow.step = discover_step;
+    frame->index = 0;
+    return &frame->flow;
+}
+
+static bool is_vconn_swap_reply(const pd_msg_t *msg) {
+    return !msg->num_data_objects && ((msg->type == MSG_TYPE_ACCEPT) || (msg->type == MSG_TYPE_REJECT) ||
+                                      (msg->type == MSG_TYPE_WAIT) || (msg->type == MSG_TYPE_NOT_SUPPORTED));
+}
+
+static pd_flow_status_t cable_step(pd_flow_t *f) {
+    pd_flow_cable_t *s = (pd_flow_cable_t *)f;
+
+    PD_FLOW_BEGIN(f);
+    // Only the VCONN Source may talk to the plugs: ask the source for VCONN,
+    // switch it on, then tell the source to let go with PS_RDY
+    if (!pd_port->vconn_source) {
+        PD_AWAIT_TX(f, false, 0, MSG_TYPE_VCONN_SWAP, NULL);
+        if (f->tx != TX_RESULT_SENT) {
+            PD_FLOW_EXIT(f, PD_FLOW_FAILED); // Tried again after the next contract
+        }
+        PD_AWAIT_RX_IF(f, is_vconn_swap_reply, PD_T_SENDER_RESPONSE_MS);
+        if (!f->rx) {
+            pd_log.println("No response received - VCONN swap");
+            pd_stats_inc(PD_CNT_TIMEOUT_SENDER_RESPONSE);
+        } else if (f->rx->type != MSG_TYPE_ACCEPT) {
+            pd_log.println("VCONN swap refused");
+        } else {
+            set_vconn(true);
+        }
+        if (!pd_port->vconn_source) {
+            pd_vdm_cable_discovered(PD_VDM_NOT_SUPPORTED);
+            PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+        }
+        PD_AWAIT_TX(f, false, 0, MSG_TYPE_PS_READY, NULL);
+        if (f->tx != TX_RESULT_SENT) {
+            set_vconn(false); // The source keeps VCONN
+            pd_vdm_cable_discovered(PD_VDM_NOT_SUPPORTED);
+            PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+        }
+        PD_AWAIT_MS(f, PD_T_VCONN_STABLE_MS);
+    }
+
+    // A plug without an e-marker never sends GoodCRC, so every attempt fails
+    // in the PHY; a NAK ends the search at once
+    for (s->attempts = 0; s->attempts < PD_N_DISCOVER_IDENTITY; s->attempts++) {
+        pd_flow_vdm_init(&s->vdm, VDM_HEADER(PD_SID, VDM_VERSION_20, 0, VDM_CMD_TYPE_REQ, VDM_CMD_DISCOVER_IDENTITY),
+                         NULL, 0);
+        s->vdm.sop = SOP_TYPE_SOP_PRIME;
+        PD_AWAIT_FLOW(f, &s->vdm);
+        if ((s->vdm.flow.status == PD_FLOW_DONE) ||
+            ((s->vdm.flow.status == PD_FLOW_FAILED) && (s->vdm.flow.tx == TX_RESULT_SENT))) {
+            break;
+        }
+        PD_AWAIT_MS(f, PD_T_DISCOVER_IDENTITY_MS);
+    }
+    if (s->vdm.flow.status != PD_FLOW_DONE) {
+        pd_log.println("No cable e-marker");
+        pd_vdm_cable_discovered(PD_VDM_NOT_SUPPORTED);
+        PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+    }
+    adoptSpecRev(SOP_TYPE_SOP_PRIME, PD_HEADER_SPEC_REV(s->vdm.flow.rx->header));
+    if (!pd_vdm_record_cable(s->vdm.flow.rx->data, s->vdm.flow.rx->num_data_objects)) {
+        PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+    }
+
+    // The contract was held to 3 A and 20 V; the responder re-selects
+    // from the Source_Capabilities this brings
+    if ((pd_vdm_cable_ma(pd_port - pd_ports) > PD_CABLE_DEFAULT_MA) || (pd_vdm_cable_mv(pd_port - pd_ports) > 20000)) {
+        PD_AWAIT_TX(f, false, 0, MSG_TYPE_GET_SOURCE_CAP, NULL);
+    }
+    PD_FLOW_END(f);
+}
+
+/**
+ * Prepare a cable discovery flow frame
+ */
+pd_flow_t *pd_flow_cable_init(pd_flow_cable_t *frame) {
+    frame->flow.name = "cable";
+    frame->flow.step = cable_step;
+    frame->attempts = 0;
+    return &frame->flow;
+}
+
+static bool is_epr_mode_reply(const pd_msg_t *msg) {
+    return !msg->extended && (msg->num_data_objects == 1) && (msg->type == MSG_TYPE_EPR_MODE);
+}
+
+static pd_flow_status_t epr_enter_step(pd_flow_t *f) {
+    pd_flow_epr_t *s = (pd_flow_epr_t *)f;
+
+    PD_FLOW_BEGIN(f);
+    put_object(s->objects, EPR_MODE_OBJECT(EPR_MODE_ENTER, PD_EPR_SINK_PDP_W));
+    PD_AWAIT_TX(f, false, 1, MSG_TYPE_EPR_MODE, s->objects);
+    if (f->tx != TX_RESULT_SENT) {
+        pd_stats_inc(PD_CNT_EPR_ENTRY_FAILURES);
+        pd_cb_error(PD_CB_ERR_EPR, 0);
+        PD_FLOW_EXIT(f, PD_FLOW_FAILED); // Tried again after the next contract
+    }
+    pd_log.println("EPR mode requested");
+
+    // Enter Acknowledged at once, Enter Succeeded once the source has
+    // checked the cable; EPR_Source_Capabilities follow for the responder
+    PD_AWAIT_RX_IF(f, is_epr_mode_reply, PD_T_SENDER_RESPONSE_MS);
+    if (f->rx && (EPR_MODE_ACTION(data_object(f->rx->data)) == EPR_MODE_ENTER_ACK)) {
+        PD_AWAIT_RX_IF(f, is_epr_mode_reply, PD_T_ENTER_EPR_MS);
+    }
+    if (!f->rx) {
+        pd_log.println("No response received - EPR mode");
+        pd_stats_inc(PD_CNT_EPR_ENTRY_FAILURES);
+        pd_cb_error(PD_CB_ERR_EPR, 0);
+        PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+    }
+    if (EPR_MODE_ACTION(data_object(f->rx->data)) != EPR_MODE_ENTER_SUCCEEDED) {
+        pd_log.print("EPR mode refused, reason: ");
+        pd_log.println(EPR_MODE_DATA(data_object(f->rx->data)), DEC);
+        pd_stats_inc(PD_CNT_EPR_ENTRY_FAILURES);
+        pd_cb_error(PD_CB_ERR_EPR, EPR_MODE_ACTION(data_object(f->rx->data)));
+        PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+    }
+    pd_log.println("EPR mode entered");
+    pd_port->epr_mode = true;
+    pd_stats_inc(PD_CNT_EPR_ENTRIES);
+    PD_FLOW_END(f);
+}
+
+/**
+ * Prepare an EPR mode entry flow frame
+ */
+pd_flow_t *pd_flow_epr_enter_init(pd_flow_epr_t *frame) {
+    frame->flow.name = "epr";
+    frame->flow.step = epr_enter_step;
+    return &frame->flow;
+}
+
+static bool is_keepalive_ack(const pd_msg_t *msg) {
+    return msg->extended && (msg->type == MSG_TYPE_EXTENDED_CONTROL) && msg->num_data_objects &&
+           (msg->data[2] == EXT_CTRL_EPR_KEEPALIVE_ACK);
+}
+
+static pd_flow_status_t epr_keepalive_step(pd_flow_t *f) {
+    pd_flow_epr_t *s = (pd_flow_epr_t *)f;
+
+    PD_FLOW_BEGIN(f);
+    PD_AWAIT_TX(f, true, 1, MSG_TYPE_EXTENDED_CONTROL, s->objects);
+    if (f->tx == TX_RESULT_SENT) {
+        PD_AWAIT_RX_IF(f, is_keepalive_ack, PD_T_SENDER_RESPONSE_MS);
+    }
+    if ((f->tx != TX_RESULT_SENT) || !f->rx) {
+        pd_log.println("No response received - EPR keep-alive");
+        pd_stats_inc(PD_CNT_TIMEOUT_EPR_KEEPALIVE);
+        pd_cb_error(PD_CB_ERR_EPR, 0);
+        PD_FLOW_EXIT(f, PD_FLOW_TIMEOUT);
+    }
+    PD_FLOW_END(f);
+}
+
+/**
+ * Prepare an EPR keep-alive flow frame
+ */
+pd_flow_t *pd_flow_epr_keepalive_init(pd_flow_epr_t *frame) {
+    uint16_t ext = PD_EXT_HEADER(1, 0, 0, 2);
+    frame->flow.name = "keepalive";
+    frame->flow.step = epr_keepalive_step;
+    frame->objects[0] = ext & 0xFF;
+    frame->objects[1] = ext >> 8;
+    frame->objects[2] = EXT_CTRL_EPR_KEEPALIVE;
+    frame->objects[3] = 0;
+    return &frame->flow;
+}
+
+static bool is_epr_caps_chunk(const pd_msg_t *msg) {
+    return msg->extended && (msg->type == MSG_TYPE_EPR_SOURCE_CAPABILITIES) && msg->num_data_objects &&
+           !PD_EXT_REQUEST_CHUNK(ext_header(msg));
+}
+
+static bool is_partner_request(const pd_msg_t *msg) {
+    if (msg->extended) {
+        // The first chunk of EPR_Source_Capabilities; the rest are asked for
+        return is_epr_caps_chunk(msg) && !PD_EXT_CHUNK_NUMBER(ext_header(msg));
+    }
+    if (msg->num_data_objects == 0) {
+        return (msg->type == MSG_TYPE_GET_SINK_CAP) || (msg->type == MSG_TYPE_GET_SOURCE_CAP) ||
+               (msg->type == MSG_TYPE_VCONN_SWAP) || (msg->type == MSG_TYPE_SOFT_RESET) ||
+               ((msg->type == MSG_TYPE_GET_REVISION) && (pd_port->spec_revs[SOP_TYPE_SOP] >= PD_SPEC_REV_30));
+    }
+    if (msg->type == MSG_TYPE_SOURCE_CAPABILITIES) {
+        return true;
+    }
+    if (msg->type == MSG_TYPE_EPR_MODE) {
+        return msg->data[3] == EPR_MODE_EXIT;
+    }
+    if (msg->type == MSG_TYPE_ALERT) {
+        return msg->num_data_objects == 1; // Load already shed by the receive path
+    }
+    // Structured VDM requests (command type REQ), answered by the VDM engine
+    return (msg->type == MSG_TYPE_VDM) && (msg->data[1] & (VDM_STRUCTURED >> 8)) &&
+           ((msg->data[0] >> 6) == VDM_CMD_TYPE_REQ);
+}
+
+static pd_flow_status_t responder_step(pd_flow_t *f) {
+    pd_flow_responder_t *s = (pd_flow_responder_t *)f;
+
+    PD_FLOW_BEGIN(f);
+    for (;;) {
+        PD_AWAIT_RX_IF(f, is_partner_request, 0);
+
+        if ((f->rx->num_data_objects > 0) && (f->rx->type == MSG_TYPE_SOURCE_CAPABILITIES)) {
+            record_src_caps(f->rx);
+            pd_flow_select_init(&s->select, s->volts, s->ma);
+            PD_AWAIT_FLOW(f, &s->select);
+            if (s->select.flow.status == PD_FLOW_TIMEOUT) {
+                PD_FLOW_EXIT(f, PD_FLOW_TIMEOUT); // The attach flow recovers
+            }
+            continue;
+        }
+
+        if (f->rx->extended) {
+            // Reassemble EPR_Source_Capabilities, asking for each chunk after the first
+            s->size = PD_EXT_DATA_SIZE(ext_header(f->rx));
+            if (s->size > sizeof(s->objects)) {
+                s->size = sizeof(s->objects);
+            }
+            s->received = 0;
+            for (;;) {
+                {
+                    uint8_t length = f->rx->num_data_objects * 4 - 2;
+                    if (length > PD_MAX_CHUNK_SIZE) {
+                        length = PD_MAX_CHUNK_SIZE;
+                    }
+                    if (length > s->size - s->received) {
+                        length = s->size - s->received;
+                    }
+                    memcpy(&s->objects[s->received], &f->rx->data[2], length);
+                    s->received += length;
+                }
+                if (s->received >= s->size) {
+                    break;
+                }
+                {
+                    uint16_t ext = PD_EXT_HEADER(1, s->received / PD_MAX_CHUNK_SIZE, 1, 0);
+                    s->chunk_request[0] = ext & 0xFF;
+                    s->chunk_request[1] = ext >> 8;
+                    s->chunk_request[2] = 0;
+                    s->chunk_request[3] = 0;
+                }
+                PD_AWAIT_TX(f, true, 1, MSG_TYPE_EPR_SOURCE_CAPABILITIES, s->chunk_request);
+                if (f->tx == TX_RESULT_SENT) {
+                    PD_AWAIT_RX_IF(f, is_epr_caps_chunk, PD_T_CHUNK_SENDER_RESPONSE_MS);
+                }
+                if ((f->tx != TX_RESULT_SENT) || !f->rx ||
+                    (PD_EXT_CHUNK_NUMBER(ext_header(f->rx)) != s->received / PD_MAX_CHUNK_SIZE)) {
+                    pd_log.println("No response received - EPR source capabilities chunk");
+                    pd_stats_inc(PD_CNT_TIMEOUT_CHUNK);
+                    PD_FLOW_EXIT(f, PD_FLOW_TIMEOUT); // The attach flow recovers
+                }
+            }
+            if (!pd_port->epr_mode) {
+                continue; // Outside EPR mode they are for information only
+            }
+            pd_log.println("EPR source capabilities received");
+            update_src_caps(s->objects, s->received / 4);
+            pd_flow_select_init(&s->select, s->volts, s->ma);
+            PD_AWAIT_FLOW(f, &s->select);
+            if (s->select.flow.status == PD_FLOW_TIMEOUT) {
+                PD_FLOW_EXIT(f, PD_FLOW_TIMEOUT);
+            }
+            continue;
+        }
+
+        if (f->rx->type == MSG_TYPE_EPR_MODE) {
+            pd_log.println("EPR mode exited by the source");
+            exit_epr_mode(); // SPR Source_Capabilities follow
+            continue;
+        }
+
+        if (!f->rx->num_data_objects && (f->rx->type == MSG_TYPE_SOFT_RESET)) {
+            pd_log.println("Soft reset received");
+            if (pd_port->epr_mode) {
+                PD_FLOW_EXIT(f, PD_FLOW_TIMEOUT); // No Soft_Reset in EPR mode: the ladder starts at Hard Reset
+            }
+            pd_reset_begin(PD_RESET_SOFT_RECEIVED);
+            resetMessageIds();
+            PD_AWAIT_TX(f, false, 0, MSG_TYPE_ACCEPT, NULL);
+            continue; // Source_Capabilities follow, the cached Request goes out again
+        }
+
+        if (f->rx->type == MSG_TYPE_ALERT) {
+            // Ask what happened; the Status is for the application only
+            pd_alert_received(data_object(f->rx->data));
+            PD_AWAIT_TX(f, false, 0, MSG_TYPE_GET_STATUS, NULL);
+            if (f->tx == TX_RESULT_SENT) {
+                PD_AWAIT_RX(f, PD_EXT(MSG_TYPE_STATUS), PD_T_SENDER_RESPONSE_MS);
+            }
+            if ((f->tx != TX_RESULT_SENT) || !f->rx) {
+                pd_log.println("No response received - status");
+                pd_stats_inc(PD_CNT_TIMEOUT_STATUS);
+                continue;
+            }
+            {
+                uint8_t size = PD_EXT_DATA_SIZE(ext_header(f->rx));
+                uint8_t length = f->rx->num_data_objects * 4 - 2;
+                pd_alert_status(&f->rx->data[2], (size < length) ? size : length);
+            }
+            continue;
+        }
+
+        if (f->rx->num_data_objects == 0) {
+            if (f->rx->type == MSG_TYPE_GET_SINK_CAP) {
+                pd_log.println("Sink capabilities requested");
+                s->type = MSG_TYPE_SINK_CAPABILITIES;
+                s->num_data_objects = cached_snk_cap(&s->reply);
+            } else if (f->rx->type == MSG_TYPE_GET_REVISION) {
+                pd_log.println("Revision requested");
+                s->type = MSG_TYPE_REVISION;
+                s->num_data_objects = 1;
+                s->objects[0] = PD_RMDO_OURS & 0xFF;
+                s->objects[1] = (PD_RMDO_OURS >> 8) & 0xFF;
+                s->objects[2] = (PD_RMDO_OURS >> 16) & 0xFF;
+                s->objects[3] = (PD_RMDO_OURS >> 24) & 0xFF;
+                s->reply = s->objects;
+            } else if (f->rx->type == MSG_TYPE_VCONN_SWAP) {
+                // VCONN is only ever taken by cable_step; give it back when asked
+                pd_log.println("VCONN swap requested");
+                s->type = pd_port->vconn_source ? MSG_TYPE_ACCEPT : MSG_TYPE_REJECT;
+                s->num_data_objects = 0;
+                s->reply = s->objects;
+            } else {
+                pd_log.println("Source capabilities requested from source");
+                s->type = MSG_TYPE_NOT_SUPPORTED;
+                s->num_data_objects = 0;
+                s->reply = s->objects;
+            }
+        } else {
+            pd_log.print("VDM request, command: ");
+            pd_log.println(f->rx->data[0] & 0x1F, DEC);
+            s->type = MSG_TYPE_VDM;
+            s->num_data_objects = pd_vdm_respond(f->rx->data, f->rx->num_data_objects, s->objects);
+            s->reply = s->objects;
+            if (!s->num_data_objects) {
+                continue; // Attention
+            }
+        }
+
+        PD_AWAIT_TX(f, false, s->num_data_objects, s->type, s->reply);
+
+        // Accepted VCONN_Swap: VCONN goes off once the source's is up
+        if ((s->type == MSG_TYPE_ACCEPT) && (f->tx == TX_RESULT_SENT)) {
+            PD_AWAIT_RX(f, PD_CTRL(MSG_TYPE_PS_READY), PD_T_VCONN_SOURCE_TIMEOUT_MS);
+            if (!f->rx) {
+                pd_log.println("No PS_RDY after VCONN swap");
+                PD_FLOW_EXIT(f, PD_FLOW_TIMEOUT); // The attach flow recovers
+            }
+            set_vconn(false);
+        }
+    }
+    PD_FLOW_END(f);
+}
+
+/**
+ * Prepare a responder flow frame
+ */
+pd_flow_t *pd_flow_responder_init(pd_flow_responder_t *frame, int volts, int ma) {
+    frame->flow.name = "responder";
+    frame->flow.step = responder_step;
+    frame->volts = volts;
+    frame->ma = ma;
+    return &frame->flow;
+}
+
+static bool start_attention(pd_flow_vdm_t *frame) {
+    uint32_t header, vdo;
+    if (!pd_vdm_take_attention(&header, &vdo)) {
+        return false;
+    }
+    pd_flow_vdm_init(frame, header, &vdo, 1);
+    return true;
+}
+
+static pd_flow_status_t attach_step(pd_flow_t *f) {
+    pd_flow_attach_t *s = (pd_flow_attach_t *)f;
+
+    PD_FLOW_BEGIN(f);
+    if (pd_port->recovery == PD_RECOVER_NONE) {
+        // Recognition ends in a hard reset, so it is skipped while recovering
+        pd_flow_recog_init(&s->child.recog, 5, 500);
+        PD_AWAIT_FLOW(f, &s->child.recog);
+
+        reset_fusb();
+        enable_tx_cc(pd_port->cc_line, true);
+    }
+    pd_flow_negotiate_init(&s->child.negotiate, s->volts, s->ma);
+    if ((pd_port->recovery == PD_RECOVER_NONE) || (pd_port->recovery == PD_RECOVER_HARD_RESET)) {
+        s->child.negotiate.wait_ms = PD_T_HARD_RESET_CAP_MS; // Source restarts after recognition's or its own hard reset
+    }
+    PD_AWAIT_FLOW(f, &s->child.negotiate);
+    pd_log.println("-------------------------------------");
+
+    // Recover when a deadline passed, then supervise the responder, which
+    // only ends when a re-selection times out
+    s->outcome = s->child.negotiate.flow.status;
+    while (s->outcome != PD_FLOW_FAILED) {
+        if (s->outcome == PD_FLOW_TIMEOUT) {
+            pd_flow_recover_init(&s->child.recover, s->volts, s->ma);
+            PD_AWAIT_FLOW(f, &s->child.recover);
+            if (s->child.recover.flow.status != PD_FLOW_DONE) {
+                PD_FLOW_EXIT(f, PD_FLOW_FAILED); // Detached
+            }
+        }
+        pd_flow_start(f->sched, pd_flow_responder_init(s->responder, s->volts, s->ma));
+        // For EPR the source checks the cable itself and must stay the VCONN Source
+        if (!epr_needed(s->volts) && pd_vdm_wants_cable_discovery()) {
+            pd_flow_cable_init(&s->child.cable);
+            PD_AWAIT_FLOW(f, &s->child.cable);
+        }
+        if (pd_vdm_wants_discovery()) {
+            pd_flow_discover_init(&s->child.discover);
+            PD_AWAIT_FLOW(f, &s->child.discover);
+        }
+        if (epr_needed(s->volts)) {
+            pd_flow_epr_enter_init(&s->child.epr);
+            PD_AWAIT_FLOW(f, &s->child.epr);
+        }
+        pd_flow_arm(f, PD_T_SINK_EPR_KEEPALIVE_MS);
+        for (;;) {
+            PD_FLOW_YIELD_UNTIL(f, (s->responder->flow.status != PD_FLOW_WAITING) || pd_vdm_attention_pending() ||
+                                       pd_cb_request_pending() || (pd_port->epr_mode && pd_flow_expired(f)));
+            if (s->responder->flow.status != PD_FLOW_WAITING) {
+                break;
+            }
+            if (pd_port->epr_mode && pd_flow_expired(f)) {
+                pd_flow_epr_keepalive_init(&s->child.epr);
+                PD_AWAIT_FLOW(f, &s->child.epr);
+                if (s->child.epr.flow.status != PD_FLOW_DONE) {
+                    // The responder is stopped and the ladder starts at Hard Reset
+                    pd_flow_stop(f->sched, &s->responder->flow);
+                    s->responder->flow.status = PD_FLOW_TIMEOUT;
+                    break;
+                }
+                pd_flow_arm(f, PD_T_SINK_EPR_KEEPALIVE_MS);
+                continue;
+            }
+            if (pd_cb_take_request(&s->volts, &s->ma)) {
+                // The application's target from now on, re-selections included
+                s->responder->volts = s->volts;
+                s->responder->ma = s->ma;
+                pd_flow_select_init(&s->child.select, s->volts, s->ma);
+                s->child.select.mismatch = false; // A target not offered leaves the contract in place
+                PD_AWAIT_FLOW(f, &s->child.select);
+                if (s->child.select.flow.status == PD_FLOW_TIMEOUT) {
+                    pd_flow_stop(f->sched, &s->responder->flow);
+                    s->responder->flow.status = PD_FLOW_TIMEOUT;
+                    break;
+                }
+                if (epr_needed(s->volts)) {
+                    pd_flow_epr_enter_init(&s->child.epr);
+                    PD_AWAIT_FLOW(f, &s->child.epr);
+                }
+                pd_flow_arm(f, PD_T_SINK_EPR_KEEPALIVE_MS);
+                continue;
+            }
+            if (!start_attention(&s->child.vdm)) {
+                continue;
+            }
+            PD_AWAIT_FLOW(f, &s->child.vdm);
+        }
+        s->outcome = s->responder->flow.status;
+    }
+    PD_FLOW_END(f);
+}
+
+/**
+ * Prepare the attach flow frame
+ */
+pd_flow_t *pd_flow_attach_init(pd_flow_attach_t *frame, int volts, int ma,
+                               pd_flow_responder_t *responder) {
+    frame->flow.name = "attach";
+    frame->flow.step = attach_step;
+    frame->volts = volts;
+    frame->ma = ma;
+    frame->responder = responder;
+    return &frame->flow;
+}
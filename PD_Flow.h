@@ -0,0 +1,459 @@
+#ifndef PD_FLOW_H
+#define PD_FLOW_H
+
+#include "FUSB302B.h"
+
+//=============================================================================
+// Negotiation Flows
+//=============================================================================
+
+// Stackless coroutines for the negotiation sequences. A flow is a step
+// function plus a statically sized frame. The PD_AWAIT_* macros save a resume
+// point in the frame and return to the scheduler, which resumes the flow once
+// the awaited message, transmission result or timeout is there:
+//
+//     PD_FLOW_BEGIN(f);
+//     PD_AWAIT_TX(f, false, 1, MSG_TYPE_REQUEST, s->request);
+//     PD_AWAIT_RX(f, PD_CTRL(MSG_TYPE_ACCEPT), PD_T_SENDER_RESPONSE_MS);
+//     if (!f->rx) PD_FLOW_EXIT(f, PD_FLOW_FAILED);
+//     PD_FLOW_END(f);
+//
+// Locals do not survive an await: anything needed afterwards lives in the
+// frame. Nothing is allocated; frames are declared by the caller and their
+// sizes are checked against PD_FLOW_FRAME_MAX at build time (and printed as
+// warnings with PD_REPORT_SIZES 1).
+//
+// Resume points come from __COUNTER__, so an await may appear anywhere in the
+// step function except inside another switch statement.
+
+#define PD_FLOW_MAX             4       ///< Flows one scheduler can run
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define PD_FLOW_FRAME_MAX       256     ///< 64-bit hosts: the 192-byte frames with every pointer widened
+#else
+#define PD_FLOW_FRAME_MAX       192     ///< Largest frame in bytes (RP2040 and other 32-bit builds)
+#endif
+
+#ifndef PD_USE_FLOWS
+#define PD_USE_FLOWS            1       ///< loop1() negotiates with flows instead of blocking calls
+#endif
+
+/**
+ * @brief Result of one flow step
+ */
+typedef enum : uint8_t {
+    PD_FLOW_WAITING = 0,            ///< Suspended at an await
+    PD_FLOW_DONE = 1,               ///< Ran to the end
+    PD_FLOW_FAILED = 2,             ///< Exited early
+    PD_FLOW_TIMEOUT = 3             ///< Exited because the partner missed a deadline
+} pd_flow_status_t;
+
+typedef struct pd_flow pd_flow_t;
+typedef struct pd_sched pd_sched_t;
+
+typedef pd_flow_status_t (*pd_flow_fn_t)(pd_flow_t *flow);
+typedef bool (*pd_msg_match_t)(const pd_msg_t *msg);
+
+/**
+ * @brief Common head of every flow frame
+ */
+struct pd_flow {
+    const char *name;               ///< For logs
+    pd_flow_fn_t step;              ///< Step function
+    pd_sched_t *sched;              ///< Scheduler running the flow
+    uint16_t resume;                ///< Resume point, 0 = from the top
+    pd_flow_status_t status;        ///< Result of the last step
+    tx_result_t tx;                 ///< Result of the last PD_AWAIT_TX
+    uint32_t deadline_ms;           ///< Timeout of the current await (0 = none)
+    const pd_msg_t *rx;             ///< Message from the last PD_AWAIT_RX*, NULL on timeout
+};
+
+/**
+ * @brief Round-robin scheduler for the flows of one port
+ */
+struct pd_sched {
+    pd_flow_t *flows[PD_FLOW_MAX];  ///< Running flows
+    pd_flow_t *tx_owner;            ///< Flow with a transmission in flight
+    uint32_t tx_start_ms;           ///< When it started
+    pd_msg_t msg;                   ///< Received message on offer
+    bool msg_valid;                 ///< msg not yet claimed
+    bool busy;                      ///< A flow needs polling (timeout or transmission)
+    uint32_t dropped;               ///< Messages no flow was waiting for
+};
+
+//=============================================================================
+// Coroutine Macros
+//=============================================================================
+
+#define PD_FLOW_BEGIN(f)        switch ((f)->resume) { case 0:
+#define PD_FLOW_END(f)          } (f)->resume = 0; return PD_FLOW_DONE
+#define PD_FLOW_EXIT(f, status) do { (f)->resume = 0; return (status); } while (0)
+
+#define PD_FLOW_YIELD_UNTIL_(f, cond, n) \
+    do { (f)->resume = (n); case (n): if (!(cond)) return PD_FLOW_WAITING; } while (0)
+
+/** Suspend until cond holds (evaluated now and on every resume) */
+#define PD_FLOW_YIELD_UNTIL(f, cond) PD_FLOW_YIELD_UNTIL_(f, cond, __COUNTER__ + 1)
+
+/** Wait for a message picked by a PD_CTRL/PD_DATA/PD_EXT selector; f->rx is NULL on timeout */
+#define PD_AWAIT_RX(f, selector, timeout_ms) \
+    do { pd_flow_arm(f, timeout_ms); PD_FLOW_YIELD_UNTIL(f, pd_flow_rx(f, selector)); } while (0)
+
+/** Wait for a message accepted by match; f->rx is NULL on timeout (0 = wait forever) */
+#define PD_AWAIT_RX_IF(f, match, timeout_ms) PD_AWAIT_RX_SOP_IF(f, SOP_TYPE_SOP, match, timeout_ms)
+
+/** PD_AWAIT_RX_IF for a message from a cable plug (SOP'/SOP'') or the partner (SOP) */
+#define PD_AWAIT_RX_SOP_IF(f, sop, match, timeout_ms) \
+    do { pd_flow_arm(f, timeout_ms); PD_FLOW_YIELD_UNTIL(f, pd_flow_rx_if(f, sop, match)); } while (0)
+
+/** Transmit a SOP message and wait for the GoodCRC; the outcome is in f->tx */
+#define PD_AWAIT_TX(f, extended, num_data_objects, message_type, data_objects) \
+    PD_AWAIT_TX_SOP(f, SOP_TYPE_SOP, extended, num_data_objects, message_type, data_objects)
+
+/** PD_AWAIT_TX on any SOP* type; SOP'/SOP'' only while we are the VCONN Source */
+#define PD_AWAIT_TX_SOP(f, sop, extended, num_data_objects, message_type, data_objects) \
+    do { \
+        PD_FLOW_YIELD_UNTIL(f, pd_flow_tx_begin(f, sop, extended, num_data_objects, message_type, data_objects)); \
+        PD_FLOW_YIELD_UNTIL(f, pd_flow_tx_done(f)); \
+    } while (0)
+
+/** Wait for a fixed time */
+#define PD_AWAIT_MS(f, ms) \
+    do { pd_flow_arm(f, ms); PD_FLOW_YIELD_UNTIL(f, pd_flow_expired(f)); } while (0)
+
+/** Run a child flow (a frame embedded in this one) to completion */
+#define PD_AWAIT_FLOW(f, child) \
+    do { pd_flow_enter(f, child); PD_FLOW_YIELD_UNTIL(f, pd_flow_child_done(child)); } while (0)
+
+/** Declare a frame type: checks its size and optionally reports it */
+#define PD_FLOW_FRAME(frame) \
+    static_assert(sizeof(frame) <= PD_FLOW_FRAME_MAX, #frame " exceeds PD_FLOW_FRAME_MAX"); \
+    PD_SIZE_NOTE(frame)
+
+//=============================================================================
+// Flow Frames
+//=============================================================================
+
+/**
+ * @brief Request a supply: Request (EPR_Request in EPR mode), Accept, PS_RDY
+ */
+typedef struct {
+    pd_flow_t flow;
+    int volts;
+    int ma;
+    bool mismatch;                  ///< Without the target, request vSafe5V with Capability Mismatch
+    bool epr;                       ///< Sent as EPR_Request
+    uint8_t request[2 * 4];         ///< Request data object, then the PDO copy of an EPR_Request
+    uint32_t accept_ms;             ///< millis() at Accept
+} pd_flow_select_t;
+PD_FLOW_FRAME(pd_flow_select_t)
+
+/**
+ * @brief Wait for Source_Capabilities, record them and request a supply
+ */
+typedef struct {
+    pd_flow_t flow;
+    int volts;
+    int ma;
+    uint16_t wait_ms;               ///< Deadline for Source_Capabilities
+    pd_flow_select_t select;
+} pd_flow_negotiate_t;
+PD_FLOW_FRAME(pd_flow_negotiate_t)
+
+/**
+ * @brief Recovery ladder: Soft_Reset and renegotiate, then Hard Reset and
+ *        renegotiate, then detach
+ */
+typedef struct {
+    pd_flow_t flow;
+    int volts;
+    int ma;
+    pd_flow_negotiate_t negotiate;
+} pd_flow_recover_t;
+PD_FLOW_FRAME(pd_flow_recover_t)
+
+/**
+ * @brief Negotiate, ask a PD 3.0 source for Source_Capabilities_Extended to
+ *        learn its VID/PID, then hard reset
+ */
+typedef struct {
+    pd_flow_t flow;
+    int volts;
+    int ma;
+    pd_flow_negotiate_t negotiate;
+} pd_flow_recog_t;
+PD_FLOW_FRAME(pd_flow_recog_t)
+
+/**
+ * @brief Fetch the partner's revision and version into partner_rev with
+ *        Get_Revision; fails at once below PD 3.0 (the header revision is
+ *        all there is) and finishes at once if partner_rev is already known
+ */
+typedef struct {
+    pd_flow_t flow;
+} pd_flow_revision_t;
+PD_FLOW_FRAME(pd_flow_revision_t)
+
+/**
+ * @brief Send one structured VDM request and wait for ACK, NAK or BUSY,
+ *        re-sending after tVDMBusy up to PD_VDM_BUSY_RETRIES times; ends
+ *        DONE with the ACK in flow.rx, FAILED on NAK, TIMEOUT on silence.
+ *        Attention ends DONE once sent
+ */
+typedef struct {
+    pd_flow_t flow;
+    uint8_t sop;                    ///< pd_sop_t to send on, SOP unless changed after init
+    uint8_t num_data_objects;       ///< VDM header plus VDOs
+    uint8_t busy_retries;           ///< Re-sends left after BUSY
+    uint8_t objects[2 * 4];         ///< VDM header and at most one VDO
+} pd_flow_vdm_t;
+PD_FLOW_FRAME(pd_flow_vdm_t)
+
+/**
+ * @brief Become the VCONN Source with VCONN_Swap, then Discover Identity
+ *        on SOP' up to PD_N_DISCOVER_IDENTITY times, and ask for
+ *        Source_Capabilities again if the cable is rated above 3 A or 20 V
+ */
+typedef struct {
+    pd_flow_t flow;
+    uint8_t attempts;               ///< Discover Identity requests sent
+    pd_flow_vdm_t vdm;
+} pd_flow_cable_t;
+PD_FLOW_FRAME(pd_flow_cable_t)
+
+/**
+ * @brief Discover Identity, Discover SVIDs and Discover Modes of every
+ *        partner SVID that has a registered handler (PD 3.x only)
+ */
+typedef struct {
+    pd_flow_t flow;
+    uint8_t index;                  ///< Partner SVID whose modes are asked next
+    pd_flow_vdm_t vdm;
+} pd_flow_discover_t;
+PD_FLOW_FRAME(pd_flow_discover_t)
+
+/**
+ * @brief Send EPR_Mode Enter and wait for Enter Acknowledged and Enter
+ *        Succeeded (epr_mode set, DONE), or send EPR_KeepAlive and wait for
+ *        its acknowledgement (TIMEOUT without one)
+ */
+typedef struct {
+    pd_flow_t flow;
+    uint8_t objects[4];             ///< EPR_Mode data object or Extended_Control message
+} pd_flow_epr_t;
+PD_FLOW_FRAME(pd_flow_epr_t)
+
+/**
+ * @brief Answer partner requests (Get_Sink_Cap, Get_Revision, structured
+ *        VDMs, VCONN_Swap, Get_Source_Cap) and re-select on new
+ *        Source_Capabilities, chunked EPR_Source_Capabilities included, until
+ *        stopped or until a re-selection, a chunk or a VCONN hand-back times
+ *        out (PD_FLOW_TIMEOUT)
+ */
+typedef struct {
+    pd_flow_t flow;
+    int volts;
+    int ma;
+    uint8_t *reply;                 ///< Reply data objects: objects, or the Sink_Capabilities cache
+    uint8_t type;                   ///< Message type of the reply
+    uint8_t num_data_objects;       ///< Data objects in the reply
+    uint8_t received;               ///< EPR_Source_Capabilities bytes reassembled in objects
+    uint8_t size;                   ///< EPR_Source_Capabilities data size
+    uint8_t objects[PD_MAX_SRC_PDOS * 4]; ///< VDM reply data objects, or EPR_Source_Capabilities
+    uint8_t chunk_request[4];       ///< Chunk request for the next EPR_Source_Capabilities chunk
+    pd_flow_select_t select;
+} pd_flow_responder_t;
+PD_FLOW_FRAME(pd_flow_responder_t)
+
+/**
+ * @brief Everything after attach: recognition, renegotiation, then
+ *        hand over to the responder, climbing the recovery ladder whenever a
+ *        deadline passes. Discovers the cable, then the partner's SVIDs and
+ *        modes once the responder runs, enters EPR mode when the contract
+ *        needs it and keeps it alive, and sends queued Attentions and
+ *        the application's power requests (pd_cb_request_power)
+ */
+typedef struct {
+    pd_flow_t flow;
+    int volts;
+    int ma;
+    pd_flow_status_t outcome;       ///< How the last negotiation or responder run ended
+    pd_flow_responder_t *responder; ///< Started once the contract is in place
+    union {
+        pd_flow_recog_t recog;
+        pd_flow_negotiate_t negotiate;
+        pd_flow_recover_t recover;
+        pd_flow_cable_t cable;
+        pd_flow_discover_t discover;
+        pd_flow_vdm_t vdm;
+        pd_flow_epr_t epr;
+        pd_flow_select_t select;
+    } child;
+} pd_flow_attach_t;
+PD_FLOW_FRAME(pd_flow_attach_t)
+
+//=============================================================================
+// Scheduler
+//=============================================================================
+
+/**
+ * @brief Initialise a scheduler with no flows
+ * @param sched Scheduler
+ */
+void pd_sched_init(pd_sched_t *sched);
+
+/**
+ * @brief Start a flow from the top
+ * @param sched Scheduler
+ * @param flow Flow frame head, with name and step filled in
+ * @return false if all PD_FLOW_MAX slots are in use
+ */
+bool pd_flow_start(pd_sched_t *sched, pd_flow_t *flow);
+
+/**
+ * @brief Stop every flow (detach, hard reset)
+ * @param sched Scheduler
+ */
+void pd_sched_stop_all(pd_sched_t *sched);
+
+/**
+ * @brief Stop one flow, flushing the transmission in flight
+ *
+ * Called from another flow that has no transmission of its own pending, so
+ * whatever is in flight belongs to the flow stopped or to its children.
+ *
+ * @param sched Scheduler
+ * @param flow Flow started with pd_flow_start()
+ */
+void pd_flow_stop(pd_sched_t *sched, pd_flow_t *flow);
+
+/**
+ * @brief Pull at most one message from the RX FIFO and step every flow once
+ * @param sched Scheduler
+ * @return true if it should be called again soon (a flow is timing or
+ *         transmitting, or more messages may be queued); false if every flow
+ *         only waits for a message, so the caller may sleep until INT_N
+ */
+bool pd_sched_run(pd_sched_t *sched);
+
+// Await helpers used by the macros above
+
+void pd_flow_arm(pd_flow_t *flow, uint32_t timeout_ms);
+bool pd_flow_expired(pd_flow_t *flow);
+bool pd_flow_rx(pd_flow_t *flow, uint8_t selector);
+bool pd_flow_rx_if(pd_flow_t *flow, uint8_t sop, pd_msg_match_t match);
+bool pd_flow_tx_begin(pd_flow_t *flow, uint8_t sop, bool extended, uint8_t num_data_objects,
+                      uint8_t message_type, uint8_t *data_objects);
+bool pd_flow_tx_done(pd_flow_t *flow);
+void pd_flow_enter(pd_flow_t *parent, void *child);
+bool pd_flow_child_done(void *child);
+
+//=============================================================================
+// Flows
+//=============================================================================
+
+/**
+ * @brief Prepare a select flow frame
+ *
+ * The frame answers Source_Capabilities, so mismatch is set; clear it
+ * to leave the contract alone when the target is not offered.
+ *
+ * @param frame Frame
+ * @param volts Desired voltage
+ * @param ma Desired current in mA
+ * @return frame's flow head
+ */
+pd_flow_t *pd_flow_select_init(pd_flow_select_t *frame, int volts, int ma);
+
+/**
+ * @brief Prepare a negotiate flow frame
+ * @param frame Frame
+ * @param volts Desired voltage
+ * @param ma Desired current in mA
+ * @return frame's flow head
+ */
+pd_flow_t *pd_flow_negotiate_init(pd_flow_negotiate_t *frame, int volts, int ma);
+
+/**
+ * @brief Prepare a recovery flow frame
+ * @param frame Frame
+ * @param volts Voltage to renegotiate
+ * @param ma Current in mA to renegotiate
+ * @return frame's flow head
+ */
+pd_flow_t *pd_flow_recover_init(pd_flow_recover_t *frame, int volts, int ma);
+
+/**
+ * @brief Prepare a device recognition flow frame
+ * @param frame Frame
+ * @param volts Voltage to negotiate while recognising
+ * @param ma Current in mA to negotiate while recognising
+ * @return frame's flow head
+ */
+pd_flow_t *pd_flow_recog_init(pd_flow_recog_t *frame, int volts, int ma);
+
+/**
+ * @brief Prepare a structured VDM request flow frame
+ * @param frame Frame
+ * @param header VDM header (command type REQ)
+ * @param vdos VDOs after the header
+ * @param num_vdos 0 or 1
+ * @return frame's flow head
+ */
+pd_flow_t *pd_flow_vdm_init(pd_flow_vdm_t *frame, uint32_t header, const uint32_t *vdos, uint8_t num_vdos);
+
+/**
+ * @brief Prepare a discovery flow frame
+ * @param frame Frame
+ * @return frame's flow head
+ */
+pd_flow_t *pd_flow_discover_init(pd_flow_discover_t *frame);
+
+/**
+ * @brief Prepare a cable discovery flow frame
+ * @param frame Frame
+ * @return frame's flow head
+ */
+pd_flow_t *pd_flow_cable_init(pd_flow_cable_t *frame);
+
+/**
+ * @brief Prepare a revision query flow frame
+ * @param frame Frame
+ * @return frame's flow head
+ */
+pd_flow_t *pd_flow_revision_init(pd_flow_revision_t *frame);
+
+/**
+ * @brief Prepare an EPR mode entry flow frame
+ * @param frame Frame
+ * @return frame's flow head
+ */
+pd_flow_t *pd_flow_epr_enter_init(pd_flow_epr_t *frame);
+
+/**
+ * @brief Prepare an EPR keep-alive flow frame
+ * @param frame Frame
+ * @return frame's flow head
+ */
+pd_flow_t *pd_flow_epr_keepalive_init(pd_flow_epr_t *frame);
+
+/**
+ * @brief Prepare a responder flow frame
+ * @param frame Frame
+ * @param volts Voltage to re-select on new Source_Capabilities
+ * @param ma Current in mA to re-select on new Source_Capabilities
+ * @return frame's flow head
+ */
+pd_flow_t *pd_flow_responder_init(pd_flow_responder_t *frame, int volts, int ma);
+
+/**
+ * @brief Prepare the attach flow frame
+ * @param frame Frame
+ * @param volts Voltage for the final contract
+ * @param ma Current in mA for the final contract
+ * @param responder Responder frame started when the contract is in place
+ * @return frame's flow head
+ */
+pd_flow_t *pd_flow_attach_init(pd_flow_attach_t *frame, int volts, int ma,
+                               pd_flow_responder_t *responder);
+
+#endif // PD_FLOW_H
@@ -0,0 +1,93 @@
+#include <string.h>
+#include <Arduino.h>
+#include "PD_Log.h"
+
+#if (PD_LOG_RING_LEN & (PD_LOG_RING_LEN - 1)) || (PD_LOG_RING_LEN > 32768)
+#error "PD_LOG_RING_LEN must be a power of two up to 32768"
+#endif
+
+PD_TLS PD_LogStream pd_log;
+
+#if PD_LOG_QUEUE
+// Ring of log text: core 1 writes log_tail, core 0 writes log_head
+static PD_TLS uint8_t log_ring[PD_LOG_RING_LEN];
+static PD_TLS uint16_t log_head = 0;
+static PD_TLS uint16_t log_tail = 0;
+#endif
+
+static PD_TLS pd_log_stats_t log_stats;
+
+size_t PD_LogStream::write(uint8_t c) {
+    return write(&c, 1);
+}
+
+/**
+ * Queue one write whole, or drop it whole
+ */
+size_t PD_LogStream::write(const uint8_t *buf, size_t size) {
+#if PD_LOG_QUEUE
+    uint16_t tail = log_tail;
+    uint16_t used = tail - __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+    if (size > (size_t)(PD_LOG_RING_LEN - used)) {
+        log_stats.dropped += size;
+        return size;
+    }
+    uint16_t offset = tail & (PD_LOG_RING_LEN - 1);
+    size_t first = PD_LOG_RING_LEN - offset;
+    if (first > size) {
+        first = size;
+    }
+    memcpy(&log_ring[offset], buf, first);
+    memcpy(log_ring, buf + first, size - first);
+    __atomic_store_n(&log_tail, (uint16_t)(tail + size), __ATOMIC_RELEASE);
+
+    log_stats.written += size;
+    if (used + size > log_stats.max_used) {
+        log_stats.max_used = used + size;
+    }
+    return size;
+#else
+    log_stats.written += size;
+    return Serial1.write(buf, size);
+#endif
+}
+
+/**
+ * Move what the destination takes without blocking
+ */
+size_t pd_log_drain(Print &out) {
+    size_t moved = 0;
+#if PD_LOG_QUEUE
+    uint16_t head = log_head;
+    uint16_t tail = __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        int room = out.availableForWrite();
+        if (room <= 0) {
+            break;
+        }
+        uint16_t offset = head & (PD_LOG_RING_LEN - 1);
+        size_t run = (uint16_t)(tail - head);
+        if (run > (size_t)(PD_LOG_RING_LEN - offset)) {
+            run = PD_LOG_RING_LEN - offset;
+        }
+        if (run > (size_t)room) {
+            run = room;
+        }
+        out.write(&log_ring[offset], run);
+        head += run;
+        moved += run;
+        __atomic_store_n(&log_head, head, __ATOMIC_RELEASE);
+    }
+#else
+    (void)out; // Written straight to Serial1, nothing queued
+#endif
+    return moved;
+}
+
+/**
+ * Copy the counters
+ */
+void pd_log_get_stats(pd_log_stats_t *out) {
+    memcpy(out, (const void *)&log_stats, sizeof(*out));
+}
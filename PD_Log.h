@@ -0,0 +1,70 @@
+#ifndef PD_LOG_H
+#define PD_LOG_H
+
+#include <stdint.h>
+#include <Arduino.h>
+#include "FUSB302B.h"
+
+//=============================================================================
+// Log Queue
+//=============================================================================
+
+// Everything the stack logs goes to pd_log. Core 1 owns the I2C bus and the
+// protocol layer and must answer the source within tReceiverResponse; the
+// UART takes ~87 us a byte at 115200 baud and blocks once its 32-byte FIFO
+// is full, so a line printed straight to Serial1 held the reply behind it.
+// With PD_LOG_QUEUE, pd_log only copies the formatted text into a
+// single-producer/single-consumer byte ring (core 1 only moves the tail,
+// core 0 only the head), and core 0 moves it on to Serial1 with
+// pd_log_drain() from loop(), never more than the UART takes without
+// blocking. A full ring drops the whole write and counts it rather than
+// stalling PD processing.
+//
+// Core 0 also runs the callbacks (pd_cb_dispatch()) and reads the counters
+// for telemetry (pd_stats_snapshot()), so anything slow the application does
+// there stays off core 1 as well.
+
+#ifndef PD_LOG_QUEUE
+#define PD_LOG_QUEUE            1       ///< 0: pd_log writes straight to Serial1 from core 1
+#endif
+#define PD_LOG_RING_LEN         4096    ///< Bytes in flight, a power of two up to 32768
+
+/**
+ * @brief Print stream of the stack's log
+ */
+class PD_LogStream : public Print {
+public:
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buf, size_t size) override;
+    using Print::write;
+};
+
+extern PD_TLS PD_LogStream pd_log;
+
+/**
+ * @brief Log queue counters (any core)
+ */
+typedef struct {
+    uint32_t written;       ///< Bytes queued by core 1
+    uint32_t dropped;       ///< Bytes dropped on a full ring
+    uint16_t max_used;      ///< Deepest the ring has been
+} pd_log_stats_t;
+
+/**
+ * @brief Move queued log text to a stream (core 0)
+ *
+ * Writes no more than out.availableForWrite(), so a UART never blocks the
+ * caller. With PD_LOG_QUEUE 0 there is nothing to move.
+ *
+ * @param out Destination, normally Serial1
+ * @return Bytes moved
+ */
+size_t pd_log_drain(Print &out);
+
+/**
+ * @brief Read the log queue counters
+ * @param out Destination
+ */
+void pd_log_get_stats(pd_log_stats_t *out);
+
+#endif // PD_LOG_H
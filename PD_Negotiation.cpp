@@ -1,14 +1,22 @@
 #include <Arduino.h>
 #include <Wire.h>
 #include "FUSB302B.h"
+#include "PD_Flow.h"
+#include "PD_Stats.h"
+#include "PD_VDM.h"
+#include "PD_VBUS.h"
+#include "PD_Callbacks.h"
+#include "PD_Alert.h"
+#include "PD_Reset.h"
+#include "PD_Log.h"
+#include "PD_Classify.h"
+#include <hardware/sync.h>
+#if PD_WATCHDOG_MS
+#include <hardware/watchdog.h>
+#endif
 
 // Implementation file - constants now in FUSB302B.h
 
-// Global variables
-uint8_t tx_buf[80];
-uint8_t rx_buf[80];
-uint8_t temp_buf[80];
-
 // Device library for VID/PID recognition
 uint16_t dev_library[10][3] = { 
     // VID, PID, device type (0:charger, 1:monitor, 2:tablet, 3:laptop/computer)
@@ -21,227 +29,284 @@ uint16_t dev_library[10][3] = {
     {0, 0, 0}
 };
 
-// Power delivery state variables
-int dev_type = 0; // 0:charger, 1:monitor, 2:tablet, 3:laptop/computer
-int volt_options[5] = {-1, -1, -1, -1, -1};
-int amp_options[5] = {-1, -1, -1, -1, -1};
-int options_pos[5] = {-1, -1, -1, -1, -1};
-int spec_revs[4] = {2, 0, 0, 0}; // revision major, revision minor, version major, version minor
-int msg_id = 0;
-bool int_flag = false;
-bool attached = false;
-bool new_attach = false;
-int meas_cc1 = 0; // BC level after measuring CC1
-int meas_cc2 = 0; // BC level after measuring CC2
-int cc_line = 1;
-int vconn_line = 2;
+// Interrupt state shared with the GPIO ISR
+PD_TLS volatile bool int_flag = false;
+PD_TLS volatile uint32_t int_time_us = 0;
+
+// Sink_Capabilities, serialized once; vSafe5V only until set_snk_caps()
+#define PD_SNK_DEFAULT_PDO ((1UL << 26) | (100UL << 10) | (PD_SNK_DEFAULT_MA / 10))
+static PD_TLS uint8_t snk_cap_objects[PD_MAX_PAYLOAD] = {
+    PD_SNK_DEFAULT_PDO & 0xFF, (PD_SNK_DEFAULT_PDO >> 8) & 0xFF,
+    (PD_SNK_DEFAULT_PDO >> 16) & 0xFF, (PD_SNK_DEFAULT_PDO >> 24) & 0xFF
+};
+static PD_TLS uint8_t snk_cap_count = 1;
+
+// Reject or Wait that answered the last Request, 0 if none; a refusal ends
+// negotiation without the recovery ladder, as the flows do
+static PD_TLS uint8_t req_refusal = 0;
 
-// Function declarations
-void sendPacket(bool extended, uint8_t num_data_objects, uint8_t message_id, 
-                uint8_t port_power_role, uint8_t spec_rev, uint8_t port_data_role, 
-                uint8_t message_type, uint8_t *data_objects);
+#if PD_USE_FLOWS
+// Negotiation flows of each port, run from loop1()
+typedef struct {
+    pd_sched_t sched;
+    pd_flow_attach_t attach;
+    pd_flow_responder_t responder;
+} pd_port_flows_t;
+
+static PD_TLS pd_port_flows_t port_flows[PD_NUM_PORTS];
+
+struct pd_port_footprint; // Size report tag: context plus flows of one port
+static_assert(sizeof(pd_port_t) + sizeof(pd_port_flows_t) <= PD_PORT_RAM_BUDGET,
+              "per-port state exceeds PD_PORT_RAM_BUDGET");
+PD_SIZE_NOTE(pd_port_flows_t)
+PD_SIZE_NOTE_BYTES(pd_port_footprint, sizeof(pd_port_t) + sizeof(pd_port_flows_t))
+#endif
+
+// Transmit engine
 
 /**
- * Set a register value on the FUSB302B
+ * Check once for the outcome of the pending transmission
  */
-void setReg(uint8_t addr, uint8_t value) {
-    Wire.beginTransmission(PD_ADDR);
-    Wire.write(addr);
-    Wire.write(value);
-    Wire.endTransmission(true);
+bool pollTxResult(tx_result_t *result) {
+    // Only TX events are consumed here, anything else stays pending for
+    // check_interrupt()
+    pollEvents();
+    
+    if (takeEvents(PD_EVT_TX_SENT)) {
+        takeEvents(PD_EVT_TX_MASK);
+        *result = TX_RESULT_SENT;
+        return true;
+    }
+    if (takeEvents(PD_EVT_RETRY_FAIL)) {
+        takeEvents(PD_EVT_TX_MASK);
+        *result = TX_RESULT_FAILED;
+        pd_stats_inc(PD_CNT_TX_FAILED);
+        return true;
+    }
+    if (takeEvents(PD_EVT_GCRC_SENT | PD_EVT_COLLISION)) {
+        // We acknowledged an incoming message first: per spec it wins
+        uint8_t control_reg = getReg(REG_CONTROL0);
+        setReg(REG_CONTROL0, (control_reg | CONTROL0_TX_FLUSH));
+        *result = TX_RESULT_DISCARDED;
+        pd_stats_inc(PD_CNT_TX_DISCARDED);
+        return true;
+    }
+    return false;
 }
 
 /**
- * Read a register value from the FUSB302B
+ * Wait for the FUSB302B to report the outcome of the pending transmission
  */
-uint8_t getReg(uint8_t addr) {
-    Wire.beginTransmission(PD_ADDR);
-    Wire.write(addr);
-    Wire.endTransmission(false);
-    Wire.requestFrom((int)PD_ADDR, 1, true);
-    return Wire.read();
+tx_result_t awaitTxResult(uint16_t timeout_ms) {
+    unsigned long time = millis();
+    tx_result_t result;
+    
+    while ((millis() - time) < timeout_ms) {
+        if (pollTxResult(&result)) {
+            return result;
+        }
+    }
+    pd_stats_inc(PD_CNT_TIMEOUT_TX);
+    return TX_RESULT_FAILED;
 }
 
 /**
- * Send data bytes to FUSB302B FIFO
+ * Load a SOP* message into the TX FIFO and start it without waiting
  */
-void sendBytes(uint8_t *data, uint16_t length) {
-    if (length > 0) {
-        Wire.beginTransmission(PD_ADDR);
-        Wire.write(REG_FIFOS);
-        for (uint16_t i = 0; i < length; i++) {
-            Wire.write(data[i]);
-        }
-        Wire.endTransmission(true);
+void beginTransmit(bool extended, uint8_t num_data_objects, uint8_t message_type,
+                   uint8_t *data_objects, uint8_t sop) {
+    // Clear stale TX flags left over from the message we may be replying to
+    pollEvents();
+    takeEvents(PD_EVT_TX_MASK);
+    
+    // Sink and UFP on SOP; Cable Plug 0 and a reserved data role on SOP'/SOP''
+    pd_port->tx_sop = sop;
+    sendPacket(extended, num_data_objects, pd_port->msg_ids[sop], 0, pd_port->spec_revs[sop], 0,
+               message_type, data_objects, sop);
+}
+
+/**
+ * Account for the outcome of a transmission started with beginTransmit()
+ */
+tx_result_t finishTransmit(tx_result_t result) {
+    if (result == TX_RESULT_SENT) {
+        pd_port->msg_ids[pd_port->tx_sop] = (pd_port->msg_ids[pd_port->tx_sop] + 1) & 0x07;
+        dropGoodCRC();
+    } else if (result == TX_RESULT_FAILED) {
+        pd_log.println("TX failed - no GoodCRC after retries");
+    } else {
+        pd_log.println("TX discarded - incoming message");
     }
+    return result;
 }
 
 /**
- * Receive data bytes from FUSB302B FIFO
+ * Transmit a SOP message and wait for the outcome
  */
-void receiveBytes(uint8_t *data, uint16_t length) {
-    if (length > 0) {
-        Wire.beginTransmission(PD_ADDR);
-        Wire.write(REG_FIFOS);
-        Wire.endTransmission(false);
-        Wire.requestFrom((int)PD_ADDR, (int)length, true);
-        for (uint16_t i = 0; i < length; i++) {
-            data[i] = Wire.read();
-        }
+tx_result_t transmitPacket(bool extended, uint8_t num_data_objects, uint8_t message_type,
+                           uint8_t *data_objects) {
+    beginTransmit(extended, num_data_objects, message_type, data_objects, SOP_TYPE_SOP);
+    return finishTransmit(awaitTxResult(PD_TX_TIMEOUT_MS));
+}
+
+/**
+ * Reset every MessageID counter
+ */
+void resetMessageIds() {
+    for (int i = 0; i < PD_NUM_SOP; i++) {
+        pd_port->msg_ids[i] = 0;
     }
 }
 
 /**
- * Receive and parse a PD packet
+ * Speak our own revision until the partner states its own
  */
-bool receivePacket() {
-    uint8_t num_data_objects;
-    uint8_t message_id;
-    uint8_t port_power_role;
-    uint8_t spec_rev;
-    uint8_t port_data_role;
-    uint8_t message_type;
-    
-    receiveBytes(rx_buf, 1);
-    if (getReg(REG_STATUS1) & 0x20) {
-        Serial1.println("RX empty - receive packet");
-        return false;
+void resetSpecRevs() {
+    for (int i = 0; i < PD_NUM_SOP; i++) {
+        pd_port->spec_revs[i] = PD_SPEC_REV_OURS;
     }
-    
-    receiveBytes(rx_buf, 2);
-    num_data_objects = ((rx_buf[1] & 0x70) >> 4);
-    message_id = ((rx_buf[1] & 0x0E) >> 1);
-    port_power_role = (rx_buf[1] & 0x01);
-    spec_rev = ((rx_buf[0] & 0xC0) >> 6);
-    port_data_role = ((rx_buf[0] & 0x10) >> 5);
-    
-    // Fixed assignment bug (was = instead of ==)
-    if (spec_revs[0] == 3) {
-        message_type = (rx_buf[0] & 0x1F);
-    } else {
-        message_type = (rx_buf[0] & 0x0F);
+    pd_port->partner_rev = pd_spec_rev_t();
+}
+
+/**
+ * Forget EPR mode; the next Source_Capabilities are SPR again
+ */
+void exit_epr_mode() {
+    pd_port->epr_mode = false;
+    pd_port->epr_contract = false;
+}
+
+/**
+ * Step down to the partner's revision; it is never raised again before a reset
+ */
+void adoptSpecRev(uint8_t sop, uint8_t spec_rev) {
+    if ((sop >= PD_NUM_SOP) || (spec_rev == PD_SPEC_REV_10)) {
+        return;
     }
-    
-    if (num_data_objects) {
-        Serial1.println("Data message received");
-    } else if (message_type == MSG_TYPE_GOODCRC) {
-        Serial1.println("GoodCRC message received");
-        receiveBytes(rx_buf, 4); // CRC-32
-        return true;
-    } else {
-        Serial1.print("Control message received, type: ");
-        Serial1.println(message_type, BIN);
+    // The cable plugs are never spoken to above the contract's revision
+    for (uint8_t i = sop; i < ((sop == SOP_TYPE_SOP) ? PD_NUM_SOP : sop + 1); i++) {
+        if (spec_rev < pd_port->spec_revs[i]) {
+            pd_port->spec_revs[i] = spec_rev;
+        }
     }
-    
-    receiveBytes(rx_buf, (num_data_objects * 4));
-    // Parse data objects if needed
-    for (uint8_t i = 0; i < num_data_objects; i++) {
-        // Data object parsing logic here
+}
+
+// Higher level abstractions
+
+/**
+ * Read RX FIFO for debugging purposes
+ */
+void read_rx_fifo() {
+    int i = 1;
+    while (!rxEmpty() && (i <= FUSB_RX_FIFO_SIZE)) {
+        pd_log.print("Byte number ");
+        pd_log.print(i);
+        pd_log.print(": 0x");
+        receiveBytes(pd_frame, 1);
+        pd_log.println(pd_frame[0], HEX);
+        i++;
     }
-    
-    // Read CRC-32
-    receiveBytes(rx_buf, 4);
-    return true;
 }
 
 /**
- * Read all FUSB302B registers for debugging
+ * Forget the previous source's options
  */
-void readAllRegs() {
-    Wire.beginTransmission(PD_ADDR);
-    Wire.write(0x01);
-    Wire.endTransmission(false);
-    Wire.requestFrom((int)PD_ADDR, 16, 1);
-    
-    for (int i = 1; i <= 16; i++) {
-        uint8_t c = Wire.read();
-        Serial1.print("Address: 0x");
-        Serial1.print(i, HEX);
-        Serial1.print(", Value: 0x");
-        Serial1.println(c, HEX);
+void clear_pdos() {
+    for (int i = 0; i < PD_MAX_OPTIONS; i++) {
+        pd_port->options[i] = power_option_t();
     }
-    
-    Wire.beginTransmission(PD_ADDR);
-    Wire.write(0x3C);
-    Wire.endTransmission(false);
-    Wire.requestFrom((int)PD_ADDR, 7, true);
-    
-    for (int i = 0x3C; i <= 0x42; i++) {
-        uint8_t c = Wire.read();
-        Serial1.print("Address: 0x");
-        Serial1.print(i, HEX);
-        Serial1.print(", Value: 0x");
-        Serial1.println(c, HEX);
+}
+
+/**
+ * Decode one PDO and record it if it is a usable fixed supply
+ */
+void record_pdo(const uint8_t *object, uint8_t position, int *index) {
+    uint32_t byte1 = object[0];
+    uint32_t byte2 = object[1] << 8;
+    uint32_t byte3 = object[2] << 16;
+    uint32_t byte4 = object[3] << 24;
+    uint32_t pdo = byte1 | byte2 | byte3 | byte4;
+    
+    switch (pdo >> 30) {
+        case 0x0: // Fixed supply
+            if (!pdo || (*index >= PD_MAX_OPTIONS)) {
+                break; // Zero: SPR position left empty in EPR_Source_Capabilities
+            }
+            pd_port->options[*index].voltage = ((pdo >> 10) & 0x3FF) / 20; // Convert to 1V units
+            pd_port->options[*index].current = (pdo & 0x3FF); // Keep in 10mA units
+            pd_port->options[*index].position = position; // Position 0001 is always safe 5V
+            (*index)++;
+            break;
+        case 0x1: // Battery supply
+            pd_log.print("Battery supply PDO: ");
+            pd_log.println(pdo, HEX);
+            break;
+        case 0x2: // Variable supply
+            pd_log.print("Variable supply PDO: ");
+            pd_log.println(pdo, HEX);
+            break;
+        case 0x3: // Augmented PDO
+            if (PDO_APDO_TYPE(pdo) == PDO_APDO_EPR_AVS) {
+                pd_log.print("EPR AVS APDO, max mV: ");
+                pd_log.println(PDO_AVS_MAX_MV(pdo));
+                break;
+            }
+            if (PDO_APDO_TYPE(pdo) == PDO_APDO_SPR_PPS) {
+                pd_log.print("PPS APDO, mV: ");
+                pd_log.print(PDO_PPS_MIN_MV(pdo));
+                pd_log.print("-");
+                pd_log.println(PDO_PPS_MAX_MV(pdo));
+                break;
+            }
+            pd_log.print("Augmented PDO: ");
+            pd_log.println(pdo, HEX);
+            break;
     }
-    Serial1.println();
 }
 
 /**
- * Send a USB-PD packet
+ * Diff Source_Capabilities against the cached set and adopt them
  */
-void sendPacket(bool extended, uint8_t num_data_objects, uint8_t message_id, 
-                uint8_t port_power_role, uint8_t spec_rev, uint8_t port_data_role, 
-                uint8_t message_type, uint8_t *data_objects) {
-    
-    uint8_t temp;
-    
-    // SOP sequence - see USB-PD 2.0 page 108
-    tx_buf[0] = SOP_SEQUENCE_0;
-    tx_buf[1] = SOP_SEQUENCE_1;
-    tx_buf[2] = SOP_SEQUENCE_2;
-    tx_buf[3] = SOP_SEQUENCE_3;
+static pd_caps_change_t cache_src_caps(const uint8_t *objects, uint8_t num_objects) {
+    uint32_t hash = pd_crc32(objects, num_objects * 4);
     
-    // Packet length
-    tx_buf[4] = (0x80 | (2 + (4 * (num_data_objects & 0x07))));
-    
-    // Header byte 1
-    tx_buf[5] = (message_type & 0x1F); // Extended message support
-    tx_buf[5] |= ((port_data_role & 0x01) << 5);
-    tx_buf[5] |= ((spec_rev & 0x03) << 6);
-    
-    // Header byte 2
-    tx_buf[6] = (port_power_role & 0x01);
-    tx_buf[6] |= ((message_id & 0x07) << 1);
-    tx_buf[6] |= ((num_data_objects & 0x07) << 4);
-    tx_buf[6] |= (extended << 7);
+    if ((num_objects == pd_port->num_src_pdos) && (hash == pd_port->src_caps_hash)) {
+        pd_log.println("Source capabilities unchanged");
+        pd_stats_inc(PD_CNT_SRC_CAPS_UNCHANGED);
+        return PD_CAPS_SAME;
+    }
     
-    // Data objects
-    temp = 7;
-    for (uint8_t i = 0; i < num_data_objects; i++) {
-        tx_buf[temp] = data_objects[(4 * i)];
-        tx_buf[temp + 1] = data_objects[(4 * i) + 1];
-        tx_buf[temp + 2] = data_objects[(4 * i) + 2];
-        tx_buf[temp + 3] = data_objects[(4 * i) + 3];
-        temp += 4;
+    uint8_t in_use = RDO_POSITION(pd_port->request_rdo);
+    uint32_t in_use_pdo = 0;
+    if (in_use && (in_use <= pd_port->num_src_pdos)) {
+        in_use_pdo = pd_port->src_pdos[in_use - 1];
     }
     
-    // Packet termination
-    tx_buf[temp] = CRC_PLACEHOLDER;
-    tx_buf[temp + 1] = EOP_SEQUENCE;
-    tx_buf[temp + 2] = TXOFF_SEQUENCE;
+    int index = 0;
+    clear_pdos();
+    for (uint8_t i = 0; i < num_objects; i++) {
+        const uint8_t *object = &objects[i * 4];
+        pd_port->src_pdos[i] = object[0] | (object[1] << 8) | (object[2] << 16) | ((uint32_t)object[3] << 24);
+        record_pdo(object, i + 1, &index);
+    }
+    pd_port->num_src_pdos = num_objects;
+    pd_port->src_caps_hash = hash;
     
-    // Send packet
-    uint8_t control_reg = getReg(REG_CONTROL0);
-    sendBytes(tx_buf, (10 + (4 * (num_data_objects & 0x07))));
-    setReg(REG_CONTROL0, (control_reg | 0x01)); // Start transmission
-    msg_id++;
+    if (in_use_pdo && (in_use <= num_objects) && (pd_port->src_pdos[in_use - 1] == in_use_pdo)) {
+        pd_log.println("Source capabilities changed, PDO in use kept");
+        return PD_CAPS_PDO_KEPT;
+    }
+    pd_port->request_rdo = 0; // Evaluate the policy again on the new set
+    return PD_CAPS_NEW;
 }
 
-// Higher level abstractions
-
 /**
- * Read RX FIFO for debugging purposes
+ * Cache a Source_Capabilities set and tell the application about it
  */
-void read_rx_fifo() {
-    int i = 1;
-    while (!(getReg(REG_STATUS1) & 0x20)) {
-        Serial1.print("Byte number ");
-        Serial1.print(i);
-        Serial1.print(": 0x");
-        receiveBytes(rx_buf, 1);
-        Serial1.println(rx_buf[0], HEX);
-        i++;
-    }
+pd_caps_change_t update_src_caps(const uint8_t *objects, uint8_t num_objects) {
+    pd_caps_change_t change = cache_src_caps(objects, num_objects);
+    pd_cb_caps(change);
+    return change;
 }
 
 /**
@@ -252,65 +317,50 @@ bool read_pdo() {
     uint8_t message_type;
     uint8_t spec_rev;
     
-    // Clear previous options
-    for (int i = 0; i < 5; i++) {
-        volt_options[i] = -1;
-        amp_options[i] = -1;
-        options_pos[i] = -1;
-    }
-    
-    receiveBytes(rx_buf, 1);
-    if (rx_buf[0] != 0xE0) {
-        Serial1.println("No response received - read PDO");
+    receiveBytes(pd_frame, 1);
+    if (pd_frame[0] != 0xE0) {
+        pd_log.println("No response received - read PDO");
+        pd_stats_inc(PD_CNT_TIMEOUT_RX_EMPTY);
         return false;
     }
     
-    receiveBytes(rx_buf, 2);
-    num_data_objects = ((rx_buf[1] & 0x70) >> 4);
-    spec_rev = ((rx_buf[0] & 0xC0) >> 6);
-    message_type = (rx_buf[0] & 0x0F);
+    receiveBytes(pd_frame, 2);
+    pd_stats_rx(pd_frame);
+    uint32_t crc = pd_crc32_update(PD_CRC_INIT, pd_frame, 2);
+    num_data_objects = ((pd_frame[1] & 0x70) >> 4);
+    spec_rev = PD_HEADER_SPEC_REV(pd_frame);
+    message_type = PD_HEADER_TYPE(pd_frame);
     
-    if ((message_type == MSG_TYPE_GOODCRC) && (num_data_objects > 0)) {
-        Serial1.println("Source capabilities message received");
+    if ((message_type == MSG_TYPE_SOURCE_CAPABILITIES) && (num_data_objects > 0)) {
+        pd_log.println("Source capabilities message received");
     } else {
-        Serial1.println("Message received, but not source capabilities");
+        pd_log.println("Message received, but not source capabilities");
+        pd_stats_inc(PD_CNT_UNEXPECTED);
         return false;
     }
     
-    receiveBytes(rx_buf, (num_data_objects * 4));
-    int index = 0;
+    // Stream the objects and CRC in the background and fold each PDO into
+    // the CRC as soon as its four bytes have landed
+    pd_bus_xfer_t xfer = {};
+    if (!receiveBytesAsync(pd_frame, (num_data_objects * 4) + 4, &xfer)) {
+        return false;
+    }
     
     for (uint8_t i = 0; i < num_data_objects; i++) {
-        uint32_t byte1 = rx_buf[0 + i * 4];
-        uint32_t byte2 = rx_buf[1 + i * 4] << 8;
-        uint32_t byte3 = rx_buf[2 + i * 4] << 16;
-        uint32_t byte4 = rx_buf[3 + i * 4] << 24;
-        int32_t pdo = byte1 | byte2 | byte3 | byte4;
-        
-        switch (pdo >> 30) {
-            case 0x0: // Fixed supply
-                volt_options[index] = ((pdo >> 10) & 0x3FF) / 20; // Convert to 1V units
-                amp_options[index] = (pdo & 0x3FF); // Keep in 10mA units
-                options_pos[index] = i + 1; // Position 0001 is always safe 5V
-                index++;
-                break;
-            case 0x1: // Battery supply
-                Serial1.print("Battery supply PDO: ");
-                Serial1.println(pdo, HEX);
-                break;
-            case 0x2: // Variable supply
-                Serial1.print("Variable supply PDO: ");
-                Serial1.println(pdo, HEX);
-                break;
-            case 0x3: // Augmented PDO
-                Serial1.print("Augmented PDO: ");
-                Serial1.println(pdo, HEX);
-                break;
+        while (pd_bus_busy(pd_bus, &xfer) && (xfer.rx_done < ((i + 1) * 4))) {}
+        if (xfer.status != PD_BUS_OK) {
+            return false;
         }
+        crc = pd_crc32_update(crc, &pd_frame[i * 4], 4);
     }
     
-    // Read CRC-32
-    receiveBytes(rx_buf, 4);
+    if ((pd_bus_wait(pd_bus, &xfer) != PD_BUS_OK) || !checkCRC(crc, &pd_frame[num_data_objects * 4])) {
+        return false;
+    }
+    
+    // Only a verified set replaces the cached one
+    adoptSpecRev(SOP_TYPE_SOP, spec_rev);
+    update_src_caps(pd_frame, num_data_objects);
     return true;
 }
 
@@ -321,79 +371,169 @@ bool get_req_outcome() {
     uint8_t message_type;
     uint8_t num_data_objects;
     
-    receiveBytes(rx_buf, 1);
-    if (getReg(REG_STATUS1) & 0x20) {
-        Serial1.println("No response received - get request outcome");
+    receiveBytes(pd_frame, 1);
+    if (rxEmpty()) {
+        pd_log.println("No response received - get request outcome");
+        pd_stats_inc(PD_CNT_TIMEOUT_RX_EMPTY);
         return false;
     }
     
-    receiveBytes(rx_buf, 2);
-    message_type = (rx_buf[0] & 0x0F);
-    num_data_objects = ((rx_buf[1] & 0x70) >> 4);
-    receiveBytes(rx_buf, 4); // CRC-32
+    receiveBytes(pd_frame, 2);
+    pd_stats_rx(pd_frame);
+    message_type = PD_HEADER_TYPE(pd_frame);
+    num_data_objects = ((pd_frame[1] & 0x70) >> 4);
+    uint32_t crc = pd_crc32_update(PD_CRC_INIT, pd_frame, 2);
+    receiveBytes(pd_frame, (num_data_objects * 4));
+    crc = pd_crc32_update(crc, pd_frame, (num_data_objects * 4));
+    if (!receiveCRC(crc)) {
+        return false;
+    }
     
     if (message_type == MSG_TYPE_ACCEPT) {
-        Serial1.println("Request accepted");
+        pd_log.println("Request accepted");
         return true;
     } else if (message_type == MSG_TYPE_PS_READY) {
-        Serial1.println("Power supply ready");
+        pd_log.println("Power supply ready");
         return true;
+    } else if ((message_type == MSG_TYPE_REJECT) && !num_data_objects) {
+        pd_log.println("Request rejected");
+        pd_stats_inc(PD_CNT_REJECTS);
+        req_refusal = message_type;
+        return false;
+    } else if ((message_type == MSG_TYPE_WAIT) && !num_data_objects) {
+        pd_log.println("Source asked to wait");
+        pd_stats_inc(PD_CNT_WAITS);
+        req_refusal = message_type;
+        return false;
     } else {
-        Serial1.print("Error, message type: ");
-        Serial1.println(message_type, DEC);
-        Serial1.print("Number of data objects: ");
-        Serial1.println(num_data_objects, DEC);
+        pd_stats_inc(PD_CNT_UNEXPECTED);
+        pd_log.print("Error, message type: ");
+        pd_log.println(message_type, DEC);
+        pd_log.print("Number of data objects: ");
+        pd_log.println(num_data_objects, DEC);
         return false;
     }
 }
 
+/**
+ * Wait for the RX FIFO to receive something
+ */
+bool wait_rx(uint16_t timeout_ms) {
+    unsigned long time = millis();
+    
+    while (rxEmpty()) {
+        if ((millis() - time) >= timeout_ms) {
+            return false;
+        }
+        pd_watchdog_feed();
+    }
+    return true;
+}
+
 /**
  * Read Revision Message Data Object
  */
 uint32_t read_rmdo() {
     uint8_t num_data_objects;
-    uint8_t spec_rev;
     uint8_t message_type;
     
-    receiveBytes(rx_buf, 1);
-    if (rx_buf[0] != 0xE0) {
-        Serial1.println("No response received - read RMDO");
+    receiveBytes(pd_frame, 1);
+    if (pd_frame[0] != 0xE0) {
+        pd_log.println("No response received - read RMDO");
+        pd_stats_inc(PD_CNT_TIMEOUT_RX_EMPTY);
         return 0;
     }
     
-    receiveBytes(rx_buf, 2);
-    num_data_objects = ((rx_buf[1] & 0x70) >> 4);
-    spec_rev = ((rx_buf[0] & 0xC0) >> 6);
-    message_type = (rx_buf[0] & 0x0F);
+    receiveBytes(pd_frame, 2);
+    pd_stats_rx(pd_frame);
+    uint32_t crc = pd_crc32_update(PD_CRC_INIT, pd_frame, 2);
+    num_data_objects = ((pd_frame[1] & 0x70) >> 4);
+    message_type = PD_HEADER_TYPE(pd_frame);
     
-    if ((message_type == 0xC) && (num_data_objects == 1)) {
-        Serial1.println("RMDO message received");
+    if ((message_type == MSG_TYPE_REVISION) && (num_data_objects == 1)) {
+        pd_log.println("RMDO message received");
     } else {
-        Serial1.print("Expected RMDO, incorrect packet type received. Type: ");
-        Serial1.println(message_type, BIN);
-        Serial1.print("Number of data objects: ");
-        Serial1.println(num_data_objects);
+        pd_log.print("Expected RMDO, incorrect packet type received. Type: ");
+        pd_log.println(message_type, BIN);
+        pd_log.print("Number of data objects: ");
+        pd_log.println(num_data_objects);
+        pd_stats_inc(PD_CNT_UNEXPECTED);
         return 0;
     }
     
-    receiveBytes(rx_buf, (num_data_objects * 4));
-    Serial1.print("RMDO: 0x");
+    receiveBytes(pd_frame, (num_data_objects * 4));
+    crc = pd_crc32_update(crc, pd_frame, (num_data_objects * 4));
+    if (!receiveCRC(crc)) {
+        return 0;
+    }
+    pd_log.print("RMDO: 0x");
     
-    uint32_t byte1 = rx_buf[0];
-    uint32_t byte2 = rx_buf[1] << 8;
-    uint32_t byte3 = rx_buf[2] << 16;
-    uint32_t byte4 = rx_buf[3] << 24;
+    uint32_t byte1 = pd_frame[0];
+    uint32_t byte2 = pd_frame[1] << 8;
+    uint32_t byte3 = pd_frame[2] << 16;
+    uint32_t byte4 = pd_frame[3] << 24;
     uint32_t rmdo = byte1 | byte2 | byte3 | byte4;
     
-    Serial1.println(rmdo, HEX);
-    
-    // Read CRC-32
-    receiveBytes(rx_buf, 4);
-    Serial1.println();
+    pd_log.println(rmdo, HEX);
+    pd_log.println();
     
     return rmdo;
 }
 
+/**
+ * Look a VID/PID up in the device library and set dev_type on a match
+ */
+bool lookup_dev_type(uint16_t vid, uint16_t pid) {
+    for (int i = 0; i < 10; i++) {
+        if ((dev_library[i][0] == vid) && (dev_library[i][1] == pid)) {
+            pd_port->dev_type = dev_library[i][2];
+            pd_cb_identity(vid, pid, false);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Guess dev_type from what the negotiation showed, or default to charger
+ */
+void classify_dev_type() {
+#if PD_CLASSIFY
+    const pd_vdm_partner_t *partner = pd_vdm_partner(pd_port - pd_ports);
+    pd_features_t features;
+    pd_classify_features(pd_port->src_pdos, pd_port->num_src_pdos, pd_port->spec_revs[SOP_TYPE_SOP],
+                         pd_port->transition_ms,
+                         (partner->discovery == PD_VDM_DISCOVERED) ? partner->id_header : 0, &features);
+    pd_port->dev_type = pd_classify(&features);
+    pd_cb_identity(0, 0, true);
+    pd_log.print("VID & PID detection failed, device type guessed from capabilities --> ");
+    print_dev_type();
+#else
+    pd_log.println("VID & PID detection failed, defaulting device type to --> charger");
+    pd_port->dev_type = 0;
+#endif
+}
+
+/**
+ * Print the recognised device type
+ */
+void print_dev_type() {
+    switch (pd_port->dev_type) {
+        case 0:
+            pd_log.println("charger");
+            break;
+        case 1:
+            pd_log.println("monitor");
+            break;
+        case 2:
+            pd_log.println("tablet");
+            break;
+        case 3:
+            pd_log.println("laptop/computer");
+            break;
+    }
+}
+
 /**
  * Read extended source capabilities message
  */
@@ -404,64 +544,80 @@ bool read_ext_src_cap() {
     bool extended_msg;
     uint16_t VID, PID;
     
-    receiveBytes(rx_buf, 1); // Preamble
-    if (getReg(REG_STATUS1) & 0x20) {
-        Serial1.println("Empty RX FIFO - read extended source cap");
+    receiveBytes(pd_frame, 1); // Preamble
+    if (rxEmpty()) {
+        pd_log.println("Empty RX FIFO - read extended source cap");
+        pd_stats_inc(PD_CNT_TIMEOUT_RX_EMPTY);
         return false;
     }
     
-    receiveBytes(rx_buf, 2); // Header
-    num_data_objects = ((rx_buf[1] & 0x70) >> 4);
+    receiveBytes(pd_frame, 2); // Header
+    pd_stats_rx(pd_frame);
+    uint32_t crc = pd_crc32_update(PD_CRC_INIT, pd_frame, 2);
+    num_data_objects = ((pd_frame[1] & 0x70) >> 4);
     
-    if (spec_revs[0] == 3) {
-        message_type = (rx_buf[0] & 0x1F);
-    } else {
-        message_type = (rx_buf[0] & 0x0F);
-    }
+    message_type = PD_HEADER_TYPE(pd_frame);
     
-    extended_msg = (rx_buf[1] >> 7);
+    extended_msg = (pd_frame[1] >> 7);
     
     if (extended_msg) {
-        Serial1.println("Extended message received");
-        receiveBytes(rx_buf, 2); // Extended header
-        ext_data_size = (((rx_buf[1] & 0x1) << 8) | rx_buf[0]);
+        pd_log.println("Extended message received");
+        if (num_data_objects < 1) {
+            // Not even room for the extended header: the payload size cannot be trusted
+            pd_log.println("Extended message without data objects - read ext source cap");
+            pd_stats_inc(PD_CNT_UNEXPECTED);
+            flushRx();
+            return false;
+        }
+        receiveBytes(pd_frame, 2); // Extended header
+        crc = pd_crc32_update(crc, pd_frame, 2);
+        ext_data_size = (((pd_frame[1] & 0x1) << 8) | pd_frame[0]);
+        
+        // Data objects carry the extended header plus the padded payload
+        uint16_t chunk_size = (num_data_objects * 4) - 2;
+        if (chunk_size > PD_MAX_CHUNK_SIZE) {
+            chunk_size = PD_MAX_CHUNK_SIZE;
+        }
+        if (chunk_size > sizeof(pd_frame)) {
+            chunk_size = sizeof(pd_frame);
+        }
         
-        if ((ext_data_size >= 24) && (message_type == 1)) {
-            receiveBytes(rx_buf, ext_data_size); // Extended source cap content
-            VID = (rx_buf[1] << 8) | rx_buf[0];
-            PID = (rx_buf[3] << 8) | rx_buf[2];
+        if ((ext_data_size >= 24) && (ext_data_size <= chunk_size) && (message_type == 1)) {
+            receiveBytes(pd_frame, chunk_size); // Extended source cap content
+            crc = pd_crc32_update(crc, pd_frame, chunk_size);
+            if (!receiveCRC(crc)) {
+                flushRx();
+                return false;
+            }
+            VID = (pd_frame[1] << 8) | pd_frame[0];
+            PID = (pd_frame[3] << 8) | pd_frame[2];
             
-            Serial1.print("Device VID: ");
-            Serial1.println(VID, HEX);
-            Serial1.print("Device PID: ");
-            Serial1.println(PID, HEX);
+            pd_log.print("Device VID: ");
+            pd_log.println(VID, HEX);
+            pd_log.print("Device PID: ");
+            pd_log.println(PID, HEX);
             
-            // Check device library for recognition
-            for (int i = 0; i < 10; i++) {
-                if ((dev_library[i][0] == VID) && (dev_library[i][1] == PID)) {
-                    dev_type = dev_library[i][2];
-                    break;
-                }
-            }
+            lookup_dev_type(VID, PID);
             
-            setReg(REG_CONTROL1, 0x04); // Flush RX
+            flushRx();
             return true;
         } else {
-            Serial1.print("Data size: ");
-            Serial1.println(ext_data_size, DEC);
-            Serial1.print("Message type: ");
-            Serial1.println(message_type, BIN);
-            setReg(REG_CONTROL1, 0x04); // Flush RX
+            pd_log.print("Data size: ");
+            pd_log.println(ext_data_size, DEC);
+            pd_log.print("Message type: ");
+            pd_log.println(message_type, BIN);
+            flushRx();
             return false;
         }
     } else {
         if ((message_type == 16) && (num_data_objects == 0)) {
-            Serial1.println("Extended source cap not supported");
-            setReg(REG_CONTROL1, 0x04); // Flush RX
+            pd_log.println("Extended source cap not supported");
+            flushRx();
             return false;
         }
-        Serial1.println("Wrong type of message received - read ext source cap");
-        setReg(REG_CONTROL1, 0x04); // Flush RX
+        pd_log.println("Wrong type of message received - read ext source cap");
+        pd_stats_inc(PD_CNT_UNEXPECTED);
+        flushRx();
         return false;
     }
     return false;
@@ -475,50 +631,50 @@ bool read_dis_idt_response() {
     uint8_t message_type;
     uint8_t command;
     uint8_t cmd_type;
-    uint16_t VID, PID;
     
-    receiveBytes(rx_buf, 1); // Preamble
-    if (getReg(REG_STATUS1) & 0x20) {
-        Serial1.println("Empty RX FIFO - read discover identity response");
+    receiveBytes(pd_frame, 1); // Preamble
+    if (rxEmpty()) {
+        pd_log.println("Empty RX FIFO - read discover identity response");
+        pd_stats_inc(PD_CNT_TIMEOUT_RX_EMPTY);
         return false;
     }
     
-    receiveBytes(rx_buf, 2); // Header
-    num_data_objects = ((rx_buf[1] & 0x70) >> 4);
-    message_type = (rx_buf[0] & 0x1F);
+    receiveBytes(pd_frame, 2); // Header
+    pd_stats_rx(pd_frame);
+    uint32_t crc = pd_crc32_update(PD_CRC_INIT, pd_frame, 2);
+    num_data_objects = ((pd_frame[1] & 0x70) >> 4);
+    message_type = PD_HEADER_TYPE(pd_frame);
     
     if (message_type == MSG_TYPE_VDM) {
-        Serial1.println("VDM received");
-        receiveBytes(rx_buf, 2); // VDM header
-        command = rx_buf[0] & 0x1F; // Discover identity
-        cmd_type = (rx_buf[0] & 0xC0) >> 6; // REQ/ACK/NACK/BUSY
+        pd_log.println("VDM received");
+        receiveBytes(pd_frame, num_data_objects * 4); // VDM header + VDOs
+        crc = pd_crc32_update(crc, pd_frame, num_data_objects * 4);
+        if (!receiveCRC(crc)) {
+            return false;
+        }
+        command = VDM_HDR_CMD(pd_frame[0]);
+        cmd_type = VDM_HDR_CMD_TYPE(pd_frame[0]);
         
-        if ((command == 1) && (cmd_type == 1)) {
-            receiveBytes(rx_buf, num_data_objects * 4); // VDM content
-            VID = (rx_buf[1] << 8) | rx_buf[0];
-            PID = (rx_buf[11] << 8) | rx_buf[10];
-            
-            Serial1.print("Device VID: ");
-            Serial1.println(VID, HEX);
-            Serial1.print("Device PID: ");
-            Serial1.println(PID, HEX);
+        if ((command == VDM_CMD_DISCOVER_IDENTITY) && (cmd_type == VDM_CMD_TYPE_ACK) && (num_data_objects >= 2)) {
+            pd_vdm_record(pd_frame, num_data_objects); // ID Header, Cert Stat, Product...
         } else {
-            if ((command == 1) && (message_type == 0xF)) {
-                Serial1.println("VDM request NACK");
+            if ((command == VDM_CMD_DISCOVER_IDENTITY) && (cmd_type != VDM_CMD_TYPE_ACK)) {
+                pd_log.println("VDM request NACK");
+                pd_stats_inc((cmd_type == VDM_CMD_TYPE_BUSY) ? PD_CNT_VDM_BUSY : PD_CNT_VDM_NAKS);
                 return false;
             }
-            Serial1.print("Command: ");
-            Serial1.println(command, DEC);
-            Serial1.print("Message type: ");
-            Serial1.println(message_type, BIN);
+            pd_log.print("Command: ");
+            pd_log.println(command, DEC);
+            pd_log.print("Message type: ");
+            pd_log.println(message_type, BIN);
             return false;
         }
     } else {
-        Serial1.println("Wrong type of message received - read discover identity response");
+        pd_log.println("Wrong type of message received - read discover identity response");
+        pd_stats_inc(PD_CNT_UNEXPECTED);
         return false;
     }
     
-    receiveBytes(rx_buf, 4); // CRC-32
     return true;
 }
 
@@ -526,30 +682,32 @@ bool read_dis_idt_response() {
  * Get source capabilities
  */
 void get_src_cap() {
-    Serial1.println("Fetching source capabilities info...");
-    sendPacket(false, 0, msg_id, 0, spec_revs[0] - 1, 0, MSG_TYPE_GET_SOURCE_CAP, NULL);
-    
-    while (getReg(REG_STATUS1) & 0x20) {} // Wait while RX empty
-    receivePacket();
+    pd_log.println("Fetching source capabilities info...");
+    if (transmitPacket(false, 0, MSG_TYPE_GET_SOURCE_CAP, NULL) != TX_RESULT_SENT) {
+        return;
+    }
     
-    while (getReg(REG_STATUS1) & 0x20) {} // Wait while RX empty  
+    if (!wait_rx(PD_T_SENDER_RESPONSE_MS)) {
+        pd_log.println("No response received - get source cap");
+        pd_stats_inc(PD_CNT_TIMEOUT_SENDER_RESPONSE);
+        return;
+    }
     read_pdo();
 }
 
 /**
- * Select source capability (request specific voltage/current)
+ * Build the Request data object for a fixed supply
  */
-bool sel_src_cap(int volts, int amps) {
-    uint8_t temp_buf[80] = {};
+uint32_t build_request(int volts, int ma) {
     bool possible_v = false;
     bool possible_a = false;
     int idx = 0;
     
     // Check if requested voltage and current are available
-    for (int i = 0; i < 5; i++) {
-        if (volt_options[i] == volts) {
+    for (int i = 0; i < PD_MAX_OPTIONS; i++) {
+        if (pd_port->options[i].position && (pd_port->options[i].voltage == volts)) {
             possible_v = true;
-            if (amp_options[i] >= amps) {
+            if (pd_port->options[i].current * 10 >= ma) {
                 possible_a = true;
                 idx = i;
                 break;
@@ -558,339 +716,482 @@ bool sel_src_cap(int volts, int amps) {
     }
     
     if (possible_v && possible_a) {
-        uint32_t request_msg = (options_pos[idx] << 28) | 
-                              ((amps * 100) << 10) | 
-                              (amp_options[idx]);
-        
-        temp_buf[0] = request_msg & 0xFF;
-        temp_buf[1] = (request_msg >> 8) & 0xFF;
-        temp_buf[2] = (request_msg >> 16) & 0xFF;
-        temp_buf[3] = (request_msg >> 24) & 0xFF;
-        
-        sendPacket(false, 1, msg_id, 0, spec_revs[0] - 1, 0, 0x2, temp_buf);
-        Serial1.println("Voltage and current requested from source");
-        
-        unsigned long time = millis();
-        while ((getReg(REG_STATUS1) & 0x20) && (millis() < (time + 500))) {} // Wait for GoodCRC
-        receivePacket();
-        
-        while ((getReg(REG_STATUS1) & 0x20) && (millis() < (time + 500))) {} // Wait for Accept
-        get_req_outcome();
-        
-        while ((getReg(REG_STATUS1) & 0x20) && (millis() < (time + 500))) {} // Wait for PS_Ready
-        if (get_req_outcome()) {
-            return true;
+        return ((uint32_t)pd_port->options[idx].position << 28) | 
+               (PD_EPR_SINK_PDP_W ? RDO_EPR_CAPABLE : 0) |
+               ((uint32_t)(ma / 10) << 10) | 
+               (pd_port->options[idx].current);
+    }
+    
+    // EPR mode: any voltage within an AVS range, at no more than its PDP
+    for (uint8_t i = PD_EPR_FIRST_POSITION - 1; pd_port->epr_mode && (i < pd_port->num_src_pdos); i++) {
+        uint32_t pdo = pd_port->src_pdos[i];
+        if (((pdo >> 30) != PDO_TYPE_AUGMENTED) || (PDO_APDO_TYPE(pdo) != PDO_APDO_EPR_AVS) ||
+            ((uint32_t)volts * 1000 < PDO_AVS_MIN_MV(pdo)) || ((uint32_t)volts * 1000 > PDO_AVS_MAX_MV(pdo))) {
+            continue;
         }
-    } else if (!possible_v) {
-        Serial1.println("Voltage not available");
-        return false;
+        if ((uint32_t)(volts * ma) > PDO_AVS_PDP_W(pdo) * 1000) {
+            possible_v = true;
+            continue;
+        }
+        return RDO_AVS(i + 1, volts * 1000, ma) | RDO_EPR_CAPABLE;
+    }
+    
+    if (!possible_v) {
+        pd_log.println("Voltage not available");
     } else {
-        Serial1.println("Current request too high for selected voltage");
-        return false;
+        pd_log.println("Current request too high for selected voltage");
     }
-    return false;
+    return 0;
 }
 
 /**
- * Send sink capabilities
+ * Request data object, reusing the last one while it still applies
  */
-void send_snk_cap(int volts, int amps) {
-    if (volts == 5) {
-        // Single 5V PDO
-        uint32_t sink_cap_msg = (0 << 29) | (1 << 26) | (0 << 25) | ((5 * 20) << 10) | (amps * 100);
-        temp_buf[0] = sink_cap_msg & 0xFF;
-        temp_buf[1] = (sink_cap_msg >> 8) & 0xFF;
-        temp_buf[2] = (sink_cap_msg >> 16) & 0xFF;
-        temp_buf[3] = (sink_cap_msg >> 24) & 0xFF;
-        
-        sendPacket(false, 1, msg_id, 0, spec_revs[0] - 1, 0, 0x4, temp_buf);
-        Serial1.println("Sink capabilities sent (5V only)");
-    } else if (volts > 5) {
-        // Dual PDO: 5V + higher voltage
-        uint32_t sink_cap_msg_p1 = (0 << 29) | (1 << 28) | (1 << 26) | (0 << 25) | ((5 * 20) << 10) | (3 * 100);
-        uint32_t sink_cap_msg_p2 = ((volts * 20) << 10) | (amps * 100);
-        
-        temp_buf[0] = sink_cap_msg_p1 & 0xFF;
-        temp_buf[1] = (sink_cap_msg_p1 >> 8) & 0xFF;
-        temp_buf[2] = (sink_cap_msg_p1 >> 16) & 0xFF;
-        temp_buf[3] = (sink_cap_msg_p1 >> 24) & 0xFF;
-        temp_buf[4] = sink_cap_msg_p2 & 0xFF;
-        temp_buf[5] = (sink_cap_msg_p2 >> 8) & 0xFF;
-        temp_buf[6] = (sink_cap_msg_p2 >> 16) & 0xFF;
-        temp_buf[7] = (sink_cap_msg_p2 >> 24) & 0xFF;
-        
-        sendPacket(false, 2, msg_id, 0, spec_revs[0] - 1, 0, 0x4, temp_buf);
-        Serial1.println("Sink capabilities sent (higher capacity than 5V)");
+uint32_t request_for(int volts, int ma) {
+    uint32_t rdo = pd_port->request_rdo;
+    uint8_t position = RDO_POSITION(rdo);
+    uint8_t port = pd_port - pd_ports;
+    
+    // VBUS goes through the cable: stay within what its e-marker allows
+    if ((uint32_t)volts * 1000 > pd_vdm_cable_mv(port)) {
+        pd_log.println("Voltage above the cable's rating");
+        return 0;
     }
+    if ((uint32_t)ma > pd_vdm_cable_ma(port)) {
+        ma = pd_vdm_cable_ma(port);
+        pd_log.print("Current held to the cable's rating: ");
+        pd_log.println(ma);
+    }
+    
+    // request_rdo is dropped whenever its PDO changes, so only the target is
+    // checked; AVS requests carry the voltage instead and are always rebuilt
+    if (rdo && ((pd_port->src_pdos[position - 1] >> 30) == PDO_TYPE_FIXED_SUPPLY) &&
+        (((rdo >> 10) & 0x3FF) == (uint32_t)(ma / 10)) &&
+        (((pd_port->src_pdos[position - 1] >> 10) & 0x3FF) == (uint32_t)VOLTAGE_TO_PDO(volts))) {
+        return rdo;
+    }
+    rdo = build_request(volts, ma);
+    pd_port->request_rdo = rdo;
+    return rdo;
 }
 
 /**
- * Send discover identity request
+ * vSafe5V with Capability Mismatch, for capabilities without the target
  */
-void send_dis_idt_request() {
-    uint8_t temp_buf[80];
-    uint16_t dev_PD_SID = 0xFF00; // SVID field must be set to this for discover identity command
+uint32_t request_mismatch() {
+    uint32_t current = pd_port->src_pdos[0] & 0x3FF; // 10mA units
     
-    uint32_t vdm_header = (dev_PD_SID << 16) | (1 << 15) | (0 << 13) | (0 << 6) | (1); // REQ for Discover Identity
-    temp_buf[0] = vdm_header & 0xFF;
-    temp_buf[1] = (vdm_header >> 8) & 0xFF;
-    temp_buf[2] = (vdm_header >> 16) & 0xFF;
-    temp_buf[3] = (vdm_header >> 24) & 0xFF;
-    
-    sendPacket(false, 1, msg_id, 0, spec_revs[0] - 1, 0, MSG_TYPE_VDM, temp_buf);
-    Serial1.println("Fetching discovery identity info...");
+    pd_log.println("Capability mismatch: vSafe5V requested");
+    pd_port->request_rdo = (1UL << 28) | RDO_CAP_MISMATCH | (PD_EPR_SINK_PDP_W ? RDO_EPR_CAPABLE : 0) |
+                           (current << 10) | current;
+    return pd_port->request_rdo;
 }
 
 /**
- * Send discover identity response
+ * Voltage of the last Request
  */
-void send_dis_idt_response() {
-    uint16_t dev_VID = 0x0483; // VID from Intel Corp
-    uint16_t dev_PID = 0x1307; // PID from Intel Corp  
-    uint16_t dev_PD_SID = 0xFF00; // SVID field for discover identity command
-    
-    uint32_t vdm_header = (dev_PD_SID << 16) | (1 << 15) | (1 << 13) | (1 << 6) | (1);
-    uint32_t id_header = (1 << 30) | (2 << 27) | (2 << 21) | (dev_VID);
-    uint32_t cert_stat = 0; // Empty XID
-    uint32_t product_vdo = (dev_PID << 16) | (0); // Empty BCD device code
-    uint32_t UFP_type_vdo = (3 << 29) | (4 << 24) | (1); // USB 3.2 capable with Gen 1 SuperSpeed
-    
-    temp_buf[0] = vdm_header & 0xFF;
-    temp_buf[1] = (vdm_header >> 8) & 0xFF;
-    temp_buf[2] = (vdm_header >> 16) & 0xFF;
-    temp_buf[3] = (vdm_header >> 24) & 0xFF;
-    
-    temp_buf[4] = id_header & 0xFF;
-    temp_buf[5] = (id_header >> 8) & 0xFF;
-    temp_buf[6] = (id_header >> 16) & 0xFF;
-    temp_buf[7] = (id_header >> 24) & 0xFF;
-    
-    temp_buf[8] = cert_stat & 0xFF;
-    temp_buf[9] = (cert_stat >> 8) & 0xFF;
-    temp_buf[10] = (cert_stat >> 16) & 0xFF;
-    temp_buf[11] = (cert_stat >> 24) & 0xFF;
-    
-    temp_buf[12] = product_vdo & 0xFF;
-    temp_buf[13] = (product_vdo >> 8) & 0xFF;
-    temp_buf[14] = (product_vdo >> 16) & 0xFF;
-    temp_buf[15] = (product_vdo >> 24) & 0xFF;
+uint32_t contract_mv() {
+    uint32_t rdo = pd_port->request_rdo;
+    uint8_t position = RDO_POSITION(rdo);
     
-    temp_buf[16] = UFP_type_vdo & 0xFF;
-    temp_buf[17] = (UFP_type_vdo >> 8) & 0xFF;
-    temp_buf[18] = (UFP_type_vdo >> 16) & 0xFF;
-    temp_buf[19] = (UFP_type_vdo >> 24) & 0xFF;
-    
-    sendPacket(false, 5, msg_id, 0, spec_revs[0] - 1, 0, MSG_TYPE_VDM, temp_buf);
-    Serial1.println("Discovery identity response sent");
+    if (!position || (position > pd_port->num_src_pdos)) {
+        return 0;
+    }
+    uint32_t pdo = pd_port->src_pdos[position - 1];
+    if (GET_PDO_TYPE(pdo) == PDO_TYPE_FIXED_SUPPLY) {
+        return PDO_FIXED_MV(pdo);
+    }
+    if ((GET_PDO_TYPE(pdo) == PDO_TYPE_AUGMENTED) && (PDO_APDO_TYPE(pdo) == PDO_APDO_EPR_AVS)) {
+        return RDO_AVS_MV(rdo);
+    }
+    return 0;
 }
 
 /**
- * Send discover SVID response
+ * Whether a voltage calls for EPR mode
  */
-void send_dis_svid_response() {
-    uint16_t dev_VID = 0x0483; // VID from Intel Corp
-    uint16_t dev_PID = 0x1307; // PID from Intel Corp
-    uint16_t dev_PD_SID = 0xFF00; // SVID field for discover identity command
+bool epr_needed(int volts) {
+    return PD_EPR_SINK_PDP_W && (volts > 20) && !pd_port->epr_mode && pd_port->num_src_pdos &&
+           (pd_port->src_pdos[0] & PDO_FIXED_EPR_CAPABLE) && (pd_port->spec_revs[SOP_TYPE_SOP] >= PD_SPEC_REV_30);
+}
+
+/**
+ * Send a Request and wait for Accept and PS_RDY
+ */
+static bool request_supply(uint32_t request_msg) {
+    uint8_t objects[4];
+    
+    req_refusal = 0;
+    if (request_msg) {
+        objects[0] = request_msg & 0xFF;
+        objects[1] = (request_msg >> 8) & 0xFF;
+        objects[2] = (request_msg >> 16) & 0xFF;
+        objects[3] = (request_msg >> 24) & 0xFF;
+        
+        if (transmitPacket(false, 1, MSG_TYPE_REQUEST, objects) != TX_RESULT_SENT) {
+            return false;
+        }
+        pd_log.println("Voltage and current requested from source");
+        
+        if (!wait_rx(PD_T_SENDER_RESPONSE_MS)) {
+            pd_stats_inc(PD_CNT_TIMEOUT_SENDER_RESPONSE);
+        } else if (get_req_outcome()) {
+            pd_port->vbus_ok = false; // VBUS is in transition
+            uint32_t accept_ms = millis();
+            if (!wait_rx(PD_T_PS_TRANSITION_MS)) {
+                pd_stats_inc(PD_CNT_TIMEOUT_PS_TRANSITION);
+            } else if (get_req_outcome()) {
+                pd_port->transition_ms = millis() - accept_ms;
+                pd_port->recovery = PD_RECOVER_NONE;
+                pd_stats_inc(PD_CNT_CONTRACTS);
+                pd_reset_contract();
+                pd_vbus_check_contract();
+                pd_cb_contract();
+                return true;
+            }
+        }
+        pd_stats_inc(PD_CNT_NEGOTIATION_FAILURES);
+        pd_cb_error(PD_CB_ERR_NEGOTIATION, req_refusal);
+    }
+    return false;
+}
+
+/**
+ * Select source capability
+ */
+bool sel_src_cap(int volts, int ma) {
+    uint32_t request_msg = request_for(volts, ma);
     
-    uint32_t vdm_header = (dev_PD_SID << 16) | (1 << 15) | (1 << 13) | (2 << 6) | (2);
+    // Source_Capabilities must be answered even when the target is not offered
+    return request_supply(request_msg ? request_msg : request_mismatch());
+}
+
+/**
+ * Serialize sink capabilities into data objects
+ */
+uint8_t build_snk_cap(const pd_snk_caps_t *caps, uint8_t *objects) {
+    if ((caps->num_pdos < 1) || (caps->num_pdos > PD_MAX_DATA_OBJECTS) ||
+        (caps->pdos[0].type != PDO_TYPE_FIXED_SUPPLY) || ((caps->pdos[0].min_mv / 50) != 100)) {
+        return 0; // vSafe5V has to come first
+    }
     
-    temp_buf[0] = vdm_header & 0xFF;
-    temp_buf[1] = (vdm_header >> 8) & 0xFF;
-    temp_buf[2] = (vdm_header >> 16) & 0xFF;
-    temp_buf[3] = (vdm_header >> 24) & 0xFF;
+    for (uint8_t i = 0; i < caps->num_pdos; i++) {
+        const pd_snk_pdo_t *pdo = &caps->pdos[i];
+        uint32_t min_v = pdo->min_mv / 50; // 50mV units
+        uint32_t max_v = pdo->max_mv / 50;
+        uint32_t object;
+        
+        switch (pdo->type) {
+            case PDO_TYPE_FIXED_SUPPLY:
+                if ((min_v > 0x3FF) || ((pdo->ma / 10) > 0x3FF)) {
+                    return 0;
+                }
+                object = (min_v << 10) | (pdo->ma / 10);
+                break;
+            case PDO_TYPE_BATTERY:
+                if ((max_v > 0x3FF) || (min_v > max_v) || ((pdo->mw / 250) > 0x3FF)) {
+                    return 0;
+                }
+                object = (1UL << 30) | (max_v << 20) | (min_v << 10) | (pdo->mw / 250);
+                break;
+            case PDO_TYPE_VARIABLE_SUPPLY:
+                if ((max_v > 0x3FF) || (min_v > max_v) || ((pdo->ma / 10) > 0x3FF)) {
+                    return 0;
+                }
+                object = (2UL << 30) | (max_v << 20) | (min_v << 10) | (pdo->ma / 10);
+                break;
+            default: // PPS APDO, 100mV and 50mA units
+                min_v = pdo->min_mv / 100;
+                max_v = pdo->max_mv / 100;
+                if ((max_v > 0xFF) || (min_v > max_v) || ((pdo->ma / 50) > 0x7F)) {
+                    return 0;
+                }
+                object = (3UL << 30) | (max_v << 17) | (min_v << 8) | (pdo->ma / 50);
+                break;
+        }
+        
+        if (i == 0) {
+            object |= ((uint32_t)caps->dual_role_power << 29) | ((uint32_t)caps->higher_capability << 28) |
+                      ((uint32_t)caps->unconstrained_power << 27) | ((uint32_t)caps->usb_comms << 26) |
+                      ((uint32_t)caps->dual_role_data << 25);
+        }
+        objects[i * 4] = object & 0xFF;
+        objects[i * 4 + 1] = (object >> 8) & 0xFF;
+        objects[i * 4 + 2] = (object >> 16) & 0xFF;
+        objects[i * 4 + 3] = (object >> 24) & 0xFF;
+    }
+    return caps->num_pdos;
+}
+
+/**
+ * Replace the advertised sink capabilities
+ */
+bool set_snk_caps(const pd_snk_caps_t *caps) {
+    uint8_t objects[PD_MAX_PAYLOAD];
+    uint8_t count = build_snk_cap(caps, objects);
     
-    sendPacket(false, 1, msg_id, 0, spec_revs[0] - 1, 0, MSG_TYPE_VDM, temp_buf);
-    Serial1.println("Discovery SVID response sent");
+    if (!count) {
+        pd_log.println("Sink capabilities rejected");
+        return false;
+    }
+    memcpy(snk_cap_objects, objects, count * 4);
+    snk_cap_count = count;
+    return true;
+}
+
+/**
+ * Cached sink capabilities
+ */
+uint8_t cached_snk_cap(uint8_t **objects) {
+    *objects = snk_cap_objects;
+    return snk_cap_count;
+}
+
+/**
+ * Send sink capabilities
+ */
+tx_result_t send_snk_cap() {
+    tx_result_t result = transmitPacket(false, snk_cap_count, MSG_TYPE_SINK_CAPABILITIES, snk_cap_objects);
+    pd_log.print("Sink capabilities sent, PDOs: ");
+    pd_log.println(snk_cap_count);
+    return result;
+}
+
+/**
+ * Send discover identity request
+ */
+tx_result_t send_dis_idt_request() {
+    uint8_t objects[4];
+    
+    pd_vdm_build(objects, VDM_HEADER(PD_SID, pd_vdm_version(), 0, VDM_CMD_TYPE_REQ, VDM_CMD_DISCOVER_IDENTITY),
+                 NULL, 0);
+    tx_result_t result = transmitPacket(false, 1, MSG_TYPE_VDM, objects);
+    pd_log.println("Fetching discovery identity info...");
+    return result;
 }
 
 /**
  * Send extended source capabilities
  */
-void send_ext_src_cap() {
+tx_result_t send_ext_src_cap() {
     uint16_t dev_VID = 0x0483; // VID from Intel Corp
     uint16_t dev_PID = 0x1307; // PID from Intel Corp
+    uint8_t objects[PD_MAX_PAYLOAD] = {};
     
-    temp_buf[0] = 0; // Extended message header
-    temp_buf[1] = 0x19; // Data size (25 bytes in SCEDB)
+    objects[0] = 0; // Extended message header
+    objects[1] = 0x19; // Data size (25 bytes in SCEDB)
     
-    temp_buf[2] = dev_VID & 0xFF;
-    temp_buf[3] = (dev_VID >> 8) & 0xFF;
-    temp_buf[4] = dev_PID & 0xFF;
-    temp_buf[5] = (dev_PID >> 8) & 0xFF;
+    objects[2] = dev_VID & 0xFF;
+    objects[3] = (dev_VID >> 8) & 0xFF;
+    objects[4] = dev_PID & 0xFF;
+    objects[5] = (dev_PID >> 8) & 0xFF;
     // Rest of SCEDB left blank
     
-    temp_buf[10] = 0xFF; // Firmware version number
-    temp_buf[11] = 0xFF; // Hardware version number  
-    temp_buf[13] = 0x3; // 3ms holdup time
-    temp_buf[15] = 0x7; // Minimal leakage, ground pin exists and connected to protective earth
+    objects[10] = 0xFF; // Firmware version number
+    objects[11] = 0xFF; // Hardware version number  
+    objects[13] = 0x3; // 3ms holdup time
+    objects[15] = 0x7; // Minimal leakage, ground pin exists and connected to protective earth
     
-    temp_buf[25] = 0x2E; // PDP rating = 46W
+    objects[25] = 0x2E; // PDP rating = 46W
     
-    sendPacket(true, 0, msg_id, 0, spec_revs[0] - 1, 0, 0x1, temp_buf);
-    Serial1.println("Extended source capabilities response sent");
+    tx_result_t result = transmitPacket(true, 0, 0x1, objects);
+    pd_log.println("Extended source capabilities response sent");
+    return result;
+}
+
+/**
+ * Store a partner's Revision Message Data Object
+ */
+void record_rmdo(uint32_t rmdo) {
+    pd_port->partner_rev.rev_major = ((rmdo >> 28) & 0xF); // Revision major
+    pd_port->partner_rev.rev_minor = ((rmdo >> 24) & 0xF); // Revision minor
+    pd_port->partner_rev.ver_major = ((rmdo >> 20) & 0xF); // Version major
+    pd_port->partner_rev.ver_minor = ((rmdo >> 16) & 0xF); // Version minor
 }
 
 /**
  * Get specification revision information
  */
-void get_spec_rev() {
-    sendPacket(false, 0, msg_id, 0, spec_revs[0] - 1, 0, 0x18, NULL);
-    Serial1.println("Fetching revision and version specifications...");
-    delay(1000);
-    
-    while (getReg(REG_STATUS1) & 0x20) {
-        delay(1);
+bool get_spec_rev() {
+    // The header revision already settles PD 2.0 vs 3.x; Get_Revision only
+    // refines a PD 3.x partner, and is not defined below that
+    if (pd_port->partner_rev.rev_major) {
+        return true;
+    }
+    if (pd_port->spec_revs[SOP_TYPE_SOP] < PD_SPEC_REV_30) {
+        return false;
+    }
+    if (transmitPacket(false, 0, MSG_TYPE_GET_REVISION, NULL) != TX_RESULT_SENT) {
+        return false;
     }
-    receivePacket();
+    pd_log.println("Fetching revision and version specifications...");
     
-    while (getReg(REG_STATUS1) & 0x20) {
-        delay(1);
+    if (!wait_rx(PD_T_SENDER_RESPONSE_MS)) {
+        pd_log.println("No response received - get revision");
+        pd_stats_inc(PD_CNT_TIMEOUT_SENDER_RESPONSE);
+        return false;
     }
     
     uint32_t rmdo = read_rmdo();
-    if (rmdo) {
-        spec_revs[0] = ((rmdo & (0xF << 28)) >> 28); // Revision major
-        spec_revs[1] = ((rmdo & (0xF << 24)) >> 24); // Revision minor
-        spec_revs[2] = ((rmdo & (0xF << 20)) >> 20); // Version major
-        spec_revs[3] = ((rmdo & (0xF << 16)) >> 16); // Version minor
-    } else {
-        Serial1.println("Invalid RMDO packet");
+    if (!rmdo) {
+        pd_log.println("Invalid RMDO packet");
+        return false;
     }
+    record_rmdo(rmdo);
+    return true;
 }
 
 /**
- * Process remaining messages after initial negotiation
+ * Answer Get_Revision with our Revision Message Data Object
  */
-bool read_rest(int volts, int amps) {
-    temp_buf[80] = {};
-    rx_buf[80] = {};
+tx_result_t send_revision() {
+    uint8_t objects[4];
+    
+    objects[0] = PD_RMDO_OURS & 0xFF;
+    objects[1] = (PD_RMDO_OURS >> 8) & 0xFF;
+    objects[2] = (PD_RMDO_OURS >> 16) & 0xFF;
+    objects[3] = (PD_RMDO_OURS >> 24) & 0xFF;
     
+    return transmitPacket(false, 1, MSG_TYPE_REVISION, objects);
+}
+
+/**
+ * Process remaining messages after initial negotiation
+ */
+bool read_rest(int volts, int ma) {
     uint8_t message_type;
     uint8_t num_data_objects;
+    uint8_t spec_rev;
     bool extended;
     
-    receiveBytes(rx_buf, 1);
-    if (getReg(REG_STATUS1) & 0x20) { // RX FIFO empty
-        Serial1.println("No more trailing messages");
+    receiveBytes(pd_frame, 1);
+    if (rxEmpty()) { // RX FIFO empty
+        pd_log.println("No more trailing messages");
         return true;
     }
     
-    receiveBytes(rx_buf, 2);
-    num_data_objects = ((rx_buf[1] & 0x70) >> 4);
+    receiveBytes(pd_frame, 2);
+    pd_stats_rx(pd_frame);
+    uint32_t crc = pd_crc32_update(PD_CRC_INIT, pd_frame, 2);
+    num_data_objects = ((pd_frame[1] & 0x70) >> 4);
     
-    if (spec_revs[0] == 3) {
-        message_type = (rx_buf[0] & 0x1F);
-    } else {
-        message_type = (rx_buf[0] & 0x0F);
+    message_type = PD_HEADER_TYPE(pd_frame);
+    spec_rev = PD_HEADER_SPEC_REV(pd_frame);
+    extended = (pd_frame[1] >> 7);
+    
+    // Pull the data objects in up front so the CRC is known before acting
+    receiveBytes(pd_frame, (num_data_objects * 4));
+    crc = pd_crc32_update(crc, pd_frame, (num_data_objects * 4));
+    if (!receiveCRC(crc)) {
+        return read_rest(volts, ma); // Corrupted frame dropped, move on
+    }
+    
+    // Shed load before anything is printed
+    bool alert = !extended && (num_data_objects == 1) && (message_type == MSG_TYPE_ALERT);
+    uint32_t ado = pd_frame[0] | (pd_frame[1] << 8) | (pd_frame[2] << 16) | ((uint32_t)pd_frame[3] << 24);
+    if (alert) {
+        pd_alert_shed(ado);
     }
-    extended = (rx_buf[1] >> 7);
     
     if ((num_data_objects == 0) && (message_type == MSG_TYPE_GET_SINK_CAP)) {
-        Serial1.println("Sink capabilities requested");
-        receiveBytes(rx_buf, 4); // Clear CRC-32
-        send_snk_cap(volts, amps);
-        
-        unsigned long time = millis();
-        while ((getReg(REG_STATUS1) & 0x20) && (millis() < (time + 300))) {}
-        receivePacket();
+        pd_log.println("Sink capabilities requested");
+        send_snk_cap();
         
-        while ((getReg(REG_STATUS1) & 0x20) && (millis() < (time + 3300))) {}
-        read_rest(volts, amps);
+        wait_rx(PD_T_PARTNER_IDLE_MS);
+        read_rest(volts, ma);
         return true;
         
-    } else if ((num_data_objects > 0) && (message_type == 0x1)) {
-        Serial1.println("Source capabilities message received");
-        receiveBytes(rx_buf, (num_data_objects * 4));
+    } else if ((num_data_objects == 0) && (message_type == MSG_TYPE_GET_REVISION) &&
+               (pd_port->spec_revs[SOP_TYPE_SOP] >= PD_SPEC_REV_30)) {
+        pd_log.println("Revision requested");
+        send_revision();
         
-        int index = 0;
-        while (!int_flag) {}
+        wait_rx(PD_T_PARTNER_IDLE_MS);
+        read_rest(volts, ma);
+        return true;
         
-        for (uint8_t i = 0; i < num_data_objects; i++) {
-            uint32_t byte1 = rx_buf[0 + i * 4];
-            uint32_t byte2 = rx_buf[1 + i * 4] << 8;
-            uint32_t byte3 = rx_buf[2 + i * 4] << 16;
-            uint32_t byte4 = rx_buf[3 + i * 4] << 24;
-            int32_t pdo = byte1 | byte2 | byte3 | byte4;
-            
-            if ((pdo >> 30) == 0) { // Fixed supply
-                volt_options[index] = ((pdo >> 10) & 0x3FF) / 20; // Convert to 1V units
-                amp_options[index] = (pdo & 0x3FF); // Keep in 10mA units
-                options_pos[index] = i + 1; // Position 0001 is always safe 5V
-                index++;
-                break;
-            }
-        }
+    } else if ((num_data_objects > 0) && (message_type == 0x1)) {
+        pd_log.println("Source capabilities message received");
         
-        receiveBytes(rx_buf, 4); // CRC-32
-        sel_src_cap(volts, amps);
+        // The source still expects a Request; unless the PDO in use changed
+        // it is the previous one again, so VBUS stays where it is
+        adoptSpecRev(SOP_TYPE_SOP, spec_rev);
+        update_src_caps(pd_frame, num_data_objects);
+        sel_src_cap(volts, ma);
         
-        unsigned long time = millis();
-        while ((getReg(REG_STATUS1) & 0x20) && (millis() < (time + 3300))) {}
-        read_rest(volts, amps);
+        wait_rx(PD_T_PARTNER_IDLE_MS);
+        read_rest(volts, ma);
         return true;
         
     } else if ((num_data_objects > 0) && (message_type == MSG_TYPE_VDM)) {
-        receiveBytes(rx_buf, (num_data_objects * 4));
-        uint8_t command = rx_buf[0] & 0x1F;
-        uint8_t cmd_type = rx_buf[0] >> 6;
-        receiveBytes(rx_buf, 4); // CRC-32
+        // Build the reply before transmitting reuses pd_frame
+        uint8_t objects[PD_MAX_PAYLOAD];
+        uint8_t count = pd_vdm_respond(pd_frame, num_data_objects, objects);
         
-        if ((command == 1) && (cmd_type == 0)) {
-            Serial1.println("Discovery identity request VDM");
-            send_dis_idt_response();
-            
-            unsigned long time = millis();
-            while ((getReg(REG_STATUS1) & 0x20) && (millis() < (time + 300))) {}
-            receivePacket();
-            
-            while ((getReg(REG_STATUS1) & 0x20) && (millis() < (time + 500))) {}
-            read_rest(volts, amps);
-            return true;
-            
-        } else if ((command == 2) && (cmd_type == 0)) {
-            Serial1.println("Discovery SVID request VDM");
-            send_dis_svid_response();
-            
-            unsigned long time = millis();
-            while ((getReg(REG_STATUS1) & 0x20) && (millis() < (time + 300))) {}
-            receivePacket();
+        if (count) {
+            pd_log.print("VDM request, command: ");
+            pd_log.println(objects[0] & 0x1F, DEC);
+            transmitPacket(false, count, MSG_TYPE_VDM, objects);
             
-            while ((getReg(REG_STATUS1) & 0x20) && (millis() < (time + 500))) {}
-            read_rest(volts, amps);
+            wait_rx(PD_T_SENDER_RESPONSE_MS);
+            read_rest(volts, ma);
             return true;
         }
         
-    } else if ((num_data_objects == 0) && (message_type == MSG_TYPE_GET_SOURCE_CAP)) {
-        receiveBytes(rx_buf, 4); // CRC-32
-        Serial1.println("Source capabilities requested from source");
-        sendPacket(false, 0, msg_id, 0, spec_revs[0] - 1, 0, MSG_TYPE_NOT_SUPPORTED, NULL);
-        Serial1.println("Replied with 'not supported'");
+    } else if (alert) {
+        pd_alert_received(ado);
+        transmitPacket(false, 0, MSG_TYPE_GET_STATUS, NULL);
+        
+        wait_rx(PD_T_SENDER_RESPONSE_MS);
+        read_rest(volts, ma);
+        return true;
+        
+    } else if (extended && (num_data_objects > 0) && (message_type == MSG_TYPE_STATUS)) {
+        uint8_t size = PD_EXT_DATA_SIZE(pd_frame[0] | (pd_frame[1] << 8));
+        uint8_t length = num_data_objects * 4 - 2;
+        pd_alert_status(&pd_frame[2], (size < length) ? size : length);
+        read_rest(volts, ma);
+        return true;
+        
+    } else if ((num_data_objects == 0) && (message_type == MSG_TYPE_SOFT_RESET)) {
+        pd_log.println("Soft reset received");
+        pd_reset_begin(PD_RESET_SOFT_RECEIVED);
+        resetMessageIds();
+        transmitPacket(false, 0, MSG_TYPE_ACCEPT, NULL);
+        
+        wait_rx(PD_T_SINK_WAIT_CAP_MS);
+        read_rest(volts, ma);
+        return true;
         
-        unsigned long time = millis();
-        while ((getReg(REG_STATUS1) & 0x20) && (millis() < (time + 300))) {}
-        receivePacket();
-        read_rest(volts, amps);
+    } else if ((num_data_objects == 0) && (message_type == MSG_TYPE_VCONN_SWAP)) {
+        pd_log.println("VCONN swap requested");
+        transmitPacket(false, 0, MSG_TYPE_REJECT, NULL); // Only the flows take VCONN over
+        read_rest(volts, ma);
+        return true;
+        
+    } else if ((num_data_objects == 0) && (message_type == MSG_TYPE_GET_SOURCE_CAP)) {
+        pd_log.println("Source capabilities requested from source");
+        transmitPacket(false, 0, MSG_TYPE_NOT_SUPPORTED, NULL);
+        pd_log.println("Replied with 'not supported'");
+        read_rest(volts, ma);
         return true;
         
     } else if ((num_data_objects == 0) && (message_type == MSG_TYPE_GET_SOURCE_CAP_EXT)) {
-        receiveBytes(rx_buf, 4); // CRC-32
         // Extended source cap request handling (commented for speed optimization)
-        read_rest(volts, amps);
+        read_rest(volts, ma);
         return true;
         
     } else {
-        Serial1.println("Miscellaneous message detected");
-        Serial1.print("Extended: ");
-        Serial1.println(extended);
-        Serial1.print("Number of data objects: ");
-        Serial1.println(num_data_objects);
-        Serial1.print("Message type: ");
-        Serial1.println(message_type);
+        pd_log.println("Miscellaneous message detected");
+        pd_log.print("Extended: ");
+        pd_log.println(extended);
+        pd_log.print("Number of data objects: ");
+        pd_log.println(num_data_objects);
+        pd_log.print("Message type: ");
+        pd_log.println(message_type);
         
-        receiveBytes(rx_buf, 4); // CRC-32
-        unsigned long time = millis();
-        while ((getReg(REG_STATUS1) & 0x20) && (millis() < (time + 3300))) {}
-        read_rest(volts, amps);
+        wait_rx(PD_T_PARTNER_IDLE_MS);
+        read_rest(volts, ma);
         return true;
     }
     return true;
@@ -902,45 +1203,197 @@ bool read_rest(int volts, int amps) {
 void reset_fusb() {
     setReg(REG_RESET, 0x01); // Reset FUSB302
     setReg(REG_POWER, 0x0F); // Full power
-    setReg(REG_CONTROL1, 0x04); // Flush RX
+    flushRx();
     setReg(REG_CONTROL0, 0x00); // Disable all interrupt masks
     setReg(REG_MASK, 0x77); // Mask all interrupts except VBUSOK
     setReg(0x02, 0x03); // Enable both pull-downs (enables attach detection)
-    setReg(REG_CONTROL2, 0x20); // Turn off auto GoodCRC and set power/data roles to SNK
+    setReg(REG_SWITCHES1, 0x20); // Turn off auto GoodCRC and set power/data roles to SNK
+    setReg(REG_CONTROL3, (CONTROL3_AUTO_RETRY | CONTROL3_N_RETRIES(PD_N_RETRIES)));
+    pd_port->vconn_source = false; // The reset dropped VCONN
+    resetMessageIds();
+    resetSpecRevs();
+    exit_epr_mode();
+    pd_vdm_reset();
+    pd_vbus_reset();
+}
+
+/**
+ * Read STATUS0A..INTERRUPT in a single I2C burst
+ */
+void readIrqSnapshot(pd_irq_snapshot_t *snap) {
+    uint8_t regs[7];
+    
+    getRegs(REG_STATUS0A, regs, 7);
+    snap->status0a = regs[0];
+    snap->status1a = regs[1];
+    snap->interrupta = regs[2];
+    snap->interruptb = regs[3];
+    snap->status0 = regs[4];
+    snap->status1 = regs[5];
+    snap->interrupt = regs[6];
+}
+
+/**
+ * Decode a snapshot into an event set
+ */
+pd_event_set_t decodeIrqSnapshot(const pd_irq_snapshot_t *snap) {
+    pd_event_set_t events = snap->interrupta;
+    events |= ((pd_event_set_t)(snap->interruptb & INTERRUPTB_I_GCRCSENT) << 8);
+    events |= ((pd_event_set_t)snap->interrupt << 16);
+    
+    if (snap->interrupt & INTERRUPT_I_ALERT) {
+        if (snap->status1 & STATUS1_RX_FULL) {
+            events |= PD_EVT_RX_FULL;
+        }
+        if (snap->status1 & STATUS1_TX_FULL) {
+            events |= PD_EVT_TX_FULL;
+        }
+    }
+    return events;
+}
+
+/**
+ * Take a snapshot and accumulate its events. The interrupt registers clear on
+ * read, so every reader goes through here and nothing is lost.
+ */
+pd_event_set_t pollEvents() {
+    readIrqSnapshot(&pd_port->irq_status);
+    pd_port->pending_events |= decodeIrqSnapshot(&pd_port->irq_status);
+    return pd_port->pending_events;
+}
+
+/**
+ * Consume pending events
+ */
+pd_event_set_t takeEvents(pd_event_set_t mask) {
+    pd_event_set_t taken = pd_port->pending_events & mask;
+    pd_port->pending_events &= ~mask;
+    return taken;
 }
 
 /**
  * Check and process interrupts
  */
 void check_interrupt() {
-    uint8_t i_reg = getReg(REG_INTERRUPT);
-    bool i_alert = i_reg & 0x8;
-    bool i_vbusok = i_reg >> 7;
-    bool vbusok = getReg(REG_STATUS0) >> 7;
-    
-    if (i_vbusok) {
-        if (vbusok) {
-            if (!attached) {
-                new_attach = true;
-                Serial1.println("NEW ATTACH");
+    pollEvents();
+    
+    // TX results belong to awaitTxResult()
+    pd_event_set_t events = takeEvents(~PD_EVT_TX_MASK);
+    
+    if (events & PD_EVT_HARD_RESET) {
+        handleHardResetReceived();
+    }
+    if (events & PD_EVT_SOFT_RESET) {
+        pd_stats_inc(PD_CNT_SOFT_RESETS_RX);
+    }
+    if (events & PD_EVT_RX_FULL) {
+        handleRxOverflow();
+    }
+    if (events & PD_EVT_TX_FULL) {
+        pd_log.println("TX FIFO full");
+    }
+    if (events & PD_EVT_OCP_TEMP) {
+        pd_log.print("Over-current/over-temperature, STATUS1: 0x");
+        pd_log.println(pd_port->irq_status.status1, HEX);
+        pd_cb_alert(PD_CB_ALERT_OCP_TEMP, pd_port->irq_status.status1);
+    }
+    if (events & PD_EVT_COMP_CHANGE) {
+        handleCompChange(pd_port->irq_status.status0 & STATUS0_COMP);
+    }
+    if (events & PD_EVT_TOGGLE_DONE) {
+        handleToggleDone((pd_port->irq_status.status1a >> 3) & 0x07);
+        events |= takeEvents(PD_EVT_VBUS_CHANGE); // Raised by exit_idle_toggle()
+    }
+    
+    if (events & PD_EVT_VBUS_CHANGE) {
+        if (pd_port->attached && pd_reset_vbus_change(pd_port->irq_status.status0 & STATUS0_VBUSOK)) {
+            // VBUS cycled by a Hard Reset: the source is still there
+        } else if (pd_port->irq_status.status0 & STATUS0_VBUSOK) {
+            if (!pd_port->attached) {
+                pd_port->new_attach = true;
+                pd_log.println("NEW ATTACH");
+                pd_cb_attach();
             } else {
-                new_attach = false;
+                pd_port->new_attach = false;
             }
-            attached = true;
+            pd_port->attached = true;
         } else {
-            attached = false;
-            Serial1.println("DETACHED");
+            if (pd_port->attached) {
+                pd_cb_detach(false);
+            }
+            pd_port->attached = false;
+            pd_port->cc_oriented = false;
+            pd_reset_clear();
+            pd_log.println("DETACHED");
         }
-    } else if (i_alert) {
-        Serial1.println("TX_FULL or RX_FULL, alert interrupt");
     } else {
-        Serial1.println("Interrupt triggered but VBUSOK=0 and alert=0");
-        if (attached) {
-            new_attach = false;
+        if (!events) {
+            pd_log.println("Interrupt triggered but no events pending");
+        }
+        if (pd_port->attached) {
+            pd_port->new_attach = false;
         }
     }
 }
 
+/**
+ * Protocol layer response to a received hard reset
+ */
+void handleHardResetReceived() {
+    pd_log.println("Hard reset received");
+    pd_stats_inc(PD_CNT_HARD_RESETS_RX);
+    pd_cb_error(PD_CB_ERR_HARD_RESET, 0);
+    pd_reset_begin(PD_RESET_HARD_RECEIVED);
+    set_vconn(false); // VCONN returns to the source
+    resetMessageIds();
+    resetSpecRevs();
+    exit_epr_mode();
+    pd_vdm_reset();
+    pd_port->vbus_ok = false; // VBUS goes to vSafe0V
+    setReg(REG_CONTROL0, (getReg(REG_CONTROL0) | CONTROL0_TX_FLUSH));
+    flushRx();
+}
+
+/**
+ * Protocol layer response to an RX FIFO overflow. The FIFO may now hold a
+ * truncated frame, so it is flushed and the partner's retry is relied upon.
+ */
+void handleRxOverflow() {
+    pd_log.println("RX FIFO full - flushing");
+    pd_stats_inc(PD_CNT_RX_OVERFLOWS);
+    flushRx();
+}
+
+/**
+ * Response to the measure comparator changing state
+ */
+void handleCompChange(bool comp) {
+    if (pd_vbus_comp_changed(comp)) {
+        pd_log.print("VBUS crossed the monitor threshold, now ");
+        pd_log.println(comp ? "above" : "below");
+        pd_cb_alert(PD_CB_ALERT_VBUS, comp);
+    }
+}
+
+/**
+ * Response to the autonomous toggle state machine finding a partner
+ */
+void handleToggleDone(uint8_t togss) {
+    pd_log.print("Toggle done, TOGSS: ");
+    pd_log.println(togss, BIN);
+    
+    if (pd_port->power_state != PD_POWER_IDLE) {
+        return;
+    }
+    if (togss == TOGSS_SNK_CC1) {
+        exit_idle_toggle(1);
+    } else if (togss == TOGSS_SNK_CC2) {
+        exit_idle_toggle(2);
+    } else {
+        enter_idle_toggle(); // Not a source we can sink from, keep toggling
+    }
+}
+
 /**
  * Determine CC line orientation
  */
@@ -949,46 +1402,198 @@ void orient_cc() {
     unsigned long time = millis();
     while (millis() < (time + 150)) {}
     
-    meas_cc1 = getReg(REG_STATUS0) & 3;
-    Serial1.print("BC level after measuring CC1: ");
-    Serial1.println(meas_cc1, BIN);
+    pd_port->meas_cc1 = getReg(REG_STATUS0) & 3;
+    pd_log.print("BC level after measuring CC1: ");
+    pd_log.println(pd_port->meas_cc1, BIN);
     
     setReg(0x02, 0x0B); // Switch to measuring CC2
     time = millis();
     while (millis() < (time + 150)) {}
     
-    meas_cc2 = getReg(REG_STATUS0) & 3;
-    Serial1.print("BC level after measuring CC2: ");
-    Serial1.println(meas_cc2, BIN);
+    pd_port->meas_cc2 = getReg(REG_STATUS0) & 3;
+    pd_log.print("BC level after measuring CC2: ");
+    pd_log.println(pd_port->meas_cc2, BIN);
     
-    if (meas_cc1 > meas_cc2) {
-        cc_line = 1;
-        vconn_line = 2;
+    if (pd_port->meas_cc1 > pd_port->meas_cc2) {
+        pd_port->cc_line = 1;
+        pd_port->vconn_line = 2;
     } else {
-        cc_line = 2;
-        vconn_line = 1;
+        pd_port->cc_line = 2;
+        pd_port->vconn_line = 1;
+    }
+}
+
+/**
+ * Switch VCONN and SOP'/SOP'' reception together
+ */
+void set_vconn(bool on) {
+    if (!PD_VCONN_SOURCE || (on == pd_port->vconn_source)) {
+        return;
+    }
+    uint8_t vconn = (pd_port->vconn_line == 1) ? SWITCHES0_VCONN_CC1 : SWITCHES0_VCONN_CC2;
+    uint8_t switches = getReg(REG_SWITCHES0) & ~(SWITCHES0_VCONN_CC1 | SWITCHES0_VCONN_CC2);
+    uint8_t control = getReg(REG_CONTROL1) & ~(CONTROL1_ENSOP1 | CONTROL1_ENSOP2 | CONTROL1_RX_FLUSH);
+    
+    // Listening to the plugs while the source powers them would GoodCRC
+    // the source's own cable traffic
+    if (on) {
+        setReg(REG_SWITCHES0, switches | vconn);
+        setReg(REG_CONTROL1, control | CONTROL1_ENSOP1 | CONTROL1_ENSOP2);
+    } else {
+        setReg(REG_CONTROL1, control);
+        setReg(REG_SWITCHES0, switches);
+    }
+    pd_port->vconn_source = on;
+    pd_log.print(on ? "VCONN on CC" : "VCONN off CC");
+    pd_log.println(pd_port->vconn_line);
+}
+
+/**
+ * Move the current power state's elapsed time into power_stats
+ */
+void update_power_stats() {
+    unsigned long now = millis();
+    
+    if (pd_port->power_state == PD_POWER_IDLE) {
+        pd_port->power_stats.idle_ms += (now - pd_port->power_state_since);
+    } else {
+        pd_port->power_stats.active_ms += (now - pd_port->power_state_since);
+    }
+    pd_port->power_state_since = now;
+}
+
+static void set_power_state(pd_power_state_t state) {
+    update_power_stats();
+    pd_port->power_state = state;
+}
+
+/**
+ * Average modelled FUSB302B current since boot
+ */
+uint32_t avg_current_ua() {
+    update_power_stats();
+    
+    uint32_t total_ms = pd_port->power_stats.idle_ms + pd_port->power_stats.active_ms;
+    if (total_ms == 0) {
+        return PD_IDD_ACTIVE_UA;
+    }
+    uint64_t charge = ((uint64_t)pd_port->power_stats.idle_ms * PD_IDD_TOGGLE_UA) +
+                      ((uint64_t)pd_port->power_stats.active_ms * PD_IDD_ACTIVE_UA);
+    return (uint32_t)(charge / total_ms);
+}
+
+/**
+ * Hand attach detection to the FUSB302B toggle state machine
+ */
+void enter_idle_toggle() {
+    setReg(REG_CONTROL2, 0x00); // Stop toggling before reconfiguring
+    setReg(REG_SWITCHES0, 0x00); // Toggle logic drives the CC terminations
+    setReg(REG_MASK, 0xFF);
+    setReg(REG_MASKA, (uint8_t)~INTERRUPTA_I_TOGDONE); // Only wake on toggle done
+    setReg(REG_MASKB, INTERRUPTB_I_GCRCSENT);
+    setReg(REG_POWER, POWER_BANDGAP_WAKE); // Enough for toggle, everything else off
+    
+    // Discard anything latched while attached
+    pollEvents();
+    pd_port->pending_events = 0;
+    
+    setReg(REG_CONTROL2, (CONTROL2_TOGGLE | CONTROL2_MODE_SNK | CONTROL2_TOG_RD_ONLY |
+                          CONTROL2_TOG_SAVE_PWR(PD_TOG_SAVE_PWR)));
+    pd_port->cc_oriented = false;
+    pd_port->wake_awaiting_rx = false;
+    set_power_state(PD_POWER_IDLE);
+    pd_log.println("Idle: toggling for attach");
+}
+
+/**
+ * Power internal blocks back up after toggle found a source
+ */
+void exit_idle_toggle(int cc) {
+    setReg(REG_CONTROL2, 0x00);
+    setReg(REG_POWER, POWER_ALL);
+    setReg(REG_SWITCHES0, (SWITCHES0_PDWN1 | SWITCHES0_PDWN2 |
+                           ((cc == 1) ? SWITCHES0_MEAS_CC1 : SWITCHES0_MEAS_CC2)));
+    setReg(REG_MASK, 0x77); // Mask all interrupts except VBUSOK and alert
+    setReg(REG_MASKA, 0x00);
+    setReg(REG_MASKB, 0x00);
+    
+    // Toggle already resolved the orientation, orient_cc() is not needed
+    pd_port->cc_line = cc;
+    pd_port->vconn_line = 3 - cc;
+    pd_port->cc_oriented = true;
+    
+    set_power_state(PD_POWER_ACTIVE);
+    pd_port->power_stats.attach_wakeups++;
+    pd_port->toggle_done_ms = millis();
+    pd_port->wake_time_us = int_time_us;
+    pd_port->wake_awaiting_rx = true;
+    
+    // VBUSOK may have risen while masked, have check_interrupt() evaluate it
+    pd_port->irq_status.status0 = getReg(REG_STATUS0);
+    pd_port->pending_events |= PD_EVT_VBUS_CHANGE;
+    pd_log.print("Wake: source on CC");
+    pd_log.println(cc);
+}
+
+/**
+ * Sleep core 1 until the INT_N GPIO fires. The ISR issues SEV, so an edge
+ * landing between the check and the WFE still wakes us.
+ */
+void sleep_until_irq() {
+    unsigned long start = millis();
+    
+    while (!int_flag && digitalRead(PD_INT_PIN) && !pd_vdm_attention_pending() &&
+           !(pd_port->attached && pd_cb_request_pending())) {
+#if PD_WATCHDOG_MS
+        // Wake up in time to feed the watchdog
+        best_effort_wfe_or_timeout(make_timeout_time_ms(PD_WATCHDOG_MS / 2));
+        pd_watchdog_feed();
+#else
+        __wfe();
+#endif
+    }
+    pd_port->power_stats.sleep_ms += (millis() - start);
+    if (pd_port->power_state == PD_POWER_IDLE) {
+        pd_port->power_stats.wakeups++;
     }
 }
 
+/**
+ * Idle-time work for loop1() when no interrupt is pending
+ */
+void service_idle() {
+    if (pd_port->cc_oriented && !pd_port->attached) {
+        // Toggle found a source but VBUS has not come up yet
+        if ((millis() - pd_port->toggle_done_ms) > PD_VBUS_ON_TIMEOUT_MS) {
+            pd_log.println("No VBUS after toggle - resuming idle");
+            pd_stats_inc(PD_CNT_TIMEOUT_VBUS_ON);
+            enter_idle_toggle();
+        }
+        return;
+    }
+    sleep_until_irq();
+}
+
 /**
  * Enable transmission on specified CC line
  */
 void enable_tx_cc(int cc, bool autocrc) {
+    pd_port->auto_crc = autocrc;
     if (cc == 1) {
         setReg(0x02, 0x07); // Switch on MEAS_CC1
-        setReg(REG_CONTROL1, 0x04); // Flush RX
+        flushRx();
         if (autocrc) {
-            setReg(REG_CONTROL2, 0x25); // Enable BMC TX on CC1, auto CRC ON
+            setReg(REG_SWITCHES1, 0x25); // Enable BMC TX on CC1, auto CRC ON
         } else {
-            setReg(REG_CONTROL2, 0x21); // Enable BMC TX on CC1, auto CRC OFF
+            setReg(REG_SWITCHES1, 0x21); // Enable BMC TX on CC1, auto CRC OFF
         }
     } else if (cc == 2) {
         setReg(0x02, 0x0B); // Switch on MEAS_CC2
-        setReg(REG_CONTROL1, 0x04); // Flush RX
+        flushRx();
         if (autocrc) {
-            setReg(REG_CONTROL2, 0x26); // Enable BMC TX on CC2, auto CRC ON
+            setReg(REG_SWITCHES1, 0x26); // Enable BMC TX on CC2, auto CRC ON
         } else {
-            setReg(REG_CONTROL2, 0x22); // Enable BMC TX on CC2, auto CRC OFF
+            setReg(REG_SWITCHES1, 0x22); // Enable BMC TX on CC2, auto CRC OFF
         }
     }
 }
@@ -996,133 +1601,281 @@ void enable_tx_cc(int cc, bool autocrc) {
 /**
  * Initialize power delivery negotiation
  */
-bool pd_init(int volts, int amps) {
-    while (getReg(REG_STATUS1) & 0x20) {} // Wait while FIFO RX is empty
-    read_pdo();
-    
-    unsigned long time = millis();
-    if (sel_src_cap(volts, amps)) {
-        while ((getReg(REG_STATUS1) & 0x20) && (millis() < (time + 3300))) {}
-        read_rest(volts, amps);
+bool pd_init(int volts, int ma) {
+    // After recognition's hard reset the source cycles VBUS before it advertises again
+    bool hard_reset = (pd_reset_phase() >= PD_RESET_HARD);
+    req_refusal = 0;
+    if (!wait_rx(hard_reset ? PD_T_HARD_RESET_CAP_MS : PD_T_SINK_WAIT_CAP_MS)) {
+        pd_log.println("No response received - read PDO");
+        pd_stats_inc(PD_CNT_TIMEOUT_SINK_WAIT_CAP);
+        return false;
     }
-    
+    if (!read_pdo() || !sel_src_cap(volts, ma)) {
+        return false;
+    }
+    wait_rx(PD_T_PARTNER_IDLE_MS);
+    read_rest(volts, ma);
     return true;
 }
 
 /**
  * Renegotiate power delivery after initialization
  */
-bool reneg_pd(int volts, int amps) {
-    setReg(REG_CONTROL1, 0x04); // Flush RX
-    get_src_cap();
-    sel_src_cap(volts, amps);
-    return true;
+bool reneg_pd(int volts, int ma) {
+    if (!pd_port->num_src_pdos) {
+        flushRx();
+        get_src_cap();
+    }
+    return request_supply(request_for(volts, ma));
 }
 
 /**
  * Recognize connected device type
  */
-void recog_dev(int volts, int amps) {
-    Serial1.println("(Spec Rev 3)");
-    spec_revs[0] = 3; // Temporarily switch to spec rev 3
-    pd_init(volts, amps);
-    
-    sendPacket(false, 0, msg_id, 0, spec_revs[0] - 1, 0, MSG_TYPE_GET_SOURCE_CAP_EXT, NULL);
-    Serial1.println("Requested extended source capabilities");
+void recog_dev(int volts, int ma) {
+    pd_init(volts, ma);
+    
+    // Extended messages only exist from PD 3.0, as the source's header says
+    tx_result_t result = TX_RESULT_FAILED;
+    if (pd_port->spec_revs[SOP_TYPE_SOP] >= PD_SPEC_REV_30) {
+        result = transmitPacket(false, 0, MSG_TYPE_GET_SOURCE_CAP_EXT, NULL);
+        pd_log.println("Requested extended source capabilities");
+    }
     
-    unsigned long time = millis();
-    while ((getReg(REG_STATUS1) & 0x20) && (millis() < (time + 500))) {}
-    receivePacket(); // For GoodCRC
-    
-    while ((getReg(REG_STATUS1) & 0x20) && (millis() < (time + 500))) {}
-    if (read_ext_src_cap()) {
-        Serial1.print("VID & PID registered successfully ---> ");
-        switch (dev_type) {
-            case 0:
-                Serial1.println("charger");
-                break;
-            case 1:
-                Serial1.println("monitor");
-                break;
-            case 2:
-                Serial1.println("tablet");
-                break;
-            case 3:
-                Serial1.println("laptop/computer");
-                break;
-        }
+    if ((result == TX_RESULT_SENT) && wait_rx(PD_T_SENDER_RESPONSE_MS) && read_ext_src_cap()) {
+        pd_log.print("VID & PID registered successfully ---> ");
+        print_dev_type();
     } else {
-        Serial1.println("VID & PID detection failed, defaulting device type to --> charger");
-        dev_type = 0;
+        classify_dev_type();
     }
     
-    setReg(REG_CONTROL3, 0x40);
-    Serial1.println("Hard reset sent");
+    send_hard_reset();
+}
+
+/**
+ * Signal Hard Reset and reset the protocol layer
+ */
+void send_hard_reset() {
+    setReg(REG_CONTROL3, (getReg(REG_CONTROL3) | CONTROL3_SEND_HARD_RESET));
+    dropHeldFrame();
+    set_vconn(false); // VCONN returns to the source
+    resetMessageIds();
+    resetSpecRevs();
+    exit_epr_mode();
+    pd_vdm_reset();
+    pd_port->vbus_ok = false; // VBUS goes to vSafe0V
+    pd_stats_inc(PD_CNT_HARD_RESETS_TX);
+    pd_cb_error(PD_CB_ERR_HARD_RESET, 1);
+    pd_reset_begin(PD_RESET_HARD_SENT);
+    pd_log.println("Hard reset sent");
+}
+
+/**
+ * Drop the partner and toggle for a fresh attach
+ */
+void detach_port() {
+    pd_log.println("Recovery: detaching");
+    pd_stats_inc(PD_CNT_RECOVERY_DETACHES);
+    if (pd_port->attached) {
+        pd_cb_detach(true);
+    }
+    pd_port->attached = false;
+    pd_port->new_attach = false;
+    pd_reset_clear();
+    reset_fusb();
+    enter_idle_toggle();
+}
+
+/**
+ * Climb the recovery ladder: Soft_Reset, Hard Reset, detach
+ */
+bool recover_contract(int volts, int ma) {
+    pd_port->recovery = PD_RECOVER_SOFT_RESET;
+    pd_log.println("Recovery: soft reset");
+    resetMessageIds(); // Soft_Reset goes out as MessageID 0
+    pd_stats_inc(PD_CNT_SOFT_RESETS_TX);
+    pd_reset_begin(PD_RESET_SOFT_SENT);
+    if ((transmitPacket(false, 0, MSG_TYPE_SOFT_RESET, NULL) == TX_RESULT_SENT) &&
+        wait_rx(PD_T_SENDER_RESPONSE_MS) && get_req_outcome() &&
+        wait_rx(PD_T_SINK_WAIT_CAP_MS) && read_pdo() && sel_src_cap(volts, ma)) {
+        return true;
+    }
     
-    spec_revs[0] = 2;
-    Serial1.println("(Spec Rev 2)");
+    pd_port->recovery = PD_RECOVER_HARD_RESET;
+    pd_log.println("Recovery: hard reset");
+    send_hard_reset();
+    if (wait_rx(PD_T_HARD_RESET_CAP_MS) && read_pdo() && sel_src_cap(volts, ma)) {
+        return true;
+    }
+    
+    pd_port->recovery = PD_RECOVER_DETACH;
+    detach_port();
+    return false;
+}
+
+/**
+ * Renegotiate for a power request left by the application, false if none
+ */
+bool service_power_request() {
+    int volts;
+    int ma;
+    
+    if (!pd_port->attached || !pd_cb_take_request(&volts, &ma)) {
+        return false;
+    }
+    pd_log.print("Application requested ");
+    pd_log.print(volts);
+    pd_log.print("V at ");
+    pd_log.print(ma);
+    pd_log.println("mA");
+    reneg_pd(volts, ma); // A refusal leaves the contract in place
+    return true;
+}
+
+/**
+ * Arm the hardware watchdog
+ */
+void pd_watchdog_begin() {
+#if PD_WATCHDOG_MS
+    if (watchdog_caused_reboot()) {
+        // Whatever hung core 1 may be the recognition dance itself
+        pd_log.println("Restarted by watchdog - skipping recognition");
+        for (int i = 0; i < PD_NUM_PORTS; i++) {
+            pd_ports[i].recovery = PD_RECOVER_DETACH;
+        }
+    }
+    watchdog_enable(PD_WATCHDOG_MS, true); // Paused while a debugger halts the cores
+#endif
+}
+
+/**
+ * Feed the hardware watchdog
+ */
+void pd_watchdog_feed() {
+#if PD_WATCHDOG_MS
+    watchdog_update();
+#endif
 }
 
 /**
  * Interrupt service routine flag setter
  */
 void InterruptFlagger(uint gpio, uint32_t events) {
+    int_time_us = micros();
     int_flag = true;
+    __sev();
 }
 
 /**
  * Arduino setup function (core 0)
  */
 void setup() {
-    // Core 0 setup if needed
+    Serial1.begin(115200); // Written only by core 0, see pd_log_drain()
 }
 
 /**
  * Arduino setup function (core 1)
  */
 void setup1() {
-    Serial1.begin(115200);
     Wire.begin();
-    pinMode(6, INPUT_PULLUP); // Interrupt pin from FUSB302B
-    gpio_set_irq_enabled_with_callback(6, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, 
+    pinMode(PD_INT_PIN, INPUT_PULLUP); // Interrupt pin from FUSB302B
+    int_flag = false;
+    gpio_set_irq_enabled_with_callback(PD_INT_PIN, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, 
                                        true, &InterruptFlagger);
     
+    for (int i = 0; i < PD_NUM_PORTS; i++) {
+        pd_port_init(&pd_ports[i]);
+        pd_stats_reset(i);
+#if PD_USE_FLOWS
+        pd_sched_init(&port_flows[i].sched);
+#endif
+    }
+    pd_watchdog_begin();
+    
     delay(150);
     reset_fusb();
+    enter_idle_toggle();
 }
 
 /**
  * Arduino main loop (core 0)
  */
 void loop() {
-    // Core 0 main loop if needed
+    // Housekeeping: callbacks and the log, off the PD timing path
+    pd_cb_dispatch(PD_CB_DISPATCH_BUDGET_US);
+    pd_log_drain(Serial1);
 }
 
 /**
  * Arduino main loop (core 1)
  */
 void loop1() {
+#if PD_USE_FLOWS
+    pd_port_flows_t *flows = &port_flows[pd_port - pd_ports];
+#endif
+    pd_watchdog_feed();
+    pd_stats_sync_bus();
     if (int_flag) {
+        int_flag = false;
         check_interrupt(); // Process attach/detach events
         
-        if (attached && new_attach) {
-            orient_cc();
-            enable_tx_cc(cc_line, true);
-            recog_dev(5, 0.5);
-            
-            reset_fusb();
-            enable_tx_cc(cc_line, true);
-            pd_init(5, 0.5);
+        if (pd_port->attached && pd_port->new_attach) {
+            if (!pd_port->cc_oriented) {
+                orient_cc();
+            }
+            enable_tx_cc(pd_port->cc_line, true);
+#if PD_USE_FLOWS
+            // Recognition, negotiation and the responder run as flows
+            pd_sched_init(&flows->sched);
+            pd_flow_start(&flows->sched, pd_flow_attach_init(&flows->attach, PD_CONTRACT_V, PD_CONTRACT_MA,
+                                                                &flows->responder));
+#else
+            if (pd_port->recovery == PD_RECOVER_NONE) {
+                recog_dev(5, 500);
+                
+                reset_fusb();
+                enable_tx_cc(pd_port->cc_line, true);
+            }
+            if (!pd_init(PD_CONTRACT_V, PD_CONTRACT_MA) && !req_refusal) {
+                recover_contract(PD_CONTRACT_V, PD_CONTRACT_MA);
+            }
             
-            Serial1.println("-------------------------------------");
+            pd_log.println("-------------------------------------");
+#endif
             
             // Optional: Renegotiate to higher power after delay
             // delay(5000);
-            // reneg_pd(20, 1);
-        } else if (!attached) {
+            // reneg_pd(20, 1000);
+        } else if (pd_port->attached && pd_reset_take_restart()) {
+            // The source restarts after its Hard Reset: wait for its
+            // capabilities and make the contract again, without recognition
+            pd_port->recovery = PD_RECOVER_HARD_RESET;
+#if PD_USE_FLOWS
+            pd_sched_stop_all(&flows->sched);
+            pd_flow_start(&flows->sched, pd_flow_attach_init(&flows->attach, PD_CONTRACT_V, PD_CONTRACT_MA,
+                                                                &flows->responder));
+#else
+            req_refusal = 0;
+            if (!(wait_rx(PD_T_HARD_RESET_CAP_MS) && read_pdo() && sel_src_cap(PD_CONTRACT_V, PD_CONTRACT_MA)) &&
+                !req_refusal) {
+                recover_contract(PD_CONTRACT_V, PD_CONTRACT_MA);
+            }
+#endif
+        } else if (!pd_port->attached && !pd_port->cc_oriented && (pd_port->power_state == PD_POWER_ACTIVE)) {
+#if PD_USE_FLOWS
+            pd_sched_stop_all(&flows->sched);
+#endif
             reset_fusb();
+            enter_idle_toggle();
         }
-        
-        int_flag = false;
     }
+#if PD_USE_FLOWS
+    else if (!pd_sched_run(&flows->sched)) {
+        service_idle();
+    }
+#else
+    else if (!service_power_request()) {
+        service_idle();
+    }
+#endif
 }
@@ -0,0 +1,28 @@
+#include "FUSB302B.h"
+
+// Port contexts; loop1() services the port pd_port points at
+PD_TLS pd_port_t pd_ports[PD_NUM_PORTS] = {};
+PD_TLS pd_port_t *pd_port = &pd_ports[0];
+
+// One frame is assembled or drained at a time, whichever port it belongs to
+PD_TLS uint8_t pd_frame[PD_FRAME_MAX];
+
+static_assert(sizeof(power_option_t) <= 4, "power_option_t is no longer packed");
+static_assert(sizeof(pd_spec_rev_t) == 2, "pd_spec_rev_t is no longer packed");
+static_assert(sizeof(pd_port_t) <= PD_PORT_RAM_BUDGET, "pd_port_t exceeds PD_PORT_RAM_BUDGET");
+static_assert(PD_FRAME_MAX <= FUSB_RX_FIFO_SIZE, "frame arena larger than the RX FIFO");
+PD_SIZE_NOTE(pd_port_t)
+
+/**
+ * Reset a port context to its power-on state
+ */
+void pd_port_init(pd_port_t *port) {
+    *port = pd_port_t();
+    for (int i = 0; i < PD_NUM_SOP; i++) {
+        port->spec_revs[i] = PD_SPEC_REV_OURS;
+    }
+    port->cc_line = 1;
+    port->vconn_line = 2;
+    port->auto_crc = true;
+    port->power_state = PD_POWER_ACTIVE;
+}
@@ -0,0 +1,97 @@
+#include <Arduino.h>
+#include "PD_Reset.h"
+#include "PD_Stats.h"
+#include "PD_Log.h"
+
+/**
+ * @brief Reset in progress on one port
+ */
+typedef struct {
+    pd_reset_phase_t phase;
+    bool restart;                   ///< Source's Hard Reset not yet picked up by loop1()
+    uint32_t start_ms;              ///< millis() at the reset
+} pd_reset_state_t;
+
+static PD_TLS pd_reset_state_t reset_states[PD_NUM_PORTS];
+
+static pd_reset_state_t *current() {
+    return &reset_states[pd_port - pd_ports];
+}
+
+/**
+ * Start tracking a reset
+ */
+void pd_reset_begin(pd_reset_kind_t kind) {
+    pd_reset_state_t *state = current();
+    bool hard = (kind == PD_RESET_HARD_SENT) || (kind == PD_RESET_HARD_RECEIVED);
+
+    state->phase = hard ? PD_RESET_HARD : PD_RESET_SOFT;
+    state->restart = (kind == PD_RESET_HARD_RECEIVED);
+    state->start_ms = millis();
+}
+
+/**
+ * Claim VBUSOK edges that belong to a Hard Reset
+ */
+bool pd_reset_vbus_change(bool vbus_ok) {
+    pd_reset_state_t *state = current();
+
+    if (!vbus_ok && (state->phase == PD_RESET_HARD) &&
+        ((millis() - state->start_ms) <= PD_T_HARD_RESET_VBUS_OFF_MS)) {
+        pd_log.println("VBUS off after hard reset");
+        state->phase = PD_RESET_VBUS_OFF;
+        pd_stats_inc(PD_CNT_RESET_VBUS_CYCLES);
+        return true;
+    }
+    if (vbus_ok && (state->phase == PD_RESET_VBUS_OFF)) {
+        pd_log.println("VBUS back after hard reset");
+        state->phase = PD_RESET_WAIT_CAPS;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Take the restart left by the source's Hard Reset
+ */
+bool pd_reset_take_restart() {
+    pd_reset_state_t *state = current();
+    bool restart = state->restart;
+    state->restart = false;
+    return restart;
+}
+
+/**
+ * Record the reset-to-contract time
+ */
+void pd_reset_contract() {
+    pd_reset_state_t *state = current();
+    if (state->phase == PD_RESET_IDLE) {
+        return;
+    }
+    uint32_t elapsed_ms = millis() - state->start_ms;
+    state->phase = PD_RESET_IDLE;
+    pd_stats_set(PD_CNT_RESET_RECOVERY_MS, elapsed_ms);
+    if (elapsed_ms > pd_stats_get(pd_port - pd_ports, PD_CNT_RESET_RECOVERY_MAX_MS)) {
+        pd_stats_set(PD_CNT_RESET_RECOVERY_MAX_MS, elapsed_ms);
+    }
+    pd_log.print("Contract restored ");
+    pd_log.print(elapsed_ms);
+    pd_log.println(" ms after the reset");
+}
+
+/**
+ * Forget the reset in progress
+ */
+void pd_reset_clear() {
+    pd_reset_state_t *state = current();
+    state->phase = PD_RESET_IDLE;
+    state->restart = false;
+}
+
+/**
+ * Phase of the current port
+ */
+pd_reset_phase_t pd_reset_phase() {
+    return current()->phase;
+}
@@ -0,0 +1,91 @@
+#ifndef PD_RESET_H
+#define PD_RESET_H
+
+#include <stdint.h>
+#include "FUSB302B.h"
+
+//=============================================================================
+// Reset Handling
+//=============================================================================
+
+// Hard Reset and Soft_Reset in both directions, tracked per port from the
+// reset to the next explicit contract.
+//
+// A Hard Reset, ours or the source's, takes VBUS to vSafe0V within
+// tPSHardReset + tSafe0V and back to vSafe5V after tSrcRecover + tSrcTurnOn,
+// then the source advertises again. The VBUSOK edges of that sequence are
+// not an unplug: check_interrupt() hands them to pd_reset_vbus_change(),
+// which keeps the port attached. After a Hard Reset from the source the
+// port's negotiation is restarted without recognition and waits up to
+// PD_T_HARD_RESET_CAP_MS for Source_Capabilities. A Soft_Reset from the
+// source resets the MessageID counters and is accepted; the source then
+// advertises again.
+//
+// Source_Capabilities are kept across both resets, so when the source comes
+// back with the same set the cached Request goes out again without running
+// the selection. The time from each reset to the contract that follows is
+// kept in PD_CNT_RESET_RECOVERY_MS and its maximum.
+
+/**
+ * @brief Reset kinds
+ */
+typedef enum : uint8_t {
+    PD_RESET_HARD_SENT = 0,         ///< Hard Reset we signalled
+    PD_RESET_HARD_RECEIVED,         ///< Hard Reset signalled by the source
+    PD_RESET_SOFT_SENT,             ///< Soft_Reset we sent (recovery ladder)
+    PD_RESET_SOFT_RECEIVED          ///< Soft_Reset from the source
+} pd_reset_kind_t;
+
+/**
+ * @brief Where a port is between a reset and its next contract
+ */
+typedef enum : uint8_t {
+    PD_RESET_IDLE = 0,              ///< No reset outstanding
+    PD_RESET_SOFT,                  ///< Soft_Reset done, waiting for Source_Capabilities
+    PD_RESET_HARD,                  ///< Hard Reset, VBUS on its way to vSafe0V
+    PD_RESET_VBUS_OFF,              ///< VBUS off, the source recovering
+    PD_RESET_WAIT_CAPS              ///< VBUS back, waiting for Source_Capabilities
+} pd_reset_phase_t;
+
+/**
+ * @brief Start tracking a reset on the current port
+ * @param kind What happened
+ */
+void pd_reset_begin(pd_reset_kind_t kind);
+
+/**
+ * @brief Offer a VBUSOK change to the Hard Reset in progress
+ *
+ * Called by check_interrupt() while attached. VBUS going away within
+ * PD_T_HARD_RESET_VBUS_OFF_MS of a Hard Reset, and coming back afterwards,
+ * belong to the reset.
+ *
+ * @param vbus_ok STATUS0 VBUSOK
+ * @return true if the change is part of the reset and the port stays attached
+ */
+bool pd_reset_vbus_change(bool vbus_ok);
+
+/**
+ * @brief Whether the source's Hard Reset calls for a fresh negotiation
+ *
+ * True once per Hard Reset received; loop1() then restarts the port's
+ * negotiation without recognition.
+ */
+bool pd_reset_take_restart();
+
+/**
+ * @brief A contract was reached: record the time since the reset, if any
+ */
+void pd_reset_contract();
+
+/**
+ * @brief Forget any reset in progress (detach)
+ */
+void pd_reset_clear();
+
+/**
+ * @brief Phase of the current port
+ */
+pd_reset_phase_t pd_reset_phase();
+
+#endif // PD_RESET_H
@@ -0,0 +1,537 @@
+#include <string.h>
+#include "PD_Sim.h"
+#include "PD_CRC.h"
+
+static void async_progress(pd_sim_t *sim);
+
+// Register values after power-on or SW_RES (FUSB302B datasheet)
+static const uint8_t reset_values[][2] = {
+    {REG_DEVICE_ID, PD_SIM_DEVICE_ID},
+    {REG_SWITCHES0, 0x03},
+    {REG_SWITCHES1, 0x20},
+    {REG_MEASURE, 0x31},
+    {REG_SLICE, 0x60},
+    {REG_CONTROL0, 0x24},
+    {REG_CONTROL2, 0x02},
+    {REG_CONTROL3, 0x06},
+    {REG_POWER, 0x01},
+};
+
+static void reset_registers(pd_sim_t *sim) {
+    memset(sim->regs, 0, sizeof(sim->regs));
+    for (unsigned i = 0; i < sizeof(reset_values) / sizeof(reset_values[0]); i++) {
+        sim->regs[reset_values[i][0]] = reset_values[i][1];
+    }
+    sim->rx_head = 0;
+    sim->rx_count = 0;
+    sim->tx_len = 0;
+    // Status follows the lines, which a reset does not touch
+    if (sim->cc) {
+        sim->regs[REG_STATUS0] |= 0x02;
+    }
+    if (sim->vbus_mv >= 4000) {
+        sim->regs[REG_STATUS0] |= STATUS0_VBUSOK;
+    }
+    sim->comp = false; // MEAS_VBUS is off after a reset
+}
+
+/**
+ * Initialise a simulator in its power-on state
+ */
+void pd_sim_init(pd_sim_t *sim) {
+    memset(sim, 0, sizeof(*sim));
+    reset_registers(sim);
+    sim->i2c_addr = PD_ADDR;
+    sim->bus_hz = 400000;
+    sim->partner_acks = true;
+}
+
+static void push_rx_byte(pd_sim_t *sim, uint8_t value) {
+    sim->rx_fifo[(sim->rx_head + sim->rx_count) % FUSB_RX_FIFO_SIZE] = value;
+    sim->rx_count++;
+}
+
+static uint8_t pop_rx_byte(pd_sim_t *sim) {
+    if (sim->rx_count == 0) {
+        return 0;
+    }
+    uint8_t value = sim->rx_fifo[sim->rx_head];
+    sim->rx_head = (sim->rx_head + 1) % FUSB_RX_FIFO_SIZE;
+    sim->rx_count--;
+    return value;
+}
+
+/**
+ * Put a frame into the RX FIFO the way the PHY would: SOP token, header and
+ * data, CRC. The chip auto-acknowledges it when SWITCHES1 AUTO_CRC is set.
+ */
+static void deliver_frame(pd_sim_t *sim, uint8_t token, const uint8_t *msg, uint8_t length) {
+    if ((uint16_t)(sim->rx_count + 1 + length + 4) > FUSB_RX_FIFO_SIZE) {
+        sim->rx_overflows++;
+        sim->regs[REG_INTERRUPT] |= INTERRUPT_I_ALERT;
+        return;
+    }
+    uint8_t crc[4];
+    pd_crc32_store(pd_crc32_update(PD_CRC_INIT, msg, length), crc);
+
+    push_rx_byte(sim, token);
+    for (uint8_t i = 0; i < length; i++) {
+        push_rx_byte(sim, msg[i]);
+    }
+    for (uint8_t i = 0; i < 4; i++) {
+        push_rx_byte(sim, crc[i]);
+    }
+    sim->messages_rx++;
+    sim->regs[REG_INTERRUPT] |= (INTERRUPT_I_CRC_CHK | INTERRUPT_I_ACTIVITY);
+    if ((token == RX_TOKEN_SOP) && (length >= 2) && ((msg[0] & 0x1F) == MSG_TYPE_SOFT_RESET) && !(msg[1] & 0xF0)) {
+        sim->regs[REG_INTERRUPTA] |= INTERRUPTA_I_SOFTRST; // The PHY flags Soft_Reset as well
+    }
+    if (sim->regs[REG_SWITCHES1] & SWITCHES1_AUTO_CRC) {
+        sim->regs[REG_INTERRUPTB] |= INTERRUPTB_I_GCRCSENT;
+    }
+}
+
+static void deliver_due(pd_sim_t *sim) {
+    for (;;) {
+        pd_sim_frame_t *next = 0;
+        for (int i = 0; i < PD_SIM_MAX_PENDING; i++) {
+            pd_sim_frame_t *f = &sim->pending[i];
+            if (f->used && (int32_t)(sim->clock_us - f->due_us) >= 0 &&
+                (!next || (int32_t)(f->due_us - next->due_us) < 0)) {
+                next = f;
+            }
+        }
+        if (!next) {
+            return;
+        }
+        next->used = false;
+        deliver_frame(sim, next->token, next->msg, next->length);
+    }
+}
+
+/**
+ * Comparator output: VBUS against the MDAC threshold when MEAS_VBUS is set
+ */
+static bool comparator(const pd_sim_t *sim) {
+    uint8_t measure = sim->regs[REG_MEASURE];
+    return (measure & MEASURE_MEAS_VBUS) &&
+           (sim->vbus_mv > (uint32_t)((measure & MEASURE_MDAC) + 1) * MEASURE_VBUS_STEP_MV);
+}
+
+/**
+ * Raise I_COMP_CHNG when the comparator output flips
+ */
+static void update_comparator(pd_sim_t *sim) {
+    bool comp = comparator(sim);
+    if (comp != sim->comp) {
+        sim->comp = comp;
+        sim->regs[REG_INTERRUPT] |= INTERRUPT_I_COMP_CHNG;
+    }
+}
+
+/**
+ * Advance virtual time, delivering any frames that fall due
+ */
+void pd_sim_advance(pd_sim_t *sim, uint32_t us) {
+    sim->power_us[sim->regs[REG_POWER] & 0x0F] += us;
+    sim->clock_us += us;
+    deliver_due(sim);
+    async_progress(sim);
+}
+
+/**
+ * Schedule a partner frame
+ */
+bool pd_sim_schedule_rx(pd_sim_t *sim, uint32_t delay_us, uint8_t token,
+                        const uint8_t *msg, uint8_t length) {
+    if (length > PD_SIM_MAX_MSG) {
+        return false;
+    }
+    for (int i = 0; i < PD_SIM_MAX_PENDING; i++) {
+        pd_sim_frame_t *f = &sim->pending[i];
+        if (!f->used) {
+            f->used = true;
+            f->due_us = sim->clock_us + delay_us;
+            f->token = token;
+            f->length = length;
+            memcpy(f->msg, msg, length);
+            if (delay_us == 0) {
+                deliver_due(sim);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Build a message header as a source/DFP partner would
+ */
+void pd_sim_header(uint8_t *msg, uint8_t type, uint8_t num_data_objects,
+                   uint8_t message_id, uint8_t spec_rev) {
+    msg[0] = (type & 0x1F) | (1 << 5) | ((spec_rev & 0x03) << 6); // DFP
+    msg[1] = 0x01 | ((message_id & 0x07) << 1) | ((num_data_objects & 0x07) << 4); // Source
+}
+
+/**
+ * Decode a TX FIFO token stream into a message
+ */
+uint16_t pd_sim_decode_tx(const uint8_t *tokens, uint16_t length, uint8_t *sop, uint8_t *msg) {
+    uint16_t i = 0;
+    uint16_t out = 0;
+    bool jam_crc = false;
+
+    if ((length > 0) && (tokens[0] == TXON_TOKEN)) {
+        i++;
+    }
+    if ((length - i) < 4) {
+        return 0;
+    }
+    const uint8_t *k = &tokens[i];
+    if ((k[0] == SYNC1_TOKEN) && (k[1] == SYNC1_TOKEN) && (k[2] == SYNC1_TOKEN) && (k[3] == SYNC2_TOKEN)) {
+        *sop = 0;
+    } else if ((k[0] == SYNC1_TOKEN) && (k[1] == SYNC1_TOKEN) && (k[2] == SYNC3_TOKEN) && (k[3] == SYNC3_TOKEN)) {
+        *sop = 1;
+    } else if ((k[0] == SYNC1_TOKEN) && (k[1] == SYNC3_TOKEN) && (k[2] == SYNC1_TOKEN) && (k[3] == SYNC3_TOKEN)) {
+        *sop = 2;
+    } else {
+        return 0;
+    }
+    i += 4;
+
+    while (i < length) {
+        uint8_t t = tokens[i++];
+        if ((t & 0xE0) == PACKSYM) {
+            uint8_t n = t & 0x1F;
+            if (((uint16_t)(i + n) > length) || ((uint16_t)(out + n) > PD_SIM_MAX_MSG + 4)) {
+                return 0;
+            }
+            memcpy(&msg[out], &tokens[i], n);
+            out += n;
+            i += n;
+        } else if (t == CRC_PLACEHOLDER) {
+            jam_crc = true;
+        } else if (t == EOP_SEQUENCE) {
+            break;
+        }
+    }
+
+    if (!jam_crc) {
+        // Software CRC packed after the data
+        if ((out < 6) || !pd_crc32_check(pd_crc32_update(PD_CRC_INIT, msg, out - 4), &msg[out - 4])) {
+            return 0;
+        }
+        out -= 4;
+    }
+    if ((out < 2) || (out != 2 + 4 * ((msg[1] >> 4) & 0x07))) {
+        return 0;
+    }
+    return out;
+}
+
+static void transmit(pd_sim_t *sim) {
+    uint8_t msg[PD_SIM_MAX_MSG + 4];
+    uint8_t sop = 0;
+    uint16_t length = pd_sim_decode_tx(sim->tx_fifo, sim->tx_len, &sop, msg);
+    sim->tx_len = 0;
+
+    if ((length == 0) || !sim->partner_acks || (sop && !sim->emarker)) {
+        // Nobody acknowledges a malformed frame, or a plug without an
+        // e-marker; hardware retries then gives up
+        sim->regs[REG_INTERRUPTA] |= INTERRUPTA_I_RETRYFAIL;
+        return;
+    }
+    sim->messages_tx++;
+
+    uint8_t goodcrc[2];
+    uint8_t token = (sop == 0) ? RX_TOKEN_SOP : ((sop == 1) ? RX_TOKEN_SOP1 : RX_TOKEN_SOP2);
+    pd_sim_header(goodcrc, MSG_TYPE_GOODCRC, 0, (msg[1] >> 1) & 0x07, (msg[0] >> 6) & 0x03);
+    deliver_frame(sim, token, goodcrc, 2);
+    sim->regs[REG_INTERRUPTB] &= ~INTERRUPTB_I_GCRCSENT; // GoodCRCs are never acknowledged
+    sim->regs[REG_INTERRUPTA] |= INTERRUPTA_I_TXSENT;
+
+    if (sim->on_message) {
+        sim->on_message(sim, sop, msg, length);
+    }
+}
+
+/**
+ * Toggle finds an attached source immediately
+ */
+static void resolve_toggle(pd_sim_t *sim) {
+    if (sim->cc && (sim->regs[REG_CONTROL2] & CONTROL2_TOGGLE)) {
+        sim->regs[REG_STATUS1A] = ((sim->cc == 1) ? TOGSS_SNK_CC1 : TOGSS_SNK_CC2) << 3;
+        sim->regs[REG_INTERRUPTA] |= INTERRUPTA_I_TOGDONE;
+    }
+}
+
+static void write_register(pd_sim_t *sim, uint8_t reg, uint8_t value) {
+    switch (reg) {
+        case REG_FIFOS:
+            if (sim->tx_len < FUSB_TX_FIFO_SIZE) {
+                sim->tx_fifo[sim->tx_len++] = value;
+            }
+            return;
+        case REG_RESET:
+            if (value & 0x01) {
+                reset_registers(sim);
+            } else if (value & 0x02) {
+                sim->rx_count = 0;
+                sim->tx_len = 0;
+            }
+            return;
+        case REG_CONTROL0:
+            if (value & CONTROL0_TX_FLUSH) {
+                sim->tx_len = 0;
+            }
+            sim->regs[reg] = value & ~(CONTROL0_TX_START | CONTROL0_TX_FLUSH);
+            if (value & CONTROL0_TX_START) {
+                transmit(sim);
+            }
+            return;
+        case REG_CONTROL1:
+            if (value & CONTROL1_RX_FLUSH) {
+                sim->rx_count = 0;
+            }
+            sim->regs[reg] = value & ~CONTROL1_RX_FLUSH;
+            return;
+        case REG_CONTROL2: {
+            bool start = (value & CONTROL2_TOGGLE) && !(sim->regs[reg] & CONTROL2_TOGGLE);
+            sim->regs[reg] = value;
+            if (start) {
+                resolve_toggle(sim);
+            }
+            return;
+        }
+        case REG_CONTROL3:
+            sim->regs[reg] = value & ~CONTROL3_SEND_HARD_RESET;
+            if (value & CONTROL3_SEND_HARD_RESET) {
+                sim->regs[REG_INTERRUPTA] |= INTERRUPTA_I_HARDSENT;
+                if (sim->on_message) {
+                    sim->on_message(sim, 0, 0, 0);
+                }
+            }
+            return;
+        case REG_MEASURE:
+            sim->regs[reg] = value;
+            update_comparator(sim);
+            return;
+        case REG_DEVICE_ID:
+        case REG_STATUS0A:
+        case REG_STATUS1A:
+        case REG_STATUS0:
+        case REG_STATUS1:
+            return; // Read only
+        default:
+            if (reg < sizeof(sim->regs)) {
+                sim->regs[reg] = value;
+            }
+            return;
+    }
+}
+
+static uint8_t read_register(pd_sim_t *sim, uint8_t reg) {
+    uint8_t value;
+
+    switch (reg) {
+        case REG_FIFOS:
+            return pop_rx_byte(sim);
+        case REG_STATUS1:
+            value = sim->regs[reg] & ~(STATUS1_RX_EMPTY | STATUS1_RX_FULL | 0x08 | STATUS1_TX_FULL);
+            if (sim->rx_count == 0) {
+                value |= STATUS1_RX_EMPTY;
+            }
+            if (sim->rx_count >= FUSB_RX_FIFO_SIZE) {
+                value |= STATUS1_RX_FULL;
+            }
+            if (sim->tx_len == 0) {
+                value |= 0x08; // TX_EMPTY
+            }
+            if (sim->tx_len >= FUSB_TX_FIFO_SIZE) {
+                value |= STATUS1_TX_FULL;
+            }
+            return value;
+        case REG_STATUS0:
+            value = sim->regs[reg] & ~STATUS0_COMP;
+            if (comparator(sim)) {
+                value |= STATUS0_COMP;
+            }
+            return value;
+        case REG_INTERRUPT:
+        case REG_INTERRUPTA:
+        case REG_INTERRUPTB:
+            value = sim->regs[reg];
+            sim->regs[reg] = 0; // Clear on read
+            return value;
+        default:
+            return (reg < sizeof(sim->regs)) ? sim->regs[reg] : 0;
+    }
+}
+
+/**
+ * Modelled bus time: start, address and stop plus 9 clocks per byte, and a
+ * repeated start and address for reads
+ */
+static uint32_t bus_time_us(const pd_sim_t *sim, uint16_t tx_len, uint16_t rx_len) {
+    uint32_t bits = 9 * (1 + tx_len) + 2;
+    if (rx_len) {
+        bits += 9 * (1 + rx_len) + 1;
+    }
+    return (uint32_t)(((uint64_t)bits * 1000000u) / sim->bus_hz);
+}
+
+static void access_registers(pd_sim_t *sim, const uint8_t *tx, uint16_t tx_len,
+                             uint8_t *rx, uint16_t rx_len) {
+    if (tx_len > 0) {
+        sim->reg_ptr = tx[0];
+        for (uint16_t i = 1; i < tx_len; i++) {
+            write_register(sim, sim->reg_ptr, tx[i]);
+            if (sim->reg_ptr != REG_FIFOS) {
+                sim->reg_ptr++;
+            }
+        }
+    }
+    for (uint16_t i = 0; i < rx_len; i++) {
+        rx[i] = read_register(sim, sim->reg_ptr);
+        if (sim->reg_ptr != REG_FIFOS) {
+            sim->reg_ptr++;
+        }
+    }
+}
+
+static pd_bus_status_t sim_transfer(pd_transport_t *bus, uint8_t addr,
+                                    const uint8_t *tx, uint16_t tx_len,
+                                    uint8_t *rx, uint16_t rx_len) {
+    pd_sim_t *sim = (pd_sim_t *)bus->ctx;
+
+    pd_sim_advance(sim, bus_time_us(sim, tx_len, rx_len));
+    if (addr != sim->i2c_addr) {
+        return PD_BUS_NACK_ADDR;
+    }
+    access_registers(sim, tx, tx_len, rx, rx_len);
+    return PD_BUS_OK;
+}
+
+/**
+ * Release rx bytes of the asynchronous transfer as virtual time passes them
+ * and complete it at its modelled end
+ */
+static void async_progress(pd_sim_t *sim) {
+    pd_bus_xfer_t *xfer = sim->async;
+    if (!xfer) {
+        return;
+    }
+    if ((int32_t)(sim->clock_us - sim->async_end_us) >= 0) {
+        sim->async = 0;
+        pd_bus_complete(sim->bus, PD_BUS_OK);
+        return;
+    }
+    int32_t into_rx = (int32_t)(sim->clock_us - sim->async_rx_start_us);
+    if ((xfer->rx_len > 0) && (into_rx > 0)) {
+        uint32_t bytes = ((uint64_t)into_rx * sim->bus_hz) / (9 * 1000000u);
+        xfer->rx_done = (bytes < xfer->rx_len) ? bytes : xfer->rx_len;
+    }
+}
+
+/**
+ * Register effects apply at submission; the data then becomes visible at the
+ * modelled bus rate
+ */
+static pd_bus_status_t sim_submit(pd_transport_t *bus, pd_bus_xfer_t *xfer) {
+    pd_sim_t *sim = (pd_sim_t *)bus->ctx;
+
+    if (xfer->addr != sim->i2c_addr) {
+        pd_sim_advance(sim, bus_time_us(sim, 0, 0));
+        return PD_BUS_NACK_ADDR;
+    }
+    access_registers(sim, xfer->tx, xfer->tx_len, xfer->rx, xfer->rx_len);
+    sim->async = xfer;
+    sim->async_rx_start_us = sim->clock_us + bus_time_us(sim, xfer->tx_len, 0) +
+                             (uint32_t)((10u * 1000000u) / sim->bus_hz);
+    sim->async_end_us = sim->clock_us + bus_time_us(sim, xfer->tx_len, xfer->rx_len);
+    return PD_BUS_OK;
+}
+
+/**
+ * Waiting on the simulator lets virtual time run one byte at a time
+ */
+static void sim_poll(pd_transport_t *bus) {
+    pd_sim_t *sim = (pd_sim_t *)bus->ctx;
+    uint32_t byte_us = (9u * 1000000u) / sim->bus_hz;
+    pd_sim_advance(sim, byte_us ? byte_us : 1);
+}
+
+static uint32_t sim_clock_us(pd_transport_t *bus) {
+    return ((pd_sim_t *)bus->ctx)->clock_us;
+}
+
+/**
+ * Expose a simulator as a transport
+ */
+void pd_sim_transport_init(pd_transport_t *bus, pd_sim_t *sim) {
+    memset(bus, 0, sizeof(*bus));
+    bus->name = "sim";
+    bus->transfer = sim_transfer;
+    bus->clock_us = sim_clock_us;
+    bus->submit = sim_submit;
+    bus->poll = sim_poll;
+    bus->ctx = sim;
+    sim->bus = bus;
+}
+
+/**
+ * Partner sends a hard reset
+ */
+void pd_sim_hard_reset(pd_sim_t *sim) {
+    sim->regs[REG_STATUS0A] |= 0x01;
+    sim->regs[REG_INTERRUPTA] |= INTERRUPTA_I_HARDRST;
+    sim->rx_count = 0;
+}
+
+/**
+ * Connect or remove a source on a CC line
+ */
+void pd_sim_attach(pd_sim_t *sim, int cc, uint32_t vbus_mv) {
+    sim->cc = cc;
+    if (cc == 0) {
+        sim->vbus_mv = 0;
+        sim->regs[REG_STATUS0] &= ~(STATUS0_VBUSOK | STATUS0_BC_LVL);
+        sim->regs[REG_STATUS1A] = 0;
+        sim->regs[REG_INTERRUPT] |= INTERRUPT_I_VBUSOK;
+        update_comparator(sim);
+        return;
+    }
+    resolve_toggle(sim);
+    sim->vbus_mv = vbus_mv;
+    sim->regs[REG_STATUS0] = (sim->regs[REG_STATUS0] & ~STATUS0_BC_LVL) | 0x02;
+    if (vbus_mv >= 4000) {
+        sim->regs[REG_STATUS0] |= STATUS0_VBUSOK;
+        sim->regs[REG_INTERRUPT] |= INTERRUPT_I_VBUSOK;
+    }
+    update_comparator(sim);
+}
+
+/**
+ * Move VBUS while attached
+ */
+void pd_sim_set_vbus(pd_sim_t *sim, uint32_t vbus_mv) {
+    bool ok = vbus_mv >= 4000;
+    sim->vbus_mv = vbus_mv;
+    if (ok != !!(sim->regs[REG_STATUS0] & STATUS0_VBUSOK)) {
+        sim->regs[REG_STATUS0] ^= STATUS0_VBUSOK;
+        sim->regs[REG_INTERRUPT] |= INTERRUPT_I_VBUSOK;
+    }
+    update_comparator(sim);
+}
+
+/**
+ * Level of the modelled INT_N pin
+ */
+bool pd_sim_int_asserted(const pd_sim_t *sim) {
+    if (sim->regs[REG_CONTROL0] & 0x20) { // INT_MASK
+        return false;
+    }
+    return (sim->regs[REG_INTERRUPT] & ~sim->regs[REG_MASK]) ||
+           (sim->regs[REG_INTERRUPTA] & ~sim->regs[REG_MASKA]) ||
+           (sim->regs[REG_INTERRUPTB] & ~sim->regs[REG_MASKB] & INTERRUPTB_I_GCRCSENT);
+}
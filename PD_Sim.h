@@ -0,0 +1,171 @@
+#ifndef PD_SIM_H
+#define PD_SIM_H
+
+#include <stdint.h>
+#include "FUSB302B_Regs.h"
+#include "PD_Transport.h"
+
+//=============================================================================
+// FUSB302B Simulator
+//=============================================================================
+
+// In-process model of the FUSB302B register file, FIFOs and PD PHY, exposed
+// as a pd_transport_t. Transmissions are decoded from the TX token stream and
+// handed to a partner model callback, which answers by queueing frames into
+// the RX FIFO. Time is virtual: it advances by the modelled I2C bus time of
+// every transfer and by pd_sim_advance(). Asynchronous transfers are
+// supported; their read data becomes visible byte by byte as time advances.
+//
+// This header has no Arduino dependencies.
+
+#define PD_SIM_MAX_PENDING  8       ///< Partner frames that can be scheduled ahead
+#define PD_SIM_MAX_MSG      34      ///< Header + 7 data objects + CRC
+#define PD_SIM_DEVICE_ID    0x91    ///< FUSB302B version/revision ID
+
+typedef struct pd_sim pd_sim_t;
+
+/**
+ * @brief Partner model hook
+ *
+ * Called for every message the stack transmits. msg holds the header and data
+ * (no CRC); a NULL msg with length 0 signals a transmitted hard reset.
+ */
+typedef void (*pd_sim_msg_hook_t)(pd_sim_t *sim, uint8_t sop, const uint8_t *msg, uint16_t length);
+
+/**
+ * @brief Frame scheduled for delivery into the RX FIFO
+ */
+typedef struct {
+    uint32_t due_us;                ///< Virtual time of arrival
+    uint8_t token;                  ///< RX_TOKEN_SOP / SOP1 / SOP2
+    uint8_t length;                 ///< Header + data bytes
+    uint8_t msg[PD_SIM_MAX_MSG];    ///< Header + data
+    bool used;
+} pd_sim_frame_t;
+
+struct pd_sim {
+    uint8_t regs[0x44];             ///< Register file
+    uint8_t rx_fifo[FUSB_RX_FIFO_SIZE];
+    uint8_t rx_head;
+    uint8_t rx_count;
+    uint8_t tx_fifo[FUSB_TX_FIFO_SIZE];
+    uint8_t tx_len;
+    uint8_t reg_ptr;                ///< I2C register address pointer
+
+    uint8_t i2c_addr;               ///< Address the model answers on
+    uint32_t bus_hz;                ///< Modelled SCL frequency
+    uint32_t clock_us;              ///< Virtual time
+    uint32_t vbus_mv;               ///< VBUS presented by the partner
+    uint8_t cc;                     ///< CC line with the partner's Rp, 0 while detached
+    bool comp;                      ///< Measure comparator output, to raise I_COMP_CHNG on a flip
+
+    bool partner_acks;              ///< Partner answers every message with GoodCRC
+    bool emarker;                   ///< A cable plug answers SOP'/SOP'' messages with GoodCRC
+    pd_sim_msg_hook_t on_message;   ///< Partner model
+    void *user;                     ///< Partner model state
+
+    pd_sim_frame_t pending[PD_SIM_MAX_PENDING];
+
+    pd_transport_t *bus;            ///< Transport wrapping this model
+    pd_bus_xfer_t *async;           ///< Asynchronous transfer in flight
+    uint32_t async_rx_start_us;     ///< When its first rx byte arrives
+    uint32_t async_end_us;          ///< When it completes
+
+    // Accounting
+    uint32_t messages_tx;           ///< Messages decoded from TX_START
+    uint32_t messages_rx;           ///< Frames delivered into the RX FIFO
+    uint32_t rx_overflows;          ///< Frames dropped because the RX FIFO was full
+    uint32_t power_us[16];          ///< Time spent at each POWER register value
+};
+
+/**
+ * @brief Initialise a simulator in its power-on state, detached
+ * @param sim Simulator
+ */
+void pd_sim_init(pd_sim_t *sim);
+
+/**
+ * @brief Expose a simulator as a transport
+ * @param bus Transport to fill in
+ * @param sim Simulator backing it
+ */
+void pd_sim_transport_init(pd_transport_t *bus, pd_sim_t *sim);
+
+/**
+ * @brief Advance virtual time, delivering any frames that fall due
+ * @param sim Simulator
+ * @param us Microseconds to advance
+ */
+void pd_sim_advance(pd_sim_t *sim, uint32_t us);
+
+/**
+ * @brief Schedule a partner frame; the CRC is appended by the model
+ * @param sim Simulator
+ * @param delay_us Delay from now until it lands in the RX FIFO
+ * @param token RX_TOKEN_SOP / SOP1 / SOP2
+ * @param msg Header + data bytes
+ * @param length Number of bytes in msg
+ * @return false if the schedule is full
+ */
+bool pd_sim_schedule_rx(pd_sim_t *sim, uint32_t delay_us, uint8_t token,
+                        const uint8_t *msg, uint8_t length);
+
+/**
+ * @brief Partner sends a hard reset (raises I_HARDRST)
+ * @param sim Simulator
+ */
+void pd_sim_hard_reset(pd_sim_t *sim);
+
+/**
+ * @brief Connect or remove a source on a CC line
+ *
+ * Resolves toggle (I_TOGDONE with the matching TOGSS) when it is running, or
+ * as soon as it is enabled while the source stays attached, and drives VBUS
+ * (I_VBUSOK).
+ *
+ * @param sim Simulator
+ * @param cc CC line with the source's Rp (1 or 2), 0 to detach
+ * @param vbus_mv VBUS to present while attached
+ */
+void pd_sim_attach(pd_sim_t *sim, int cc, uint32_t vbus_mv);
+
+/**
+ * @brief Move VBUS while attached, as a source does between Accept and PS_RDY
+ *
+ * Updates VBUSOK and the measure comparator, raising their interrupts when
+ * they change.
+ *
+ * @param sim Simulator
+ * @param vbus_mv New VBUS
+ */
+void pd_sim_set_vbus(pd_sim_t *sim, uint32_t vbus_mv);
+
+/**
+ * @brief Level of the modelled INT_N pin
+ * @param sim Simulator
+ * @return true while any unmasked interrupt is pending (INT_N low)
+ */
+bool pd_sim_int_asserted(const pd_sim_t *sim);
+
+/**
+ * @brief Build a message header as a source/DFP partner would
+ * @param msg Destination (2 bytes, LSB first)
+ * @param type Message type
+ * @param num_data_objects Number of data objects
+ * @param message_id MessageID
+ * @param spec_rev Specification revision field (0-2)
+ */
+void pd_sim_header(uint8_t *msg, uint8_t type, uint8_t num_data_objects,
+                   uint8_t message_id, uint8_t spec_rev);
+
+/**
+ * @brief Decode a TX FIFO token stream into a message
+ * @param tokens Token stream as written to REG_FIFOS
+ * @param length Number of token bytes
+ * @param sop Decoded SOP* type (pd_sop_t numbering)
+ * @param msg Destination for header + data (CRC stripped and verified)
+ * @return Message length, 0 if the stream or its software CRC is invalid
+ */
+uint16_t pd_sim_decode_tx(const uint8_t *tokens, uint16_t length, uint8_t *sop, uint8_t *msg);
+
+#endif // PD_SIM_H
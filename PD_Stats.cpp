@@ -0,0 +1,270 @@
+#include <string.h>
+#include <Arduino.h>
+#include "FUSB302B.h"
+#include "PD_Stats.h"
+
+PD_TLS pd_stats_t pd_stats[PD_NUM_PORTS];
+
+#define NO_REQUEST  PD_CTRL(0)     // Reserved type, never a request
+
+/**
+ * @brief Request waiting for our reply on one port (core 1 only)
+ */
+typedef struct {
+    uint8_t selector;               ///< NO_REQUEST when nothing is owed
+    uint32_t since_us;              ///< micros() when it was taken out of the RX FIFO
+} pd_stats_reply_t;
+
+static PD_TLS pd_stats_reply_t stats_replies[PD_NUM_PORTS];
+
+/**
+ * Counter block of the port being serviced
+ */
+static pd_stats_t *current() {
+    return &pd_stats[pd_port - pd_ports];
+}
+
+/**
+ * Open an update: readers retry until seq is even and unchanged
+ */
+static inline void writeBegin(pd_stats_t *stats) {
+    stats->seq = stats->seq + 1;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void writeEnd(pd_stats_t *stats) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    stats->seq = stats->seq + 1;
+}
+
+/**
+ * Selector of a message header: PD_CTRL, PD_DATA or PD_EXT of its type
+ */
+static uint8_t headerSelector(const uint8_t *header) {
+    uint8_t type = header[0] & 0x1F;
+    if (header[1] & 0x80) {
+        return PD_EXT(type);
+    }
+    return (header[1] & 0x70) ? PD_DATA(type) : PD_CTRL(type);
+}
+
+/**
+ * Whether a message asks the sink for a reply within tReceiverResponse/tSenderResponse
+ */
+static bool isRequest(uint8_t selector) {
+    switch (selector) {
+        case PD_CTRL(MSG_TYPE_GET_SOURCE_CAP):
+        case PD_CTRL(MSG_TYPE_GET_SINK_CAP):
+        case PD_CTRL(MSG_TYPE_DR_SWAP):
+        case PD_CTRL(MSG_TYPE_PR_SWAP):
+        case PD_CTRL(MSG_TYPE_VCONN_SWAP):
+        case PD_CTRL(MSG_TYPE_SOFT_RESET):
+        case PD_CTRL(MSG_TYPE_GET_SOURCE_CAP_EXT):
+        case PD_CTRL(MSG_TYPE_GET_STATUS):
+        case PD_CTRL(MSG_TYPE_FR_SWAP):
+        case PD_CTRL(MSG_TYPE_GET_PPS_STATUS):
+        case PD_CTRL(MSG_TYPE_GET_COUNTRY_CODES):
+        case PD_CTRL(MSG_TYPE_GET_REVISION):
+        case PD_DATA(MSG_TYPE_SOURCE_CAPABILITIES):
+        case PD_DATA(MSG_TYPE_ALERT):
+        case PD_DATA(MSG_TYPE_GET_COUNTRY_INFO):
+        case PD_EXT(MSG_TYPE_EPR_SOURCE_CAPABILITIES):
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Count one event on the current port
+ */
+void pd_stats_inc(pd_counter_t id) {
+    pd_stats_t *stats = current();
+    writeBegin(stats);
+    stats->counters[id]++;
+    writeEnd(stats);
+}
+
+/**
+ * Count several events on the current port
+ */
+void pd_stats_add(pd_counter_t id, uint32_t count) {
+    pd_stats_t *stats = current();
+    writeBegin(stats);
+    stats->counters[id] += count;
+    writeEnd(stats);
+}
+
+/**
+ * Record a value on the current port
+ */
+void pd_stats_set(pd_counter_t id, uint32_t value) {
+    pd_stats_t *stats = current();
+    writeBegin(stats);
+    stats->counters[id] = value;
+    writeEnd(stats);
+}
+
+/**
+ * Count an outgoing frame
+ */
+void pd_stats_tx(const uint8_t *header) {
+    pd_stats_t *stats = current();
+    pd_stats_reply_t *reply = &stats_replies[pd_port - pd_ports];
+    uint32_t reply_us = (reply->selector != NO_REQUEST) ? micros() - reply->since_us : 0;
+
+    writeBegin(stats);
+    stats->counters[PD_CNT_TX_MESSAGES]++;
+    stats->tx_by_type[headerSelector(header)]++;
+    if ((reply->selector != NO_REQUEST) && (reply_us > stats->reply_max_us[reply->selector])) {
+        stats->reply_max_us[reply->selector] = (reply_us > 0xFFFF) ? 0xFFFF : reply_us;
+    }
+    writeEnd(stats);
+    reply->selector = NO_REQUEST;
+}
+
+/**
+ * Count an incoming frame
+ */
+void pd_stats_rx(const uint8_t *header) {
+    pd_stats_t *stats = current();
+    pd_stats_reply_t *reply = &stats_replies[pd_port - pd_ports];
+    uint8_t selector = headerSelector(header);
+
+    writeBegin(stats);
+    stats->counters[PD_CNT_RX_MESSAGES]++;
+    stats->rx_by_type[selector]++;
+    writeEnd(stats);
+    if (isRequest(selector)) {
+        reply->selector = selector;
+        reply->since_us = micros();
+    } else if (selector != PD_CTRL(MSG_TYPE_GOODCRC)) {
+        reply->selector = NO_REQUEST;
+    }
+}
+
+/**
+ * Mirror the transport's counters
+ */
+void pd_stats_sync_bus() {
+    pd_stats_t *stats = current();
+    const pd_bus_stats_t *bus = &pd_bus->stats;
+    writeBegin(stats);
+    stats->counters[PD_CNT_I2C_TRANSACTIONS] = bus->transactions;
+    stats->counters[PD_CNT_I2C_BYTES] = bus->bytes_written + bus->bytes_read;
+    stats->counters[PD_CNT_I2C_ERRORS] = bus->errors;
+    writeEnd(stats);
+}
+
+/**
+ * Read one counter
+ */
+uint32_t pd_stats_get(uint8_t port, pd_counter_t id) {
+    if ((port >= PD_NUM_PORTS) || (id >= PD_NUM_COUNTERS)) {
+        return 0;
+    }
+    return ((volatile uint32_t *)pd_stats[port].counters)[id];
+}
+
+/**
+ * Read one worst reply time
+ */
+uint16_t pd_stats_reply_max_us(uint8_t port, uint8_t selector) {
+    if ((port >= PD_NUM_PORTS) || (selector >= PD_STATS_MSG_SLOTS)) {
+        return 0;
+    }
+    return ((volatile uint16_t *)pd_stats[port].reply_max_us)[selector];
+}
+
+/**
+ * Take a consistent copy; core 1 never waits for the reader
+ */
+bool pd_stats_snapshot(uint8_t port, pd_stats_t *out) {
+    if (port >= PD_NUM_PORTS) {
+        return false;
+    }
+    const pd_stats_t *stats = &pd_stats[port];
+
+    for (int i = 0; i < PD_STATS_SNAPSHOT_TRIES; i++) {
+        uint32_t seq = stats->seq;
+        if (seq & 1) {
+            continue; // Update in progress
+        }
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        memcpy(out->counters, stats->counters, sizeof(out->counters));
+        memcpy(out->tx_by_type, stats->tx_by_type, sizeof(out->tx_by_type));
+        memcpy(out->rx_by_type, stats->rx_by_type, sizeof(out->rx_by_type));
+        memcpy(out->reply_max_us, stats->reply_max_us, sizeof(out->reply_max_us));
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (stats->seq == seq) {
+            out->seq = seq;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Append an unsigned LEB128 varint
+ */
+static bool putVarint(uint8_t *buf, uint16_t size, uint16_t *pos, uint32_t value) {
+    do {
+        if (*pos >= size) {
+            return false;
+        }
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        buf[(*pos)++] = value ? (byte | 0x80) : byte;
+    } while (value);
+    return true;
+}
+
+/**
+ * Serialize a snapshot
+ */
+uint16_t pd_stats_pack(const pd_stats_t *stats, uint8_t *buf, uint16_t size) {
+    uint16_t pos = 0;
+
+    if (size < 2) {
+        return 0;
+    }
+    buf[pos++] = PD_STATS_PACK_VERSION;
+    buf[pos++] = PD_NUM_COUNTERS;
+    for (int i = 0; i < PD_NUM_COUNTERS; i++) {
+        if (!putVarint(buf, size, &pos, stats->counters[i])) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < PD_STATS_MSG_SLOTS; i++) {
+        if (!stats->tx_by_type[i] && !stats->rx_by_type[i]) {
+            continue;
+        }
+        if (!putVarint(buf, size, &pos, i + 1) ||
+            !putVarint(buf, size, &pos, stats->tx_by_type[i]) ||
+            !putVarint(buf, size, &pos, stats->rx_by_type[i]) ||
+            !putVarint(buf, size, &pos, stats->reply_max_us[i])) {
+            return 0;
+        }
+    }
+    if (!putVarint(buf, size, &pos, 0)) {
+        return 0;
+    }
+    return pos;
+}
+
+/**
+ * Zero a port's counters
+ */
+void pd_stats_reset(uint8_t port) {
+    if (port >= PD_NUM_PORTS) {
+        return;
+    }
+    pd_stats_t *stats = &pd_stats[port];
+    writeBegin(stats);
+    memset(stats->counters, 0, sizeof(stats->counters));
+    memset(stats->tx_by_type, 0, sizeof(stats->tx_by_type));
+    memset(stats->rx_by_type, 0, sizeof(stats->rx_by_type));
+    memset(stats->reply_max_us, 0, sizeof(stats->reply_max_us));
+    writeEnd(stats);
+    stats_replies[port].selector = NO_REQUEST;
+}
@@ -0,0 +1,197 @@
+#ifndef PD_STATS_H
+#define PD_STATS_H
+
+#include <stdint.h>
+#include "FUSB302B_Regs.h"
+#include "PD_Transport.h"
+
+//=============================================================================
+// Runtime Statistics
+//=============================================================================
+
+// Health counters, one block per port. Core 1 is the only writer; every
+// update is bracketed by a sequence counter (odd while an update is in
+// progress), so core 0 can take a consistent snapshot at any time without
+// locks and without stopping PD processing.
+
+#define PD_STATS_MSG_SLOTS      96      ///< Message counters, indexed by PD_CTRL/PD_DATA/PD_EXT selector
+#define PD_STATS_SNAPSHOT_TRIES 8       ///< Attempts before pd_stats_snapshot() gives up
+#define PD_STATS_PACK_VERSION   2       ///< First byte of a packed snapshot
+#define PD_STATS_PACK_MAX       (2 + PD_NUM_COUNTERS * 5 + PD_STATS_MSG_SLOTS * 10 + 1)
+
+/**
+ * @brief Named counters
+ */
+typedef enum {
+    // Traffic
+    PD_CNT_TX_MESSAGES = 0,         ///< Frames loaded into the TX FIFO
+    PD_CNT_RX_MESSAGES,             ///< Frames taken out of the RX FIFO (GoodCRC included)
+    // Link health
+    PD_CNT_TX_FAILED,               ///< No GoodCRC after PD_N_RETRIES hardware retries
+    PD_CNT_TX_DISCARDED,            ///< Transmission pre-empted by an incoming message
+    PD_CNT_CRC_FAILURES,            ///< Received frames dropped for a bad CRC-32
+    PD_CNT_UNEXPECTED,              ///< Messages of the wrong type or that nothing waited for
+    PD_CNT_REJECTS,                 ///< Reject in reply to a Request
+    PD_CNT_WAITS,                   ///< Wait in reply to a Request
+    PD_CNT_HARD_RESETS_RX,          ///< Hard resets signalled by the partner
+    PD_CNT_HARD_RESETS_TX,          ///< Hard resets we signalled
+    PD_CNT_SOFT_RESETS_RX,          ///< Soft resets from the partner
+    PD_CNT_SOFT_RESETS_TX,          ///< Soft resets we sent (first recovery rung)
+    PD_CNT_RECOVERY_DETACHES,       ///< Recovery ladder ran out and detached
+    PD_CNT_RX_OVERFLOWS,            ///< RX FIFO overflows (FIFO flushed)
+    // Timeouts, one per named timer
+    PD_CNT_TIMEOUT_SENDER_RESPONSE, ///< tSenderResponse: no Accept/Reject/Wait
+    PD_CNT_TIMEOUT_SINK_WAIT_CAP,   ///< tTypeCSinkWaitCap: no Source_Capabilities
+    PD_CNT_TIMEOUT_PS_TRANSITION,   ///< tPSTransition: no PS_RDY after Accept
+    PD_CNT_TIMEOUT_TX,              ///< PD_TX_TIMEOUT_MS: no TX result from the FUSB302B
+    PD_CNT_TIMEOUT_RX_EMPTY,        ///< Blocking read found the RX FIFO still empty
+    PD_CNT_TIMEOUT_VBUS_ON,         ///< PD_VBUS_ON_TIMEOUT_MS: no VBUS after toggle
+    // I2C (mirrored from the transport by pd_stats_sync_bus())
+    PD_CNT_I2C_TRANSACTIONS,        ///< Bus transfers
+    PD_CNT_I2C_BYTES,               ///< Bytes written plus bytes read
+    PD_CNT_I2C_ERRORS,              ///< Failed transfers
+    // Negotiation
+    PD_CNT_CONTRACTS,               ///< Explicit contracts reached (PS_RDY)
+    PD_CNT_NEGOTIATION_FAILURES,    ///< Requests that did not end in PS_RDY
+    PD_CNT_SRC_CAPS_UNCHANGED,      ///< Source_Capabilities identical to the cached set
+    // Structured VDMs
+    PD_CNT_TIMEOUT_VDM_RESPONSE,    ///< tVDMSenderResponse/tVDMWaitMode*: no ACK, NAK or BUSY
+    PD_CNT_VDM_BUSY,                ///< BUSY replies to our requests
+    PD_CNT_VDM_NAKS,                ///< NAK replies to our requests
+    // Extended Power Range
+    PD_CNT_EPR_ENTRIES,             ///< EPR_Mode Enter Succeeded
+    PD_CNT_EPR_ENTRY_FAILURES,      ///< EPR_Mode Enter not sent, refused or unanswered
+    PD_CNT_EPR_CONTRACTS,           ///< Contracts reached with EPR_Request
+    PD_CNT_EPR_CONTRACT_MS,         ///< Toggle done to the first EPR contract, last attach (a value)
+    PD_CNT_TIMEOUT_EPR_KEEPALIVE,   ///< tSenderResponse: no EPR_KeepAlive_Ack
+    PD_CNT_TIMEOUT_CHUNK,           ///< tChunkSenderResponse: no next EPR_Source_Capabilities chunk
+    // VBUS measurement
+    PD_CNT_VBUS_READINGS,           ///< pd_vbus_measure() readings
+    PD_CNT_VBUS_TRANSACTIONS,       ///< I2C transactions spent on them (divide by readings for the overhead)
+    PD_CNT_VBUS_MV,                 ///< Lower bound of the last reading in mV (a value)
+    PD_CNT_VBUS_MISMATCHES,         ///< Contracts whose VBUS was not within PD_VBUS_TOLERANCE_PCT
+    PD_CNT_VBUS_CROSSINGS,          ///< Monitor threshold crossings
+    // Alerts
+    PD_CNT_ALERTS,                  ///< Alert messages received
+    PD_CNT_LOAD_SHEDS,              ///< Alerts that called the load-shed hook
+    PD_CNT_SHED_LATENCY_US,         ///< INT_N edge to the load-shed hook, last shed (a value)
+    PD_CNT_SHED_LATENCY_MAX_US,     ///< ...the longest since the counters were reset (a value)
+    PD_CNT_STATUS_RX,               ///< Status messages decoded
+    PD_CNT_TIMEOUT_STATUS,          ///< tSenderResponse: no Status after Get_Status
+    // Resets
+    PD_CNT_RESET_RECOVERY_MS,       ///< Last Hard Reset or Soft_Reset to the next contract (a value)
+    PD_CNT_RESET_RECOVERY_MAX_MS,   ///< ...the longest since the counters were reset (a value)
+    PD_CNT_RESET_VBUS_CYCLES,       ///< Hard Resets ridden through with VBUS off and back
+    PD_NUM_COUNTERS
+} pd_counter_t;
+
+/**
+ * @brief Counter block of one port
+ */
+typedef struct {
+    volatile uint32_t seq;                      ///< Odd while core 1 is updating
+    uint32_t counters[PD_NUM_COUNTERS];         ///< Indexed by pd_counter_t
+    uint16_t tx_by_type[PD_STATS_MSG_SLOTS];    ///< Sent messages per selector (wraps)
+    uint16_t rx_by_type[PD_STATS_MSG_SLOTS];    ///< Received messages per selector (wraps)
+    uint16_t reply_max_us[PD_STATS_MSG_SLOTS];  ///< Worst request-to-reply time per request selector (saturates)
+} pd_stats_t;
+
+extern PD_TLS pd_stats_t pd_stats[]; ///< One block per port (PD_NUM_PORTS)
+
+//=============================================================================
+// Recording (core 1, current port)
+//=============================================================================
+
+/**
+ * @brief Count one event on the port being serviced
+ * @param id Counter
+ */
+void pd_stats_inc(pd_counter_t id);
+
+/**
+ * @brief Count several events on the port being serviced
+ * @param id Counter
+ * @param count Events to add
+ */
+void pd_stats_add(pd_counter_t id, uint32_t count);
+
+/**
+ * @brief Record a value (a duration or level, not a count) on the port being serviced
+ * @param id Counter
+ * @param value New value
+ */
+void pd_stats_set(pd_counter_t id, uint32_t value);
+
+/**
+ * @brief Count a frame going out
+ * @param header Message header, LSB first
+ */
+void pd_stats_tx(const uint8_t *header);
+
+/**
+ * @brief Count a frame coming in
+ *
+ * A request the sink has to answer (Source_Capabilities, Get_Sink_Cap,
+ * Soft_Reset, Get_Status, Alert, ...) starts the reply clock; the next
+ * pd_stats_tx() stops it and keeps the worst time in reply_max_us. Any other
+ * message but GoodCRC stops the clock unrecorded.
+ *
+ * @param header Message header, LSB first
+ */
+void pd_stats_rx(const uint8_t *header);
+
+/**
+ * @brief Mirror the transport's transfer counters into the current port's block
+ */
+void pd_stats_sync_bus();
+
+//=============================================================================
+// Query (any core)
+//=============================================================================
+
+/**
+ * @brief Read one counter
+ * @param port Port index
+ * @param id Counter
+ * @return Current value (a single aligned word, so never torn)
+ */
+uint32_t pd_stats_get(uint8_t port, pd_counter_t id);
+
+/**
+ * @brief Worst time from taking a request out of the RX FIFO to loading our reply
+ * @param port Port index
+ * @param selector PD_CTRL/PD_DATA/PD_EXT selector of the request
+ * @return Microseconds, 0 if never answered, 65535 or more saturates
+ */
+uint16_t pd_stats_reply_max_us(uint8_t port, uint8_t selector);
+
+/**
+ * @brief Copy a port's whole block consistently
+ * @param port Port index
+ * @param out Destination
+ * @return false if core 1 kept updating for PD_STATS_SNAPSHOT_TRIES attempts
+ */
+bool pd_stats_snapshot(uint8_t port, pd_stats_t *out);
+
+/**
+ * @brief Serialize a snapshot into the compact binary format
+ *
+ * Version byte, counter count, every counter as an unsigned LEB128 varint,
+ * then (selector + 1, TX count, RX count, worst reply in us) varint
+ * quadruples for each message type seen, terminated by a 0 byte. An idle
+ * port packs into ~30 bytes.
+ *
+ * @param stats Snapshot from pd_stats_snapshot()
+ * @param buf Destination
+ * @param size Size of buf (PD_STATS_PACK_MAX always fits)
+ * @return Bytes written, 0 if buf is too small
+ */
+uint16_t pd_stats_pack(const pd_stats_t *stats, uint8_t *buf, uint16_t size);
+
+/**
+ * @brief Zero a port's counters (call from core 1)
+ * @param port Port index
+ */
+void pd_stats_reset(uint8_t port);
+
+#endif // PD_STATS_H
@@ -0,0 +1,134 @@
+#ifndef PD_TRACE_H
+#define PD_TRACE_H
+
+#include "FUSB302B.h"
+
+//=============================================================================
+// Packet Engine Trace Policies
+//=============================================================================
+
+// The packet engine (Protocol_Engine.cpp) is a pair of templates over a trace
+// policy. The policy sees every frame the engine puts into the TX FIFO and
+// every frame it takes out of the RX FIFO:
+//
+//     struct Policy {
+//         static void tx(const uint8_t *header, const uint8_t *objects);
+//         static void rx(const pd_msg_t *msg, bool crc_ok);
+//     };
+//
+// pd_trace_none has empty inline hooks, so the production TX/RX paths carry
+// no logging code at all. pd_trace_decode dumps header fields, data objects
+// and CRC-32 for every frame. pd_trace_capture writes every frame as a
+// binary record to the stream given to pd_trace_capture_begin(), for bulk
+// decoding on a host with extras/pd_trace.cpp. PD_TRACE picks the policy
+// behind sendPacket(), receiveFrame() and receivePacket(); any of them can
+// also be named explicitly, e.g. pd_send_packet<pd_trace_decode>(...) from a
+// debug command.
+//
+// A capture is PD_CAPTURE_MAGIC followed by one record per frame:
+//
+//     offset  size  field
+//     0       4     micros() when the frame was loaded or read, LSB first
+//     4       1     flags: PD_CAPTURE_TX, PD_CAPTURE_CRC_BAD, pd_sop_t
+//     5       1     port index
+//     6       2     message header as on the wire, LSB first
+//     8       4n    the header's n data objects as on the wire
+//
+// Records are whole 32-bit words, so a reader walks a mapped capture with
+// aligned loads. Only frames that pass through the packet engine are
+// captured; the blocking path reads some replies itself.
+
+#ifndef PD_TRACE
+#define PD_TRACE                0       ///< 1: decode every frame to pd_log, 2: capture every frame
+#endif
+
+#define PD_CAPTURE_MAGIC        "PDCAP01\n"  ///< File header, 8 bytes without the NUL
+#define PD_CAPTURE_MAGIC_LEN    8
+#define PD_CAPTURE_RECORD_MAX   (8 + 7 * 4)     ///< Header plus seven data objects
+#define PD_CAPTURE_TX           0x01    ///< Sent by this port (else received)
+#define PD_CAPTURE_CRC_BAD      0x02    ///< Received with a CRC mismatch
+#define PD_CAPTURE_SOP(flags)   (((flags) >> 2) & 0x3)  ///< pd_sop_t of the frame
+
+/**
+ * @brief Production policy: nothing is traced
+ */
+struct pd_trace_none {
+    static inline void tx(const uint8_t *, const uint8_t *) {}
+    static inline void rx(const pd_msg_t *, bool) {}
+};
+
+/**
+ * @brief Debug policy: decode every frame to pd_log
+ */
+struct pd_trace_decode {
+    static void tx(const uint8_t *header, const uint8_t *objects);
+    static void rx(const pd_msg_t *msg, bool crc_ok);
+};
+
+/**
+ * @brief Capture policy: every frame as a binary record
+ */
+struct pd_trace_capture {
+    static void tx(const uint8_t *header, const uint8_t *objects);
+    static void rx(const pd_msg_t *msg, bool crc_ok);
+};
+
+/**
+ * @brief Start a capture: write PD_CAPTURE_MAGIC and send every record to out
+ *
+ * Records go out from core 1 as the frames pass, so out should buffer
+ * (USB CDC Serial, a file) rather than block on a slow UART.
+ *
+ * @param out Destination, NULL to stop capturing
+ */
+void pd_trace_capture_begin(Print *out);
+
+#if PD_TRACE == 2
+typedef pd_trace_capture pd_trace_t;
+#elif PD_TRACE
+typedef pd_trace_decode pd_trace_t;
+#else
+typedef pd_trace_none pd_trace_t;
+#endif
+
+//=============================================================================
+// Packet Engine
+//=============================================================================
+
+/**
+ * @brief Assemble a SOP* frame in pd_frame, load it into the TX FIFO and start it
+ * @param extended Extended message flag
+ * @param num_data_objects Number of 32-bit data objects (0-7)
+ * @param message_id Message ID (0-7)
+ * @param port_power_role Power role (0=sink, 1=source)
+ * @param spec_rev Specification revision field (0-3)
+ * @param port_data_role Data role (0=UFP, 1=DFP)
+ * @param message_type 5-bit message type
+ * @param data_objects Data objects, LSB first
+ * @param sop pd_sop_t ordered set to start the frame with
+ */
+template <class Trace>
+void pd_send_packet(bool extended, uint8_t num_data_objects, uint8_t message_id,
+                    uint8_t port_power_role, uint8_t spec_rev, uint8_t port_data_role,
+                    uint8_t message_type, const uint8_t *data_objects, uint8_t sop);
+
+/**
+ * @brief Read one whole frame from the RX FIFO without waiting
+ * @param msg Destination
+ * @return true if a frame with a valid CRC was read (GoodCRC included)
+ */
+template <class Trace>
+bool pd_receive_frame(pd_msg_t *msg);
+
+// All policies are instantiated in Protocol_Engine.cpp
+extern template void pd_send_packet<pd_trace_none>(bool, uint8_t, uint8_t, uint8_t, uint8_t,
+                                                   uint8_t, uint8_t, const uint8_t *, uint8_t);
+extern template void pd_send_packet<pd_trace_decode>(bool, uint8_t, uint8_t, uint8_t, uint8_t,
+                                                     uint8_t, uint8_t, const uint8_t *, uint8_t);
+extern template void pd_send_packet<pd_trace_capture>(bool, uint8_t, uint8_t, uint8_t, uint8_t,
+                                                      uint8_t, uint8_t, const uint8_t *, uint8_t);
+extern template bool pd_receive_frame<pd_trace_none>(pd_msg_t *);
+extern template bool pd_receive_frame<pd_trace_decode>(pd_msg_t *);
+extern template bool pd_receive_frame<pd_trace_capture>(pd_msg_t *);
+
+#endif // PD_TRACE_H
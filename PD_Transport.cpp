@@ -0,0 +1,116 @@
+#include "PD_Transport.h"
+
+#if defined(ARDUINO_ARCH_RP2040) && PD_I2C_DMA
+PD_TLS pd_transport_t *pd_bus = pd_rp2040_dma_transport();
+#elif defined(ARDUINO)
+PD_TLS pd_transport_t *pd_bus = pd_wire_transport();
+#else
+PD_TLS pd_transport_t *pd_bus = 0;
+#endif
+
+/**
+ * Account for one finished transfer in the transport's stats
+ */
+static void account(pd_transport_t *bus, pd_bus_status_t status, uint32_t elapsed,
+                    uint16_t tx_len, uint16_t rx_len) {
+    bus->stats.transactions++;
+    bus->stats.busy_us += elapsed;
+    if (elapsed > bus->stats.max_us) {
+        bus->stats.max_us = elapsed;
+    }
+    if (status == PD_BUS_OK) {
+        bus->stats.bytes_written += tx_len;
+        bus->stats.bytes_read += rx_len;
+    } else {
+        bus->stats.errors++;
+    }
+    bus->last_status = status;
+}
+
+/**
+ * Run one transfer and account for it in the transport's stats
+ */
+pd_bus_status_t pd_bus_transfer(pd_transport_t *bus, uint8_t addr,
+                                const uint8_t *tx, uint16_t tx_len,
+                                uint8_t *rx, uint16_t rx_len) {
+    if (bus->active) {
+        pd_bus_wait(bus, bus->active);
+    }
+    uint32_t start = bus->clock_us(bus);
+    pd_bus_status_t status = bus->transfer(bus, addr, tx, tx_len, rx, rx_len);
+    account(bus, status, bus->clock_us(bus) - start, tx_len, rx_len);
+    return status;
+}
+
+/**
+ * Start an asynchronous transfer
+ */
+pd_bus_status_t pd_bus_submit(pd_transport_t *bus, pd_bus_xfer_t *xfer) {
+    if (bus->active) {
+        pd_bus_wait(bus, bus->active);
+    }
+    xfer->busy = true;
+    xfer->rx_done = 0;
+    xfer->status = PD_BUS_OK;
+    xfer->start_us = bus->clock_us(bus);
+
+    if (!bus->submit) {
+        // Synchronous backend: run it now and complete in place
+        bus->active = xfer;
+        pd_bus_complete(bus, bus->transfer(bus, xfer->addr, xfer->tx, xfer->tx_len,
+                                           xfer->rx, xfer->rx_len));
+        return xfer->status;
+    }
+
+    bus->active = xfer;
+    pd_bus_status_t status = bus->submit(bus, xfer);
+    if ((status != PD_BUS_OK) && xfer->busy) {
+        pd_bus_complete(bus, status);
+    }
+    return status;
+}
+
+/**
+ * Check an asynchronous transfer without blocking
+ */
+bool pd_bus_busy(pd_transport_t *bus, pd_bus_xfer_t *xfer) {
+    if (xfer->busy && bus->poll) {
+        bus->poll(bus);
+    }
+    return xfer->busy;
+}
+
+/**
+ * Wait for an asynchronous transfer to finish
+ */
+pd_bus_status_t pd_bus_wait(pd_transport_t *bus, pd_bus_xfer_t *xfer) {
+    while (pd_bus_busy(bus, xfer)) {}
+    return xfer->status;
+}
+
+/**
+ * Finish the in-flight transfer (called by backends)
+ */
+void pd_bus_complete(pd_transport_t *bus, pd_bus_status_t status) {
+    pd_bus_xfer_t *xfer = bus->active;
+    if (!xfer) {
+        return;
+    }
+    bus->active = 0;
+    account(bus, status, bus->clock_us(bus) - xfer->start_us, xfer->tx_len, xfer->rx_len);
+    if (status == PD_BUS_OK) {
+        xfer->rx_done = xfer->rx_len;
+    }
+    xfer->status = status;
+    xfer->busy = false;
+    if (xfer->done) {
+        xfer->done(xfer);
+    }
+}
+
+/**
+ * Clear a transport's counters
+ */
+void pd_bus_reset_stats(pd_transport_t *bus) {
+    bus->stats = pd_bus_stats_t();
+}
@@ -0,0 +1,224 @@
+#ifndef PD_TRANSPORT_H
+#define PD_TRANSPORT_H
+
+#include <stdint.h>
+
+#ifndef PD_TLS
+#define PD_TLS                      ///< Storage of the stack's mutable globals; thread_local for host farms
+#endif
+
+#ifndef PD_I2C_DMA
+#define PD_I2C_DMA          1       ///< Use the DMA backend on RP2040 targets
+#endif
+
+#ifndef PD_BUS_TIMEOUT_US
+#define PD_BUS_TIMEOUT_US   10000   ///< Async transfers abort after this long
+#endif
+
+//=============================================================================
+// I2C Transport Layer
+//=============================================================================
+
+// Every register and FIFO access goes through a pd_transport_t. A backend only
+// has to implement one combined transfer: write tx_len bytes, then (if rx_len
+// is non-zero) issue a repeated start and read rx_len bytes. That covers
+// single register writes, bursts and write-read register/FIFO reads.
+//
+// Backends may also accept asynchronous transfers (submit/poll). FIFO bursts
+// can then stream while the CPU keeps working, reading rx bytes as they land.
+// Only one transfer is in flight per bus; a synchronous transfer waits for
+// the pending one first, so register accesses stay ordered.
+//
+// Backends:
+//  - Arduino Wire     (PD_Transport_Wire.cpp, default on other Arduino targets)
+//  - RP2040 DMA       (PD_Transport_RP2040.cpp, default on the Pico, async)
+//  - Linux i2c-dev    (PD_Transport_Linux.cpp, /dev/i2c-N)
+//  - In-process model (PD_Sim.cpp, FUSB302B register/FIFO simulator, async)
+//
+// This header has no Arduino dependencies.
+
+/**
+ * @brief Result of a bus transaction
+ */
+typedef enum {
+    PD_BUS_OK = 0,              ///< Transaction completed
+    PD_BUS_NACK_ADDR = 1,       ///< Device did not acknowledge its address
+    PD_BUS_NACK_DATA = 2,       ///< Device did not acknowledge a data byte
+    PD_BUS_TIMEOUT = 3,         ///< Bus stuck or clock stretched too long
+    PD_BUS_SHORT_READ = 4,      ///< Fewer bytes returned than requested
+    PD_BUS_ERROR = 5            ///< Any other backend error
+} pd_bus_status_t;
+
+/**
+ * @brief Per-transport counters, updated by pd_bus_transfer()
+ */
+typedef struct {
+    uint32_t transactions;      ///< Completed or failed transfers
+    uint32_t errors;            ///< Transfers that did not return PD_BUS_OK
+    uint32_t bytes_written;     ///< Payload bytes written (incl. register address)
+    uint32_t bytes_read;        ///< Payload bytes read
+    uint32_t busy_us;           ///< Total time spent inside transfers
+    uint32_t max_us;            ///< Longest single transfer
+} pd_bus_stats_t;
+
+typedef struct pd_transport pd_transport_t;
+typedef struct pd_bus_xfer pd_bus_xfer_t;
+
+/**
+ * @brief Completion callback, may run in interrupt context
+ */
+typedef void (*pd_bus_done_t)(pd_bus_xfer_t *xfer);
+
+/**
+ * @brief Asynchronous transfer descriptor
+ *
+ * Owned by the caller and must stay valid (with its buffers) until busy
+ * clears. rx_done counts the leading rx bytes that are already valid.
+ */
+struct pd_bus_xfer {
+    uint8_t addr;               ///< 7-bit device address
+    const uint8_t *tx;          ///< Bytes to write (register address first)
+    uint16_t tx_len;
+    uint8_t *rx;                ///< Buffer for bytes read after a repeated start
+    uint16_t rx_len;
+    pd_bus_done_t done;         ///< Optional completion callback
+    void *user;                 ///< Caller context for done
+
+    volatile bool busy;                 ///< Set by submit, cleared on completion
+    volatile uint16_t rx_done;          ///< rx bytes received so far
+    volatile pd_bus_status_t status;    ///< Result once busy clears
+    uint32_t start_us;                  ///< Submission time (stats)
+    uint8_t reg;                        ///< Register address storage for FIFO helpers
+};
+
+/**
+ * @brief I2C transport instance
+ */
+struct pd_transport {
+    const char *name;           ///< Backend name for logs
+
+    /**
+     * Combined transfer: write tx, then repeated-start read rx.
+     * Either length may be zero (but not both).
+     */
+    pd_bus_status_t (*transfer)(pd_transport_t *bus, uint8_t addr,
+                                const uint8_t *tx, uint16_t tx_len,
+                                uint8_t *rx, uint16_t rx_len);
+
+    /** Microsecond clock used for the timing counters */
+    uint32_t (*clock_us)(pd_transport_t *bus);
+
+    /**
+     * Start an asynchronous transfer (NULL if the backend is synchronous).
+     * The backend calls pd_bus_complete() when it finishes.
+     */
+    pd_bus_status_t (*submit)(pd_transport_t *bus, pd_bus_xfer_t *xfer);
+
+    /** Advance the in-flight transfer: update rx_done, detect completion */
+    void (*poll)(pd_transport_t *bus);
+
+    void *ctx;                  ///< Backend private state
+    pd_bus_xfer_t *active;      ///< Transfer in flight, NULL when idle
+    pd_bus_stats_t stats;       ///< Counters, see pd_bus_transfer()
+    pd_bus_status_t last_status; ///< Result of the most recent transfer
+};
+
+/**
+ * @brief Run one transfer on a transport and account for it in its stats
+ * @param bus Transport
+ * @param addr 7-bit device address
+ * @param tx Bytes to write (register address first)
+ * @param tx_len Number of bytes to write
+ * @param rx Buffer for bytes read after a repeated start
+ * @param rx_len Number of bytes to read
+ * @return Transfer status
+ */
+pd_bus_status_t pd_bus_transfer(pd_transport_t *bus, uint8_t addr,
+                                const uint8_t *tx, uint16_t tx_len,
+                                uint8_t *rx, uint16_t rx_len);
+
+/**
+ * @brief Start an asynchronous transfer
+ *
+ * Waits for any transfer already in flight. On synchronous backends the
+ * transfer runs to completion before this returns.
+ *
+ * @param bus Transport
+ * @param xfer Descriptor with addr, tx, rx and optional done filled in
+ * @return PD_BUS_OK if the transfer was started (or completed), else the error
+ */
+pd_bus_status_t pd_bus_submit(pd_transport_t *bus, pd_bus_xfer_t *xfer);
+
+/**
+ * @brief Check an asynchronous transfer without blocking
+ * @param bus Transport
+ * @param xfer Transfer
+ * @return true while the transfer is still in flight
+ */
+bool pd_bus_busy(pd_transport_t *bus, pd_bus_xfer_t *xfer);
+
+/**
+ * @brief Wait for an asynchronous transfer to finish
+ * @param bus Transport
+ * @param xfer Transfer
+ * @return Transfer status
+ */
+pd_bus_status_t pd_bus_wait(pd_transport_t *bus, pd_bus_xfer_t *xfer);
+
+/**
+ * @brief Finish the in-flight transfer (called by backends)
+ * @param bus Transport
+ * @param status Transfer result
+ */
+void pd_bus_complete(pd_transport_t *bus, pd_bus_status_t status);
+
+/**
+ * @brief Clear a transport's counters
+ * @param bus Transport
+ */
+void pd_bus_reset_stats(pd_transport_t *bus);
+
+/**
+ * @brief Transport used by setReg/getReg/sendBytes/receiveBytes
+ *
+ * Defaults to the DMA backend on the RP2040 (unless PD_I2C_DMA is 0), the Wire
+ * backend on other Arduino targets and NULL elsewhere; host programs point it
+ * at a Linux or simulated transport before use.
+ */
+extern PD_TLS pd_transport_t *pd_bus;
+
+/**
+ * @brief Arduino Wire backend (Arduino targets only)
+ * @return Shared Wire transport instance
+ */
+pd_transport_t *pd_wire_transport();
+
+/**
+ * @brief RP2040 I2C + DMA backend (RP2040 targets only)
+ *
+ * Drives the I2C block Wire.begin() configured (PD_I2C_INST) directly: one
+ * DMA channel feeds commands into IC_DATA_CMD, a second drains received bytes,
+ * and the I2C STOP_DET/TX_ABRT interrupt completes the transfer.
+ *
+ * @return Shared DMA transport instance
+ */
+pd_transport_t *pd_rp2040_dma_transport();
+
+/**
+ * @brief Open a Linux i2c-dev backend (Linux only)
+ *
+ * Uses I2C_RDWR combined transactions when the adapter supports plain I2C and
+ * falls back to SMBus I2C-block transfers otherwise (e.g. the i2c-stub module).
+ *
+ * @param device Device node, e.g. "/dev/i2c-1"
+ * @return Transport, or NULL if the device could not be opened
+ */
+pd_transport_t *pd_linux_transport_open(const char *device);
+
+/**
+ * @brief Close a transport returned by pd_linux_transport_open()
+ * @param bus Transport
+ */
+void pd_linux_transport_close(pd_transport_t *bus);
+
+#endif // PD_TRANSPORT_H
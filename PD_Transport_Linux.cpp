@@ -0,0 +1,190 @@
+#if defined(__linux__) && !defined(ARDUINO)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "PD_Transport.h"
+
+// SMBus I2C-block transfers carry at most this many data bytes
+#define SMBUS_BLOCK_MAX     I2C_SMBUS_BLOCK_MAX
+
+typedef struct {
+    int fd;
+    bool plain_i2c;             // Adapter supports I2C_RDWR
+    int bound_addr;             // Address set with I2C_SLAVE (SMBus path)
+} linux_bus_t;
+
+static pd_bus_status_t errno_status() {
+    switch (errno) {
+        case ENXIO:
+        case EREMOTEIO:
+            return PD_BUS_NACK_ADDR;
+        case ETIMEDOUT:
+            return PD_BUS_TIMEOUT;
+        default:
+            return PD_BUS_ERROR;
+    }
+}
+
+static pd_bus_status_t rdwr_transfer(linux_bus_t *lb, uint8_t addr,
+                                     const uint8_t *tx, uint16_t tx_len,
+                                     uint8_t *rx, uint16_t rx_len) {
+    struct i2c_msg msgs[2];
+    struct i2c_rdwr_ioctl_data xfer;
+    int n = 0;
+
+    if (tx_len > 0) {
+        msgs[n].addr = addr;
+        msgs[n].flags = 0;
+        msgs[n].len = tx_len;
+        msgs[n].buf = (uint8_t *)tx;
+        n++;
+    }
+    if (rx_len > 0) {
+        msgs[n].addr = addr;
+        msgs[n].flags = I2C_M_RD;
+        msgs[n].len = rx_len;
+        msgs[n].buf = rx;
+        n++;
+    }
+    xfer.msgs = msgs;
+    xfer.nmsgs = n;
+    if (ioctl(lb->fd, I2C_RDWR, &xfer) < 0) {
+        return errno_status();
+    }
+    return PD_BUS_OK;
+}
+
+static int smbus_access(int fd, char rw, uint8_t cmd, int size, union i2c_smbus_data *data) {
+    struct i2c_smbus_ioctl_data args;
+    args.read_write = rw;
+    args.command = cmd;
+    args.size = size;
+    args.data = data;
+    return ioctl(fd, I2C_SMBUS, &args);
+}
+
+/**
+ * SMBus fallback: the first tx byte is the register, the rest is written as
+ * I2C-block data and reads use I2C-block reads from the same register. Long
+ * transfers are split into SMBus-sized chunks; the FUSB302B FIFO register does
+ * not auto-increment, so chunked FIFO access still works.
+ */
+static pd_bus_status_t smbus_transfer(linux_bus_t *lb, uint8_t addr,
+                                      const uint8_t *tx, uint16_t tx_len,
+                                      uint8_t *rx, uint16_t rx_len) {
+    union i2c_smbus_data data;
+
+    if (tx_len == 0) {
+        return PD_BUS_ERROR; // Register-less reads are not expressible
+    }
+    if (lb->bound_addr != addr) {
+        if (ioctl(lb->fd, I2C_SLAVE, addr) < 0) {
+            return errno_status();
+        }
+        lb->bound_addr = addr;
+    }
+
+    uint8_t reg = tx[0];
+    uint16_t done = 1;
+    while (done < tx_len) {
+        uint16_t chunk = tx_len - done;
+        if (chunk > SMBUS_BLOCK_MAX) {
+            chunk = SMBUS_BLOCK_MAX;
+        }
+        data.block[0] = chunk;
+        memcpy(&data.block[1], &tx[done], chunk);
+        if (smbus_access(lb->fd, I2C_SMBUS_WRITE, reg, I2C_SMBUS_I2C_BLOCK_DATA, &data) < 0) {
+            return errno_status();
+        }
+        done += chunk;
+    }
+
+    done = 0;
+    while (done < rx_len) {
+        uint16_t chunk = rx_len - done;
+        if (chunk > SMBUS_BLOCK_MAX) {
+            chunk = SMBUS_BLOCK_MAX;
+        }
+        data.block[0] = chunk;
+        if (smbus_access(lb->fd, I2C_SMBUS_READ, reg, I2C_SMBUS_I2C_BLOCK_DATA, &data) < 0) {
+            return errno_status();
+        }
+        if (data.block[0] < chunk) {
+            return PD_BUS_SHORT_READ;
+        }
+        memcpy(&rx[done], &data.block[1], chunk);
+        done += chunk;
+    }
+    return PD_BUS_OK;
+}
+
+static pd_bus_status_t linux_transfer(pd_transport_t *bus, uint8_t addr,
+                                      const uint8_t *tx, uint16_t tx_len,
+                                      uint8_t *rx, uint16_t rx_len) {
+    linux_bus_t *lb = (linux_bus_t *)bus->ctx;
+    if (lb->plain_i2c) {
+        return rdwr_transfer(lb, addr, tx, tx_len, rx, rx_len);
+    }
+    return smbus_transfer(lb, addr, tx, tx_len, rx, rx_len);
+}
+
+static uint32_t linux_clock_us(pd_transport_t *) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000);
+}
+
+/**
+ * Open a Linux i2c-dev backend
+ */
+pd_transport_t *pd_linux_transport_open(const char *device) {
+    unsigned long funcs = 0;
+    int fd = open(device, O_RDWR);
+    if (fd < 0) {
+        return 0;
+    }
+    if (ioctl(fd, I2C_FUNCS, &funcs) < 0) {
+        close(fd);
+        return 0;
+    }
+
+    linux_bus_t *lb = (linux_bus_t *)calloc(1, sizeof(linux_bus_t));
+    pd_transport_t *bus = (pd_transport_t *)calloc(1, sizeof(pd_transport_t));
+    if (!lb || !bus) {
+        free(lb);
+        free(bus);
+        close(fd);
+        return 0;
+    }
+    lb->fd = fd;
+    lb->plain_i2c = (funcs & I2C_FUNC_I2C) != 0;
+    lb->bound_addr = -1;
+
+    bus->name = lb->plain_i2c ? "i2c-dev" : "i2c-dev/smbus";
+    bus->transfer = linux_transfer;
+    bus->clock_us = linux_clock_us;
+    bus->ctx = lb;
+    return bus;
+}
+
+/**
+ * Close a Linux i2c-dev backend
+ */
+void pd_linux_transport_close(pd_transport_t *bus) {
+    if (!bus) {
+        return;
+    }
+    linux_bus_t *lb = (linux_bus_t *)bus->ctx;
+    close(lb->fd);
+    free(lb);
+    free(bus);
+}
+
+#endif // __linux__ && !ARDUINO
@@ -0,0 +1,222 @@
+#if defined(ARDUINO_ARCH_RP2040)
+
+#include <Arduino.h>
+#include <hardware/dma.h>
+#include <hardware/i2c.h>
+#include <hardware/irq.h>
+#include <hardware/sync.h>
+#include "PD_Transport.h"
+
+#ifndef PD_I2C_INST
+#define PD_I2C_INST         i2c0    ///< I2C block set up by Wire.begin()
+#endif
+
+// Longest transfer: register address + the 80 byte RX FIFO, with headroom
+#define DMA_MAX_CMDS        96
+
+typedef struct {
+    bool ready;
+    int tx_chan;                    // Commands into IC_DATA_CMD
+    int rx_chan;                    // Received bytes out of IC_DATA_CMD
+    uint16_t cmd[DMA_MAX_CMDS];     // DATA_CMD words: data | CMD | STOP | RESTART
+    pd_bus_xfer_t *cur;             // Transfer on the wire
+    bool stopped;                   // STOP_DET seen for cur
+} rp2040_dma_bus_t;
+
+static rp2040_dma_bus_t dma_bus;
+static pd_transport_t *dma_transport();
+
+static void dma_service();
+
+static void i2c_irq_handler() {
+    dma_service();
+}
+
+static void dma_bus_init() {
+    i2c_hw_t *hw = i2c_get_hw(PD_I2C_INST);
+    dma_bus.tx_chan = dma_claim_unused_channel(true);
+    dma_bus.rx_chan = dma_claim_unused_channel(true);
+    hw->dma_tdlr = 4;
+    hw->dma_rdlr = 0;
+    hw->dma_cr = I2C_IC_DMA_CR_TDMAE_BITS | I2C_IC_DMA_CR_RDMAE_BITS;
+    hw->intr_mask = 0;
+
+    uint irq = I2C0_IRQ + i2c_hw_index(PD_I2C_INST);
+    irq_add_shared_handler(irq, i2c_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(irq, true);
+    dma_bus.ready = true;
+}
+
+/**
+ * Hand the finished transfer back: through pd_bus_complete() when it was
+ * submitted asynchronously, in place for a synchronous transfer
+ */
+static void dma_finish(pd_bus_status_t status) {
+    i2c_hw_t *hw = i2c_get_hw(PD_I2C_INST);
+    pd_bus_xfer_t *xfer = dma_bus.cur;
+    pd_transport_t *bus = dma_transport();
+
+    hw->intr_mask = 0;
+    dma_bus.cur = 0;
+    if (bus->active == xfer) {
+        pd_bus_complete(bus, status);
+    } else {
+        xfer->status = status;
+        xfer->busy = false;
+    }
+}
+
+/**
+ * Progress and completion; runs from the I2C interrupt and from poll with
+ * interrupts off
+ */
+static void dma_service() {
+    i2c_hw_t *hw = i2c_get_hw(PD_I2C_INST);
+    pd_bus_xfer_t *xfer = dma_bus.cur;
+    if (!xfer) {
+        return;
+    }
+    if (xfer->rx_len) {
+        xfer->rx_done = xfer->rx_len - dma_hw->ch[dma_bus.rx_chan].transfer_count;
+    }
+
+    uint32_t raw = hw->raw_intr_stat;
+    if (raw & I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS) {
+        uint32_t source = hw->tx_abrt_source;
+        (void)hw->clr_tx_abrt;
+        dma_channel_abort(dma_bus.tx_chan);
+        dma_channel_abort(dma_bus.rx_chan);
+        if (source & I2C_IC_TX_ABRT_SOURCE_ABRT_7B_ADDR_NOACK_BITS) {
+            dma_finish(PD_BUS_NACK_ADDR);
+        } else if (source & I2C_IC_TX_ABRT_SOURCE_ABRT_TXDATA_NOACK_BITS) {
+            dma_finish(PD_BUS_NACK_DATA);
+        } else {
+            dma_finish(PD_BUS_ERROR);
+        }
+        return;
+    }
+    if (raw & I2C_IC_RAW_INTR_STAT_STOP_DET_BITS) {
+        (void)hw->clr_stop_det;
+        dma_bus.stopped = true;
+    }
+    // After STOP every read byte is in the RX FIFO; wait for DMA to drain it
+    if (dma_bus.stopped && !dma_channel_is_busy(dma_bus.rx_chan)) {
+        dma_finish(PD_BUS_OK);
+        return;
+    }
+    if ((time_us_32() - xfer->start_us) > PD_BUS_TIMEOUT_US) {
+        dma_channel_abort(dma_bus.tx_chan);
+        dma_channel_abort(dma_bus.rx_chan);
+        hw->enable = 0; // Flushes the FIFOs and releases the bus
+        hw->enable = 1;
+        dma_finish(PD_BUS_TIMEOUT);
+    }
+}
+
+/**
+ * Translate the transfer into DATA_CMD words and start both DMA channels
+ */
+static pd_bus_status_t dma_start(pd_bus_xfer_t *xfer) {
+    i2c_hw_t *hw = i2c_get_hw(PD_I2C_INST);
+    uint16_t n = 0;
+
+    if ((xfer->tx_len + xfer->rx_len) > DMA_MAX_CMDS) {
+        return PD_BUS_ERROR;
+    }
+    if (!dma_bus.ready) {
+        dma_bus_init();
+    }
+    for (uint16_t i = 0; i < xfer->tx_len; i++) {
+        dma_bus.cmd[n++] = xfer->tx[i];
+    }
+    for (uint16_t i = 0; i < xfer->rx_len; i++) {
+        dma_bus.cmd[n] = I2C_IC_DATA_CMD_CMD_BITS;
+        if ((i == 0) && (xfer->tx_len > 0)) {
+            dma_bus.cmd[n] |= I2C_IC_DATA_CMD_RESTART_BITS;
+        }
+        n++;
+    }
+    dma_bus.cmd[n - 1] |= I2C_IC_DATA_CMD_STOP_BITS;
+
+    hw->enable = 0;
+    hw->tar = xfer->addr;
+    hw->enable = 1;
+    (void)hw->clr_tx_abrt;
+    (void)hw->clr_stop_det;
+
+    xfer->start_us = time_us_32();
+    dma_bus.cur = xfer;
+    dma_bus.stopped = false;
+
+    if (xfer->rx_len) {
+        dma_channel_config c = dma_channel_get_default_config(dma_bus.rx_chan);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+        channel_config_set_read_increment(&c, false);
+        channel_config_set_write_increment(&c, true);
+        channel_config_set_dreq(&c, i2c_get_dreq(PD_I2C_INST, false));
+        dma_channel_configure(dma_bus.rx_chan, &c, xfer->rx, &hw->data_cmd, xfer->rx_len, true);
+    }
+
+    dma_channel_config c = dma_channel_get_default_config(dma_bus.tx_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, i2c_get_dreq(PD_I2C_INST, true));
+
+    hw->intr_mask = I2C_IC_INTR_MASK_M_STOP_DET_BITS | I2C_IC_INTR_MASK_M_TX_ABRT_BITS;
+    dma_channel_configure(dma_bus.tx_chan, &c, &hw->data_cmd, dma_bus.cmd, n, true);
+    return PD_BUS_OK;
+}
+
+static void dma_poll(pd_transport_t *bus) {
+    uint32_t irq_state = save_and_disable_interrupts();
+    dma_service();
+    restore_interrupts(irq_state);
+}
+
+static pd_bus_status_t dma_submit(pd_transport_t *bus, pd_bus_xfer_t *xfer) {
+    uint32_t irq_state = save_and_disable_interrupts();
+    pd_bus_status_t status = dma_start(xfer);
+    restore_interrupts(irq_state);
+    return status;
+}
+
+static pd_bus_status_t dma_transfer(pd_transport_t *bus, uint8_t addr,
+                                    const uint8_t *tx, uint16_t tx_len,
+                                    uint8_t *rx, uint16_t rx_len) {
+    pd_bus_xfer_t xfer = {};
+    xfer.addr = addr;
+    xfer.tx = tx;
+    xfer.tx_len = tx_len;
+    xfer.rx = rx;
+    xfer.rx_len = rx_len;
+    xfer.busy = true;
+
+    pd_bus_status_t status = dma_submit(bus, &xfer);
+    if (status != PD_BUS_OK) {
+        return status;
+    }
+    while (xfer.busy) {
+        dma_poll(bus);
+    }
+    return xfer.status;
+}
+
+static uint32_t dma_clock_us(pd_transport_t *) {
+    return time_us_32();
+}
+
+static pd_transport_t *dma_transport() {
+    static pd_transport_t dma_transport_bus = {"rp2040-dma", dma_transfer, dma_clock_us,
+                                               dma_submit, dma_poll, &dma_bus, 0, {}, PD_BUS_OK};
+    return &dma_transport_bus;
+}
+
+/**
+ * RP2040 I2C + DMA backend
+ */
+pd_transport_t *pd_rp2040_dma_transport() {
+    return dma_transport();
+}
+
+#endif // ARDUINO_ARCH_RP2040
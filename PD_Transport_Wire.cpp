@@ -0,0 +1,64 @@
+#if defined(ARDUINO)
+
+#include <Arduino.h>
+#include <Wire.h>
+#include "PD_Transport.h"
+
+/**
+ * Map Wire.endTransmission() return codes onto transport status
+ */
+static pd_bus_status_t wire_status(uint8_t code) {
+    switch (code) {
+        case 0:
+            return PD_BUS_OK;
+        case 2:
+            return PD_BUS_NACK_ADDR;
+        case 3:
+            return PD_BUS_NACK_DATA;
+        case 5:
+            return PD_BUS_TIMEOUT;
+        default:
+            return PD_BUS_ERROR;
+    }
+}
+
+static pd_bus_status_t wire_transfer(pd_transport_t *bus, uint8_t addr,
+                                     const uint8_t *tx, uint16_t tx_len,
+                                     uint8_t *rx, uint16_t rx_len) {
+    if (tx_len > 0) {
+        Wire.beginTransmission(addr);
+        Wire.write(tx, tx_len);
+        // Keep the bus for a repeated start when a read follows
+        pd_bus_status_t status = wire_status(Wire.endTransmission(rx_len == 0));
+        if (status != PD_BUS_OK) {
+            return status;
+        }
+    }
+    if (rx_len > 0) {
+        uint16_t got = Wire.requestFrom((int)addr, (int)rx_len, true);
+        for (uint16_t i = 0; i < got; i++) {
+            rx[i] = Wire.read();
+        }
+        if (got == 0) {
+            return PD_BUS_NACK_ADDR;
+        }
+        if (got < rx_len) {
+            return PD_BUS_SHORT_READ;
+        }
+    }
+    return PD_BUS_OK;
+}
+
+static uint32_t wire_clock_us(pd_transport_t *) {
+    return micros();
+}
+
+/**
+ * Arduino Wire backend
+ */
+pd_transport_t *pd_wire_transport() {
+    static pd_transport_t wire_bus = {"wire", wire_transfer, wire_clock_us, 0, 0, 0, 0, {}, PD_BUS_OK};
+    return &wire_bus;
+}
+
+#endif // ARDUINO
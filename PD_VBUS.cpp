@@ -0,0 +1,212 @@
+#include <Arduino.h>
+#include "PD_VBUS.h"
+#include "PD_Stats.h"
+#include "PD_Callbacks.h"
+#include "PD_Log.h"
+
+#define MEAS_CC_BITS (SWITCHES0_MEAS_CC1 | SWITCHES0_MEAS_CC2)
+
+/**
+ * @brief Comparator monitor of one port
+ */
+typedef struct {
+    pd_vbus_hook_t hook;            ///< Called on crossings
+    uint8_t code;                   ///< MDAC code armed: threshold (code + 1) steps
+    uint8_t measure;                ///< MEASURE before the monitor took it
+    uint8_t meas_cc;                ///< MEAS_CCx bits to give back on stop
+    bool active;                    ///< Armed, I_COMP_CHNG unmasked
+    bool above;                     ///< Last level seen against the threshold
+} pd_vbus_monitor_t;
+
+static PD_TLS pd_vbus_monitor_t vbus_monitors[PD_NUM_PORTS];
+static PD_TLS uint16_t vbus_settle_us = PD_VBUS_SETTLE_US;
+
+static pd_vbus_monitor_t *current() {
+    return &vbus_monitors[pd_port - pd_ports];
+}
+
+/**
+ * Record the level against the monitor threshold, true on a crossing
+ */
+static bool monitor_level(pd_vbus_monitor_t *mon, bool above) {
+    if (above == mon->above) {
+        return false;
+    }
+    mon->above = above;
+    pd_stats_inc(PD_CNT_VBUS_CROSSINGS);
+    if (mon->hook) {
+        mon->hook(above);
+    }
+    return true;
+}
+
+/**
+ * Set the MEASURE to STATUS0 settle time
+ */
+void pd_vbus_set_settle_us(uint16_t us) {
+    vbus_settle_us = us;
+}
+
+/**
+ * Current settle time
+ */
+uint16_t pd_vbus_settle_us() {
+    return vbus_settle_us;
+}
+
+/**
+ * Measure VBUS: binary search for the highest MDAC step VBUS is above
+ */
+bool pd_vbus_measure(pd_vbus_reading_t *reading) {
+    pd_vbus_monitor_t *mon = current();
+    uint32_t transactions = pd_bus->stats.transactions;
+    uint32_t start_us = micros();
+    uint8_t regs[3]; // SWITCHES0, SWITCHES1, MEASURE
+    uint8_t lo = 0;
+    uint8_t hi = MEASURE_MDAC;
+
+    if ((pd_port->power_state != PD_POWER_ACTIVE) || !getRegs(REG_SWITCHES0, regs, sizeof(regs))) {
+        return false;
+    }
+    uint8_t meas_cc = regs[0] & MEAS_CC_BITS;
+    if (meas_cc) {
+        setReg(REG_SWITCHES0, regs[0] & ~MEAS_CC_BITS);
+    }
+
+    // Invariant: VBUS is above lo steps and not above hi + 1
+    while (lo < hi) {
+        uint8_t mid = (lo + hi + 1) / 2;
+        setReg(REG_MEASURE, MEASURE_MEAS_VBUS | (mid - 1));
+        delayMicroseconds(vbus_settle_us);
+        if (getReg(REG_STATUS0) & STATUS0_COMP) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    setReg(REG_MEASURE, mon->active ? (MEASURE_MEAS_VBUS | mon->code) : regs[2]);
+    if (meas_cc) {
+        setReg(REG_SWITCHES0, regs[0]);
+    }
+
+    reading->min_mv = lo * MEASURE_VBUS_STEP_MV;
+    reading->max_mv = (lo < MEASURE_MDAC) ? (lo + 1) * MEASURE_VBUS_STEP_MV : 0xFFFF;
+    reading->transactions = pd_bus->stats.transactions - transactions;
+    reading->us = micros() - start_us;
+    pd_stats_inc(PD_CNT_VBUS_READINGS);
+    pd_stats_add(PD_CNT_VBUS_TRANSACTIONS, reading->transactions);
+    pd_stats_set(PD_CNT_VBUS_MV, reading->min_mv);
+
+    // The search ran past the monitor threshold, so it knows the level too
+    if (mon->active && (mon->code < MEASURE_MDAC)) {
+        monitor_level(mon, lo > mon->code);
+    }
+    return true;
+}
+
+/**
+ * Compare VBUS with the voltage of the last Request
+ */
+bool pd_vbus_check_contract() {
+    uint32_t expected_mv = contract_mv();
+    pd_vbus_reading_t reading;
+
+    pd_port->vbus_ok = false;
+    if (!expected_mv) {
+        pd_port->vbus_ok = true; // Nothing to compare with
+        return true;
+    }
+    if (!pd_vbus_measure(&reading)) {
+        return false;
+    }
+
+    // VBUS lies in (min_mv, max_mv]; it matches if that bracket meets the tolerance band
+    uint32_t low_mv = expected_mv * (100 - PD_VBUS_TOLERANCE_PCT) / 100;
+    uint32_t high_mv = expected_mv * (100 + PD_VBUS_TOLERANCE_PCT) / 100;
+    pd_port->vbus_ok = (reading.max_mv >= low_mv) && (reading.min_mv < high_mv);
+
+    pd_log.print("VBUS above ");
+    pd_log.print(reading.min_mv);
+    pd_log.print(" mV, ");
+    pd_log.print(reading.transactions);
+    pd_log.println(" I2C transactions");
+    if (!pd_port->vbus_ok) {
+        pd_log.print("VBUS not at the contract voltage of ");
+        pd_log.print(expected_mv);
+        pd_log.println(" mV");
+        pd_stats_inc(PD_CNT_VBUS_MISMATCHES);
+        pd_cb_error(PD_CB_ERR_VBUS, reading.min_mv);
+    }
+    return pd_port->vbus_ok;
+}
+
+/**
+ * Arm the comparator at a threshold and unmask its interrupt
+ */
+bool pd_vbus_monitor(uint16_t threshold_mv, pd_vbus_hook_t hook) {
+    pd_vbus_monitor_t *mon = current();
+
+    if ((pd_port->power_state != PD_POWER_ACTIVE) || (threshold_mv < MEASURE_VBUS_STEP_MV) ||
+        (threshold_mv > (MEASURE_MDAC + 1) * MEASURE_VBUS_STEP_MV)) {
+        return false;
+    }
+    if (!mon->active) {
+        uint8_t regs[3]; // SWITCHES0, SWITCHES1, MEASURE
+        if (!getRegs(REG_SWITCHES0, regs, sizeof(regs))) {
+            return false;
+        }
+        mon->measure = regs[2];
+        mon->meas_cc = regs[0] & MEAS_CC_BITS;
+        if (mon->meas_cc) {
+            setReg(REG_SWITCHES0, regs[0] & ~MEAS_CC_BITS);
+        }
+    }
+
+    mon->code = threshold_mv / MEASURE_VBUS_STEP_MV - 1;
+    mon->hook = hook;
+    setReg(REG_MEASURE, MEASURE_MEAS_VBUS | mon->code);
+    delayMicroseconds(vbus_settle_us);
+    mon->above = getReg(REG_STATUS0) & STATUS0_COMP;
+
+    if (!mon->active) {
+        setReg(REG_MASK, getReg(REG_MASK) & ~INTERRUPT_I_COMP_CHNG);
+        mon->active = true;
+    }
+    return true;
+}
+
+/**
+ * Mask the comparator interrupt and give the measure block back to the CC line
+ */
+void pd_vbus_monitor_stop() {
+    pd_vbus_monitor_t *mon = current();
+
+    if (!mon->active) {
+        return;
+    }
+    mon->active = false;
+    setReg(REG_MASK, getReg(REG_MASK) | INTERRUPT_I_COMP_CHNG);
+    setReg(REG_MEASURE, mon->measure);
+    if (mon->meas_cc) {
+        setReg(REG_SWITCHES0, getReg(REG_SWITCHES0) | mon->meas_cc);
+    }
+}
+
+/**
+ * Comparator interrupt: a crossing if the level differs from the last one seen
+ */
+bool pd_vbus_comp_changed(bool comp) {
+    pd_vbus_monitor_t *mon = current();
+
+    // Readings and re-arming flip COMP too; only a level change is a crossing
+    return mon->active && monitor_level(mon, comp);
+}
+
+/**
+ * Forget the monitor and the contract check
+ */
+void pd_vbus_reset() {
+    current()->active = false;
+    pd_port->vbus_ok = false;
+}
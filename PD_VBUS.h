@@ -0,0 +1,111 @@
+#ifndef PD_VBUS_H
+#define PD_VBUS_H
+
+#include <stdint.h>
+#include "FUSB302B.h"
+
+//=============================================================================
+// VBUS Measurement
+//=============================================================================
+
+// VBUS read through the FUSB302B measure block. With MEAS_VBUS set, STATUS0
+// COMP tells whether VBUS is above (MDAC + 1) x 420 mV, so a reading is a
+// binary search over the 6-bit MDAC: six comparator steps of one MEASURE
+// write, one settle time and one STATUS0 read each, where a linear sweep
+// takes up to 64. A reading brackets VBUS to one 420 mV step and saturates
+// above 26.46 V, so EPR voltages above that only read as "at least".
+//
+// The measure block watches one input at a time, so MEAS_CCx is off while
+// VBUS is measured or monitored and BC_LVL is not updated meanwhile. All
+// calls are for core 1, on the port being serviced, while attached (the
+// measure block is only powered then).
+
+/**
+ * @brief One VBUS reading: min_mv < VBUS <= max_mv
+ */
+typedef struct {
+    uint16_t min_mv;        ///< Highest threshold VBUS was above, 0 if none
+    uint16_t max_mv;        ///< Lowest threshold VBUS was not above, 0xFFFF when saturated
+    uint8_t transactions;   ///< I2C transactions the reading took
+    uint16_t us;            ///< Time the reading took, settle times included
+} pd_vbus_reading_t;
+
+/**
+ * @brief Called on core 1 (from check_interrupt) when VBUS crosses the monitor threshold
+ * @param above true if VBUS is now above the threshold
+ */
+typedef void (*pd_vbus_hook_t)(bool above);
+
+/**
+ * @brief Set the wait between a MEASURE write and the STATUS0 read
+ *
+ * The comparator needs the MDAC and the VBUS divider to settle after every
+ * threshold change. Shorter settles make faster readings; calibrate per
+ * board by lowering it until readings of a steady VBUS start to scatter.
+ *
+ * @param us Settle time, PD_VBUS_SETTLE_US at start-up
+ */
+void pd_vbus_set_settle_us(uint16_t us);
+
+/**
+ * @brief Current settle time
+ */
+uint16_t pd_vbus_settle_us();
+
+/**
+ * @brief Measure VBUS by successive approximation
+ *
+ * Takes 14 to 16 I2C transactions: the SWITCHES0..MEASURE burst, six
+ * MEASURE/STATUS0 pairs, the MEASURE restore and, unless the monitor has it
+ * off already, MEAS_CCx off and back on. A running monitor is re-armed
+ * afterwards and told about any crossing the reading revealed.
+ *
+ * @param reading Result
+ * @return false if the port is idle (measure block off)
+ */
+bool pd_vbus_measure(pd_vbus_reading_t *reading);
+
+/**
+ * @brief Check that the source delivered the voltage of the contract in place
+ *
+ * Call after PS_RDY. Measures VBUS and compares it with the voltage of the
+ * last Request (fixed PDO or AVS) within PD_VBUS_TOLERANCE_PCT, allowing
+ * for the reading's 420 mV bracket. The result is kept in pd_port->vbus_ok
+ * so the application can hold its load off until it is set.
+ *
+ * @return true if VBUS matches, or the contract's voltage cannot be checked
+ */
+bool pd_vbus_check_contract();
+
+/**
+ * @brief Watch VBUS against one threshold with the comparator interrupt
+ *
+ * Arms the MDAC at the threshold, rounded down to a 420 mV step, and
+ * unmasks I_COMP_CHNG; hook runs on every crossing. A window needs the hook
+ * to move the threshold with another call. Ends with pd_vbus_monitor_stop()
+ * or a reset of the FUSB302B (detach).
+ *
+ * @param threshold_mv 420 to 26880 mV
+ * @param hook Called on crossings, may be NULL (crossings are still counted)
+ * @return false if the port is idle or the threshold is out of range
+ */
+bool pd_vbus_monitor(uint16_t threshold_mv, pd_vbus_hook_t hook);
+
+/**
+ * @brief Stop the monitor and give the measure block back to the CC line
+ */
+void pd_vbus_monitor_stop();
+
+/**
+ * @brief Feed a comparator change to the monitor (handleCompChange)
+ * @param comp STATUS0 COMP at the interrupt
+ * @return true if it was a crossing of the monitor threshold
+ */
+bool pd_vbus_comp_changed(bool comp);
+
+/**
+ * @brief Forget the monitor and the contract check (the FUSB302B was reset)
+ */
+void pd_vbus_reset();
+
+#endif // PD_VBUS_H
@@ -0,0 +1,485 @@
+#include <string.h>
+#include <Arduino.h>
+#include <hardware/sync.h>
+#include "PD_VDM.h"
+#include "PD_Log.h"
+
+/**
+ * @brief Structured VDM state of one port
+ */
+typedef struct {
+    pd_vdm_partner_t partner;       ///< Discovery results
+    pd_vdm_cable_t cable;           ///< SOP' discovery results
+    volatile uint32_t attention;    ///< Queued Attention VDO
+    volatile uint16_t attention_svid; ///< SVID of the queued Attention
+    volatile bool attention_pending; ///< attention not sent yet
+    uint8_t mode_handler;           ///< Registry index + 1 of the entered mode, 0 = none
+    uint8_t mode_pos;               ///< Object position of the entered mode
+} pd_vdm_port_t;
+
+// Registry and identity are shared by every port
+static PD_TLS const pd_svid_handler_t *vdm_handlers[PD_VDM_MAX_SVIDS];
+static PD_TLS uint8_t vdm_num_handlers = 0;
+
+static PD_TLS uint32_t vdm_identity[3 + 3] = {
+    VDO_IDH_USB_DEVICE | (2UL << 27) | (2UL << 21) | PD_VDM_VID, // PDUSB peripheral, USB-C receptacle
+    0,                                  // Cert Stat: no XID
+    (uint32_t)PD_VDM_PID << 16,         // Product: bcdDevice 0
+    (3UL << 29) | (4UL << 24) | 1       // UFP VDO: USB 3.2 Gen 1 device
+};
+static PD_TLS uint8_t vdm_identity_count = 4;
+
+static PD_TLS pd_vdm_port_t vdm_ports[PD_NUM_PORTS];
+
+/**
+ * VDM state of the port being serviced
+ */
+static pd_vdm_port_t *current() {
+    return &vdm_ports[pd_port - pd_ports];
+}
+
+static uint32_t getObject(const uint8_t *object) {
+    return object[0] | (object[1] << 8) | ((uint32_t)object[2] << 16) | ((uint32_t)object[3] << 24);
+}
+
+static void putObject(uint8_t *object, uint32_t value) {
+    object[0] = value & 0xFF;
+    object[1] = (value >> 8) & 0xFF;
+    object[2] = (value >> 16) & 0xFF;
+    object[3] = (value >> 24) & 0xFF;
+}
+
+/**
+ * Registry index of an SVID, PD_VDM_MAX_SVIDS if none
+ */
+static uint8_t handlerIndex(uint16_t svid) {
+    for (uint8_t i = 0; i < vdm_num_handlers; i++) {
+        if (vdm_handlers[i]->svid == svid) {
+            return i;
+        }
+    }
+    return PD_VDM_MAX_SVIDS;
+}
+
+/**
+ * Add an SVID handler to the registry
+ */
+bool pd_vdm_register(const pd_svid_handler_t *handler) {
+    if ((vdm_num_handlers >= PD_VDM_MAX_SVIDS) || (handlerIndex(handler->svid) < PD_VDM_MAX_SVIDS)) {
+        return false;
+    }
+    vdm_handlers[vdm_num_handlers++] = handler;
+    return true;
+}
+
+/**
+ * Handler registered for an SVID
+ */
+const pd_svid_handler_t *pd_vdm_handler(uint16_t svid) {
+    uint8_t index = handlerIndex(svid);
+    return (index < PD_VDM_MAX_SVIDS) ? vdm_handlers[index] : NULL;
+}
+
+/**
+ * Replace the identity answered to Discover Identity
+ */
+bool pd_vdm_set_identity(const uint32_t *vdos, uint8_t num_vdos) {
+    if ((num_vdos < 3) || (num_vdos > 6)) {
+        return false;
+    }
+    memcpy(vdm_identity, vdos, num_vdos * sizeof(uint32_t));
+    vdm_identity_count = num_vdos;
+    return true;
+}
+
+/**
+ * SVDM version to use towards the partner
+ */
+uint8_t pd_vdm_version() {
+    return (pd_port->spec_revs[SOP_TYPE_SOP] >= PD_SPEC_REV_30) ? VDM_VERSION_20 : VDM_VERSION_10;
+}
+
+/**
+ * Serialize a VDM header and VDOs into data objects
+ */
+uint8_t pd_vdm_build(uint8_t *objects, uint32_t header, const uint32_t *vdos, uint8_t num_vdos) {
+    putObject(objects, header);
+    for (uint8_t i = 0; i < num_vdos; i++) {
+        putObject(&objects[(i + 1) * 4], vdos[i]);
+    }
+    return num_vdos + 1;
+}
+
+/**
+ * Discover Identity ACK VDOs; Modal Operation follows the registry
+ */
+static uint8_t identityVdos(uint32_t *vdos) {
+    memcpy(vdos, vdm_identity, vdm_identity_count * sizeof(uint32_t));
+    vdos[0] &= ~VDO_IDH_MODAL;
+    for (uint8_t i = 0; i < vdm_num_handlers; i++) {
+        if (vdm_handlers[i]->modes) {
+            vdos[0] |= VDO_IDH_MODAL;
+        }
+    }
+    return vdm_identity_count;
+}
+
+/**
+ * Discover SVIDs ACK VDOs: two SVIDs per VDO, ended by a zero SVID
+ */
+static uint8_t svidVdos(uint32_t *vdos) {
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < vdm_num_handlers; i++) {
+        if (!vdm_handlers[i]->modes) {
+            continue; // Only SVIDs with modes are discoverable
+        }
+        if (count & 1) {
+            vdos[count / 2] |= vdm_handlers[i]->svid;
+        } else {
+            vdos[count / 2] = (uint32_t)vdm_handlers[i]->svid << 16;
+        }
+        count++;
+    }
+    if (!count) {
+        return 0;
+    }
+    if (!(count & 1)) {
+        vdos[count / 2] = 0; // Even count: a VDO of two zero SVIDs ends the list
+    }
+    return (count / 2) + 1;
+}
+
+/**
+ * Answer a structured VDM request
+ */
+uint8_t pd_vdm_respond(const uint8_t *request, uint8_t num_data_objects, uint8_t *reply) {
+    if (!num_data_objects) {
+        return 0;
+    }
+    uint32_t header = getObject(request);
+    if (!(header & VDM_STRUCTURED) || (VDM_HDR_CMD_TYPE(header) != VDM_CMD_TYPE_REQ)) {
+        return 0;
+    }
+
+    pd_vdm_port_t *vp = current();
+    uint8_t port = pd_port - pd_ports;
+    uint16_t svid = VDM_HDR_SVID(header);
+    uint8_t command = VDM_HDR_CMD(header);
+    uint8_t pos = VDM_HDR_OBJ_POS(header);
+    uint8_t index = handlerIndex(svid);
+    const pd_svid_handler_t *handler = (index < PD_VDM_MAX_SVIDS) ? vdm_handlers[index] : NULL;
+    bool in_mode = handler && (vp->mode_handler == index + 1);
+    uint32_t in[PD_VDM_MAX_VDOS];
+    uint32_t vdos[PD_VDM_MAX_VDOS];
+    uint8_t num_in = (num_data_objects > PD_VDM_MAX_VDOS + 1) ? PD_VDM_MAX_VDOS : (num_data_objects - 1);
+    uint8_t num_vdos = 0;
+    vdm_cmd_type_t type = VDM_CMD_TYPE_NAK;
+
+    for (uint8_t i = 0; i < num_in; i++) {
+        in[i] = getObject(&request[(i + 1) * 4]);
+    }
+
+    switch (command) {
+    case VDM_CMD_DISCOVER_IDENTITY:
+        if (svid == PD_SID) {
+            num_vdos = identityVdos(vdos);
+            type = VDM_CMD_TYPE_ACK;
+        }
+        pos = 0;
+        break;
+    case VDM_CMD_DISCOVER_SVID:
+        if (svid == PD_SID) {
+            num_vdos = svidVdos(vdos);
+            type = num_vdos ? VDM_CMD_TYPE_ACK : VDM_CMD_TYPE_NAK;
+        }
+        pos = 0;
+        break;
+    case VDM_CMD_DISCOVER_MODES:
+        if (handler && handler->modes) {
+            num_vdos = handler->modes(vdos);
+            type = num_vdos ? VDM_CMD_TYPE_ACK : VDM_CMD_TYPE_NAK;
+        }
+        pos = 0;
+        break;
+    case VDM_CMD_ENTER_MODE:
+        // One mode at a time; entering the entered mode again is ACKed
+        if (in_mode && (vp->mode_pos == pos)) {
+            type = VDM_CMD_TYPE_ACK;
+        } else if (handler && handler->enter && pos && (pos != PD_VDM_EXIT_ALL) && !vp->mode_handler &&
+                   handler->enter(port, pos)) {
+            vp->mode_handler = index + 1;
+            vp->mode_pos = pos;
+            type = VDM_CMD_TYPE_ACK;
+        }
+        break;
+    case VDM_CMD_EXIT_MODE:
+        if (in_mode && ((pos == vp->mode_pos) || (pos == PD_VDM_EXIT_ALL))) {
+            vp->mode_handler = 0;
+            vp->attention_pending = false;
+            if (handler->exit) {
+                handler->exit(port, vp->mode_pos);
+            }
+            type = VDM_CMD_TYPE_ACK;
+        }
+        break;
+    case VDM_CMD_ATTENTION:
+        if (handler && handler->attention) {
+            handler->attention(port, header, in, num_in);
+        }
+        return 0; // Never answered
+    default:
+        if ((command >= VDM_CMD_SVID_FIRST) && in_mode && handler->command) {
+            type = handler->command(port, header, in, num_in, vdos, &num_vdos);
+        }
+        break;
+    }
+
+    if (type != VDM_CMD_TYPE_ACK) {
+        num_vdos = 0;
+    }
+    uint8_t version = VDM_HDR_VERSION(header);
+    if (version > pd_vdm_version()) {
+        version = pd_vdm_version();
+    }
+    return pd_vdm_build(reply, VDM_HEADER(svid, version, pos, type, command), vdos, num_vdos);
+}
+
+/**
+ * Record the partner's ACK to one of our discovery requests
+ */
+bool pd_vdm_record(const uint8_t *reply, uint8_t num_data_objects) {
+    if (!num_data_objects) {
+        return false;
+    }
+    pd_vdm_partner_t *partner = &current()->partner;
+    uint32_t header = getObject(reply);
+    uint8_t num_vdos = num_data_objects - 1;
+
+    if (VDM_HDR_CMD_TYPE(header) != VDM_CMD_TYPE_ACK) {
+        return false;
+    }
+    switch (VDM_HDR_CMD(header)) {
+    case VDM_CMD_DISCOVER_IDENTITY:
+        if (num_vdos >= 1) {
+            partner->id_header = getObject(&reply[4]);
+        }
+        if (num_vdos >= 3) {
+            partner->product = getObject(&reply[12]);
+        }
+        pd_log.print("Partner VID: ");
+        pd_log.print(VDO_IDH_VID(partner->id_header), HEX);
+        pd_log.print(" PID: ");
+        pd_log.println(partner->product >> 16, HEX);
+        return false;
+
+    case VDM_CMD_DISCOVER_SVID:
+        for (uint8_t i = 0; i < num_vdos * 2; i++) {
+            uint32_t vdo = getObject(&reply[((i / 2) + 1) * 4]);
+            uint16_t svid = (i & 1) ? (vdo & 0xFFFF) : (vdo >> 16);
+            if (!svid) {
+                return false; // End of the list
+            }
+            if (partner->num_svids >= PD_VDM_PARTNER_SVIDS) {
+                return false;
+            }
+            partner->svids[partner->num_svids++] = svid;
+        }
+        // A full reply without a terminator means the list goes on
+        return num_vdos == PD_VDM_MAX_VDOS;
+
+    case VDM_CMD_DISCOVER_MODES: {
+        const pd_svid_handler_t *handler = pd_vdm_handler(VDM_HDR_SVID(header));
+        if (handler && handler->partner_modes) {
+            uint32_t vdos[PD_VDM_MAX_VDOS];
+            if (num_vdos > PD_VDM_MAX_VDOS) {
+                num_vdos = PD_VDM_MAX_VDOS;
+            }
+            for (uint8_t i = 0; i < num_vdos; i++) {
+                vdos[i] = getObject(&reply[(i + 1) * 4]);
+            }
+            handler->partner_modes(pd_port - pd_ports, vdos, num_vdos);
+        }
+        return false;
+    }
+    }
+    return false;
+}
+
+/**
+ * Whether discovery has work on the current port
+ */
+bool pd_vdm_wants_discovery() {
+    return vdm_num_handlers && (current()->partner.discovery == PD_VDM_UNDISCOVERED) &&
+           (pd_port->spec_revs[SOP_TYPE_SOP] >= PD_SPEC_REV_30);
+}
+
+/**
+ * Mark discovery of the current port finished
+ */
+void pd_vdm_discovered(pd_vdm_discovery_t result) {
+    current()->partner.discovery = result;
+}
+
+/**
+ * Record the cable's ACK to Discover Identity on SOP'
+ */
+bool pd_vdm_record_cable(const uint8_t *reply, uint8_t num_data_objects) {
+    pd_vdm_cable_t *cable = &current()->cable;
+    uint32_t header = getObject(reply);
+
+    cable->discovery = PD_VDM_DISCOVERED;
+    if ((num_data_objects < 1 + 4) || (VDM_HDR_CMD_TYPE(header) != VDM_CMD_TYPE_ACK) ||
+        (VDM_HDR_CMD(header) != VDM_CMD_DISCOVER_IDENTITY)) {
+        return false;
+    }
+    cable->id_header = getObject(&reply[4]);
+    cable->product = getObject(&reply[12]);
+    uint8_t type = VDO_IDH_PRODUCT_TYPE(cable->id_header);
+    if ((type != VDO_IDH_PTYPE_PASSIVE_CABLE) && (type != VDO_IDH_PTYPE_ACTIVE_CABLE)) {
+        return false;
+    }
+    // Bits 10:9 were something else before PD 3.0
+    cable->cable_vdo = getObject(&reply[16]);
+    if (pd_port->spec_revs[SOP_TYPE_SOP_PRIME] < PD_SPEC_REV_30) {
+        cable->cable_vdo &= ~(3UL << 9);
+    }
+    pd_log.print((type == VDO_IDH_PTYPE_ACTIVE_CABLE) ? "Active cable, " : "Passive cable, ");
+    pd_log.print(pd_vdm_cable_ma(pd_port - pd_ports));
+    pd_log.print(" mA ");
+    pd_log.print(pd_vdm_cable_mv(pd_port - pd_ports));
+    pd_log.println(" mV");
+    return true;
+}
+
+/**
+ * Whether cable discovery has work on the current port
+ */
+bool pd_vdm_wants_cable_discovery() {
+    return PD_VCONN_SOURCE && (current()->cable.discovery == PD_VDM_UNDISCOVERED) &&
+           (pd_port->spec_revs[SOP_TYPE_SOP] >= PD_SPEC_REV_30);
+}
+
+/**
+ * Mark cable discovery of the current port finished
+ */
+void pd_vdm_cable_discovered(pd_vdm_discovery_t result) {
+    current()->cable.discovery = result;
+}
+
+/**
+ * Leave every mode implicitly and forget the partner and the cable
+ */
+void pd_vdm_reset() {
+    pd_vdm_port_t *vp = current();
+    uint8_t handler = vp->mode_handler;
+
+    vp->mode_handler = 0;
+    vp->attention_pending = false;
+    vp->partner = pd_vdm_partner_t();
+    vp->cable = pd_vdm_cable_t();
+    if (handler && vdm_handlers[handler - 1]->exit) {
+        vdm_handlers[handler - 1]->exit(pd_port - pd_ports, vp->mode_pos);
+    }
+}
+
+/**
+ * Queue an Attention for the mode entered on a port
+ */
+bool pd_vdm_attention(uint8_t port, uint16_t svid, uint32_t vdo) {
+    if (port >= PD_NUM_PORTS) {
+        return false;
+    }
+    pd_vdm_port_t *vp = &vdm_ports[port];
+    uint8_t handler = vp->mode_handler;
+    if (!handler || (vdm_handlers[handler - 1]->svid != svid)) {
+        return false;
+    }
+    vp->attention_pending = false;
+    vp->attention = vdo;
+    vp->attention_svid = svid;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    vp->attention_pending = true;
+    __sev(); // Core 1 may be waiting for INT_N
+    return true;
+}
+
+/**
+ * Whether an Attention is queued for the current port
+ */
+bool pd_vdm_attention_pending() {
+    return current()->attention_pending;
+}
+
+/**
+ * Take the queued Attention of the current port
+ */
+bool pd_vdm_take_attention(uint32_t *header, uint32_t *vdo) {
+    pd_vdm_port_t *vp = current();
+    if (!vp->attention_pending) {
+        return false;
+    }
+    vp->attention_pending = false;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    *vdo = vp->attention;
+    *header = VDM_HEADER(vp->attention_svid, pd_vdm_version(), vp->mode_pos, VDM_CMD_TYPE_REQ,
+                         VDM_CMD_ATTENTION);
+    return true;
+}
+
+/**
+ * What discovery learned about a port's partner
+ */
+const pd_vdm_partner_t *pd_vdm_partner(uint8_t port) {
+    return &vdm_ports[(port < PD_NUM_PORTS) ? port : 0].partner;
+}
+
+/**
+ * What Discover Identity on SOP' learned about a port's cable
+ */
+const pd_vdm_cable_t *pd_vdm_cable(uint8_t port) {
+    return &vdm_ports[(port < PD_NUM_PORTS) ? port : 0].cable;
+}
+
+/**
+ * Whether a port's source vouched for a cable we never read: it only enters
+ * EPR mode over a 50 V, 5 A cable
+ */
+static bool epr_cable(uint8_t port) {
+    return (port < PD_NUM_PORTS) && pd_ports[port].epr_mode && !pd_vdm_cable(port)->cable_vdo;
+}
+
+/**
+ * VBUS current the cable of a port is rated for
+ */
+uint16_t pd_vdm_cable_ma(uint8_t port) {
+    uint32_t vdo = pd_vdm_cable(port)->cable_vdo;
+    if (epr_cable(port)) {
+        return 5000;
+    }
+    return (vdo && (VDO_CABLE_CURRENT(vdo) == VDO_CABLE_CURRENT_5A)) ? 5000 : PD_CABLE_DEFAULT_MA;
+}
+
+/**
+ * VBUS voltage the cable of a port is rated for
+ */
+uint16_t pd_vdm_cable_mv(uint8_t port) {
+    if (epr_cable(port)) {
+        return 50000;
+    }
+    return 20000 + (VDO_CABLE_MAX_VOLTAGE(pd_vdm_cable(port)->cable_vdo) * 10000);
+}
+
+/**
+ * Mode entered on a port
+ */
+uint8_t pd_vdm_active_mode(uint8_t port, uint16_t *svid) {
+    if (port >= PD_NUM_PORTS) {
+        return 0;
+    }
+    uint8_t handler = vdm_ports[port].mode_handler;
+    if (!handler) {
+        return 0;
+    }
+    *svid = vdm_handlers[handler - 1]->svid;
+    return vdm_ports[port].mode_pos;
+}
@@ -0,0 +1,272 @@
+#ifndef PD_VDM_H
+#define PD_VDM_H
+
+#include <stdint.h>
+#include "FUSB302B.h"
+
+//=============================================================================
+// Structured VDM Engine
+//=============================================================================
+
+// Structured Vendor_Defined messages on SOP, in both directions.
+//
+// Responder: pd_vdm_respond() answers Discover Identity and Discover SVIDs
+// from the configured identity and the SVID registry, and hands Discover
+// Modes, Enter/Exit Mode, Attention and SVID-specific commands (16-31) to the
+// handler registered for the addressed SVID.
+//
+// Initiator: pd_flow_vdm_t (PD_Flow.h) sends one request and waits for the
+// reply within tVDMSenderResponse (tVDMWaitModeEntry/Exit for Enter/Exit
+// Mode), re-sending after tVDMBusy when the partner answers BUSY.
+// pd_flow_discover_t walks Discover Identity, Discover SVIDs and Discover
+// Modes of every SVID that has a handler, and the results land here.
+//
+// Cable: pd_flow_cable_t takes VCONN over with VCONN_Swap and sends
+// Discover Identity on SOP' to the e-marker; its current and voltage rating
+// then bound every Request (request_for() in FUSB302B.h).
+
+#define PD_VDM_MAX_SVIDS        4       ///< Handlers the registry holds
+#define PD_VDM_PARTNER_SVIDS    8       ///< Partner SVIDs kept from Discover SVIDs
+#define PD_VDM_MAX_VDOS         6       ///< VDOs after the VDM header
+#define PD_VDM_BUSY_RETRIES     3       ///< Re-sends of a request answered with BUSY
+#define PD_VDM_EXIT_ALL         7       ///< Exit Mode object position: every mode of the SVID
+
+// Identity answered until pd_vdm_set_identity(); use your own USB-IF VID/PID
+#ifndef PD_VDM_VID
+#define PD_VDM_VID              0x0483
+#endif
+#ifndef PD_VDM_PID
+#define PD_VDM_PID              0x1307
+#endif
+
+/**
+ * @brief Handler of one SVID
+ *
+ * Callbacks run on core 1 while the port is being serviced; any of them may
+ * be NULL. port is the index into pd_ports.
+ */
+typedef struct {
+    uint16_t svid;  ///< Standard or Vendor ID
+    /** Our modes for Discover Modes: fill vdos (PD_VDM_MAX_VDOS), return the count */
+    uint8_t (*modes)(uint32_t *vdos);
+    /** Enter Mode at object position mode (1-based): true to ACK */
+    bool (*enter)(uint8_t port, uint8_t mode);
+    /** Mode left: Exit Mode, hard reset or detach */
+    void (*exit)(uint8_t port, uint8_t mode);
+    /** SVID-specific command while a mode is entered: fill reply and num_reply, return the command type */
+    vdm_cmd_type_t (*command)(uint8_t port, uint32_t header, const uint32_t *vdos, uint8_t num_vdos,
+                              uint32_t *reply, uint8_t *num_reply);
+    /** Attention from the partner */
+    void (*attention)(uint8_t port, uint32_t header, const uint32_t *vdos, uint8_t num_vdos);
+    /** Partner's modes, from our Discover Modes */
+    void (*partner_modes)(uint8_t port, const uint32_t *vdos, uint8_t num_vdos);
+} pd_svid_handler_t;
+
+/**
+ * @brief What discovery learned about the partner
+ */
+typedef enum {
+    PD_VDM_UNDISCOVERED = 0,        ///< Nothing asked since attach or hard reset
+    PD_VDM_DISCOVERED,              ///< Identity known, SVIDs and modes as far as answered
+    PD_VDM_NOT_SUPPORTED            ///< Partner NAKed Discover Identity or stayed silent
+} pd_vdm_discovery_t;
+
+typedef struct {
+    uint32_t id_header;                     ///< ID Header VDO (VID, product type, modal bit)
+    uint32_t product;                       ///< Product VDO (PID, bcdDevice)
+    uint16_t svids[PD_VDM_PARTNER_SVIDS];   ///< SVIDs from Discover SVIDs
+    uint8_t num_svids;                      ///< Entries in svids
+    uint8_t discovery;                      ///< pd_vdm_discovery_t
+} pd_vdm_partner_t;
+
+typedef struct {
+    uint32_t id_header;             ///< ID Header VDO (VID, product type)
+    uint32_t product;               ///< Product VDO (PID, bcdDevice)
+    uint32_t cable_vdo;             ///< Passive Cable VDO or Active Cable VDO 1, 0 = not e-marked
+    uint8_t discovery;              ///< pd_vdm_discovery_t
+} pd_vdm_cable_t;
+
+//=============================================================================
+// Configuration
+//=============================================================================
+
+/**
+ * @brief Add an SVID handler to the registry (before attach)
+ * @param handler Handler, kept by reference
+ * @return false if the registry is full or the SVID is taken
+ */
+bool pd_vdm_register(const pd_svid_handler_t *handler);
+
+/**
+ * @brief Handler registered for an SVID
+ * @param svid Standard or Vendor ID
+ * @return Handler, NULL if none
+ */
+const pd_svid_handler_t *pd_vdm_handler(uint16_t svid);
+
+/**
+ * @brief Replace the identity answered to Discover Identity
+ *
+ * The Modal Operation bit of the ID Header is set for you while any
+ * registered handler has modes.
+ *
+ * @param vdos ID Header, Cert Stat, Product, then up to 3 product type VDOs
+ * @param num_vdos 3 to 6
+ * @return false if num_vdos is out of range
+ */
+bool pd_vdm_set_identity(const uint32_t *vdos, uint8_t num_vdos);
+
+//=============================================================================
+// Protocol (core 1, current port)
+//=============================================================================
+
+/**
+ * @brief Answer a structured VDM request
+ * @param request Received data objects, VDM header first
+ * @param num_data_objects Objects in request
+ * @param reply Destination for up to 7 data objects
+ * @return Data objects to send as a Vendor_Defined message, 0 for none
+ *         (Attention, or not a structured request)
+ */
+uint8_t pd_vdm_respond(const uint8_t *request, uint8_t num_data_objects, uint8_t *reply);
+
+/**
+ * @brief Serialize a VDM header and VDOs into data objects
+ * @param objects Destination for 1 + num_vdos data objects
+ * @param header VDM header
+ * @param vdos VDOs after the header
+ * @param num_vdos Entries in vdos
+ * @return Data objects written
+ */
+uint8_t pd_vdm_build(uint8_t *objects, uint32_t header, const uint32_t *vdos, uint8_t num_vdos);
+
+/**
+ * @brief Record the partner's ACK to one of our discovery requests
+ * @param reply Received data objects, VDM header first
+ * @param num_data_objects Objects in reply
+ * @return true if Discover SVIDs should be sent again for more SVIDs
+ */
+bool pd_vdm_record(const uint8_t *reply, uint8_t num_data_objects);
+
+/**
+ * @brief Whether pd_flow_discover_t has work on the current port: a handler
+ *        is registered, the partner speaks PD 3.x and was not asked yet
+ */
+bool pd_vdm_wants_discovery();
+
+/**
+ * @brief Mark discovery of the current port finished
+ * @param result PD_VDM_DISCOVERED or PD_VDM_NOT_SUPPORTED
+ */
+void pd_vdm_discovered(pd_vdm_discovery_t result);
+
+/**
+ * @brief Leave every mode implicitly and forget the partner and the cable
+ *        (hard reset, detach)
+ */
+void pd_vdm_reset();
+
+/**
+ * @brief SVDM version to use towards the partner: 2.0 at PD 3.x, else 1.0
+ */
+uint8_t pd_vdm_version();
+
+/**
+ * @brief Record the cable's ACK to Discover Identity on SOP'
+ *
+ * Call after adoptSpecRev() with the reply's header: the voltage rating is
+ * only read from PD 3.x cables.
+ *
+ * @param reply Received data objects, VDM header first
+ * @param num_data_objects Objects in reply
+ * @return true if the plug identified itself as a passive or active cable
+ */
+bool pd_vdm_record_cable(const uint8_t *reply, uint8_t num_data_objects);
+
+/**
+ * @brief Whether pd_flow_cable_t has work on the current port: the board can
+ *        source VCONN (PD_VCONN_SOURCE), the partner speaks PD 3.x and the
+ *        cable was not asked yet
+ */
+bool pd_vdm_wants_cable_discovery();
+
+/**
+ * @brief Mark cable discovery of the current port finished
+ * @param result PD_VDM_DISCOVERED or PD_VDM_NOT_SUPPORTED (no e-marker, or
+ *        the source kept VCONN)
+ */
+void pd_vdm_cable_discovered(pd_vdm_discovery_t result);
+
+//=============================================================================
+// Attention (any core)
+//=============================================================================
+
+/**
+ * @brief Queue an Attention for the mode entered on a port
+ *
+ * A newer Attention replaces one that has not gone out yet. It is sent by
+ * the attach flow once the responder runs (PD_USE_FLOWS only).
+ *
+ * @param port Port index
+ * @param svid SVID of the entered mode
+ * @param vdo The one VDO carried, e.g. a DisplayPort Status
+ * @return false if no mode of svid is entered on the port
+ */
+bool pd_vdm_attention(uint8_t port, uint16_t svid, uint32_t vdo);
+
+/**
+ * @brief Whether an Attention is queued for the current port
+ */
+bool pd_vdm_attention_pending();
+
+/**
+ * @brief Take the queued Attention of the current port
+ * @param header VDM header to send
+ * @param vdo VDO to send
+ * @return false if none was queued
+ */
+bool pd_vdm_take_attention(uint32_t *header, uint32_t *vdo);
+
+//=============================================================================
+// Query (any core)
+//=============================================================================
+
+/**
+ * @brief What discovery learned about a port's partner
+ * @param port Port index
+ * @return Partner record
+ */
+const pd_vdm_partner_t *pd_vdm_partner(uint8_t port);
+
+/**
+ * @brief What Discover Identity on SOP' learned about a port's cable
+ * @param port Port index
+ * @return Cable record
+ */
+const pd_vdm_cable_t *pd_vdm_cable(uint8_t port);
+
+/**
+ * @brief VBUS current the cable of a port is rated for
+ * @param port Port index
+ * @return 5000 for a 5 A cable or in EPR mode with the e-marker unread,
+ *         else PD_CABLE_DEFAULT_MA
+ */
+uint16_t pd_vdm_cable_ma(uint8_t port);
+
+/**
+ * @brief VBUS voltage the cable of a port is rated for
+ * @param port Port index
+ * @return 20000 unless a PD 3.x e-marker states more; 50000 in EPR mode
+ *         with the e-marker unread
+ */
+uint16_t pd_vdm_cable_mv(uint8_t port);
+
+/**
+ * @brief Mode entered on a port
+ * @param port Port index
+ * @param svid Set to the SVID of the mode
+ * @return Object position of the mode, 0 if none is entered
+ */
+uint8_t pd_vdm_active_mode(uint8_t port, uint16_t *svid);
+
+#endif // PD_VDM_H
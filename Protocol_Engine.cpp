@@ -1,235 +1,565 @@
+#include <string.h>
 #include <Arduino.h>
-#include <Wire.h>
 #include "FUSB302B.h"
+#include "PD_Trace.h"
+#include "PD_Stats.h"
+#include "PD_Alert.h"
+#include "PD_Log.h"
 
-// Implementation file - constants now in FUSB302B.h
+// Packet engine: register and FIFO access, frame assembly and frame
+// reception. Tracing is a compile-time policy, see PD_Trace.h.
 
-// Global variables
-uint8_t tx_buf[80];
-uint8_t rx_buf[80];
-uint8_t temp_buf[80];
+//=============================================================================
+// Register and FIFO Access
+//=============================================================================
 
-// Power delivery state variables
-int volt_options[5] = {-1, -1, -1, -1, -1};
-int amp_options[5] = {-1, -1, -1, -1, -1};
-int options_pos[5] = {-1, -1, -1, -1, -1};
-int spec_revs[4] = {2, 0, 0, 0}; // revision major, revision minor, version major, version minor
-int msg_id = 2;
-
-// Function declarations
-void sendPacket(uint8_t num_data_objects, uint8_t message_id, uint8_t port_power_role, 
-                uint8_t spec_rev, uint8_t port_data_role, uint8_t message_type, 
-                uint8_t *data_objects);
+/**
+ * Log a failed bus transfer
+ */
+static bool busResult(pd_bus_status_t status, uint8_t addr) {
+    if (status != PD_BUS_OK) {
+        pd_log.print("I2C error ");
+        pd_log.print(status);
+        pd_log.print(" at reg 0x");
+        pd_log.println(addr, HEX);
+        return false;
+    }
+    return true;
+}
 
 /**
  * Set a register value on the FUSB302B
  */
-void setReg(uint8_t addr, uint8_t value) {
-    Wire.beginTransmission(PD_ADDR);
-    Wire.write(addr);
-    Wire.write(value);
-    Wire.endTransmission(true);
+bool setReg(uint8_t addr, uint8_t value) {
+    uint8_t tx[2] = {addr, value};
+    return busResult(pd_bus_transfer(pd_bus, PD_ADDR, tx, 2, 0, 0), addr);
 }
 
 /**
  * Read a register value from the FUSB302B
  */
 uint8_t getReg(uint8_t addr) {
-    Wire.beginTransmission(PD_ADDR);
-    Wire.write(addr);
-    Wire.endTransmission(false);
-    Wire.requestFrom((int)PD_ADDR, 1, true);
-    return Wire.read();
+    uint8_t value = 0;
+    busResult(pd_bus_transfer(pd_bus, PD_ADDR, &addr, 1, &value, 1), addr);
+    return value;
+}
+
+/**
+ * Read consecutive registers in one auto-increment burst
+ */
+bool getRegs(uint8_t addr, uint8_t *data, uint16_t length) {
+    return busResult(pd_bus_transfer(pd_bus, PD_ADDR, &addr, 1, data, length), addr);
 }
 
 /**
  * Send data bytes to FUSB302B FIFO
  */
-void sendBytes(uint8_t *data, uint16_t length) {
-    if (length > 0) {
-        Wire.beginTransmission(PD_ADDR);
-        Wire.write(REG_FIFOS);
-        for (uint16_t i = 0; i < length; i++) {
-            Wire.write(data[i]);
-        }
-        Wire.endTransmission(true);
+bool sendBytes(uint8_t *data, uint16_t length) {
+    if (length == 0) {
+        return true;
+    }
+    uint8_t tx[1 + FUSB_TX_FIFO_SIZE];
+    if (length > FUSB_TX_FIFO_SIZE) {
+        length = FUSB_TX_FIFO_SIZE;
     }
+    tx[0] = REG_FIFOS;
+    memcpy(&tx[1], data, length);
+    return busResult(pd_bus_transfer(pd_bus, PD_ADDR, tx, length + 1, 0, 0), REG_FIFOS);
 }
 
+// A frame that dropGoodCRC() found ahead of the GoodCRC. It is served before
+// the FIFO, so readers see it where it arrived. The case is rare and a slot
+// in pd_port_t would break PD_PORT_RAM_BUDGET, so one slot serves every port;
+// only held_port sees it.
+static PD_TLS uint8_t held_frame[3 + PD_MAX_PAYLOAD + 4];
+static PD_TLS uint8_t held_len = 0;
+static PD_TLS uint8_t held_pos = 0;
+static PD_TLS pd_port_t *held_port = NULL;
+
 /**
- * Receive data bytes from FUSB302B FIFO
+ * Copy out what is left of this port's held frame
  */
-void receiveBytes(uint8_t *data, uint16_t length) {
-    if (length > 0) {
-        Wire.beginTransmission(PD_ADDR);
-        Wire.write(REG_FIFOS);
-        Wire.endTransmission(false);
-        Wire.requestFrom((int)PD_ADDR, (int)length, true);
-        for (uint16_t i = 0; i < length; i++) {
-            data[i] = Wire.read();
-        }
+static uint16_t takeHeld(uint8_t *data, uint16_t length) {
+    if ((held_port != pd_port) || (held_pos >= held_len)) {
+        return 0;
     }
+    uint16_t n = held_len - held_pos;
+    if (n > length) {
+        n = length;
+    }
+    memcpy(data, &held_frame[held_pos], n);
+    held_pos += n;
+    return n;
 }
 
 /**
- * Receive and parse a PD packet (debug version with full logging)
+ * Read data bytes straight from the FUSB302B FIFO
  */
-bool receivePacket() {
-    uint8_t num_data_objects;
-    uint8_t message_id;
-    uint8_t port_power_role;
-    uint8_t spec_rev;
-    uint8_t port_data_role;
-    uint8_t message_type;
-    
-    receiveBytes(rx_buf, 1);
-    if (rx_buf[0] != 0xE0) {
-        Serial1.println("FAIL - receive packet");
-        return false;
-    }
-    
-    receiveBytes(rx_buf, 2);
-    num_data_objects = ((rx_buf[1] & 0x70) >> 4);
-    message_id = ((rx_buf[1] & 0x0E) >> 1);
-    port_power_role = (rx_buf[1] & 0x01);
-    spec_rev = ((rx_buf[0] & 0xC0) >> 6);
-    port_data_role = ((rx_buf[0] & 0x10) >> 5);
-    message_type = (rx_buf[0] & 0x0F);
-    
-    if (num_data_objects) {
-        Serial1.println("Data message received");
-        spec_revs[0] = spec_rev + 1;
-    } else if (message_type == MSG_TYPE_GOODCRC) {
-        Serial1.println("GoodCRC message received");
-    } else {
-        Serial1.println("Control message received");
+static bool readFifo(uint8_t *data, uint16_t length) {
+    if (length == 0) {
+        return true;
     }
-    
-    Serial1.println("Received SOP Packet");
-    Serial1.print("Header: 0x");
-    Serial1.println(*(int *)rx_buf, HEX);
-    Serial1.print("Number of data objects = ");
-    Serial1.println(num_data_objects, DEC);
-    Serial1.print("Message ID = ");
-    Serial1.println(message_id, DEC);
-    Serial1.print("Port power role = ");
-    Serial1.println(port_power_role, DEC);
-    Serial1.print("Spec revision = ");
-    Serial1.println(spec_rev, DEC);
-    Serial1.print("Port data role = ");
-    Serial1.println(port_data_role, DEC);
-    Serial1.print("Message type = ");
-    Serial1.println(message_type, DEC);
-    
-    receiveBytes(rx_buf, (num_data_objects * 4));
-    // Parse each data object (32 bits each)
-    for (uint8_t i = 0; i < num_data_objects; i++) {
-        Serial1.print("Object: 0x");
-        uint32_t byte1 = rx_buf[0 + i * 4];
-        uint32_t byte2 = rx_buf[1 + i * 4] << 8;
-        uint32_t byte3 = rx_buf[2 + i * 4] << 16;
-        uint32_t byte4 = rx_buf[3 + i * 4] << 24;
-        Serial1.println(byte1 | byte2 | byte3 | byte4, HEX);
+    uint8_t reg = REG_FIFOS;
+    return busResult(pd_bus_transfer(pd_bus, PD_ADDR, &reg, 1, data, length), REG_FIFOS);
+}
+
+/**
+ * Receive data bytes from FUSB302B FIFO
+ */
+bool receiveBytes(uint8_t *data, uint16_t length) {
+    uint16_t held = takeHeld(data, length);
+    return readFifo(data + held, length - held);
+}
+
+/**
+ * Check whether nothing is left to receive
+ */
+bool rxEmpty() {
+    if ((held_port == pd_port) && (held_pos < held_len)) {
+        return false;
     }
-    
-    // Read CRC-32
-    receiveBytes(rx_buf, 4);
-    Serial1.print("CRC-32: 0x");
-    Serial1.println(*(long *)rx_buf, HEX);
-    Serial1.println();
-    
-    return true;
+    return getReg(REG_STATUS1) & STATUS1_RX_EMPTY;
 }
 
 /**
- * Read all FUSB302B registers for debugging
+ * Forget this port's held frame
  */
-void readAllRegs() {
-    Wire.beginTransmission(PD_ADDR);
-    Wire.write(0x01);
-    Wire.endTransmission(false);
-    Wire.requestFrom((int)PD_ADDR, 16, 1);
-    
-    for (int i = 1; i <= 16; i++) {
-        uint8_t c = Wire.read();
-        Serial1.print("Address: 0x");
-        Serial1.print(i, HEX);
-        Serial1.print(", Value: 0x");
-        Serial1.println(c, HEX);
+void dropHeldFrame() {
+    if (held_port == pd_port) {
+        held_len = 0;
+        held_pos = 0;
     }
-    
-    Wire.beginTransmission(PD_ADDR);
-    Wire.write(0x3C);
-    Wire.endTransmission(false);
-    Wire.requestFrom((int)PD_ADDR, 7, true);
-    
-    for (int i = 0x3C; i <= 0x42; i++) {
-        uint8_t c = Wire.read();
-        Serial1.print("Address: 0x");
-        Serial1.print(i, HEX);
-        Serial1.print(", Value: 0x");
-        Serial1.println(c, HEX);
+}
+
+/**
+ * Discard everything waiting to be received
+ */
+void flushRx() {
+    setReg(REG_CONTROL1, CONTROL1_RX_FLUSH);
+    dropHeldFrame();
+}
+
+/**
+ * Start a background FIFO read
+ */
+bool receiveBytesAsync(uint8_t *data, uint16_t length, pd_bus_xfer_t *xfer) {
+    if ((held_port == pd_port) && (held_pos < held_len)) {
+        // Part of it is in memory already: read it in place and complete
+        bool ok = receiveBytes(data, length);
+        xfer->busy = false;
+        xfer->rx_done = length;
+        xfer->status = ok ? PD_BUS_OK : pd_bus->last_status;
+        return ok;
     }
-    Serial1.println();
+    xfer->addr = PD_ADDR;
+    xfer->reg = REG_FIFOS;
+    xfer->tx = &xfer->reg;
+    xfer->tx_len = 1;
+    xfer->rx = data;
+    xfer->rx_len = length;
+    return busResult(pd_bus_submit(pd_bus, xfer), REG_FIFOS);
 }
 
+//=============================================================================
+// Transmit Path
+//=============================================================================
+
 /**
- * Send a USB-PD packet (debug version with logging)
+ * Assemble a frame in pd_frame, load it into the TX FIFO and start it
  */
-void sendPacket(uint8_t num_data_objects, uint8_t message_id, uint8_t port_power_role, 
-                uint8_t spec_rev, uint8_t port_data_role, uint8_t message_type, 
-                uint8_t *data_objects) {
+template <class Trace>
+void pd_send_packet(bool extended, uint8_t num_data_objects, uint8_t message_id,
+                    uint8_t port_power_role, uint8_t spec_rev, uint8_t port_data_role,
+                    uint8_t message_type, const uint8_t *data_objects, uint8_t sop) {
     
     uint8_t temp;
     
-    // SOP sequence - see USB-PD 2.0 page 108
-    tx_buf[0] = SOP_SEQUENCE_0;
-    tx_buf[1] = SOP_SEQUENCE_1;
-    tx_buf[2] = SOP_SEQUENCE_2;
-    tx_buf[3] = SOP_SEQUENCE_3;
+    num_data_objects &= 0x07; // 3-bit field; 7 objects (30 bytes) fit one PACKSYM run
     
-    // Packet length
-    tx_buf[4] = (0x80 | (2 + (4 * (num_data_objects & 0x1F))));
+    // SOP* sequence - see USB-PD 2.0 page 108
+    if (sop == SOP_TYPE_SOP_PRIME) {
+        pd_frame[0] = SOP1_SEQUENCE_0;
+        pd_frame[1] = SOP1_SEQUENCE_1;
+        pd_frame[2] = SOP1_SEQUENCE_2;
+        pd_frame[3] = SOP1_SEQUENCE_3;
+    } else if (sop == SOP_TYPE_SOP_DPRIME) {
+        pd_frame[0] = SOP2_SEQUENCE_0;
+        pd_frame[1] = SOP2_SEQUENCE_1;
+        pd_frame[2] = SOP2_SEQUENCE_2;
+        pd_frame[3] = SOP2_SEQUENCE_3;
+    } else {
+        pd_frame[0] = SOP_SEQUENCE_0;
+        pd_frame[1] = SOP_SEQUENCE_1;
+        pd_frame[2] = SOP_SEQUENCE_2;
+        pd_frame[3] = SOP_SEQUENCE_3;
+    }
     
-    // Header byte 1
-    tx_buf[5] = (message_type & 0x0F);
-    tx_buf[5] |= ((port_data_role & 0x01) << 5);
-    tx_buf[5] |= ((spec_rev & 0x03) << 6);
+    // Packet length
+    pd_frame[4] = (PACKSYM | (2 + (4 * num_data_objects)));
     
-    // Header byte 2
-    tx_buf[6] = (port_power_role & 0x01);
-    tx_buf[6] |= ((message_id & 0x07) << 1);
-    tx_buf[6] |= ((num_data_objects & 0x07) << 4);
+    // Header byte 1; PD 2.0 reserves bit 4 of the type, so 5 bits suit both
+    pd_frame[5] = (message_type & 0x1F);
+    pd_frame[5] |= ((port_data_role & 0x01) << 5);
+    pd_frame[5] |= ((spec_rev & 0x03) << 6);
     
-    Serial1.print("Sending Header: 0x");
-    Serial1.println((tx_buf[6] << 8) | (tx_buf[5]), HEX);
-    Serial1.println();
+    // Header byte 2; on SOP'/SOP'' bit 0 is Cable Plug, 0 from a port
+    pd_frame[6] = (port_power_role & 0x01);
+    pd_frame[6] |= ((message_id & 0x07) << 1);
+    pd_frame[6] |= (num_data_objects << 4);
+    pd_frame[6] |= (extended << 7);
     
     // Data objects
     temp = 7;
     for (uint8_t i = 0; i < num_data_objects; i++) {
-        tx_buf[temp] = data_objects[(4 * i)];
-        tx_buf[temp + 1] = data_objects[(4 * i) + 1];
-        tx_buf[temp + 2] = data_objects[(4 * i) + 2];
-        tx_buf[temp + 3] = data_objects[(4 * i) + 3];
-        
-        Serial1.print("Data object being sent out: 0x");
-        Serial1.println((tx_buf[temp + 3] << 24) | (tx_buf[temp + 2] << 16) | 
-                       (tx_buf[temp + 1] << 8) | (tx_buf[temp]), HEX);
+        pd_frame[temp] = data_objects[(4 * i)];
+        pd_frame[temp + 1] = data_objects[(4 * i) + 1];
+        pd_frame[temp + 2] = data_objects[(4 * i) + 2];
+        pd_frame[temp + 3] = data_objects[(4 * i) + 3];
         temp += 4;
     }
-    
-    Serial1.print("Message ID: ");
-    Serial1.println(message_id, DEC);
+    Trace::tx(&pd_frame[5], &pd_frame[7]);
+    pd_stats_tx(&pd_frame[5]);
     
     // Packet termination
-    tx_buf[temp] = CRC_PLACEHOLDER;
-    tx_buf[temp + 1] = EOP_SEQUENCE;
-    tx_buf[temp + 2] = TXOFF_SEQUENCE;
+    if (pd_port->auto_crc) {
+        pd_frame[temp++] = CRC_PLACEHOLDER; // Hardware inserts the CRC
+    } else {
+        // Header + 7 objects + CRC exceeds one PACKSYM (31 bytes), so the
+        // software CRC goes out as a second packed run
+        pd_frame[temp] = (PACKSYM | 4);
+        pd_crc32_store(pd_crc32_update(PD_CRC_INIT, &pd_frame[5], temp - 5), &pd_frame[temp + 1]);
+        temp += 5;
+    }
+    pd_frame[temp] = EOP_SEQUENCE;
+    pd_frame[temp + 1] = TXOFF_SEQUENCE;
     
     // Send packet
     uint8_t control_reg = getReg(REG_CONTROL0);
-    sendBytes(tx_buf, (10 + (4 * (num_data_objects & 0x1F))));
-    setReg(REG_CONTROL0, (control_reg | 0x01)); // Start transmission
-    msg_id++;
+    sendBytes(pd_frame, temp + 2);
+    setReg(REG_CONTROL0, (control_reg | CONTROL0_TX_START)); // Start transmission
+}
+
+/**
+ * Send a USB-PD packet through the configured trace policy
+ */
+void sendPacket(bool extended, uint8_t num_data_objects, uint8_t message_id, 
+                uint8_t port_power_role, uint8_t spec_rev, uint8_t port_data_role, 
+                uint8_t message_type, const uint8_t *data_objects, uint8_t sop) {
+    pd_send_packet<pd_trace_t>(extended, num_data_objects, message_id, port_power_role,
+                               spec_rev, port_data_role, message_type, data_objects, sop);
+}
+
+//=============================================================================
+// Receive Path
+//=============================================================================
+
+/**
+ * Read one whole frame from the RX FIFO: token and header, then data objects
+ * and CRC in a second burst
+ */
+template <class Trace>
+bool pd_receive_frame(pd_msg_t *msg) {
+    uint8_t frame[3];
+    
+    if (rxEmpty()) {
+        return false;
+    }
+    receiveBytes(frame, 3); // Token and header
+    switch (frame[0] & RX_TOKEN_MASK) {
+        case RX_TOKEN_SOP:
+            msg->sop = SOP_TYPE_SOP;
+            break;
+        case RX_TOKEN_SOP1:
+            msg->sop = SOP_TYPE_SOP_PRIME;
+            break;
+        case RX_TOKEN_SOP2:
+            msg->sop = SOP_TYPE_SOP_DPRIME;
+            break;
+        default:
+            pd_log.println("Unexpected RX token - flushing");
+            flushRx();
+            return false;
+    }
+    msg->header[0] = frame[1];
+    msg->header[1] = frame[2];
+    msg->type = (frame[1] & 0x1F);
+    msg->num_data_objects = ((frame[2] & 0x70) >> 4);
+    msg->extended = (frame[2] >> 7);
+    
+    uint16_t length = msg->num_data_objects * 4;
+    receiveBytes(msg->data, length + 4);
+    uint32_t crc = pd_crc32_update(PD_CRC_INIT, msg->header, 2);
+    crc = pd_crc32_update(crc, msg->data, length);
+    bool crc_ok = checkCRC(crc, &msg->data[length]);
+    if (crc_ok && (msg->sop == SOP_TYPE_SOP) && !msg->extended && (msg->num_data_objects == 1) &&
+        (msg->type == MSG_TYPE_ALERT)) {
+        // Load shedding goes first, ahead of the trace and the flows
+        pd_alert_shed(msg->data[0] | (msg->data[1] << 8) | ((uint32_t)msg->data[2] << 16) |
+                      ((uint32_t)msg->data[3] << 24));
+    }
+    Trace::rx(msg, crc_ok);
+    if (crc_ok) {
+        pd_stats_rx(msg->header);
+    }
+    return crc_ok;
+}
+
+/**
+ * Consume the partner's GoodCRC after a successful transmission. The FUSB302B
+ * handles the GoodCRC exchange itself but still queues the GoodCRC frame, so it
+ * is drained as one burst (token, header, CRC) instead of being parsed. A
+ * message that was already waiting sits ahead of it; that one is read out
+ * whole and held for the next reader.
+ */
+void dropGoodCRC() {
+    static const uint8_t tokens[PD_NUM_SOP] = {RX_TOKEN_SOP, RX_TOKEN_SOP1, RX_TOKEN_SOP2};
+    uint8_t frame[sizeof(held_frame)];
+    
+    for (;;) {
+        readFifo(frame, 7);
+        uint8_t token = frame[0] & RX_TOKEN_MASK;
+        uint8_t num_data_objects = (frame[2] & 0x70) >> 4;
+        if ((token == tokens[pd_port->tx_sop]) && ((frame[1] & 0x1F) == MSG_TYPE_GOODCRC) &&
+            !num_data_objects) {
+            pd_stats_rx(&frame[1]);
+            return;
+        }
+        bool message = (token == RX_TOKEN_SOP) || (token == RX_TOKEN_SOP1) || (token == RX_TOKEN_SOP2);
+        if (!message || ((held_port == pd_port) && (held_pos < held_len))) {
+            pd_log.println("Expected GoodCRC at head of RX FIFO - flushing");
+            flushRx();
+            return;
+        }
+        if (held_pos < held_len) {
+            // The slot is another port's; this port's GoodCRC and message come first
+            pd_log.println("Held frame of another port dropped");
+        }
+        uint8_t length = 3 + (num_data_objects * 4) + 4;
+        readFifo(&frame[7], length - 7);
+        memcpy(held_frame, frame, length);
+        held_len = length;
+        held_pos = 0;
+        held_port = pd_port;
+        pd_log.println("Message ahead of GoodCRC - held for the next read");
+    }
+}
+
+/**
+ * Read one message for the protocol layer; GoodCRC frames are dropped
+ */
+bool receiveFrame(pd_msg_t *msg) {
+    if (!pd_receive_frame<pd_trace_t>(msg)) {
+        return false;
+    }
+    return !((msg->type == MSG_TYPE_GOODCRC) && (msg->num_data_objects == 0));
+}
+
+/**
+ * Receive one PD packet of any kind
+ */
+bool receivePacket() {
+    pd_msg_t msg;
+    return pd_receive_frame<pd_trace_t>(&msg);
+}
+
+/**
+ * Read a frame's trailing CRC-32 and verify it against the running CRC
+ */
+bool receiveCRC(uint32_t crc) {
+    uint8_t crc_bytes[4];
+    
+    receiveBytes(crc_bytes, 4);
+    return checkCRC(crc, crc_bytes);
+}
+
+/**
+ * Verify a frame's trailing CRC-32 that has already been read
+ */
+bool checkCRC(uint32_t crc, const uint8_t *crc_bytes) {
+    if (!pd_crc32_check(crc, crc_bytes)) {
+        pd_log.println("CRC mismatch - frame dropped");
+        pd_stats_inc(PD_CNT_CRC_FAILURES);
+        return false;
+    }
+    if (pd_port->wake_awaiting_rx) {
+        // First valid frame since toggle woke us up
+        pd_port->wake_awaiting_rx = false;
+        pd_port->power_stats.last_wake_to_rx_us = micros() - pd_port->wake_time_us;
+        if (pd_port->power_stats.last_wake_to_rx_us > pd_port->power_stats.max_wake_to_rx_us) {
+            pd_port->power_stats.max_wake_to_rx_us = pd_port->power_stats.last_wake_to_rx_us;
+        }
+    }
+    return true;
+}
+
+template void pd_send_packet<pd_trace_none>(bool, uint8_t, uint8_t, uint8_t, uint8_t,
+                                            uint8_t, uint8_t, const uint8_t *, uint8_t);
+template void pd_send_packet<pd_trace_decode>(bool, uint8_t, uint8_t, uint8_t, uint8_t,
+                                              uint8_t, uint8_t, const uint8_t *, uint8_t);
+template void pd_send_packet<pd_trace_capture>(bool, uint8_t, uint8_t, uint8_t, uint8_t,
+                                               uint8_t, uint8_t, const uint8_t *, uint8_t);
+template bool pd_receive_frame<pd_trace_none>(pd_msg_t *);
+template bool pd_receive_frame<pd_trace_decode>(pd_msg_t *);
+template bool pd_receive_frame<pd_trace_capture>(pd_msg_t *);
+
+//=============================================================================
+// Debug Trace
+//=============================================================================
+
+/**
+ * Print the fields of a message header
+ */
+static void traceHeader(const uint8_t *header) {
+    pd_log.print("Header: 0x");
+    pd_log.println((header[1] << 8) | header[0], HEX);
+    pd_log.print("Number of data objects = ");
+    pd_log.println((header[1] & 0x70) >> 4, DEC);
+    pd_log.print("Message ID = ");
+    pd_log.println((header[1] & 0x0E) >> 1, DEC);
+    pd_log.print("Port power role = ");
+    pd_log.println(header[1] & 0x01, DEC);
+    pd_log.print("Spec revision = ");
+    pd_log.println((header[0] & 0xC0) >> 6, DEC);
+    pd_log.print("Port data role = ");
+    pd_log.println((header[0] & 0x20) >> 5, DEC);
+    pd_log.print("Message type = ");
+    pd_log.println(header[0] & 0x1F, DEC);
+    pd_log.print("Extended = ");
+    pd_log.println(header[1] >> 7, DEC);
+}
+
+/**
+ * Print data objects, one 32-bit word per line
+ */
+static void traceObjects(const char *label, const uint8_t *objects, uint8_t num_data_objects) {
+    for (uint8_t i = 0; i < num_data_objects; i++) {
+        const uint8_t *object = &objects[i * 4];
+        pd_log.print(label);
+        pd_log.println((uint32_t)object[0] | ((uint32_t)object[1] << 8) |
+                        ((uint32_t)object[2] << 16) | ((uint32_t)object[3] << 24), HEX);
+    }
+}
+
+/**
+ * Decode an outgoing frame
+ */
+void pd_trace_decode::tx(const uint8_t *header, const uint8_t *objects) {
+    uint8_t num_data_objects = (header[1] & 0x70) >> 4;
+    
+    pd_log.println("Sending SOP Packet");
+    traceHeader(header);
+    traceObjects("Data object being sent out: 0x", objects, num_data_objects);
+    uint32_t crc = pd_crc32_update(PD_CRC_INIT, header, 2);
+    crc = pd_crc32_update(crc, objects, num_data_objects * 4);
+    pd_log.print(pd_port->auto_crc ? "CRC-32 (hardware): 0x" : "Software CRC-32: 0x");
+    pd_log.println(~crc, HEX);
+    pd_log.println();
+}
+
+/**
+ * Decode an incoming frame
+ */
+void pd_trace_decode::rx(const pd_msg_t *msg, bool crc_ok) {
+    const uint8_t *crc_bytes = &msg->data[msg->num_data_objects * 4];
+    
+    if (msg->num_data_objects) {
+        pd_log.println("Data message received");
+    } else if (msg->type == MSG_TYPE_GOODCRC) {
+        pd_log.println("GoodCRC message received");
+    } else {
+        pd_log.println("Control message received");
+    }
+    pd_log.print("Received SOP");
+    for (uint8_t i = 0; i < msg->sop; i++) {
+        pd_log.print("'");
+    }
+    pd_log.println(" Packet");
+    traceHeader(msg->header);
+    traceObjects("Object: 0x", msg->data, msg->num_data_objects);
+    pd_log.print("CRC-32: 0x");
+    pd_log.print((uint32_t)crc_bytes[0] | ((uint32_t)crc_bytes[1] << 8) |
+                  ((uint32_t)crc_bytes[2] << 16) | ((uint32_t)crc_bytes[3] << 24), HEX);
+    pd_log.println(crc_ok ? " OK" : " MISMATCH");
+    pd_log.println();
+}
+
+//=============================================================================
+// Binary Capture
+//=============================================================================
+
+static PD_TLS Print *capture_out = NULL;
+
+/**
+ * Start or stop a capture
+ */
+void pd_trace_capture_begin(Print *out) {
+    capture_out = out;
+    if (out) {
+        out->write((const uint8_t *)PD_CAPTURE_MAGIC, PD_CAPTURE_MAGIC_LEN);
+    }
+}
+
+/**
+ * Write one record in a single write
+ */
+static void captureRecord(uint8_t flags, const uint8_t *header, const uint8_t *objects) {
+    Print *out = capture_out;
+    if (!out) {
+        return;
+    }
+    uint8_t record[PD_CAPTURE_RECORD_MAX];
+    uint8_t length = 8 + ((header[1] & 0x70) >> 4) * 4;
+    uint32_t now_us = micros();
+
+    record[0] = now_us;
+    record[1] = now_us >> 8;
+    record[2] = now_us >> 16;
+    record[3] = now_us >> 24;
+    record[4] = flags;
+    record[5] = pd_port - pd_ports;
+    record[6] = header[0];
+    record[7] = header[1];
+    memcpy(&record[8], objects, length - 8);
+    out->write(record, length);
+}
+
+/**
+ * Capture an outgoing frame
+ */
+void pd_trace_capture::tx(const uint8_t *header, const uint8_t *objects) {
+    captureRecord(PD_CAPTURE_TX | (pd_port->tx_sop << 2), header, objects);
+}
+
+/**
+ * Capture an incoming frame
+ */
+void pd_trace_capture::rx(const pd_msg_t *msg, bool crc_ok) {
+    captureRecord((crc_ok ? 0 : PD_CAPTURE_CRC_BAD) | (msg->sop << 2), msg->header, msg->data);
+}
+
+//=============================================================================
+// Debug Utilities
+//=============================================================================
+
+/**
+ * Read all FUSB302B registers for debugging
+ */
+void readAllRegs() {
+    uint8_t regs[16];
+    getRegs(REG_DEVICE_ID, regs, 16);
+    for (int i = 0; i < 16; i++) {
+        pd_log.print("Address: 0x");
+        pd_log.print(i + REG_DEVICE_ID, HEX);
+        pd_log.print(", Value: 0x");
+        pd_log.println(regs[i], HEX);
+    }
+
+    getRegs(REG_STATUS0A, regs, 7);
+    for (int i = 0; i < 7; i++) {
+        pd_log.print("Address: 0x");
+        pd_log.print(i + REG_STATUS0A, HEX);
+        pd_log.print(", Value: 0x");
+        pd_log.println(regs[i], HEX);
+    }
+    pd_log.println();
 }
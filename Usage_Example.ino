@@ -9,6 +9,11 @@
  * 2. Detect device attachment
  * 3. Negotiate power delivery (20V, 3A in this example)
  * 4. Recognize the connected device type
+ * 5. Report attach, capabilities, contracts and errors through callbacks
+ *    run on core 0
+ * 6. Switch the load off the moment the source sends an over-current,
+ *    over-temperature or over-voltage Alert
+ * 7. Keep the stack's log off core 1: core 0 moves it to Serial1
  * 
  * Hardware Requirements:
  * - FUSB302B USB-C PD Controller connected via I2C
@@ -20,11 +25,114 @@
  */
 
 #include "FUSB302B.h"
+#include "PD_Stats.h"
+#include "PD_DisplayPort.h"
+#include "PD_Callbacks.h"
+#include "PD_Log.h"
 
 // Configuration
 const int DESIRED_VOLTAGE = 20;  // Volts
-const int DESIRED_CURRENT = 3;   // Amps
+const int DESIRED_CURRENT = 3000; // mA
 const int INTERRUPT_PIN = 6;     // GPIO pin for FUSB302B interrupt
+const int LOAD_ENABLE_PIN = 7;   // GPIO pin switching the load on VBUS
+
+// What the callbacks learned, only touched on core 0
+static uint32_t src_pdos[PD_MAX_SRC_PDOS];
+static uint8_t num_src_pdos = 0;
+static uint8_t dev_type = DEVICE_TYPE_CHARGER;
+static bool contract_ok = false;
+
+//=============================================================================
+// Callbacks (core 0, from pd_cb_dispatch() in loop()). Keep them short:
+// each gets PD_CB_BUDGET_US before it counts as an overrun.
+//=============================================================================
+
+void onAttach(uint8_t port, const pd_cb_attach_t *attach) {
+    Serial.print("New device detected on CC");
+    Serial.println(attach->cc_line);
+}
+
+void onCaps(uint8_t port, const pd_cb_caps_t *caps) {
+    memcpy(src_pdos, caps->pdos, caps->num_pdos * sizeof(uint32_t));
+    num_src_pdos = caps->num_pdos;
+    Serial.print("Source offers ");
+    Serial.print(num_src_pdos);
+    Serial.print(" PDOs, up to ");
+    Serial.print(getMaxAvailablePower());
+    Serial.println("W fixed");
+}
+
+void onContract(uint8_t port, const pd_cb_contract_t *contract) {
+    // Switch the load on only once VBUS was measured at the contract voltage
+    contract_ok = contract->vbus_ok;
+    digitalWrite(LOAD_ENABLE_PIN, contract_ok ? HIGH : LOW);
+    Serial.print("Contract: ");
+    Serial.print(contract->mv);
+    Serial.print("mV at ");
+    Serial.print(contract->ma);
+    Serial.print("mA");
+    Serial.println(contract->vbus_ok ? "" : ", VBUS NOT at the contract voltage");
+}
+
+void onIdentity(uint8_t port, const pd_cb_identity_t *identity) {
+    dev_type = identity->dev_type;
+    Serial.print(identity->classified ? "Device type (guessed, no VID/PID): " : "Device type: ");
+    switch (dev_type) {
+        case DEVICE_TYPE_CHARGER:
+            Serial.println("Charger");
+            break;
+        case DEVICE_TYPE_MONITOR:
+            Serial.println("Monitor");
+            break;
+        case DEVICE_TYPE_TABLET:
+            Serial.println("Tablet");
+            break;
+        case DEVICE_TYPE_LAPTOP:
+            Serial.println("Laptop");
+            break;
+        default:
+            Serial.println("Unknown");
+            break;
+    }
+}
+
+void onDetach(uint8_t port, const pd_cb_detach_t *detach) {
+    num_src_pdos = 0;
+    contract_ok = false;
+    digitalWrite(LOAD_ENABLE_PIN, LOW);
+    Serial.println(detach->recovery ? "Source dropped after failed recovery" : "Device disconnected");
+}
+
+void onError(uint8_t port, const pd_cb_error_t *error) {
+    Serial.print("PD error ");
+    Serial.print(error->code);
+    Serial.print(", detail ");
+    Serial.println(error->detail);
+}
+
+void onAlert(uint8_t port, const pd_cb_alert_t *alert) {
+    Serial.print("Alert ");
+    Serial.print(alert->source);
+    Serial.print(": 0x");
+    Serial.println(alert->value, HEX);
+}
+
+void onStatus(uint8_t port, const pd_status_t *status) {
+    Serial.print("Source status: ");
+    Serial.print(status->internal_temp);
+    Serial.print("C, events 0x");
+    Serial.println(status->event_flags, HEX);
+}
+
+static const pd_callbacks_t callbacks = {
+    onAttach, onCaps, onContract, onIdentity, onDetach, onError, onAlert, onStatus
+};
+
+// Load-shed hook: runs on core 1 as soon as a source Alert is received, before
+// onAlert is even queued, so it only drops the load
+void shedLoad(uint8_t port, uint32_t ado) {
+    digitalWrite(LOAD_ENABLE_PIN, LOW);
+}
 
 void setup() {
     // Initialize serial communication
@@ -37,15 +145,37 @@ void setup() {
     
     // Setup interrupt pin
     pinMode(INTERRUPT_PIN, INPUT_PULLUP);
+    pinMode(LOAD_ENABLE_PIN, OUTPUT);
+    digitalWrite(LOAD_ENABLE_PIN, LOW);
     gpio_set_irq_enabled_with_callback(INTERRUPT_PIN, 
                                       GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, 
                                       true, &InterruptFlagger);
     
+    // Port context: PD 3.0 until the source's header says otherwise, CC1, hardware CRC
+    pd_port_init(pd_port);
+    
+    // Advertise what this sink can take: vSafe5V plus 9V and 20V
+    static const pd_snk_caps_t snk_caps = {
+        { { PDO_TYPE_FIXED_SUPPLY, 5000, 5000, 3000, 0 },
+          { PDO_TYPE_FIXED_SUPPLY, 9000, 9000, 3000, 0 },
+          { PDO_TYPE_FIXED_SUPPLY, 20000, 20000, 3000, 0 } },
+        3, false, true, false, true, false
+    };
+    set_snk_caps(&snk_caps);
+    
+    // Answer DisplayPort alternate mode as a UFP_D (docks and adapters only)
+    // pd_dp_register();
+    
+    // Port events arrive through the callbacks above
+    pd_cb_register(&callbacks);
+    pd_alert_set_shed_hook(shedLoad);
+    
     // Give system time to stabilize
     delay(150);
     
-    // Initialize FUSB302B
+    // Initialize FUSB302B and let it toggle in low power until a source attaches
     reset_fusb();
+    enter_idle_toggle();
     
     Serial.println("FUSB302B initialized. Waiting for device connection...");
 }
@@ -55,99 +185,121 @@ void setup1() {
 }
 
 void loop() {
-    // Main processing happens in loop1() on core 1
-    delay(100);
+    // Main processing happens in loop1() on core 1; events come through the callbacks
+    pd_cb_dispatch(PD_CB_DISPATCH_BUDGET_US);
+    
+    // The stack's log, queued by core 1, goes out as fast as the UART takes it
+    pd_log_drain(Serial1);
     
     // Optional: Print status periodically
     static unsigned long last_status = 0;
     if (millis() - last_status > 5000) {
         last_status = millis();
         
-        if (IS_DEVICE_ATTACHED()) {
-            Serial.println("Device connected and negotiated successfully!");
-            Serial.print("Device type: ");
-            switch(dev_type) {
-                case DEVICE_TYPE_CHARGER:
-                    Serial.println("Charger");
-                    break;
-                case DEVICE_TYPE_MONITOR:
-                    Serial.println("Monitor");
-                    break;
-                case DEVICE_TYPE_TABLET:
-                    Serial.println("Tablet");
-                    break;
-                case DEVICE_TYPE_LAPTOP:
-                    Serial.println("Laptop");
-                    break;
-                default:
-                    Serial.println("Unknown");
-                    break;
+        // Modelled FUSB302B current and wake-to-first-packet latency
+        Serial.print("Avg FUSB302B current: ");
+        Serial.print(avg_current_ua());
+        Serial.print("uA, last wake-to-packet: ");
+        Serial.print(pd_port->power_stats.last_wake_to_rx_us);
+        Serial.println("us");
+        
+        // Health counters, read from core 0 while core 1 keeps running
+        pd_stats_t stats;
+        if (pd_stats_snapshot(0, &stats)) {
+            Serial.print("Contracts: ");
+            Serial.print(stats.counters[PD_CNT_CONTRACTS]);
+            Serial.print(", TX failed: ");
+            Serial.print(stats.counters[PD_CNT_TX_FAILED]);
+            Serial.print(", CRC failures: ");
+            Serial.print(stats.counters[PD_CNT_CRC_FAILURES]);
+            Serial.print(", hard resets rx/tx: ");
+            Serial.print(stats.counters[PD_CNT_HARD_RESETS_RX]);
+            Serial.print("/");
+            Serial.println(stats.counters[PD_CNT_HARD_RESETS_TX]);
+            if (stats.counters[PD_CNT_EPR_CONTRACTS]) {
+                Serial.print("EPR contracts: ");
+                Serial.print(stats.counters[PD_CNT_EPR_CONTRACTS]);
+                Serial.print(", first after: ");
+                Serial.print(stats.counters[PD_CNT_EPR_CONTRACT_MS]);
+                Serial.println("ms");
             }
-            
-            // Print available power options
-            Serial.println("Available power options:");
-            for (int i = 0; i < 5; i++) {
-                if (volt_options[i] != -1) {
-                    Serial.print("  ");
-                    Serial.print(volt_options[i]);
-                    Serial.print("V @ ");
-                    Serial.print(amp_options[i] * 10); // Convert from 10mA units
-                    Serial.println("mA");
-                }
+            if (stats.counters[PD_CNT_VBUS_READINGS]) {
+                Serial.print("VBUS above ");
+                Serial.print(stats.counters[PD_CNT_VBUS_MV]);
+                Serial.print("mV, ");
+                Serial.print(contract_ok ? "at" : "NOT at");
+                Serial.print(" the contract voltage, ");
+                Serial.print(stats.counters[PD_CNT_VBUS_TRANSACTIONS] / stats.counters[PD_CNT_VBUS_READINGS]);
+                Serial.println(" I2C transactions per reading");
             }
-        } else {
-            Serial.println("No device connected");
+            
+            // Request read to reply loaded, the worst so far
+            Serial.print("Worst reply to Source_Capabilities: ");
+            Serial.print(stats.reply_max_us[PD_DATA(MSG_TYPE_SOURCE_CAPABILITIES)]);
+            Serial.print("us, Get_Sink_Cap: ");
+            Serial.print(stats.reply_max_us[PD_CTRL(MSG_TYPE_GET_SINK_CAP)]);
+            Serial.print("us, Soft_Reset: ");
+            Serial.print(stats.reply_max_us[PD_CTRL(MSG_TYPE_SOFT_RESET)]);
+            Serial.println("us");
         }
+        
+        pd_cb_stats_t cb_stats;
+        pd_cb_get_stats(&cb_stats);
+        Serial.print("Callbacks: ");
+        Serial.print(cb_stats.dispatched);
+        Serial.print(", dropped: ");
+        Serial.print(cb_stats.dropped);
+        Serial.print(", over budget: ");
+        Serial.print(cb_stats.overruns);
+        Serial.print(", max latency: ");
+        Serial.print(cb_stats.max_latency_us);
+        Serial.println("us");
+        
+        pd_log_stats_t log_stats;
+        pd_log_get_stats(&log_stats);
+        Serial.print("Log bytes: ");
+        Serial.print(log_stats.written);
+        Serial.print(", dropped: ");
+        Serial.print(log_stats.dropped);
+        Serial.print(", queue high water: ");
+        Serial.println(log_stats.max_used);
     }
 }
 
 void loop1() {
     // Main power delivery processing
     if (int_flag) {
+        int_flag = false;
         check_interrupt(); // Process attach/detach events
         
         if (IS_NEW_ATTACHMENT()) {
-            Serial.println("New device detected!");
-            
-            // Determine CC line orientation
-            orient_cc();
+            // Determine CC line orientation (already known when toggle woke us)
+            if (!pd_port->cc_oriented) {
+                orient_cc();
+            }
             
             // Enable transmission on the correct CC line
-            enable_tx_cc(cc_line, true);
+            enable_tx_cc(pd_port->cc_line, true);
             
             // Recognize device type (using PD 3.0 extended capabilities)
-            recog_dev(5, 0.5); // Start with safe 5V negotiation
+            recog_dev(5, 500); // Start with safe 5V negotiation
             
             // Reset and reinitialize for main power negotiation
             reset_fusb();
-            enable_tx_cc(cc_line, true);
+            enable_tx_cc(pd_port->cc_line, true);
             
             // Negotiate desired power
-            if (pd_init(DESIRED_VOLTAGE, DESIRED_CURRENT)) {
-                Serial.print("Successfully negotiated ");
-                Serial.print(DESIRED_VOLTAGE);
-                Serial.print("V at ");
-                Serial.print(DESIRED_CURRENT);
-                Serial.println("A");
-            } else {
-                Serial.println("Power negotiation failed, using default");
-            }
-            
-            Serial.println("=== Power Delivery Setup Complete ===");
-            
-            // Optional: Renegotiate to different power after delay
-            // delay(5000);
-            // if (reneg_pd(12, 2)) {
-            //     Serial.println("Renegotiated to 12V @ 2A");
-            // }
+            // Negotiate desired power; the outcome arrives as onContract or onError
+            pd_init(DESIRED_VOLTAGE, DESIRED_CURRENT);
             
-        } else if (!attached) {
-            // Device disconnected
+        } else if (!pd_port->attached && !pd_port->cc_oriented && (pd_port->power_state == PD_POWER_ACTIVE)) {
+            // Device disconnected, go back to low-power toggling
             reset_fusb();
-            Serial.println("Device disconnected");
+            enter_idle_toggle();
         }
-        
-        int_flag = false;
+    } else if (!service_power_request()) {
+        // Nothing asked for by core 0: sleep until the FUSB302B raises INT_N
+        service_idle();
     }
 }
 
@@ -156,11 +308,12 @@ void loop1() {
 /**
  * @brief Check if specific voltage is available
  * @param desired_voltage Voltage to check for
- * @return true if voltage is available
+ * @return true if a fixed PDO of the last onCaps offers it
  */
 bool isVoltageAvailable(int desired_voltage) {
-    for (int i = 0; i < 5; i++) {
-        if (volt_options[i] == desired_voltage) {
+    for (int i = 0; i < num_src_pdos; i++) {
+        if ((GET_PDO_TYPE(src_pdos[i]) == PDO_TYPE_FIXED_SUPPLY) &&
+            (PDO_FIXED_MV(src_pdos[i]) == (uint32_t)desired_voltage * 1000)) {
             return true;
         }
     }
@@ -169,13 +322,13 @@ bool isVoltageAvailable(int desired_voltage) {
 
 /**
  * @brief Get maximum available power
- * @return Maximum power in watts, 0 if no options available
+ * @return Maximum power of the fixed PDOs in watts, 0 if no options available
  */
 int getMaxAvailablePower() {
     int max_power = 0;
-    for (int i = 0; i < 5; i++) {
-        if (volt_options[i] != -1) {
-            int power = volt_options[i] * (amp_options[i] * 10) / 1000; // Convert to watts
+    for (int i = 0; i < num_src_pdos; i++) {
+        if (GET_PDO_TYPE(src_pdos[i]) == PDO_TYPE_FIXED_SUPPLY) {
+            int power = PDO_FIXED_MV(src_pdos[i]) * PDO_FIXED_MA(src_pdos[i]) / 1000000; // Convert to watts
             if (power > max_power) {
                 max_power = power;
             }
@@ -185,32 +338,34 @@ int getMaxAvailablePower() {
 }
 
 /**
- * @brief Request optimal power based on device type
- * @return true if successful
+ * @brief Request optimal power based on device type (e.g. from onIdentity)
+ * @return true if the request was handed to core 1; the outcome arrives as
+ *         onContract or onError
  */
 bool requestOptimalPower() {
     // Adjust power request based on detected device type
     int target_voltage = 5;
-    int target_current = 1;
+    int target_current = 1000; // mA
     
     switch(dev_type) {
         case DEVICE_TYPE_LAPTOP:
             target_voltage = 20;
-            target_current = 3;
+            target_current = 3000;
             break;
         case DEVICE_TYPE_TABLET:
             target_voltage = 12;
-            target_current = 2;
+            target_current = 2000;
             break;
         case DEVICE_TYPE_CHARGER:
             target_voltage = 9;
-            target_current = 2;
+            target_current = 2000;
             break;
         default:
             target_voltage = 5;
-            target_current = 1;
+            target_current = 1000;
             break;
     }
     
-    return sel_src_cap(target_voltage, target_current);
-} 
\ No newline at end of file
+    // Core 1 owns the FUSB302B; it picks the request up between messages
+    return pd_cb_request_power(0, target_voltage, target_current);
+}
@@ -0,0 +1,73 @@
+/**
+ * @file crc_bench.cpp
+ * @brief Host throughput comparison of the PD_CRC.cpp variants
+ *
+ * Build and run from the repository root:
+ *
+ *     g++ -O2 -std=c++17 -DPD_CRC_ALL -I. extras/crc_bench.cpp PD_CRC.cpp -o crc_bench
+ *     ./crc_bench
+ *
+ * Each variant is checked against the standard CRC-32 check value and then
+ * timed on buffers shaped like real PD traffic: a 6 byte control message, a
+ * 30 byte Source_Capabilities message and a bulk 4 KB buffer.
+ */
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include "PD_CRC.h"
+
+typedef uint32_t (*crc_fn_t)(uint32_t, const uint8_t *, uint16_t);
+
+struct variant_t {
+    const char *name;
+    crc_fn_t fn;
+    unsigned table_bytes;
+};
+
+static const variant_t variants[] = {
+    {"bitwise", pd_crc32_update_bitwise, 0},
+    {"table",   pd_crc32_update_table,   1024},
+    {"slice4",  pd_crc32_update_slice4,  4096},
+    {"slice8",  pd_crc32_update_slice8,  8192},
+};
+
+static volatile uint32_t sink;
+
+static double bench(crc_fn_t fn, const uint8_t *buf, uint16_t len) {
+    // Scale iterations so every measurement covers roughly 64 MB
+    const unsigned long iters = (64UL << 20) / len;
+    auto start = std::chrono::steady_clock::now();
+    uint32_t crc = PD_CRC_INIT;
+    for (unsigned long i = 0; i < iters; i++) {
+        crc = fn(crc, buf, len);
+    }
+    auto end = std::chrono::steady_clock::now();
+    sink = crc;
+    double secs = std::chrono::duration<double>(end - start).count();
+    return ((double)iters * len) / secs / 1e6;
+}
+
+int main() {
+    static uint8_t bulk[4096];
+    for (unsigned i = 0; i < sizeof(bulk); i++) {
+        bulk[i] = (uint8_t)(i * 131 + 7);
+    }
+    const uint8_t check[] = "123456789";
+    const uint16_t sizes[] = {6, 30, sizeof(bulk)};
+
+    printf("%-8s %6s %12s %12s %12s\n", "variant", "table", "6 B MB/s", "30 B MB/s", "4 KB MB/s");
+    for (const variant_t &v : variants) {
+        uint32_t crc = ~v.fn(PD_CRC_INIT, check, 9);
+        if (crc != 0xCBF43926UL) {
+            printf("%-8s FAILED check value: 0x%08lX\n", v.name, (unsigned long)crc);
+            return 1;
+        }
+        printf("%-8s %6u", v.name, v.table_bytes);
+        for (uint16_t len : sizes) {
+            printf(" %12.1f", bench(v.fn, bulk, len));
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+#ifndef PD_HOST_ARDUINO_H
+#define PD_HOST_ARDUINO_H
+
+//=============================================================================
+// Host Arduino Shim
+//=============================================================================
+
+// The slice of the Arduino / arduino-pico API the stack uses, implemented in
+// pd_host.cpp on top of a PD_Sim model so the unmodified sources build and
+// run as an ordinary host program. Time is the simulator's virtual clock and
+// every board is thread-local; see pd_host.h.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+typedef unsigned int uint;
+typedef bool boolean;
+
+#define HEX 16
+#define DEC 10
+#define BIN 2
+
+#define INPUT           0
+#define OUTPUT          1
+#define INPUT_PULLUP    2
+
+#define GPIO_IRQ_LEVEL_LOW  0x1u
+#define GPIO_IRQ_LEVEL_HIGH 0x2u
+#define GPIO_IRQ_EDGE_FALL  0x4u
+#define GPIO_IRQ_EDGE_RISE  0x8u
+
+// Time (virtual, from the current board's simulator)
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// GPIO (only INT_N is modelled)
+typedef void (*gpio_irq_callback_t)(uint gpio, uint32_t events);
+void pinMode(int pin, int mode);
+int digitalRead(int pin);
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t events, bool enabled, gpio_irq_callback_t callback);
+void gpio_set_irq_enabled(uint gpio, uint32_t events, bool enabled);
+void gpio_set_dormant_irq_enabled(uint gpio, uint32_t events, bool enabled);
+
+// Cores and interrupts (the host board is single core)
+void __dmb(void);
+uint32_t save_and_disable_interrupts();
+void restore_interrupts(uint32_t status);
+uint32_t rp2040_get_core_num();
+
+// pico_time
+typedef uint64_t absolute_time_t;
+absolute_time_t make_timeout_time_ms(uint32_t ms);
+bool best_effort_wfe_or_timeout(absolute_time_t timeout);
+
+// Serial output goes to the current board's log, or nowhere
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buf, size_t size);
+    virtual int availableForWrite() { return 0; }
+    int printf(const char *format, ...);
+
+    size_t print(const char *s);
+    size_t print(char c);
+    size_t print(int value, int base = DEC);
+    size_t print(unsigned int value, int base = DEC);
+    size_t print(long value, int base = DEC);
+    size_t print(unsigned long value, int base = DEC);
+    size_t print(long long value, int base = DEC);
+    size_t print(unsigned long long value, int base = DEC);
+    size_t print(double value, int digits = 2);
+
+    size_t println();
+    size_t println(const char *s);
+    size_t println(char c);
+    size_t println(int value, int base = DEC);
+    size_t println(unsigned int value, int base = DEC);
+    size_t println(long value, int base = DEC);
+    size_t println(unsigned long value, int base = DEC);
+    size_t println(long long value, int base = DEC);
+    size_t println(unsigned long long value, int base = DEC);
+    size_t println(double value, int digits = 2);
+
+private:
+    size_t printNumber(unsigned long long value, bool negative, int base);
+};
+
+// With the board's uart_baud set, a write that finds the 32-byte TX FIFO
+// full waits for it on the virtual clock, as arduino-pico's SerialUART does
+class HardwareSerial : public Print {
+public:
+    void begin(unsigned long baud);
+    int available();
+    operator bool();
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buf, size_t size) override;
+    int availableForWrite() override;
+    using Print::write;
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+#include <hardware/sync.h>
+
+#endif // PD_HOST_ARDUINO_H
@@ -0,0 +1,17 @@
+#ifndef PD_HOST_WIRE_H
+#define PD_HOST_WIRE_H
+
+// Host Wire shim: the stack talks to the FUSB302B through pd_bus, so only
+// the calls setup1() makes on Wire itself are needed.
+
+#include <Arduino.h>
+
+class TwoWire {
+public:
+    void begin();
+    void setClock(uint32_t hz);
+};
+
+extern TwoWire Wire;
+
+#endif // PD_HOST_WIRE_H
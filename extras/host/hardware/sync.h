@@ -0,0 +1,10 @@
+#ifndef PD_HOST_HARDWARE_SYNC_H
+#define PD_HOST_HARDWARE_SYNC_H
+
+// Host shim: waiting for an event advances the simulator instead
+
+void __wfe(void);
+void __wfi(void);
+void __sev(void);
+
+#endif // PD_HOST_HARDWARE_SYNC_H
@@ -0,0 +1,13 @@
+#ifndef PD_HOST_HARDWARE_WATCHDOG_H
+#define PD_HOST_HARDWARE_WATCHDOG_H
+
+// Host shim: the watchdog is checked against virtual time by pd_host_tick()
+// and a bite is recorded on the board rather than resetting anything
+
+#include <stdint.h>
+
+bool watchdog_caused_reboot(void);
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug);
+void watchdog_update(void);
+
+#endif // PD_HOST_HARDWARE_WATCHDOG_H
@@ -0,0 +1,338 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <Arduino.h>
+#include <Wire.h>
+#include <hardware/sync.h>
+#include <hardware/watchdog.h>
+#include "pd_host.h"
+
+HardwareSerial Serial;
+HardwareSerial Serial1;
+TwoWire Wire;
+
+static thread_local pd_host_board_t *board;
+
+void pd_host_select(pd_host_board_t *selected) {
+    board = selected;
+}
+
+pd_host_board_t *pd_host_board() {
+    return board;
+}
+
+/**
+ * Pass virtual time on the current board
+ */
+static void advance(uint32_t us) {
+    pd_sim_advance(board->sim, us);
+    pd_host_tick();
+}
+
+void pd_host_tick() {
+    // The script and the INT_N handler read the clock, which ticks again
+    static thread_local bool ticking;
+    if (ticking) {
+        return;
+    }
+    ticking = true;
+    if (board->script) {
+        board->script(board);
+    }
+    bool low = pd_sim_int_asserted(board->sim);
+    if (low != board->int_low) {
+        board->int_low = low;
+        if (board->irq) {
+            board->irq(0, low ? GPIO_IRQ_EDGE_FALL : GPIO_IRQ_EDGE_RISE);
+        }
+    }
+    uint32_t now_ms = board->sim->clock_us / 1000;
+    if (board->wdt_enabled && !board->wdt_bitten && board->wdt_period_ms &&
+        (now_ms - board->wdt_fed_ms) > board->wdt_period_ms) {
+        board->wdt_bitten = true;
+        board->wdt_bitten_ms = now_ms;
+    }
+    ticking = false;
+}
+
+//=============================================================================
+// Time
+//=============================================================================
+
+// Reading the clock costs a microsecond, as it roughly does on the RP2040,
+// so a loop that only polls millis() still reaches its deadline, and the
+// script and INT_N keep running under the blocking path's busy waits.
+
+unsigned long millis() {
+    advance(1);
+    return board->sim->clock_us / 1000;
+}
+
+unsigned long micros() {
+    advance(1);
+    return board->sim->clock_us;
+}
+
+void delay(unsigned long ms) {
+    for (unsigned long i = 0; i < ms; i++) {
+        advance(1000);
+    }
+}
+
+void delayMicroseconds(unsigned int us) {
+    advance(us);
+}
+
+absolute_time_t make_timeout_time_ms(uint32_t ms) {
+    return (uint64_t)board->sim->clock_us + ms * 1000ull;
+}
+
+bool best_effort_wfe_or_timeout(absolute_time_t timeout) {
+    advance(100);
+    return board->sim->clock_us >= timeout;
+}
+
+void __wfe(void) {
+    advance(100);
+}
+
+void __wfi(void) {
+    advance(100);
+}
+
+void __sev(void) {
+}
+
+//=============================================================================
+// GPIO, Cores, Watchdog
+//=============================================================================
+
+void pinMode(int, int) {
+}
+
+int digitalRead(int) {
+    return !pd_sim_int_asserted(board->sim);
+}
+
+void gpio_set_irq_enabled_with_callback(uint, uint32_t, bool enabled, gpio_irq_callback_t callback) {
+    board->irq = enabled ? callback : NULL;
+}
+
+void gpio_set_irq_enabled(uint, uint32_t, bool) {
+}
+
+void gpio_set_dormant_irq_enabled(uint, uint32_t, bool) {
+}
+
+void __dmb(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+uint32_t save_and_disable_interrupts() {
+    return 0;
+}
+
+void restore_interrupts(uint32_t) {
+}
+
+uint32_t rp2040_get_core_num() {
+    return 1;
+}
+
+bool watchdog_caused_reboot(void) {
+    return board->wdt_rebooted;
+}
+
+void watchdog_enable(uint32_t delay_ms, bool) {
+    board->wdt_enabled = true;
+    board->wdt_period_ms = delay_ms;
+    board->wdt_fed_ms = millis();
+}
+
+void watchdog_update(void) {
+    board->wdt_fed_ms = millis();
+}
+
+void TwoWire::begin() {
+}
+
+void TwoWire::setClock(uint32_t) {
+}
+
+//=============================================================================
+// Serial
+//=============================================================================
+
+void HardwareSerial::begin(unsigned long) {
+}
+
+int HardwareSerial::available() {
+    return 0;
+}
+
+HardwareSerial::operator bool() {
+    return true;
+}
+
+/**
+ * Time the UART takes for one byte (start, 8 data and stop bits), 0 if not modelled
+ */
+static uint32_t uartByteUs() {
+    if (!board->uart_baud) {
+        return 0;
+    }
+    return (10000000u + board->uart_baud - 1) / board->uart_baud;
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+    return write(&c, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t *buf, size_t size) {
+    if (!board) {
+        return size;
+    }
+    uint32_t byte_us = uartByteUs();
+    for (size_t i = 0; byte_us && (i < size); i++) {
+        uint32_t now = board->sim->clock_us;
+        if ((int32_t)(board->uart_idle_us - now) < 0) {
+            board->uart_idle_us = now;
+        }
+        uint32_t backlog_us = board->uart_idle_us - now;
+        if (backlog_us > (PD_HOST_UART_FIFO - 1) * byte_us) {
+            advance(backlog_us - (PD_HOST_UART_FIFO - 1) * byte_us); // FIFO full
+        }
+        board->uart_idle_us += byte_us;
+    }
+    if (!board->log) {
+        return size;
+    }
+    return fwrite(buf, 1, size, board->log);
+}
+
+int HardwareSerial::availableForWrite() {
+    uint32_t byte_us = board ? uartByteUs() : 0;
+    if (!byte_us) {
+        return PD_HOST_UART_FIFO;
+    }
+    int32_t backlog_us = (int32_t)(board->uart_idle_us - board->sim->clock_us);
+    uint32_t backlog = (backlog_us > 0) ? (backlog_us + byte_us - 1) / byte_us : 0;
+    return (backlog >= PD_HOST_UART_FIFO) ? 0 : (int)(PD_HOST_UART_FIFO - backlog);
+}
+
+size_t Print::write(const uint8_t *buf, size_t size) {
+    size_t n = 0;
+    while ((n < size) && write(buf[n])) {
+        n++;
+    }
+    return n;
+}
+
+int Print::printf(const char *format, ...) {
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (n > 0) {
+        write((const uint8_t *)text, strlen(text));
+    }
+    return n;
+}
+
+size_t Print::printNumber(unsigned long long value, bool negative, int base) {
+    char text[66];
+    int pos = sizeof(text);
+    if (base < 2) {
+        base = DEC;
+    }
+    do {
+        int digit = value % base;
+        text[--pos] = digit < 10 ? '0' + digit : 'A' + digit - 10;
+        value /= base;
+    } while (value);
+    if (negative) {
+        text[--pos] = '-';
+    }
+    return write((const uint8_t *)&text[pos], sizeof(text) - pos);
+}
+
+size_t Print::print(const char *s) {
+    return write((const uint8_t *)s, strlen(s));
+}
+
+size_t Print::print(char c) {
+    return write((uint8_t)c);
+}
+
+size_t Print::print(long long value, int base) {
+    if (value < 0 && base == DEC) {
+        return printNumber(-(unsigned long long)value, true, base);
+    }
+    return printNumber((unsigned long long)value, false, base);
+}
+
+size_t Print::print(unsigned long long value, int base) {
+    return printNumber(value, false, base);
+}
+
+size_t Print::print(int value, int base) {
+    return print((long long)value, base);
+}
+
+size_t Print::print(unsigned int value, int base) {
+    return printNumber(value, false, base);
+}
+
+size_t Print::print(long value, int base) {
+    return print((long long)value, base);
+}
+
+size_t Print::print(unsigned long value, int base) {
+    return printNumber(value, false, base);
+}
+
+size_t Print::print(double value, int digits) {
+    char text[48];
+    snprintf(text, sizeof(text), "%.*f", digits, value);
+    return print(text);
+}
+
+size_t Print::println() {
+    return print("\n");
+}
+
+size_t Print::println(const char *s) {
+    return print(s) + println();
+}
+
+size_t Print::println(char c) {
+    return print(c) + println();
+}
+
+size_t Print::println(int value, int base) {
+    return print(value, base) + println();
+}
+
+size_t Print::println(unsigned int value, int base) {
+    return print(value, base) + println();
+}
+
+size_t Print::println(long value, int base) {
+    return print(value, base) + println();
+}
+
+size_t Print::println(unsigned long value, int base) {
+    return print(value, base) + println();
+}
+
+size_t Print::println(long long value, int base) {
+    return print(value, base) + println();
+}
+
+size_t Print::println(unsigned long long value, int base) {
+    return print(value, base) + println();
+}
+
+size_t Print::println(double value, int digits) {
+    return print(value, digits) + println();
+}
@@ -0,0 +1,68 @@
+#ifndef PD_HOST_H
+#define PD_HOST_H
+
+#include <stdio.h>
+#include <Arduino.h>
+#include "PD_Sim.h"
+
+//=============================================================================
+// Host Board
+//=============================================================================
+
+// One simulated board: the PD_Sim FUSB302B behind pd_bus plus the pins,
+// watchdog and serial port the stack expects around it. The Arduino shim
+// resolves every call against the calling thread's current board, so a
+// program built with -DPD_TLS=thread_local can run one stack per thread.
+
+#define PD_HOST_UART_FIFO       32      ///< RP2040 UART TX FIFO depth
+
+typedef struct pd_host_board pd_host_board_t;
+
+/**
+ * @brief Test script hook, run on every tick
+ *
+ * The stack sleeps inside loop1() while nothing is attached, so events such
+ * as plugging the source in have to be injected from here.
+ */
+typedef void (*pd_host_script_t)(pd_host_board_t *board);
+
+/**
+ * @brief State of one simulated board
+ */
+struct pd_host_board {
+    pd_sim_t *sim;                  ///< FUSB302B model; its clock is millis()/micros()
+    FILE *log;                      ///< Serial/Serial1 output, NULL to discard
+    uint32_t uart_baud;             ///< Line rate writes are timed at, 0: output takes no time
+    uint32_t uart_idle_us;          ///< When the UART TX FIFO runs empty
+    gpio_irq_callback_t irq;        ///< Handler registered for INT_N
+    bool int_low;                   ///< INT_N level last delivered to irq
+    bool wdt_enabled;               ///< watchdog_enable() was called
+    bool wdt_rebooted;              ///< What watchdog_caused_reboot() reports
+    uint32_t wdt_period_ms;         ///< Timeout passed to watchdog_enable()
+    uint32_t wdt_fed_ms;            ///< Last watchdog_update()
+    bool wdt_bitten;                ///< The watchdog would have reset the chip
+    uint32_t wdt_bitten_ms;         ///< When it first would have
+    pd_host_script_t script;        ///< Called from every pd_host_tick(), may be NULL
+    void *user;                     ///< Script state
+};
+
+/**
+ * @brief Make a board current for the calling thread
+ * @param board Board, zero-initialised apart from sim, log, uart_baud and script; NULL to release
+ */
+void pd_host_select(pd_host_board_t *board);
+
+/**
+ * @brief Board current for the calling thread
+ * @return Board, NULL if none is selected
+ */
+pd_host_board_t *pd_host_board();
+
+/**
+ * @brief Run the script, deliver INT_N edges to the registered handler and check the watchdog
+ *
+ * Called by every shim call that lets time pass; call it after loop1() too.
+ */
+void pd_host_tick();
+
+#endif // PD_HOST_H
@@ -0,0 +1,505 @@
+/**
+ * @file pd_classify.cpp
+ * @brief Host trainer and evaluator for the partner classifier (PD_Classify.h)
+ *
+ * Build and run from the repository root:
+ *
+ *     g++ -O2 -std=gnu++17 -I. extras/pd_classify.cpp PD_Classify.cpp -o pd_classify
+ *     ./pd_classify train [-d depth] [-m min_leaf] samples.csv > PD_Classify_Tree.h
+ *     ./pd_classify eval [-d depth] [-m min_leaf] [-k folds] samples.csv
+ *     ./pd_classify features CLASS capture...
+ *
+ * Samples are lines of "class,spec_rev,transition_ms,id_header,pdo..." (see
+ * extras/pd_classify_samples.csv); features are derived from them with the
+ * stack's own pd_classify_features(), so a retrained tree always sees what
+ * the sink will compute.
+ *
+ * train grows a CART tree (Gini impurity, binary splits on "value <=
+ * threshold") no deeper than -d and with no leaf under -m samples, merges
+ * sibling leaves of the same class and prints it as PD_Classify_Tree.h.
+ *
+ * eval estimates how such a tree does on partners it was not trained on:
+ * k-fold cross-validation over the samples (shuffled with a fixed seed, so
+ * runs compare) with a confusion matrix, then the accuracy of the built-in
+ * tree on the samples and its time per classification.
+ *
+ * features turns PD_TRACE 2 captures (see PD_Trace.h) into sample lines of
+ * the given class: per port, the first Source_Capabilities received on SOP,
+ * the Accept to PS_RDY time of the Request that follows and the ID Header of
+ * a Discover Identity ACK.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "FUSB302B_Regs.h"
+#include "PD_Classify.h"
+
+// Capture format, as in PD_Trace.h
+#define PD_CAPTURE_MAGIC        "PDCAP01\n"
+#define PD_CAPTURE_MAGIC_LEN    8
+#define PD_CAPTURE_TX           0x01
+#define PD_CAPTURE_CRC_BAD      0x02
+#define PD_CAPTURE_SOP(flags)   (((flags) >> 2) & 0x3)
+
+#define CLASSIFY_DEPTH      5       // Default -d
+#define CLASSIFY_MIN_LEAF   2       // Default -m
+#define CLASSIFY_FOLDS      5       // Default -k
+#define CLASSIFY_SEED       1       // Fold shuffle
+#define CLASSIFY_MAX_NODES  255     // pd_class_node_t::skip is 8 bits
+
+typedef struct {
+    pd_features_t features;
+    uint8_t label;
+} sample_t;
+
+typedef struct {
+    unsigned depth;
+    unsigned min_leaf;
+} train_opts_t;
+
+//=============================================================================
+// Samples
+//=============================================================================
+
+static int class_index(const char *name) {
+    for (int c = 0; c < PD_CLASSIFY_CLASSES; c++) {
+        if (!strcmp(name, pd_class_names[c])) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Read a sample file
+ * @return false on a malformed line (reported)
+ */
+static bool load_samples(const char *path, std::vector<sample_t> *samples) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "%s: cannot open\n", path);
+        return false;
+    }
+    char line[512];
+    unsigned line_no = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), file)) {
+        line_no++;
+        char *text = line + strspn(line, " \t");
+        char *comment = strchr(text, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        if (!*text || (*text == '\n') || (*text == '\r')) {
+            continue;
+        }
+        char *fields[4 + PD_MAX_DATA_OBJECTS];
+        unsigned num_fields = 0;
+        for (char *field = strtok(text, ",\r\n"); field && (num_fields < 4 + PD_MAX_DATA_OBJECTS);
+             field = strtok(NULL, ",\r\n")) {
+            fields[num_fields++] = field;
+        }
+        int label = (num_fields >= 5) ? class_index(fields[0]) : -1;
+        if (label < 0) {
+            fprintf(stderr, "%s:%u: expected class,spec_rev,transition_ms,id_header,pdo...\n", path, line_no);
+            ok = false;
+            continue;
+        }
+        uint32_t pdos[PD_MAX_DATA_OBJECTS];
+        uint8_t num_pdos = num_fields - 4;
+        for (uint8_t i = 0; i < num_pdos; i++) {
+            pdos[i] = strtoul(fields[4 + i], NULL, 0);
+        }
+        sample_t sample;
+        pd_classify_features(pdos, num_pdos, strtoul(fields[1], NULL, 0), strtoul(fields[2], NULL, 0),
+                             strtoul(fields[3], NULL, 0), &sample.features);
+        sample.label = label;
+        samples->push_back(sample);
+    }
+    fclose(file);
+    if (ok && samples->empty()) {
+        fprintf(stderr, "%s: no samples\n", path);
+        ok = false;
+    }
+    return ok;
+}
+
+//=============================================================================
+// Training
+//=============================================================================
+
+static double gini(const unsigned *counts, unsigned total) {
+    double sum = 0;
+    for (int c = 0; c < PD_CLASSIFY_CLASSES; c++) {
+        double p = (double)counts[c] / total;
+        sum += p * p;
+    }
+    return 1.0 - sum;
+}
+
+/**
+ * Most frequent class; ties go to the lower pd_device_type_t (charger first, as recognition defaults)
+ */
+static uint8_t majority(const unsigned *counts) {
+    uint8_t best = 0;
+    for (int c = 1; c < PD_CLASSIFY_CLASSES; c++) {
+        if (counts[c] > counts[best]) {
+            best = c;
+        }
+    }
+    return best;
+}
+
+/**
+ * Append the subtree for samples[index] to tree, depth first
+ */
+static void grow(const std::vector<sample_t> &samples, std::vector<unsigned> index, unsigned depth,
+                 const train_opts_t *opts, std::vector<pd_class_node_t> *tree) {
+    unsigned counts[PD_CLASSIFY_CLASSES] = {};
+    for (unsigned i : index) {
+        counts[samples[i].label]++;
+    }
+    uint8_t label = majority(counts);
+    double impurity = gini(counts, index.size());
+
+    // Best split over every feature and every boundary between distinct values
+    double best = impurity - 1e-9;
+    int best_feature = -1;
+    uint16_t best_threshold = 0;
+    if ((depth < opts->depth) && (impurity > 0) && (index.size() >= 2 * opts->min_leaf)) {
+        for (int f = 0; f < PD_NUM_FEATURES; f++) {
+            std::sort(index.begin(), index.end(), [&](unsigned a, unsigned b) {
+                return samples[a].features.value[f] < samples[b].features.value[f];
+            });
+            unsigned left[PD_CLASSIFY_CLASSES] = {};
+            unsigned right[PD_CLASSIFY_CLASSES];
+            memcpy(right, counts, sizeof(right));
+            for (size_t k = 0; k + 1 < index.size(); k++) {
+                uint8_t c = samples[index[k]].label;
+                left[c]++;
+                right[c]--;
+                uint16_t value = samples[index[k]].features.value[f];
+                if (value == samples[index[k + 1]].features.value[f]) {
+                    continue;
+                }
+                size_t n_left = k + 1, n_right = index.size() - n_left;
+                if ((n_left < opts->min_leaf) || (n_right < opts->min_leaf)) {
+                    continue;
+                }
+                double split = (n_left * gini(left, n_left) + n_right * gini(right, n_right)) / index.size();
+                if (split < best) {
+                    best = split;
+                    best_feature = f;
+                    best_threshold = value;
+                }
+            }
+        }
+    }
+
+    size_t at = tree->size();
+    if (best_feature < 0) {
+        tree->push_back({PD_CLASSIFY_LEAF, 0, label});
+        return;
+    }
+    std::vector<unsigned> lower, upper;
+    for (unsigned i : index) {
+        (samples[i].features.value[best_feature] <= best_threshold ? lower : upper).push_back(i);
+    }
+    tree->push_back({(uint8_t)best_feature, 0, best_threshold});
+    grow(samples, lower, depth + 1, opts, tree);
+    size_t skip = tree->size() - at;
+    grow(samples, upper, depth + 1, opts, tree);
+    (*tree)[at].skip = skip;
+
+    // Both children leaves of one class: the split decides nothing
+    if ((tree->size() == at + 3) && ((*tree)[at + 1].feature == PD_CLASSIFY_LEAF) &&
+        ((*tree)[at + 2].feature == PD_CLASSIFY_LEAF) && ((*tree)[at + 1].threshold == (*tree)[at + 2].threshold)) {
+        uint16_t merged = (*tree)[at + 1].threshold;
+        tree->resize(at);
+        tree->push_back({PD_CLASSIFY_LEAF, 0, merged});
+    }
+}
+
+/**
+ * Train a tree on a subset of the samples
+ * @return false if it outgrew CLASSIFY_MAX_NODES
+ */
+static bool train(const std::vector<sample_t> &samples, const std::vector<unsigned> &index,
+                  const train_opts_t *opts, std::vector<pd_class_node_t> *tree) {
+    tree->clear();
+    grow(samples, index, 0, opts, tree);
+    return tree->size() <= CLASSIFY_MAX_NODES;
+}
+
+//=============================================================================
+// Commands
+//=============================================================================
+
+/**
+ * Print the tree as PD_Classify_Tree.h
+ */
+static void print_tree(const std::vector<pd_class_node_t> &tree, const char *path, size_t num_samples,
+                       const train_opts_t *opts) {
+    printf("#ifndef PD_CLASSIFY_TREE_H\n#define PD_CLASSIFY_TREE_H\n\n");
+    printf("#include \"PD_Classify.h\"\n\n");
+    printf("// Generated by extras/pd_classify.cpp from %s\n", path);
+    printf("// (%zu samples, depth %u, min leaf %u); retrain rather than edit.\n", num_samples, opts->depth,
+           opts->min_leaf);
+    printf("static const pd_class_node_t pd_classify_nodes[] = {\n");
+    std::vector<unsigned> depth(tree.size(), 0);
+    for (size_t i = 0; i < tree.size(); i++) {
+        const pd_class_node_t *node = &tree[i];
+        char entry[64];
+        if (node->feature == PD_CLASSIFY_LEAF) {
+            snprintf(entry, sizeof(entry), "{PD_CLASSIFY_LEAF, 0, %u},", node->threshold);
+            printf("    %-44s // %*s%s\n", entry, depth[i] * 2, "", pd_class_names[node->threshold]);
+            continue;
+        }
+        std::string name = pd_feature_names[node->feature];
+        std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+        snprintf(entry, sizeof(entry), "{PD_FEAT_%s, %u, %u},", name.c_str(), node->skip, node->threshold);
+        printf("    %-44s // %*s%s <= %u\n", entry, depth[i] * 2, "", pd_feature_names[node->feature],
+               node->threshold);
+        depth[i + 1] = depth[i] + 1;
+        depth[i + node->skip] = depth[i] + 1;
+    }
+    printf("};\n\n#endif // PD_CLASSIFY_TREE_H\n");
+}
+
+static void print_confusion(const unsigned confusion[PD_CLASSIFY_CLASSES][PD_CLASSIFY_CLASSES]) {
+    printf("%-10s", "actual");
+    for (int c = 0; c < PD_CLASSIFY_CLASSES; c++) {
+        printf(" %8s", pd_class_names[c]);
+    }
+    printf("   recall\n");
+    for (int a = 0; a < PD_CLASSIFY_CLASSES; a++) {
+        unsigned total = 0;
+        printf("%-10s", pd_class_names[a]);
+        for (int p = 0; p < PD_CLASSIFY_CLASSES; p++) {
+            printf(" %8u", confusion[a][p]);
+            total += confusion[a][p];
+        }
+        printf("   %5.1f%%\n", total ? 100.0 * confusion[a][a] / total : 0.0);
+    }
+}
+
+static int cmd_eval(const std::vector<sample_t> &samples, const train_opts_t *opts, unsigned folds) {
+    std::vector<unsigned> order(samples.size());
+    for (unsigned i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937(CLASSIFY_SEED));
+    folds = std::max(2u, std::min<unsigned>(folds, samples.size()));
+
+    unsigned confusion[PD_CLASSIFY_CLASSES][PD_CLASSIFY_CLASSES] = {};
+    unsigned correct = 0;
+    size_t nodes = 0;
+    for (unsigned k = 0; k < folds; k++) {
+        std::vector<unsigned> training, held_out;
+        for (unsigned i = 0; i < order.size(); i++) {
+            ((i % folds) == k ? held_out : training).push_back(order[i]);
+        }
+        std::vector<pd_class_node_t> tree;
+        if (!train(samples, training, opts, &tree)) {
+            fprintf(stderr, "tree exceeds %u nodes, lower -d\n", CLASSIFY_MAX_NODES);
+            return 2;
+        }
+        nodes += tree.size();
+        for (unsigned i : held_out) {
+            uint8_t predicted = pd_classify_tree(tree.data(), &samples[i].features);
+            confusion[samples[i].label][predicted]++;
+            correct += (predicted == samples[i].label);
+        }
+    }
+    printf("%u-fold cross-validation, depth %u, min leaf %u: %.1f%% of %zu samples, %.1f nodes per tree\n",
+           folds, opts->depth, opts->min_leaf, 100.0 * correct / samples.size(), samples.size(),
+           (double)nodes / folds);
+    print_confusion(confusion);
+
+    // The tree the stack is built with, on the whole set
+    memset(confusion, 0, sizeof(confusion));
+    correct = 0;
+    for (const sample_t &s : samples) {
+        uint8_t predicted = pd_classify(&s.features);
+        confusion[s.label][predicted]++;
+        correct += (predicted == s.label);
+    }
+    const unsigned rounds = 20000;
+    volatile unsigned sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned r = 0; r < rounds; r++) {
+        for (const sample_t &s : samples) {
+            sink += pd_classify(&s.features);
+        }
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() /
+                ((double)rounds * samples.size());
+    printf("\nbuilt-in tree (PD_Classify_Tree.h) on the same samples: %.1f%%, %.1f ns per classification\n",
+           100.0 * correct / samples.size(), ns);
+    print_confusion(confusion);
+    return 0;
+}
+
+static uint32_t load32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * Print one sample line per port of a PD_TRACE 2 capture
+ */
+static bool capture_features(const char *path, const char *label) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "%s: cannot open\n", path);
+        return false;
+    }
+    std::vector<uint8_t> data;
+    uint8_t buf[65536];
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), file)) > 0;) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(file);
+    if ((data.size() < PD_CAPTURE_MAGIC_LEN) || memcmp(data.data(), PD_CAPTURE_MAGIC, PD_CAPTURE_MAGIC_LEN)) {
+        fprintf(stderr, "%s: not a PD capture\n", path);
+        return false;
+    }
+
+    struct port_t {
+        uint32_t pdos[PD_MAX_DATA_OBJECTS];
+        uint8_t num_pdos;
+        uint8_t spec_rev;
+        bool requested;         // Request sent after the capabilities
+        uint32_t accept_us;     // 0 until Accepted
+        uint32_t transition_ms;
+        uint32_t id_header;
+    } ports[256] = {};
+    for (size_t at = PD_CAPTURE_MAGIC_LEN; at + 8 <= data.size();) {
+        const uint8_t *record = &data[at];
+        uint8_t objects = (record[7] >> 4) & 0x7;
+        if (at + 8 + objects * 4 > data.size()) {
+            break;
+        }
+        at += 8 + objects * 4;
+        uint8_t flags = record[4];
+        if ((flags & PD_CAPTURE_CRC_BAD) || PD_CAPTURE_SOP(flags)) {
+            continue; // Bad CRC or not SOP
+        }
+        port_t *port = &ports[record[5]];
+        uint8_t type = PD_HEADER_TYPE(&record[6]);
+        bool extended = record[7] >> 7;
+        if (flags & PD_CAPTURE_TX) {
+            port->requested |= port->num_pdos && !extended && (type == MSG_TYPE_REQUEST) && objects;
+            continue;
+        }
+        uint32_t now_us = load32(record);
+        if (!extended && (type == MSG_TYPE_SOURCE_CAPABILITIES) && objects && !port->num_pdos) {
+            port->num_pdos = objects;
+            port->spec_rev = PD_HEADER_SPEC_REV(&record[6]);
+            for (uint8_t i = 0; i < objects; i++) {
+                port->pdos[i] = load32(&record[8 + i * 4]);
+            }
+        } else if (!extended && !objects && (type == MSG_TYPE_ACCEPT) && port->requested && !port->accept_us) {
+            port->accept_us = now_us ? now_us : 1;
+        } else if (!extended && !objects && (type == MSG_TYPE_PS_READY) && port->accept_us && !port->transition_ms) {
+            port->transition_ms = std::max(1u, (now_us - port->accept_us + 500) / 1000);
+        } else if (!extended && (type == MSG_TYPE_VDM) && (objects >= 2)) {
+            uint32_t vdm = load32(&record[8]);
+            if ((vdm & VDM_STRUCTURED) && (VDM_HDR_SVID(vdm) == PD_SID) && (VDM_HDR_CMD(vdm) == 1) &&
+                (VDM_HDR_CMD_TYPE(vdm) == 1)) {
+                port->id_header = load32(&record[12]);
+            }
+        }
+    }
+    for (unsigned p = 0; p < 256; p++) {
+        const port_t *port = &ports[p];
+        if (!port->num_pdos) {
+            continue;
+        }
+        printf("%s,%u,%u,0x%08X", label, port->spec_rev, port->transition_ms, port->id_header);
+        for (uint8_t i = 0; i < port->num_pdos; i++) {
+            printf(",0x%08X", port->pdos[i]);
+        }
+        printf("  # %s port %u\n", path, p);
+    }
+    return true;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s train [-d depth] [-m min_leaf] samples.csv\n"
+                    "       %s eval [-d depth] [-m min_leaf] [-k folds] samples.csv\n"
+                    "       %s features CLASS capture...\n", argv0, argv0, argv0);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return 2;
+    }
+    const char *command = argv[1];
+    if (!strcmp(command, "features")) {
+        if ((argc < 4) || (class_index(argv[2]) < 0)) {
+            usage(argv[0]);
+            return 2;
+        }
+        bool ok = true;
+        for (int i = 3; i < argc; i++) {
+            ok &= capture_features(argv[i], argv[2]);
+        }
+        return ok ? 0 : 2;
+    }
+
+    train_opts_t opts = {CLASSIFY_DEPTH, CLASSIFY_MIN_LEAF};
+    unsigned folds = CLASSIFY_FOLDS;
+    const char *path = NULL;
+    for (int i = 2; i < argc; i++) {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!strcmp(argv[i], "-d") && value) {
+            opts.depth = strtoul(value, NULL, 0);
+            i++;
+        } else if (!strcmp(argv[i], "-m") && value) {
+            opts.min_leaf = std::max(1ul, strtoul(value, NULL, 0));
+            i++;
+        } else if (!strcmp(argv[i], "-k") && value) {
+            folds = strtoul(value, NULL, 0);
+            i++;
+        } else if ((argv[i][0] != '-') && !path) {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    std::vector<sample_t> samples;
+    if (!path || !load_samples(path, &samples)) {
+        if (!path) {
+            usage(argv[0]);
+        }
+        return 2;
+    }
+
+    if (!strcmp(command, "eval")) {
+        return cmd_eval(samples, &opts, folds);
+    }
+    if (strcmp(command, "train")) {
+        usage(argv[0]);
+        return 2;
+    }
+    std::vector<unsigned> all(samples.size());
+    for (unsigned i = 0; i < all.size(); i++) {
+        all[i] = i;
+    }
+    std::vector<pd_class_node_t> tree;
+    if (!train(samples, all, &opts, &tree)) {
+        fprintf(stderr, "tree exceeds %u nodes, lower -d\n", CLASSIFY_MAX_NODES);
+        return 2;
+    }
+    print_tree(tree, path, samples.size(), &opts);
+    return 0;
+}
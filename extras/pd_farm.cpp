@@ -0,0 +1,1146 @@
+/**
+ * @file pd_farm.cpp
+ * @brief Host simulation farm: stress the sink stack against a catalogue of source behaviours
+ *
+ * Build and run from the repository root:
+ *
+ *     g++ -O2 -std=gnu++17 -pthread -DPD_TLS=thread_local -Iextras/host -I. \
+ *         extras/pd_farm.cpp extras/host/pd_host.cpp PD_Negotiation.cpp Protocol_Engine.cpp \
+ *         PD_Flow.cpp PD_Port.cpp PD_Stats.cpp PD_CRC.cpp PD_Transport.cpp PD_Sim.cpp PD_VDM.cpp PD_VBUS.cpp \
+ *         PD_Callbacks.cpp PD_Alert.cpp PD_Reset.cpp PD_Log.cpp PD_Classify.cpp -o pd_farm
+ *     ./pd_farm [-n instances] [-j threads] [-s seed] [-r instance] [-c dir]
+ *
+ * Every instance is a complete stack (setup1()/loop1() with PD_TLS state) on
+ * its own PD_Sim FUSB302B, attached to the source profile (index % profiles)
+ * with timings drawn from a generator seeded by (seed, index), so a run is
+ * reproducible regardless of thread count and -r replays one instance with
+ * its Serial1 log. Instances are dealt out to per-thread queues; a thread
+ * that runs dry steals from the others.
+ *
+ * An instance passes when it ends in the profile's expected outcome within
+ * the profile's deadline, without the watchdog biting, without a malformed
+ * Request and, in EPR mode, without a lapsed keep-alive. Sources move VBUS to
+ * the contract voltage just before PS_RDY; the sink must flag the contracts
+ * of the sagging-vbus source, which delivers 10% low, and no others. The
+ * alert-ocp source sends an over-current Alert after the final contract: the
+ * load-shed hook must run within FARM_SHED_LIMIT_US of the Alert going out
+ * and the sink must read the Status it asks for; no other source may trigger
+ * the hook.
+ *
+ * Every Hard Reset, the sink's or the source's, switches VBUS off after
+ * tPSHardReset and back on shortly before the source advertises again. The
+ * soft-resets and hard-resets sources send their own reset after the final
+ * contract and must get a contract again within the profile's reset limit
+ * without the sink detaching.
+ *
+ * Serial1 is timed as a 115200 baud UART and the board script drains the
+ * log queue into it as core 0 would. Every request the sink answers must be
+ * answered within FARM_REPLY_LIMIT_US of being read, and the summary lists
+ * the worst reply per request type; build with -DPD_LOG_QUEUE=0 to see the
+ * UART in those times.
+ *
+ * The idle-wake source is plugged in only after the sink has idled for 3 s.
+ * At that moment POWER must hold only the bandgap and wake blocks and
+ * CONTROL2 SNK toggling with Rd only; the sink's first register read must
+ * follow within FARM_WAKE_LIMIT_US.
+ *
+ * Build with -DPD_USE_FLOWS=0 to run the blocking path instead of the flows.
+ * It listens PD_T_PARTNER_IDLE_MS for the source's requests after
+ * recognition's contract, so every deadline grows by that window.
+ *
+ * The epr-140w source only enters EPR mode for a sink built with
+ * -DPD_EPR_SINK_PDP_W=140 -DPD_CONTRACT_V=28 -DPD_CONTRACT_MA=5000; the SPR
+ * profiles offer no 28 V, so in that build they end in a vSafe5V contract
+ * requested with Capability Mismatch and keep their expected outcomes.
+ *
+ * With -c every instance writes its traffic to dir/NNNNN.pdc (the instance
+ * index) for extras/pd_trace.cpp; the stack must be built with -DPD_TRACE=2.
+ *
+ * The summary lists pass/fail counts and the attach to outcome latency
+ * distribution per profile; the exit status is 1 if any instance failed.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "FUSB302B.h"
+#include "PD_Flow.h"
+#include "PD_Sim.h"
+#include "PD_Stats.h"
+#include "PD_Alert.h"
+#include "PD_Log.h"
+#include "PD_Trace.h"
+#include "host/pd_host.h"
+
+void setup1();
+void loop1();
+
+#define FARM_SLACK_MS       100     // Polling and bus time on top of the protocol deadlines
+#define FARM_SETTLE_MS      1000    // Run on after the deadline to catch late misbehaviour
+#define FARM_MAX_FAILURES   10      // Failing instances listed in the summary
+#define FARM_READVERTISE_MS 300     // PS_RDY to a re-sent Source_Capabilities
+#define FARM_EPR_KEEPALIVE_MS 1000  // tSourceEPRKeepAlive: EPR mode lapses without EPR_KeepAlive
+#define FARM_ALERT_MS       200     // PS_RDY of the final contract to an Alert
+#define FARM_RESET_MS       300     // PS_RDY of the final contract to the source's own reset
+#define FARM_PS_HARD_RESET_MS 30    // tPSHardReset: Hard Reset to VBUS switched off
+#define FARM_FIRST_CAP_MS   100     // VBUS back on to Source_Capabilities after a Hard Reset
+#define FARM_SHED_LIMIT_US  2000    // Alert on the wire to the load-shed hook: wake-up, INT_N service, FIFO read at 400 kHz
+#define FARM_UART_BAUD      115200  // Serial1 line rate the log is timed at
+#define FARM_REPLY_LIMIT_US 15000   // tReceiverResponse: a request read from the RX FIFO to our reply loaded
+#define FARM_WAKE_LIMIT_US  500     // INT_N on attach to the first register read out of an idle sleep
+#define FARM_IDLE_CONTROL2  (CONTROL2_TOGGLE | CONTROL2_MODE_SNK | CONTROL2_TOG_RD_ONLY | \
+                             CONTROL2_TOG_SAVE_PWR(PD_TOG_SAVE_PWR)) // SNK toggle, Rd only
+
+static const char *capture_dir = NULL;  // -c: write a PD_TRACE 2 capture per instance
+
+/**
+ * Capture stream of one instance
+ */
+class CaptureFile : public Print {
+public:
+    FILE *file;
+    size_t write(uint8_t c) override {
+        return fwrite(&c, 1, 1, file);
+    }
+    size_t write(const uint8_t *buf, size_t size) override {
+        return fwrite(buf, 1, size, file);
+    }
+    using Print::write;
+};
+
+//=============================================================================
+// Source Profiles
+//=============================================================================
+
+typedef enum {
+    OUTCOME_CONTRACT = 0,           // Explicit contract, never detached
+    OUTCOME_NONE,                   // Attached without a contract
+    OUTCOME_DETACH,                 // Recovery ladder ran out
+    NUM_OUTCOMES
+} outcome_t;
+
+static const char *const outcome_names[NUM_OUTCOMES] = {"contract", "none", "detach"};
+
+typedef enum {
+    RESET_NONE = 0,
+    RESET_SOFT,                     // Soft_Reset, Source_Capabilities once accepted
+    RESET_HARD                      // Hard Reset, VBUS cycled, Source_Capabilities
+} source_reset_t;
+
+typedef struct {
+    const char *name;
+    uint8_t spec_rev;               // Header revision field (1 = PD 2.0, 2 = PD 3.0)
+    uint16_t caps_ms[2];            // Attach or reset to Source_Capabilities (min, max)
+    uint16_t accept_ms[2];          // Request to Accept/Wait/Reject
+    uint16_t ps_rdy_ms[2];          // Accept to PS_RDY
+    uint16_t hard_reset_ms[2];      // Hard Reset to Source_Capabilities
+    uint8_t waits;                  // Requests answered with Wait before accepting
+    uint8_t drop_request;           // Request number left unanswered (0 = none)
+    bool silent_after_drop;         // ...and nothing answered after it
+    bool ignore_soft_reset;         // Soft_Reset left unanswered
+    bool reject;                    // Every Request rejected
+    bool ext_caps;                  // Answers Get_Source_Cap_Extended (PD 3.0)
+    bool chunked;                   // ...as a chunked extended message
+    outcome_t expect;
+    uint8_t readvertise;            // Source_Capabilities re-sent after a contract, the last one with a new 20 V PDO
+    uint8_t cable;                  // E-marked cable rated for 3 or 5 A, 0 = none (VCONN_Swap rejected)
+    bool epr;                       // EPR Mode Capable: 28/36/48 V and a 15-48 V AVS in EPR mode
+    uint8_t sag_pct;                // VBUS delivered this far below the contract voltage
+    bool alert;                     // Alert (OCP) after the final contract, Status on Get_Status
+    source_reset_t reset;           // Reset sent by the source after the final contract
+    uint16_t idle_ms;               // Plugged in only after the sink has idled this long (0: 100-400 ms)
+} profile_t;
+
+static const profile_t profiles[] = {
+    // name               rev caps        accept    ps_rdy      hard reset    W  D  silent ignSR  rej    ext    chunk  expect            rdv cable epr    sag alert  reset      idle
+    {"compliant-pd3",     2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 0, false, false, false, true,  false, OUTCOME_CONTRACT, 0,  0,    false, 0,  false, RESET_NONE, 0},
+    {"compliant-pd2",     1,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 0, false, false, false, false, false, OUTCOME_CONTRACT, 0,  0,    false, 0,  false, RESET_NONE, 0},
+    {"pd3-not-supported", 2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 0, false, false, false, false, false, OUTCOME_CONTRACT, 0,  0,    false, 0,  false, RESET_NONE, 0},
+    {"chunked-ext",       2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 0, false, false, false, true,  true,  OUTCOME_CONTRACT, 0,  0,    false, 0,  false, RESET_NONE, 0},
+    {"slow",              2,  {450, 600}, {20, 27}, {400, 540}, {1200, 1500}, 0, 0, false, false, false, true,  false, OUTCOME_CONTRACT, 0,  0,    false, 0,  false, RESET_NONE, 0},
+    {"wait-once",         2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  1, 0, false, false, false, true,  false, OUTCOME_CONTRACT, 0,  0,    false, 0,  false, RESET_NONE, 0},
+    {"reject",            2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 0, false, false, true,  true,  false, OUTCOME_NONE,     0,  0,    false, 0,  false, RESET_NONE, 0},
+    {"drops-request",     2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 2, false, false, false, true,  false, OUTCOME_CONTRACT, 0,  0,    false, 0,  false, RESET_NONE, 0},
+    {"ignores-soft-reset",2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 2, false, true,  false, true,  false, OUTCOME_CONTRACT, 0,  0,    false, 0,  false, RESET_NONE, 0},
+    {"goes-silent",       2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 2, true,  false, false, true,  false, OUTCOME_DETACH,   0,  0,    false, 0,  false, RESET_NONE, 0},
+    {"re-advertises",     2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 0, false, false, false, true,  false, OUTCOME_CONTRACT, 3,  0,    false, 0,  false, RESET_NONE, 0},
+    {"5a-cable",          2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 0, false, false, false, true,  false, OUTCOME_CONTRACT, 0,  5,    false, 0,  false, RESET_NONE, 0},
+    {"epr-140w",          2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 0, false, false, false, true,  false, OUTCOME_CONTRACT, 0,  0,    true,  0,  false, RESET_NONE, 0},
+    {"sagging-vbus",      2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 0, false, false, false, true,  false, OUTCOME_CONTRACT, 0,  0,    false, 10, false, RESET_NONE, 0},
+    {"alert-ocp",         2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 0, false, false, false, true,  false, OUTCOME_CONTRACT, 0,  0,    false, 0,  true,  RESET_NONE, 0},
+    {"soft-resets",       2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 0, false, false, false, true,  false, OUTCOME_CONTRACT, 0,  0,    false, 0,  false, RESET_SOFT, 0},
+    {"hard-resets",       2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 0, false, false, false, true,  false, OUTCOME_CONTRACT, 0,  0,    false, 0,  false, RESET_HARD, 0},
+    {"idle-wake",         2,  {80, 250},  {1, 10},  {20, 250},  {600, 1200},  0, 0, false, false, false, true,  false, OUTCOME_CONTRACT, 0,  0,    false, 0,  false, RESET_NONE, 3000},
+};
+
+#define NUM_PROFILES (sizeof(profiles) / sizeof(profiles[0]))
+
+/**
+ * Longest a profile's own reset may take to end in a contract again, in ms
+ */
+static uint32_t reset_limit_ms(const profile_t *p) {
+    uint32_t select = PD_TX_TIMEOUT_MS + p->accept_ms[1] + p->ps_rdy_ms[1];
+    return ((p->reset == RESET_HARD) ? p->hard_reset_ms[1] : PD_TX_TIMEOUT_MS + 1) + select + FARM_SLACK_MS;
+}
+
+/**
+ * Latest a profile may reach its expected outcome, in ms after attach
+ */
+static uint32_t deadline_ms(const profile_t *p) {
+    // Recognition (caps, select, extended caps query), hard reset, final select
+    uint32_t select = PD_TX_TIMEOUT_MS + p->accept_ms[1] + p->ps_rdy_ms[1];
+    uint32_t limit = p->caps_ms[1] + select + PD_TX_TIMEOUT_MS + PD_T_SENDER_RESPONSE_MS +
+                     p->hard_reset_ms[1] + select;
+    if (p->drop_request) {
+        limit += PD_T_RECOVERY_MAX_MS;
+    }
+    if (!PD_USE_FLOWS) {
+        // The blocking path listens for the source's requests after recognition's contract
+        limit += PD_T_PARTNER_IDLE_MS;
+    }
+    limit += p->readvertise * (FARM_READVERTISE_MS + select);
+    if (PD_VCONN_SOURCE && (p->cable == 5)) {
+        // VCONN_Swap, PS_RDY, Discover Identity on SOP', Get_Source_Cap, then a new contract
+        limit += 3 * PD_TX_TIMEOUT_MS + PD_T_SENDER_RESPONSE_MS + PD_T_VCONN_STABLE_MS +
+                 PD_TX_TIMEOUT_MS + PD_T_VDM_SENDER_RESPONSE_MS + select;
+    }
+    if (PD_EPR_SINK_PDP_W && (PD_CONTRACT_V > 20) && p->epr) {
+        // EPR_Mode Enter, Enter Succeeded after the cable check, two chunks, then an EPR contract
+        limit += 2 * PD_TX_TIMEOUT_MS + p->ps_rdy_ms[1] + 2 * PD_T_CHUNK_SENDER_RESPONSE_MS + select +
+                 p->ps_rdy_ms[1];
+    }
+    if (p->reset) {
+        // The source's reset, then Source_Capabilities and the same Request again
+        limit += FARM_RESET_MS + reset_limit_ms(p);
+    }
+    return limit + FARM_SLACK_MS;
+}
+
+//=============================================================================
+// Source Model
+//=============================================================================
+
+typedef struct {
+    const profile_t *profile;
+    uint64_t rng;
+    uint8_t message_id;
+    uint8_t cable_message_id;       // The e-marker's own MessageID on SOP'
+    uint8_t num_caps;
+    uint32_t offered[4];            // Last Source_Capabilities sent
+    uint8_t requests;               // Requests received
+    uint8_t waits;                  // Wait replies sent
+    uint8_t bad_requests;           // Requests for an object we never offered
+    uint8_t contracts;              // PS_RDY sent
+    bool silent;
+    uint32_t epr_since_us;          // EPR_Mode Enter Succeeded or the last EPR_KeepAlive, 0 = SPR
+    bool keepalive_lapsed;          // EPR mode ended for want of EPR_KeepAlive
+    uint32_t vbus_mv;               // VBUS of the contract being transitioned to
+    uint32_t vbus_due_us;           // ...reached just before PS_RDY
+    bool vbus_pending;
+    uint32_t alert_us;              // Alert due on the wire, 0 = none sent
+    bool status_sent;               // Status sent for a Get_Status
+    uint32_t vbus_off_due_us;       // Hard Reset: VBUS switched off here...
+    bool vbus_off_pending;          // ...and back on at vbus_due_us
+    uint32_t reset_due_us;          // The profile's own reset goes out here...
+    bool reset_pending;
+    uint32_t reset_us;              // ...and went out here, 0 = not yet
+    bool soft_reset_sent;           // Soft_Reset waiting for Accept
+} source_t;
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Uniform delay in [range[0], range[1]] ms, returned in us
+ */
+static uint32_t draw_us(source_t *src, const uint16_t range[2]) {
+    uint32_t span = (range[1] - range[0]) * 1000u + 1;
+    return range[0] * 1000u + (uint32_t)(splitmix64(&src->rng) % span);
+}
+
+/**
+ * VBUS the source actually delivers for a contract voltage
+ */
+static uint32_t source_vbus_mv(const source_t *src, uint32_t mv) {
+    return mv * (100 - src->profile->sag_pct) / 100;
+}
+
+static void source_send(pd_sim_t *sim, source_t *src, uint32_t delay_us, uint8_t type,
+                        const uint32_t *objects, uint8_t num_objects) {
+    uint8_t msg[2 + 7 * 4];
+    pd_sim_header(msg, type, num_objects, src->message_id, src->profile->spec_rev);
+    src->message_id = (src->message_id + 1) & 0x7;
+    for (int i = 0; i < num_objects; i++) {
+        for (int b = 0; b < 4; b++) {
+            msg[2 + i * 4 + b] = objects[i] >> (8 * b);
+        }
+    }
+    pd_sim_schedule_rx(sim, delay_us, RX_TOKEN_SOP, msg, 2 + num_objects * 4);
+}
+
+static void source_send_caps(pd_sim_t *sim, source_t *src, uint32_t delay_us) {
+    const uint32_t caps[] = {
+        (src->profile->epr ? (uint32_t)PDO_FIXED_EPR_CAPABLE : 0u) |
+        (uint32_t)PDO_FIXED_UNCONSTRAINED | (100u << 10) | 300u, // 5 V 3 A, unconstrained power
+        (180u << 10) | 300u,                // 9 V 3 A
+        (300u << 10) | 300u,                // 15 V 3 A (PD 3.0 sources only)
+        (400u << 10) | 225u,                // 20 V 2.25 A
+    };
+    uint32_t objects[4];
+    memcpy(objects, caps, sizeof(caps));
+    if (src->profile->readvertise && (src->contracts > src->profile->readvertise)) {
+        objects[3] = (400u << 10) | 150u;   // Budget moved to another port
+    }
+    src->num_caps = (src->profile->spec_rev >= 2) ? 4 : 2;
+    memcpy(src->offered, objects, sizeof(objects));
+    source_send(sim, src, delay_us, MSG_TYPE_SOURCE_CAPABILITIES, objects, src->num_caps);
+}
+
+/**
+ * EPR source capabilities: the SPR set padded to seven positions, then the EPR (A)PDOs
+ */
+static const uint32_t epr_caps[PD_MAX_SRC_PDOS] = {
+    PDO_FIXED_EPR_CAPABLE | PDO_FIXED_UNCONSTRAINED | (100u << 10) | 300u,
+    (180u << 10) | 300u,
+    (300u << 10) | 300u,
+    (400u << 10) | 225u,
+    0, 0, 0,
+    (560u << 10) | 500u,                    // 28 V 5 A
+    (720u << 10) | 389u,                    // 36 V 3.89 A
+    (960u << 10) | 292u,                    // 48 V 2.92 A
+    (3u << 30) | (1u << 28) | (480u << 17) | (150u << 8) | 140u, // AVS 15-48 V, 140 W
+};
+
+/**
+ * One chunk of EPR_Source_Capabilities, padded to whole data objects
+ */
+static void source_send_epr_chunk(pd_sim_t *sim, source_t *src, uint32_t delay_us, uint8_t chunk) {
+    uint8_t payload[sizeof(epr_caps)];
+    uint8_t msg[2 + 2 + PD_MAX_CHUNK_SIZE] = {};
+    for (unsigned i = 0; i < sizeof(payload); i++) {
+        payload[i] = epr_caps[i / 4] >> (8 * (i % 4));
+    }
+    unsigned offset = chunk * PD_MAX_CHUNK_SIZE;
+    unsigned length = std::min<unsigned>(sizeof(payload) - offset, PD_MAX_CHUNK_SIZE);
+    uint8_t num_objects = (2 + length + 3) / 4;
+    uint16_t ext = PD_EXT_HEADER(1, chunk, 0, sizeof(payload));
+
+    pd_sim_header(msg, MSG_TYPE_EPR_SOURCE_CAPABILITIES, num_objects, src->message_id, src->profile->spec_rev);
+    src->message_id = (src->message_id + 1) & 0x7;
+    msg[1] |= 0x80;
+    msg[2] = ext & 0xFF;
+    msg[3] = ext >> 8;
+    memcpy(&msg[4], &payload[offset], length);
+    pd_sim_schedule_rx(sim, delay_us, RX_TOKEN_SOP, msg, 2 + num_objects * 4);
+}
+
+/**
+ * Extended messages of EPR mode: chunk requests and keep-alives
+ */
+static void source_on_epr_extended(pd_sim_t *sim, source_t *src, const uint8_t *msg, uint16_t length) {
+    uint8_t type = msg[0] & 0x1F;
+    uint16_t ext = msg[2] | (msg[3] << 8);
+
+    if ((length < 6) || !src->epr_since_us) {
+        return;
+    }
+    if ((type == MSG_TYPE_EPR_SOURCE_CAPABILITIES) && PD_EXT_REQUEST_CHUNK(ext)) {
+        source_send_epr_chunk(sim, src, 1000, PD_EXT_CHUNK_NUMBER(ext));
+    } else if ((type == MSG_TYPE_EXTENDED_CONTROL) && (msg[4] == EXT_CTRL_EPR_KEEPALIVE)) {
+        uint8_t reply[2 + 4] = {};
+        uint16_t ack = PD_EXT_HEADER(1, 0, 0, 2);
+        pd_sim_header(reply, MSG_TYPE_EXTENDED_CONTROL, 1, src->message_id, src->profile->spec_rev);
+        src->message_id = (src->message_id + 1) & 0x7;
+        reply[1] |= 0x80;
+        reply[2] = ack & 0xFF;
+        reply[3] = ack >> 8;
+        reply[4] = EXT_CTRL_EPR_KEEPALIVE_ACK;
+        pd_sim_schedule_rx(sim, 1000, RX_TOKEN_SOP, reply, sizeof(reply));
+        src->epr_since_us = sim->clock_us;
+    }
+}
+
+static void source_send_ext_caps(pd_sim_t *sim, source_t *src, uint32_t delay_us) {
+    // Extended header plus the 25 byte SCEDB, padded to 7 data objects
+    uint8_t msg[2 + 28] = {};
+    pd_sim_header(msg, 0x1, 7, src->message_id, src->profile->spec_rev);
+    src->message_id = (src->message_id + 1) & 0x7;
+    msg[1] |= 0x80;
+    msg[2] = 25;
+    msg[3] = src->profile->chunked ? 0x80 : 0x00;
+    msg[4] = 0x17;  // VID 0x2717
+    msg[5] = 0x27;
+    msg[6] = 0x01;  // PID 0x5001
+    msg[7] = 0x50;
+    pd_sim_schedule_rx(sim, delay_us, RX_TOKEN_SOP, msg, sizeof(msg));
+}
+
+/**
+ * Status after an over-current Alert: 7 byte SDB in a single chunk
+ */
+static void source_send_status(pd_sim_t *sim, source_t *src, uint32_t delay_us) {
+    uint8_t msg[2 + 12] = {};
+    uint16_t ext = PD_EXT_HEADER(1, 0, 0, SDB_SIZE);
+    pd_sim_header(msg, MSG_TYPE_STATUS, 3, src->message_id, src->profile->spec_rev);
+    src->message_id = (src->message_id + 1) & 0x7;
+    msg[1] |= 0x80;
+    msg[2] = ext & 0xFF;
+    msg[3] = ext >> 8;
+    msg[4] = 45;                    // Internal Temp
+    msg[5] = SDB_INPUT_EXTERNAL;    // Present Input
+    msg[7] = SDB_EVENT_OCP;         // Event Flags
+    msg[8] = 1 << 1;                // Temperature Status: normal
+    pd_sim_schedule_rx(sim, delay_us, RX_TOKEN_SOP, msg, sizeof(msg));
+    src->status_sent = true;
+}
+
+static void source_reply(pd_sim_t *sim, source_t *src, uint32_t delay_us, uint8_t type) {
+    source_send(sim, src, delay_us, type, NULL, 0);
+}
+
+/**
+ * Hard Reset either way: VBUS to vSafe0V and back, then Source_Capabilities
+ */
+static void source_hard_reset(pd_sim_t *sim, source_t *src) {
+    uint32_t caps_us = draw_us(src, src->profile->hard_reset_ms);
+    src->message_id = 0;
+    src->cable_message_id = 0;
+    src->epr_since_us = 0;
+    src->soft_reset_sent = false;
+    src->vbus_off_due_us = sim->clock_us + FARM_PS_HARD_RESET_MS * 1000u;
+    src->vbus_off_pending = true;
+    src->vbus_mv = source_vbus_mv(src, 5000);
+    src->vbus_due_us = sim->clock_us + caps_us - FARM_FIRST_CAP_MS * 1000u;
+    src->vbus_pending = true;
+    source_send_caps(sim, src, caps_us);
+}
+
+/**
+ * E-marker: ACK Discover Identity on SOP' as a passive cable
+ */
+static void cable_on_message(pd_sim_t *sim, source_t *src, const uint8_t *msg, uint16_t length) {
+    if ((length < 6) || ((msg[0] & 0x1F) != MSG_TYPE_VDM) || (msg[2] != VDM_CMD_DISCOVER_IDENTITY) ||
+        !(msg[3] & (VDM_STRUCTURED >> 8)) || (msg[4] != (PD_SID & 0xFF)) || (msg[5] != (PD_SID >> 8))) {
+        return;
+    }
+    const uint32_t vdos[5] = {
+        VDM_HEADER(PD_SID, VDM_VERSION_20, 0, 1, VDM_CMD_DISCOVER_IDENTITY),    // ACK
+        ((uint32_t)VDO_IDH_PTYPE_PASSIVE_CABLE << 27) | 0x20C2,                 // ID Header
+        0,                                                                      // Cert Stat
+        0x00010000,                                                             // Product
+        ((src->profile->cable == 5) ? ((uint32_t)VDO_CABLE_CURRENT_5A << 5) : ((uint32_t)VDO_CABLE_CURRENT_3A << 5)) |
+            0x2                                                                 // USB 3.2 Gen 2
+    };
+    uint8_t reply[2 + 5 * 4];
+    pd_sim_header(reply, MSG_TYPE_VDM, 5, src->cable_message_id, src->profile->spec_rev);
+    src->cable_message_id = (src->cable_message_id + 1) & 0x7;
+    reply[0] &= ~0x20; // Reserved on SOP'; the Cable Plug bit stays set
+    for (int i = 0; i < 5; i++) {
+        for (int b = 0; b < 4; b++) {
+            reply[2 + i * 4 + b] = vdos[i] >> (8 * b);
+        }
+    }
+    pd_sim_schedule_rx(sim, 500, RX_TOKEN_SOP1, reply, sizeof(reply));
+}
+
+/**
+ * PD_Sim partner hook: answer what the sink sent
+ */
+static void source_on_message(pd_sim_t *sim, uint8_t sop, const uint8_t *msg, uint16_t length) {
+    source_t *src = (source_t *)sim->user;
+    const profile_t *p = src->profile;
+
+    if (src->silent) {
+        return;
+    }
+    if (!msg) {
+        source_hard_reset(sim, src);
+        return;
+    }
+    if ((sop == SOP_TYPE_SOP_PRIME) && p->cable) {
+        cable_on_message(sim, src, msg, length);
+        return;
+    }
+    if ((sop != 0) || (length < 2)) {
+        return;
+    }
+    uint8_t type = msg[0] & 0x1F;
+    uint8_t num_data_objects = (msg[1] >> 4) & 0x7;
+    bool extended = msg[1] & 0x80;
+
+    if (extended) {
+        if (p->epr) {
+            source_on_epr_extended(sim, src, msg, length);
+        }
+        return;
+    }
+    if (!num_data_objects) {
+        switch (type) {
+        case MSG_TYPE_SOFT_RESET:
+            if (p->ignore_soft_reset) {
+                return;
+            }
+            src->message_id = 0;
+            source_reply(sim, src, 1000, MSG_TYPE_ACCEPT);
+            source_send_caps(sim, src, draw_us(src, p->caps_ms) / 4);
+            break;
+        case MSG_TYPE_GET_SOURCE_CAP:
+            source_send_caps(sim, src, 1000);
+            break;
+        case MSG_TYPE_VCONN_SWAP:
+            // Swapped only to reach a cable worth asking; PS_RDY needs no answer
+            source_reply(sim, src, 1000, p->cable ? MSG_TYPE_ACCEPT : MSG_TYPE_REJECT);
+            break;
+        case MSG_TYPE_GET_SOURCE_CAP_EXT:
+            if (p->spec_rev < 2) {
+                source_reply(sim, src, 1000, MSG_TYPE_REJECT);
+            } else if (p->ext_caps) {
+                source_send_ext_caps(sim, src, 1000);
+            } else {
+                source_reply(sim, src, 1000, MSG_TYPE_NOT_SUPPORTED);
+            }
+            break;
+        case MSG_TYPE_ACCEPT:
+            if (src->soft_reset_sent) {
+                src->soft_reset_sent = false;
+                source_send_caps(sim, src, 1000);
+            }
+            break;
+        case MSG_TYPE_GET_STATUS:
+            if (p->alert) {
+                source_send_status(sim, src, 1000);
+            } else {
+                source_reply(sim, src, 1000, MSG_TYPE_NOT_SUPPORTED);
+            }
+            break;
+        }
+        return;
+    }
+    if ((type == MSG_TYPE_EPR_MODE) && p->epr && (msg[5] == EPR_MODE_ENTER)) {
+        // Acknowledge, check the cable, then advertise the EPR set
+        uint32_t succeeded_us = 1000 + draw_us(src, p->ps_rdy_ms);
+        uint32_t ack = EPR_MODE_OBJECT(EPR_MODE_ENTER_ACK, 0);
+        uint32_t succeeded = EPR_MODE_OBJECT(EPR_MODE_ENTER_SUCCEEDED, 0);
+        source_send(sim, src, 1000, MSG_TYPE_EPR_MODE, &ack, 1);
+        source_send(sim, src, succeeded_us, MSG_TYPE_EPR_MODE, &succeeded, 1);
+        source_send_epr_chunk(sim, src, succeeded_us + 1000, 0);
+        src->num_caps = PD_MAX_SRC_PDOS;
+        src->epr_since_us = sim->clock_us + succeeded_us;
+        return;
+    }
+    bool epr_request = (type == MSG_TYPE_EPR_REQUEST) && (num_data_objects == 2) && src->epr_since_us;
+    if (!epr_request && ((type != MSG_TYPE_REQUEST) || (num_data_objects != 1))) {
+        return;
+    }
+
+    src->requests++;
+    if (src->requests == p->drop_request) {
+        src->silent = p->silent_after_drop;
+        return;
+    }
+    uint8_t position = (msg[5] >> 4) & 0xF;
+    uint32_t accept_us = draw_us(src, p->accept_ms);
+    uint32_t copy = epr_request ? (msg[6] | (msg[7] << 8) | (msg[8] << 16) | ((uint32_t)msg[9] << 24)) : 0;
+    if (!position || (position > src->num_caps) || (src->epr_since_us && !epr_request) ||
+        (epr_request && (!epr_caps[position - 1] || (copy != epr_caps[position - 1])))) {
+        src->bad_requests++;
+        source_reply(sim, src, accept_us, MSG_TYPE_REJECT);
+    } else if (src->waits < p->waits) {
+        src->waits++;
+        source_reply(sim, src, accept_us, MSG_TYPE_WAIT);
+    } else if (p->reject) {
+        source_reply(sim, src, accept_us, MSG_TYPE_REJECT);
+    } else {
+        source_reply(sim, src, accept_us, MSG_TYPE_ACCEPT);
+        uint32_t ps_rdy_us = accept_us + draw_us(src, p->ps_rdy_ms) * (epr_request ? 2 : 1);
+        uint32_t rdo = msg[2] | (msg[3] << 8) | (msg[4] << 16) | ((uint32_t)msg[5] << 24);
+        uint32_t pdo = epr_request ? epr_caps[position - 1] : src->offered[position - 1];
+        src->vbus_mv = source_vbus_mv(src, (GET_PDO_TYPE(pdo) == PDO_TYPE_AUGMENTED) ? RDO_AVS_MV(rdo)
+                                                                                   : PDO_FIXED_MV(pdo));
+        src->vbus_due_us = sim->clock_us + ps_rdy_us - 500;
+        src->vbus_pending = true;
+        source_reply(sim, src, ps_rdy_us, MSG_TYPE_PS_READY);
+        // Recognition's contract comes first, so the final one is number 2
+        src->contracts++;
+        if ((src->contracts >= 2) && (src->contracts <= 1 + p->readvertise)) {
+            source_send_caps(sim, src, ps_rdy_us + FARM_READVERTISE_MS * 1000u);
+        }
+        if (p->reset && (src->contracts == 2)) {
+            src->reset_due_us = sim->clock_us + ps_rdy_us + FARM_RESET_MS * 1000u;
+            src->reset_pending = true;
+        }
+        if (p->alert && (src->contracts == 2)) {
+            uint32_t ado = ADO_TYPE_OCP;
+            uint32_t alert_us = ps_rdy_us + FARM_ALERT_MS * 1000u;
+            source_send(sim, src, alert_us, MSG_TYPE_ALERT, &ado, 1);
+            src->alert_us = sim->clock_us + alert_us;
+        }
+    }
+}
+
+//=============================================================================
+// Instances
+//=============================================================================
+
+typedef struct {
+    outcome_t outcome;
+    uint32_t latency_ms;            // Attach to the event that settled the outcome
+    bool watchdog;                  // The watchdog would have reset the chip
+    uint8_t bad_requests;
+    bool keepalive_lapsed;          // EPR mode lapsed for want of EPR_KeepAlive
+    uint32_t vbus_mismatches;       // Contracts whose VBUS the sink measured off the contract voltage
+    bool reset;                     // The source sent its reset...
+    bool reset_recovered;           // ...and a contract followed
+    uint32_t reset_recovery_ms;     // Reset to that contract
+    bool alerted;                   // The source sent an Alert
+    bool shed;                      // The load-shed hook ran
+    uint32_t shed_us;               // ...this long after the Alert went out
+    bool status;                    // A Status was decoded after the Alert
+    uint16_t reply_max_us[PD_STATS_MSG_SLOTS]; // Worst reply time per request type
+    uint16_t reply_worst_us;        // ...and over all of them
+    uint32_t log_dropped;           // Log bytes lost to a full queue
+    uint8_t idle_power;             // REG_POWER when the source was plugged into an idling sink...
+    uint8_t idle_control2;          // ...and REG_CONTROL2
+    bool woke;                      // The sink touched the bus after the source was plugged in...
+    uint32_t wake_us;               // ...this long after
+    bool pass;
+} result_t;
+
+typedef struct {
+    source_t src;
+    int cc;                         // CC line the source is plugged into
+    uint32_t attach_us;             // Source plugged in
+    uint32_t end_us;                // Source unplugged, instance over
+    bool attached;
+    bool unplugged;
+    uint32_t contracts;             // PD_CNT_CONTRACTS last seen
+    pd_bus_status_t (*transfer)(pd_transport_t *bus, uint8_t addr, const uint8_t *tx, uint16_t tx_len,
+                                uint8_t *rx, uint16_t rx_len); // The model's own transfer
+    result_t result;
+} instance_t;
+
+/**
+ * Board script: plug the source in, record outcomes, unplug at the end
+ */
+static void instance_script(pd_host_board_t *board) {
+    instance_t *inst = (instance_t *)board->user;
+    pd_sim_t *sim = board->sim;
+    result_t *result = &inst->result;
+
+    // Core 0: move the log on to the UART as far as its FIFO takes it
+    pd_log_drain(Serial1);
+    if (inst->unplugged) {
+        return;
+    }
+    if (!inst->attached) {
+        if ((int32_t)(sim->clock_us - inst->attach_us) >= 0) {
+            result->idle_power = sim->regs[REG_POWER];
+            result->idle_control2 = sim->regs[REG_CONTROL2];
+            pd_sim_attach(sim, inst->cc, source_vbus_mv(&inst->src, 5000));
+            source_send_caps(sim, &inst->src, draw_us(&inst->src, inst->src.profile->caps_ms));
+            inst->attached = true;
+        }
+        return;
+    }
+
+    uint32_t now_ms = (sim->clock_us - inst->attach_us) / 1000;
+    source_t *src = &inst->src;
+    if (src->epr_since_us && ((int32_t)(sim->clock_us - src->epr_since_us) > FARM_EPR_KEEPALIVE_MS * 1000)) {
+        src->keepalive_lapsed = true;
+        src->epr_since_us = 0;
+    }
+    if (src->reset_pending && ((int32_t)(sim->clock_us - src->reset_due_us) >= 0)) {
+        src->reset_pending = false;
+        src->reset_us = sim->clock_us;
+        if (src->profile->reset == RESET_HARD) {
+            pd_sim_hard_reset(sim);
+            source_hard_reset(sim, src);
+        } else {
+            src->message_id = 0;
+            source_reply(sim, src, 0, MSG_TYPE_SOFT_RESET);
+            src->soft_reset_sent = true;
+        }
+    }
+    if (src->vbus_off_pending && ((int32_t)(sim->clock_us - src->vbus_off_due_us) >= 0)) {
+        pd_sim_set_vbus(sim, 0);
+        src->vbus_off_pending = false;
+    }
+    if (src->vbus_pending && ((int32_t)(sim->clock_us - src->vbus_due_us) >= 0)) {
+        pd_sim_set_vbus(sim, src->vbus_mv);
+        src->vbus_pending = false;
+    }
+    if ((result->outcome != OUTCOME_DETACH) && pd_stats_get(0, PD_CNT_RECOVERY_DETACHES)) {
+        result->outcome = OUTCOME_DETACH;
+        result->latency_ms = now_ms;
+    }
+    uint32_t contracts = pd_stats_get(0, PD_CNT_CONTRACTS);
+    if (contracts != inst->contracts) {
+        inst->contracts = contracts;
+        if (result->outcome != OUTCOME_DETACH) {
+            result->outcome = OUTCOME_CONTRACT;
+            result->latency_ms = now_ms;
+        }
+        if (src->reset_us && !result->reset_recovered) {
+            result->reset_recovered = true;
+            result->reset_recovery_ms = (sim->clock_us - src->reset_us) / 1000;
+        }
+    }
+    // Unplug, and pulse INT_N so loop1() returns even from an idle sleep
+    // with everything masked
+    if ((int32_t)(sim->clock_us - inst->end_us) >= 0) {
+        pd_sim_attach(sim, 0, 0);
+        inst->unplugged = true;
+        if (board->irq) {
+            board->irq(PD_INT_PIN, GPIO_IRQ_EDGE_FALL);
+        }
+    }
+}
+
+/**
+ * Load-shed hook: time it against the Alert the source sent
+ */
+static void instance_shed(uint8_t, uint32_t) {
+    pd_host_board_t *board = pd_host_board();
+    instance_t *inst = (instance_t *)board->user;
+    if (!inst->result.shed) {
+        inst->result.shed = true;
+        inst->result.shed_us = board->sim->clock_us - inst->src.alert_us;
+    }
+}
+
+/**
+ * Idle profiles: the sink slept with only toggle powered and woke in time
+ */
+static bool idle_ok(const profile_t *p, const result_t *r) {
+    return !p->idle_ms || ((r->idle_power == POWER_BANDGAP_WAKE) && (r->idle_control2 == FARM_IDLE_CONTROL2) &&
+                           r->woke && (r->wake_us <= FARM_WAKE_LIMIT_US));
+}
+
+/**
+ * Bus hook: time the first transfer after the source was plugged in
+ */
+static pd_bus_status_t instance_transfer(pd_transport_t *bus, uint8_t addr, const uint8_t *tx, uint16_t tx_len,
+                                         uint8_t *rx, uint16_t rx_len) {
+    pd_host_board_t *board = pd_host_board();
+    instance_t *inst = (instance_t *)board->user;
+    if (inst->attached && !inst->result.woke) {
+        inst->result.woke = true;
+        inst->result.wake_us = board->sim->clock_us - inst->attach_us;
+    }
+    return inst->transfer(bus, addr, tx, tx_len, rx, rx_len);
+}
+
+static result_t run_instance(uint64_t seed, uint32_t index, FILE *log) {
+    static const uint16_t attach_delay_ms[2] = {100, 400};
+    const profile_t *p = &profiles[index % NUM_PROFILES];
+    uint32_t deadline = deadline_ms(p);
+
+    instance_t inst = {};
+    inst.src.profile = p;
+    inst.src.rng = seed ^ (index * 0xD1B54A32D192ED03ull);
+    inst.result.outcome = OUTCOME_NONE;
+
+    static thread_local pd_sim_t sim;
+    static thread_local pd_transport_t bus;
+    pd_sim_init(&sim);
+    sim.on_message = source_on_message;
+    sim.user = &inst.src;
+    sim.emarker = (p->cable != 0);
+    pd_sim_transport_init(&bus, &sim);
+    inst.transfer = bus.transfer;
+    bus.transfer = instance_transfer;
+
+    pd_host_board_t board = {};
+    board.sim = &sim;
+    board.log = log;
+    board.uart_baud = FARM_UART_BAUD;
+    board.script = instance_script;
+    board.user = &inst;
+    pd_host_select(&board);
+    pd_bus = &bus;
+
+    inst.cc = 1 + (splitmix64(&inst.src.rng) & 1);
+    inst.attach_us = sim.clock_us + (p->idle_ms ? p->idle_ms * 1000u : draw_us(&inst.src, attach_delay_ms));
+    inst.end_us = inst.attach_us + (deadline + FARM_SETTLE_MS) * 1000u;
+    pd_log_stats_t log_before;
+    pd_log_get_stats(&log_before); // The queue is the thread's, shared by its instances
+    CaptureFile capture;
+    capture.file = NULL;
+    if (capture_dir) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%05u.pdc", capture_dir, index);
+        capture.file = fopen(path, "wb");
+        if (capture.file) {
+            pd_trace_capture_begin(&capture);
+        }
+    }
+    setup1();
+    pd_alert_set_shed_hook(instance_shed);
+    while (!inst.unplugged) {
+        loop1();
+        pd_host_tick();
+    }
+    board.uart_baud = 0;
+    pd_log_drain(Serial1); // What core 0 had not sent yet
+    if (capture.file) {
+        pd_trace_capture_begin(NULL);
+        fclose(capture.file);
+    }
+    pd_log_stats_t log_stats;
+    pd_log_get_stats(&log_stats);
+    pd_host_select(NULL);
+
+    result_t result = inst.result;
+    result.watchdog = board.wdt_bitten;
+    result.bad_requests = inst.src.bad_requests;
+    result.keepalive_lapsed = inst.src.keepalive_lapsed;
+    result.vbus_mismatches = pd_stats_get(0, PD_CNT_VBUS_MISMATCHES);
+    result.reset = (inst.src.reset_us != 0);
+    result.alerted = (inst.src.alert_us != 0);
+    result.status = inst.src.status_sent && pd_stats_get(0, PD_CNT_STATUS_RX);
+    for (int i = 0; i < PD_STATS_MSG_SLOTS; i++) {
+        result.reply_max_us[i] = pd_stats_reply_max_us(0, i);
+        result.reply_worst_us = std::max(result.reply_worst_us, result.reply_max_us[i]);
+    }
+    result.log_dropped = log_stats.dropped - log_before.dropped;
+    result.pass = (result.outcome == p->expect) && !result.watchdog && !result.bad_requests &&
+                  !result.keepalive_lapsed && (!result.vbus_mismatches == !p->sag_pct) &&
+                  ((p->expect == OUTCOME_NONE) || (result.latency_ms <= deadline)) &&
+                  (result.alerted ? (result.shed && (result.shed_us <= FARM_SHED_LIMIT_US) && result.status)
+                                  : !result.shed) &&
+                  (!result.reset || (result.reset_recovered && (result.reset_recovery_ms <= reset_limit_ms(p)))) &&
+                  (result.reply_worst_us <= FARM_REPLY_LIMIT_US) && idle_ok(p, &result);
+    return result;
+}
+
+/**
+ * Note on an idle profile: the registers the sink idled with, or its wake-up time
+ */
+static const char *idle_note(const profile_t *p, const result_t *r) {
+    static thread_local char note[64];
+    if (!p->idle_ms) {
+        return "";
+    }
+    if ((r->idle_power != POWER_BANDGAP_WAKE) || (r->idle_control2 != FARM_IDLE_CONTROL2)) {
+        snprintf(note, sizeof(note), ", idled with POWER 0x%02X CONTROL2 0x%02X", r->idle_power, r->idle_control2);
+    } else if (!r->woke) {
+        snprintf(note, sizeof(note), ", no bus access after the attach");
+    } else {
+        snprintf(note, sizeof(note), ", first register read %u us after the attach", r->wake_us);
+    }
+    return note;
+}
+
+/**
+ * Failure note for the VBUS check: a sag that went unnoticed, or a false alarm
+ */
+static const char *vbus_note(const profile_t *p, const result_t *r) {
+    if (!r->vbus_mismatches == !p->sag_pct) {
+        return "";
+    }
+    return p->sag_pct ? ", sag not detected" : ", VBUS mismatch";
+}
+
+/**
+ * Note on the source's own reset: not recovered from, or how long it took
+ */
+static const char *reset_note(const result_t *r) {
+    static thread_local char note[48];
+    if (!r->reset) {
+        return "";
+    }
+    if (!r->reset_recovered) {
+        return ", no contract after the reset";
+    }
+    snprintf(note, sizeof(note), ", contract %u ms after the reset", r->reset_recovery_ms);
+    return note;
+}
+
+/**
+ * Note on the Alert: how fast the load was shed, or that it was shed for nothing
+ */
+static const char *alert_note(const result_t *r) {
+    static thread_local char note[48];
+    if (!r->alerted) {
+        return r->shed ? ", load shed without an Alert" : "";
+    }
+    if (!r->shed) {
+        return ", load not shed";
+    }
+    snprintf(note, sizeof(note), ", shed after %u us%s", r->shed_us, r->status ? "" : ", no Status");
+    return note;
+}
+
+/**
+ * Note on a request answered too slowly
+ */
+static const char *reply_note(const result_t *r) {
+    static thread_local char note[48];
+    if (r->reply_worst_us <= FARM_REPLY_LIMIT_US) {
+        return "";
+    }
+    snprintf(note, sizeof(note), ", replied after %u us", r->reply_worst_us);
+    return note;
+}
+
+//=============================================================================
+// Work-Stealing Scheduler
+//=============================================================================
+
+typedef struct {
+    std::mutex lock;
+    std::deque<uint32_t> queue;
+} worker_t;
+
+static bool take_own(worker_t *w, uint32_t *index) {
+    std::lock_guard<std::mutex> guard(w->lock);
+    if (w->queue.empty()) {
+        return false;
+    }
+    *index = w->queue.back();
+    w->queue.pop_back();
+    return true;
+}
+
+static bool steal(worker_t *w, uint32_t *index) {
+    std::lock_guard<std::mutex> guard(w->lock);
+    if (w->queue.empty()) {
+        return false;
+    }
+    *index = w->queue.front();
+    w->queue.pop_front();
+    return true;
+}
+
+static void worker_main(std::vector<worker_t> *workers, unsigned self, uint64_t seed,
+                        std::vector<result_t> *results) {
+    uint64_t rng = seed ^ self;
+    unsigned count = workers->size();
+
+    for (;;) {
+        uint32_t index = 0;
+        bool found = take_own(&(*workers)[self], &index);
+        // Nothing left here: sweep the others from a random start. No work
+        // is ever added, so one empty sweep means the farm is done.
+        unsigned start = splitmix64(&rng) % count;
+        for (unsigned i = 0; !found && (i < count); i++) {
+            unsigned victim = (start + i) % count;
+            found = (victim != self) && steal(&(*workers)[victim], &index);
+        }
+        if (!found) {
+            return;
+        }
+        (*results)[index] = run_instance(seed, index, NULL);
+    }
+}
+
+//=============================================================================
+// Summary
+//=============================================================================
+
+/**
+ * Name of a request selector the sink replies to
+ */
+static const char *request_name(uint8_t selector) {
+    switch (selector) {
+        case PD_CTRL(MSG_TYPE_GET_SOURCE_CAP):              return "Get_Source_Cap";
+        case PD_CTRL(MSG_TYPE_GET_SINK_CAP):                return "Get_Sink_Cap";
+        case PD_CTRL(MSG_TYPE_DR_SWAP):                     return "DR_Swap";
+        case PD_CTRL(MSG_TYPE_PR_SWAP):                     return "PR_Swap";
+        case PD_CTRL(MSG_TYPE_VCONN_SWAP):                  return "VCONN_Swap";
+        case PD_CTRL(MSG_TYPE_SOFT_RESET):                  return "Soft_Reset";
+        case PD_CTRL(MSG_TYPE_GET_SOURCE_CAP_EXT):          return "Get_Source_Cap_Extended";
+        case PD_CTRL(MSG_TYPE_GET_STATUS):                  return "Get_Status";
+        case PD_CTRL(MSG_TYPE_FR_SWAP):                     return "FR_Swap";
+        case PD_CTRL(MSG_TYPE_GET_PPS_STATUS):              return "Get_PPS_Status";
+        case PD_CTRL(MSG_TYPE_GET_COUNTRY_CODES):           return "Get_Country_Codes";
+        case PD_CTRL(MSG_TYPE_GET_REVISION):                return "Get_Revision";
+        case PD_DATA(MSG_TYPE_SOURCE_CAPABILITIES):         return "Source_Capabilities";
+        case PD_DATA(MSG_TYPE_ALERT):                       return "Alert";
+        case PD_DATA(MSG_TYPE_GET_COUNTRY_INFO):            return "Get_Country_Info";
+        case PD_EXT(MSG_TYPE_EPR_SOURCE_CAPABILITIES):      return "EPR_Source_Capabilities";
+        default:                                            return "?";
+    }
+}
+
+static uint32_t percentile(const std::vector<uint32_t> &sorted, unsigned pct) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t rank = (sorted.size() * pct + 99) / 100;
+    return sorted[rank ? rank - 1 : 0];
+}
+
+static unsigned summarize(const std::vector<result_t> &results, uint64_t seed) {
+    unsigned failures = 0;
+
+    printf("%-20s %6s %6s %6s %8s %6s %6s %6s %6s %6s\n", "profile", "runs", "pass", "fail",
+           "expect", "p50", "p90", "p99", "max", "limit");
+    for (unsigned p = 0; p < NUM_PROFILES; p++) {
+        std::vector<uint32_t> latencies;
+        unsigned runs = 0, pass = 0;
+        for (size_t i = p; i < results.size(); i += NUM_PROFILES) {
+            runs++;
+            pass += results[i].pass;
+            if (results[i].outcome != OUTCOME_NONE) {
+                latencies.push_back(results[i].latency_ms);
+            }
+        }
+        std::sort(latencies.begin(), latencies.end());
+        printf("%-20s %6u %6u %6u %8s %6u %6u %6u %6u %6u\n", profiles[p].name, runs, pass,
+               runs - pass, outcome_names[profiles[p].expect], percentile(latencies, 50),
+               percentile(latencies, 90), percentile(latencies, 99),
+               latencies.empty() ? 0 : latencies.back(), deadline_ms(&profiles[p]));
+        failures += runs - pass;
+    }
+    printf("latencies in ms from attach to the outcome\n");
+
+    for (unsigned p = 0; p < NUM_PROFILES; p++) {
+        std::vector<uint32_t> recoveries;
+        for (size_t i = p; profiles[p].reset && (i < results.size()); i += NUM_PROFILES) {
+            if (results[i].reset_recovered) {
+                recoveries.push_back(results[i].reset_recovery_ms);
+            }
+        }
+        if (!recoveries.empty()) {
+            std::sort(recoveries.begin(), recoveries.end());
+            printf("%s: contract p50 %u p99 %u max %u ms after the reset, limit %u ms\n", profiles[p].name,
+                   percentile(recoveries, 50), percentile(recoveries, 99), recoveries.back(),
+                   reset_limit_ms(&profiles[p]));
+        }
+    }
+    for (unsigned p = 0; p < NUM_PROFILES; p++) {
+        std::vector<uint32_t> sheds;
+        for (size_t i = p; profiles[p].alert && (i < results.size()); i += NUM_PROFILES) {
+            if (results[i].shed) {
+                sheds.push_back(results[i].shed_us);
+            }
+        }
+        if (!sheds.empty()) {
+            std::sort(sheds.begin(), sheds.end());
+            printf("%s: load shed p50 %u p99 %u max %u us after the Alert, limit %u us\n",
+                   profiles[p].name, percentile(sheds, 50), percentile(sheds, 99), sheds.back(),
+                   FARM_SHED_LIMIT_US);
+        }
+    }
+    for (unsigned p = 0; p < NUM_PROFILES; p++) {
+        std::vector<uint32_t> wakes;
+        for (size_t i = p; profiles[p].idle_ms && (i < results.size()); i += NUM_PROFILES) {
+            if (results[i].woke) {
+                wakes.push_back(results[i].wake_us);
+            }
+        }
+        if (!wakes.empty()) {
+            std::sort(wakes.begin(), wakes.end());
+            printf("%s: first register read p50 %u p99 %u max %u us after the attach, limit %u us\n",
+                   profiles[p].name, percentile(wakes, 50), percentile(wakes, 99), wakes.back(),
+                   FARM_WAKE_LIMIT_US);
+        }
+    }
+
+    uint64_t log_dropped = 0;
+    for (const result_t &r : results) {
+        log_dropped += r.log_dropped;
+    }
+    printf("worst reply in us, request read to reply loaded, limit %u:", FARM_REPLY_LIMIT_US);
+    for (int t = 0; t < PD_STATS_MSG_SLOTS; t++) {
+        uint16_t worst = 0;
+        for (const result_t &r : results) {
+            worst = std::max(worst, r.reply_max_us[t]);
+        }
+        if (worst) {
+            printf(" %s %u", request_name(t), worst);
+        }
+    }
+    printf("; %llu log bytes dropped\n", (unsigned long long)log_dropped);
+
+    unsigned listed = 0;
+    for (size_t i = 0; (i < results.size()) && (listed < FARM_MAX_FAILURES); i++) {
+        const result_t *r = &results[i];
+        if (r->pass) {
+            continue;
+        }
+        printf("FAIL instance %zu (%s): %s at %u ms%s%s%s%s%s%s%s%s, replay with -s %llu -r %zu\n", i,
+               profiles[i % NUM_PROFILES].name, outcome_names[r->outcome], r->latency_ms,
+               r->watchdog ? ", watchdog bit" : "", r->bad_requests ? ", bad Request" : "",
+               r->keepalive_lapsed ? ", keep-alive lapsed" : "", vbus_note(&profiles[i % NUM_PROFILES], r),
+               reset_note(r), alert_note(r), reply_note(r), idle_note(&profiles[i % NUM_PROFILES], r),
+               (unsigned long long)seed, i);
+        listed++;
+    }
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    unsigned instances = 2000;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    uint64_t seed = 1;
+    long replay = -1;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!strcmp(argv[i], "-n") && value) {
+            instances = strtoul(value, NULL, 0);
+        } else if (!strcmp(argv[i], "-j") && value) {
+            threads = std::max(1ul, strtoul(value, NULL, 0));
+        } else if (!strcmp(argv[i], "-s") && value) {
+            seed = strtoull(value, NULL, 0);
+        } else if (!strcmp(argv[i], "-r") && value) {
+            replay = strtol(value, NULL, 0);
+        } else if (!strcmp(argv[i], "-c") && value) {
+            capture_dir = value;
+        } else {
+            fprintf(stderr, "usage: %s [-n instances] [-j threads] [-s seed] [-r instance] [-c dir]\n", argv[0]);
+            return 2;
+        }
+        i++;
+    }
+#if PD_TRACE != 2
+    if (capture_dir) {
+        fprintf(stderr, "%s: -c needs a stack built with -DPD_TRACE=2\n", argv[0]);
+        return 2;
+    }
+#endif
+
+    if (replay >= 0) {
+        result_t r = run_instance(seed, replay, stdout);
+        const profile_t *p = &profiles[replay % NUM_PROFILES];
+        printf("\ninstance %ld (%s): %s at %u ms, expected %s within %u ms%s%s%s%s%s%s%s%s -> %s\n", replay,
+               p->name, outcome_names[r.outcome], r.latency_ms, outcome_names[p->expect],
+               deadline_ms(p), r.watchdog ? ", watchdog bit" : "", r.bad_requests ? ", bad Request" : "",
+               r.keepalive_lapsed ? ", keep-alive lapsed" : "", vbus_note(p, &r), reset_note(&r),
+               alert_note(&r), reply_note(&r), idle_note(p, &r), r.pass ? "PASS" : "FAIL");
+        return r.pass ? 0 : 1;
+    }
+
+    std::vector<worker_t> workers(threads);
+    std::vector<result_t> results(instances);
+    for (uint32_t i = 0; i < instances; i++) {
+        workers[i % threads].queue.push_back(i);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; t++) {
+        pool.emplace_back(worker_main, &workers, t, seed, &results);
+    }
+    for (std::thread &t : pool) {
+        t.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    unsigned failures = summarize(results, seed);
+    printf("%u instances on %u threads in %.2f s, seed %llu: %u failed\n", instances, threads,
+           seconds, (unsigned long long)seed, failures);
+    return failures ? 1 : 0;
+}
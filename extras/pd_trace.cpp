@@ -0,0 +1,519 @@
+/**
+ * @file pd_trace.cpp
+ * @brief Host decoder for PD_TRACE 2 captures: filter and aggregate many captures in parallel
+ *
+ * Build and run from the repository root:
+ *
+ *     g++ -O3 -std=gnu++17 -pthread -I. extras/pd_trace.cpp -o pd_trace
+ *     ./pd_trace [-j threads] [-l] [-q query]... capture...
+ *
+ * Queries, all of which a capture must satisfy to be listed:
+ *
+ *     pps             the source offered a PPS APDO
+ *     epr             the source is EPR capable or sent EPR_Source_Capabilities
+ *     reject=MV:MA    the source rejected a Request for a fixed MV mV PDO at MA mA
+ *     type=NAME       a message of that type was captured, e.g. type=Soft_Reset
+ *
+ * Without a query every capture is listed. Each listed capture shows the
+ * source's VID/PID when its Source_Capabilities_Extended or Discover
+ * Identity ACK was captured; -l prints the names only. The totals (messages
+ * per type over all captures, decode throughput) go to stderr so the list
+ * can be piped. The exit status is 0 if a capture was listed, 1 if none was
+ * and 2 on an unreadable capture or bad arguments, as grep does.
+ *
+ * Each capture is mapped read-only and walked in batches of TRACE_BATCH
+ * records. Indexing a batch (finding where each record starts) is the only
+ * step that depends on the record before; the header fields of the whole
+ * batch are then extracted in flat loops with no branches, and the PDOs of
+ * its Source_Capabilities are gathered into one array and decoded the same
+ * way, so the compiler vectorizes both. PDOs, RDOs and VDMs are taken apart
+ * with the stack's own FUSB302B_Regs.h macros. Only the short per-port state machine
+ * that pairs Requests with Rejects runs record by record. Captures are
+ * handed out to the worker threads one at a time from a shared index.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "FUSB302B_Regs.h"
+
+// Only the capture format and pdo_type_t are needed from PD_Trace.h and
+// FUSB302B.h, which pull in the Arduino side of the stack
+#define PD_CAPTURE_MAGIC        "PDCAP01\n"
+#define PD_CAPTURE_MAGIC_LEN    8
+#define PD_CAPTURE_TX           0x01
+#define PD_CAPTURE_CRC_BAD      0x02
+#define PD_CAPTURE_SOP(flags)   (((flags) >> 2) & 0x3)
+#define PDO_FIXED               0       // pdo_type_t
+#define PDO_AUGMENTED           3
+
+#define TRACE_BATCH         1024    // Records decoded together
+#define TRACE_SLOTS         96      // Message selectors, PD_CTRL/PD_DATA/PD_EXT
+#define TRACE_PORTS         256     // Port index is one byte
+#define TRACE_MAX_PDOS      7
+
+//=============================================================================
+// Message Names
+//=============================================================================
+
+static const char *const ctrl_names[32] = {
+    NULL, "GoodCRC", "GotoMin", "Accept", "Reject", "Ping", "PS_RDY", "Get_Source_Cap",
+    "Get_Sink_Cap", "DR_Swap", "PR_Swap", "VCONN_Swap", "Wait", "Soft_Reset", "Data_Reset",
+    "Data_Reset_Complete", "Not_Supported", "Get_Source_Cap_Extended", "Get_Status", "FR_Swap",
+    "Get_PPS_Status", "Get_Country_Codes", "Get_Sink_Cap_Extended", "Get_Source_Info",
+    "Get_Revision",
+};
+
+static const char *const data_names[32] = {
+    NULL, "Source_Capabilities", "Request", "BIST", "Sink_Capabilities", "Battery_Status",
+    "Alert", "Get_Country_Info", "Enter_USB", "EPR_Request", "EPR_Mode", "Source_Info",
+    "Revision", NULL, NULL, "Vendor_Defined",
+};
+
+static const char *const ext_names[32] = {
+    NULL, "Source_Capabilities_Extended", "Status", "Get_Battery_Cap", "Get_Battery_Status",
+    "Battery_Capabilities", "Get_Manufacturer_Info", "Manufacturer_Info", "Security_Request",
+    "Security_Response", "Firmware_Update_Request", "Firmware_Update_Response", "PPS_Status",
+    "Country_Info", "Country_Codes", "Sink_Capabilities_Extended", "Extended_Control",
+    "EPR_Source_Capabilities", "EPR_Sink_Capabilities",
+};
+
+/**
+ * Name of a message selector, NULL if reserved
+ */
+static const char *message_name(uint8_t selector) {
+    const char *const *names = (selector & 0x40) ? ext_names : (selector & 0x20) ? data_names : ctrl_names;
+    return names[selector & 0x1F];
+}
+
+//=============================================================================
+// Queries and Results
+//=============================================================================
+
+typedef struct {
+    bool pps;
+    bool epr;
+    bool reject;
+    uint32_t reject_mv;
+    uint32_t reject_ma;
+    std::vector<uint8_t> types;     // Selectors that must appear
+} query_t;
+
+typedef struct {
+    const char *error;              // NULL if the capture decoded
+    uint64_t bytes;
+    uint64_t messages;
+    uint64_t crc_bad;
+    bool truncated;                 // Last record cut short
+    uint32_t tx_by_type[TRACE_SLOTS];
+    uint32_t rx_by_type[TRACE_SLOTS];
+    bool pps;                       // A PPS APDO was offered
+    bool epr;                       // EPR capable, or EPR_Source_Capabilities seen
+    uint32_t rejects_matched;       // Rejects of the queried Request
+    bool identified;
+    uint16_t vid;
+    uint16_t pid;
+} capture_result_t;
+
+/**
+ * Request state of one port between our Request and the source's answer
+ */
+typedef struct {
+    uint32_t pdos[TRACE_MAX_PDOS];  // Last Source_Capabilities
+    uint8_t num_pdos;
+    uint32_t rdo;                   // Request awaiting an answer, 0 if none
+} port_state_t;
+
+static inline uint32_t load32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, 4);           // Little-endian host, as the capture
+    return value;
+}
+
+//=============================================================================
+// Batch Decoding
+//=============================================================================
+
+/**
+ * Decoded fields of one batch, one flat array per field
+ */
+typedef struct {
+    uint32_t offset[TRACE_BATCH];   // Record start in the mapping
+    uint16_t header[TRACE_BATCH];   // Message header, 16-bit so the field shifts vectorize
+    uint8_t flags[TRACE_BATCH];
+    uint8_t port[TRACE_BATCH];
+    uint8_t selector[TRACE_BATCH];
+    uint8_t num_objects[TRACE_BATCH];
+    uint8_t tx[TRACE_BATCH];
+    uint8_t valid[TRACE_BATCH];     // CRC good
+    // PDOs of the batch's received Source_Capabilities
+    uint32_t pdo[TRACE_BATCH * TRACE_MAX_PDOS];
+    uint16_t pdo_record[TRACE_BATCH * TRACE_MAX_PDOS];
+    uint8_t pdo_position[TRACE_BATCH * TRACE_MAX_PDOS];
+    uint8_t pdo_pps[TRACE_BATCH * TRACE_MAX_PDOS];
+    uint8_t pdo_epr[TRACE_BATCH * TRACE_MAX_PDOS];
+} batch_t;
+
+/**
+ * Find up to TRACE_BATCH record starts
+ * @return Records indexed; *pos is left after the last one
+ */
+static unsigned index_batch(const uint8_t *base, size_t size, size_t *pos, batch_t *b, bool *truncated) {
+    unsigned n = 0;
+    size_t at = *pos;
+    while ((n < TRACE_BATCH) && (at + 8 <= size)) {
+        size_t length = 8 + ((base[at + 7] & 0x70) >> 4) * 4;
+        if (at + length > size) {
+            *truncated = true;
+            break;
+        }
+        b->offset[n++] = at;
+        at += length;
+    }
+    *pos = at;
+    return n;
+}
+
+/**
+ * Pull every record's header apart; no branches, so the loops vectorize
+ */
+static void decode_headers(const uint8_t *base, batch_t *b, unsigned n) {
+    for (unsigned i = 0; i < n; i++) {
+        const uint8_t *record = base + b->offset[i];
+        b->flags[i] = record[4];
+        b->port[i] = record[5];
+        b->header[i] = record[6] | (record[7] << 8);
+    }
+    for (unsigned i = 0; i < n; i++) {
+        uint16_t header = b->header[i];
+        uint16_t objects = (header >> 12) & 0x7;
+        uint16_t extended = (header >> 9) & 0x40;                      // Bit 15 to PD_EXT()
+        uint16_t data = (objects ? 0x20 : 0) & ~(header >> 10);        // PD_DATA() unless extended
+        b->num_objects[i] = objects;
+        b->selector[i] = (header & 0x1F) | extended | data;
+        b->tx[i] = b->flags[i] & PD_CAPTURE_TX;
+        b->valid[i] = !(b->flags[i] & PD_CAPTURE_CRC_BAD);
+    }
+}
+
+/**
+ * Gather the PDOs of received Source_Capabilities and classify them in one pass
+ * @return PDOs gathered
+ */
+static unsigned decode_pdos(const uint8_t *base, batch_t *b, unsigned n) {
+    unsigned m = 0;
+    for (unsigned i = 0; i < n; i++) {
+        if ((b->selector[i] != PD_DATA(MSG_TYPE_SOURCE_CAPABILITIES)) || b->tx[i] || !b->valid[i]) {
+            continue;
+        }
+        const uint8_t *objects = base + b->offset[i] + 8;
+        for (unsigned k = 0; k < b->num_objects[i]; k++) {
+            b->pdo[m] = load32(objects + k * 4);
+            b->pdo_record[m] = i;
+            b->pdo_position[m] = k;
+            m++;
+        }
+    }
+    for (unsigned j = 0; j < m; j++) {
+        uint32_t pdo = b->pdo[j];
+        b->pdo_pps[j] = (PDO_TYPE(pdo) == PDO_AUGMENTED) & (PDO_APDO_TYPE(pdo) == PDO_APDO_SPR_PPS);
+        b->pdo_epr[j] = (b->pdo_position[j] == 0) & (PDO_TYPE(pdo) == PDO_FIXED) & ((pdo & PDO_FIXED_EPR_CAPABLE) != 0);
+    }
+    return m;
+}
+
+/**
+ * Walk the batch in order: counts, the Request/Reject pairing and identity
+ */
+static void scan_batch(const uint8_t *base, const batch_t *b, unsigned n, unsigned m, const query_t *q,
+                       port_state_t *ports, capture_result_t *r) {
+    for (unsigned j = 0; j < m; j++) {
+        r->pps |= b->pdo_pps[j];
+        r->epr |= b->pdo_epr[j];
+    }
+    for (unsigned i = 0; i < n; i++) {
+        if (!b->valid[i]) {
+            r->crc_bad++;
+            continue;
+        }
+        uint8_t selector = b->selector[i];
+        const uint8_t *objects = base + b->offset[i] + 8;
+        port_state_t *port = &ports[b->port[i]];
+
+        (b->tx[i] ? r->tx_by_type : r->rx_by_type)[selector]++;
+        if (PD_CAPTURE_SOP(b->flags[i]) != 0) {
+            continue; // Cable traffic
+        }
+        if (b->tx[i]) {
+            if ((selector == PD_DATA(MSG_TYPE_REQUEST)) || (selector == PD_DATA(MSG_TYPE_EPR_REQUEST))) {
+                port->rdo = load32(objects);
+            }
+            continue;
+        }
+        switch (selector) {
+            case PD_DATA(MSG_TYPE_SOURCE_CAPABILITIES):
+                port->num_pdos = b->num_objects[i];
+                for (unsigned k = 0; k < port->num_pdos; k++) {
+                    port->pdos[k] = load32(objects + k * 4);
+                }
+                break;
+            case PD_EXT(MSG_TYPE_EPR_SOURCE_CAPABILITIES):
+                r->epr = true;
+                break;
+            case PD_CTRL(MSG_TYPE_REJECT):
+                if (q->reject && port->rdo) {
+                    uint8_t position = RDO_POSITION(port->rdo);
+                    uint32_t pdo = ((position >= 1) && (position <= port->num_pdos)) ? port->pdos[position - 1] : 0;
+                    if (pdo && (PDO_TYPE(pdo) == PDO_FIXED) && (PDO_FIXED_MV(pdo) == q->reject_mv) &&
+                        (RDO_FIXED_OP_MA(port->rdo) == q->reject_ma)) {
+                        r->rejects_matched++;
+                    }
+                }
+                port->rdo = 0;
+                break;
+            case PD_CTRL(MSG_TYPE_ACCEPT):
+            case PD_CTRL(MSG_TYPE_WAIT):
+                port->rdo = 0;
+                break;
+            case PD_EXT(MSG_TYPE_SOURCE_CAPABILITIES_EXTENDED):
+                // Extended header, then VID and PID at the start of the SCEDB
+                if (b->num_objects[i] >= 2) {
+                    r->identified = true;
+                    r->vid = objects[2] | (objects[3] << 8);
+                    r->pid = objects[4] | (objects[5] << 8);
+                }
+                break;
+            case PD_DATA(MSG_TYPE_VDM): {
+                uint32_t vdm = load32(objects);
+                if ((b->num_objects[i] >= 4) && (vdm & VDM_STRUCTURED) && (VDM_HDR_SVID(vdm) == PD_SID) &&
+                    (VDM_HDR_CMD(vdm) == 1) && (VDM_HDR_CMD_TYPE(vdm) == 1)) {
+                    // Discover Identity ACK: ID Header VDO, Cert Stat VDO, Product VDO
+                    r->identified = true;
+                    r->vid = VDO_IDH_VID(load32(objects + 4));
+                    r->pid = load32(objects + 12) >> 16;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+/**
+ * Map and decode one capture
+ */
+static void decode_capture(const char *path, const query_t *q, capture_result_t *r) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        r->error = "cannot open";
+        return;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size < PD_CAPTURE_MAGIC_LEN)) {
+        close(fd);
+        r->error = "not a PD capture";
+        return;
+    }
+    size_t size = st.st_size;
+    const uint8_t *base = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        r->error = "cannot map";
+        return;
+    }
+    madvise((void *)base, size, MADV_SEQUENTIAL);
+    if (memcmp(base, PD_CAPTURE_MAGIC, PD_CAPTURE_MAGIC_LEN) != 0) {
+        munmap((void *)base, size);
+        r->error = "not a PD capture";
+        return;
+    }
+
+    static thread_local batch_t batch;
+    static thread_local port_state_t ports[TRACE_PORTS];
+    memset(ports, 0, sizeof(ports));
+    size_t pos = PD_CAPTURE_MAGIC_LEN;
+    r->bytes = size;
+    for (;;) {
+        unsigned n = index_batch(base, size, &pos, &batch, &r->truncated);
+        if (!n) {
+            break;
+        }
+        decode_headers(base, &batch, n);
+        unsigned m = decode_pdos(base, &batch, n);
+        scan_batch(base, &batch, n, m, q, ports, r);
+        r->messages += n;
+    }
+    munmap((void *)base, size);
+}
+
+/**
+ * Whether a decoded capture satisfies every query
+ */
+static bool matches(const query_t *q, const capture_result_t *r) {
+    if (r->error || (q->pps && !r->pps) || (q->epr && !r->epr) || (q->reject && !r->rejects_matched)) {
+        return false;
+    }
+    for (uint8_t selector : q->types) {
+        if (!r->tx_by_type[selector] && !r->rx_by_type[selector]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//=============================================================================
+// Command Line
+//=============================================================================
+
+/**
+ * Add one -q argument to the query
+ */
+static bool parse_query(const char *text, query_t *q) {
+    if (!strcmp(text, "pps")) {
+        q->pps = true;
+    } else if (!strcmp(text, "epr")) {
+        q->epr = true;
+    } else if (!strncmp(text, "reject=", 7)) {
+        char *end;
+        q->reject_mv = strtoul(text + 7, &end, 10);
+        if (*end != ':') {
+            return false;
+        }
+        q->reject_ma = strtoul(end + 1, &end, 10);
+        q->reject = (*end == '\0');
+        return q->reject;
+    } else if (!strncmp(text, "type=", 5)) {
+        for (int selector = 0; selector < TRACE_SLOTS; selector++) {
+            const char *name = message_name(selector);
+            if (name && !strcmp(name, text + 5)) {
+                q->types.push_back(selector);
+                return true;
+            }
+        }
+        return false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-j threads] [-l] [-q pps|epr|reject=MV:MA|type=NAME]... capture...\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    bool names_only = false;
+    query_t query = {};
+    std::vector<const char *> paths;
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (!strcmp(argv[i], "-j") && value) {
+            threads = std::max(1ul, strtoul(value, NULL, 0));
+            i++;
+        } else if (!strcmp(argv[i], "-q") && value) {
+            if (!parse_query(value, &query)) {
+                fprintf(stderr, "%s: bad query '%s'\n", argv[0], value);
+                return 2;
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-l")) {
+            names_only = true;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 2;
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+    if (paths.empty()) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::vector<capture_result_t> results(paths.size());
+    std::atomic<size_t> next(0);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < std::min<size_t>(threads, paths.size()); t++) {
+        pool.emplace_back([&]() {
+            for (size_t i; (i = next.fetch_add(1)) < paths.size();) {
+                decode_capture(paths[i], &query, &results[i]);
+            }
+        });
+    }
+    for (std::thread &t : pool) {
+        t.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    unsigned listed = 0, errors = 0;
+    uint64_t messages = 0, bytes = 0, crc_bad = 0;
+    uint64_t tx_by_type[TRACE_SLOTS] = {}, rx_by_type[TRACE_SLOTS] = {};
+    for (size_t i = 0; i < paths.size(); i++) {
+        const capture_result_t *r = &results[i];
+        if (r->error) {
+            fprintf(stderr, "%s: %s\n", paths[i], r->error);
+            errors++;
+            continue;
+        }
+        if (r->truncated) {
+            fprintf(stderr, "%s: last record truncated\n", paths[i]);
+        }
+        messages += r->messages;
+        bytes += r->bytes;
+        crc_bad += r->crc_bad;
+        for (int t = 0; t < TRACE_SLOTS; t++) {
+            tx_by_type[t] += r->tx_by_type[t];
+            rx_by_type[t] += r->rx_by_type[t];
+        }
+        if (!matches(&query, r)) {
+            continue;
+        }
+        listed++;
+        if (names_only) {
+            printf("%s\n", paths[i]);
+            continue;
+        }
+        printf("%s: %llu messages", paths[i], (unsigned long long)r->messages);
+        if (r->identified) {
+            printf(", VID 0x%04X PID 0x%04X", r->vid, r->pid);
+        }
+        printf("%s%s", r->pps ? ", PPS" : "", r->epr ? ", EPR" : "");
+        if (r->rejects_matched) {
+            printf(", %u rejects of %u mV at %u mA", r->rejects_matched, query.reject_mv, query.reject_ma);
+        }
+        printf("\n");
+    }
+
+    fprintf(stderr, "%-30s %10s %10s\n", "message", "tx", "rx");
+    for (int t = 0; t < TRACE_SLOTS; t++) {
+        if (tx_by_type[t] || rx_by_type[t]) {
+            const char *name = message_name(t);
+            char reserved[16];
+            if (!name) {
+                snprintf(reserved, sizeof(reserved), "reserved 0x%02X", t);
+                name = reserved;
+            }
+            fprintf(stderr, "%-30s %10llu %10llu\n", name, (unsigned long long)tx_by_type[t],
+                    (unsigned long long)rx_by_type[t]);
+        }
+    }
+    fprintf(stderr, "%zu captures, %u listed, %llu messages (%llu bad CRC) in %.1f MB on %u threads in %.3f s: "
+            "%.1f M messages/s, %.0f MB/s\n", paths.size(), listed, (unsigned long long)messages,
+            (unsigned long long)crc_bad, bytes / 1e6, threads, seconds, messages / seconds / 1e6,
+            bytes / seconds / 1e6);
+    return errors ? 2 : (listed ? 0 : 1);
+}